@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "dns-admin.h"
+#include "dns-engine.h"
+
+void admin_init(struct admin *a, admin_handler handle, void *ctx)
+{
+    uint32_t i;
+
+    memset(a, 0, sizeof(*a));
+    a->fd = -1;
+    a->handle = handle;
+    a->ctx = ctx;
+    for (i = 0; i < ADMIN_CLIENTS; i++)
+        a->clients[i].fd = -1;
+}
+
+void admin_free(struct admin *a)
+{
+    uint32_t i;
+
+    if (a->fd != -1) {
+        close(a->fd);
+        unlink(a->path);
+    }
+    for (i = 0; i < ADMIN_CLIENTS; i++) {
+        if (a->clients[i].fd != -1)
+            close(a->clients[i].fd);
+        free(a->clients[i].text);
+        a->clients[i].text = NULL;
+        a->clients[i].fd = -1;
+    }
+    a->fd = -1;
+}
+
+int admin_listen(struct admin *a, const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct stat st;
+    mode_t mask;
+    int ret;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Path of the control socket %s is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    /* A socket left by a process which didn't exit cleanly is in the way, any other file is kept */
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    a->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (a->fd == -1) {
+        fprintf(stderr, "Couldn't listen on %s:\n%d %s\n", path, errno, strerror(errno));
+        return -1;
+    }
+    /* The socket is created without access for others, not opened up until a chmod */
+    mask = umask(0077);
+    ret = bind(a->fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (ret == -1 || listen(a->fd, 8) == -1) {
+        fprintf(stderr, "Couldn't listen on %s:\n%d %s\n", path, errno, strerror(errno));
+        if (ret == 0)
+            unlink(path);
+        close(a->fd);
+        a->fd = -1;
+        return -1;
+    }
+    a->path = path;
+    return 0;
+}
+
+/* Hands the whole request of the client to the handler and sends its reply back */
+static void admin_reply(struct admin *a, struct admin_client *c)
+{
+    char reply[256];
+
+    c->text[c->len] = '\0';
+    if (strlen(c->text) != c->len) {
+        snprintf(reply, sizeof(reply), "ERROR not text\n");
+        a->failed++;
+    }
+    else
+        a->handle(a->ctx, c->text, reply, sizeof(reply));
+    /* A client gone already doesn't get the reply, what it asked for is done */
+    send(c->fd, reply, strlen(reply), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+static void admin_close(struct admin_client *c, const char *reply)
+{
+    if (reply)
+        send(c->fd, reply, strlen(reply), MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(c->fd);
+    free(c->text);
+    c->text = NULL;
+    c->fd = -1;
+}
+
+/* Reads what the client sent so far, true once it shut its side down or is to be closed */
+static bool admin_read(struct admin *a, struct admin_client *c)
+{
+    char reply[64], *bigger;
+    ssize_t got;
+
+    for (;;) {
+        if (c->len + 1 == c->size) {
+            if (c->size == ADMIN_MAX || !(bigger = realloc(c->text, c->size * 2))) {
+                snprintf(reply, sizeof(reply), "ERROR longer than %d bytes\n", ADMIN_MAX);
+                a->failed++;
+                admin_close(c, reply);
+                return true;
+            }
+            c->text = bigger;
+            c->size *= 2;
+        }
+        got = read(c->fd, c->text + c->len, c->size - c->len - 1);
+        if (got > 0) {
+            c->len += got;
+            continue;
+        }
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return false;
+        if (got == 0)
+            admin_reply(a, c);
+        admin_close(c, NULL);
+        return true;
+    }
+}
+
+uint32_t admin_poll(const struct admin *a, struct pollfd *pfd, int32_t *wait)
+{
+    uint64_t now = now_ms();
+    uint32_t i, count = 0;
+    bool room = false;
+    int32_t left;
+
+    *wait = -1;
+    for (i = 0; i < ADMIN_CLIENTS; i++) {
+        const struct admin_client *c = &a->clients[i];
+
+        if (c->fd == -1) {
+            room = true;
+            continue;
+        }
+        pfd[count].fd = c->fd;
+        pfd[count].revents = 0;
+        pfd[count++].events = POLLIN;
+        left = c->deadline > now ? (int32_t)(c->deadline - now) : 0;
+        if (*wait == -1 || left < *wait)
+            *wait = left;
+    }
+    /* Clients over the limit wait in the backlog, the socket would only wake poll() up */
+    if (a->fd != -1 && room) {
+        pfd[count].fd = a->fd;
+        pfd[count].revents = 0;
+        pfd[count++].events = POLLIN;
+    }
+    return count;
+}
+
+void admin_serve(struct admin *a, const struct pollfd *pfd, uint32_t count)
+{
+    uint64_t now = now_ms();
+    char reply[64];
+    uint32_t i, j;
+    int fd;
+
+    for (i = 0; i < ADMIN_CLIENTS; i++) {
+        struct admin_client *c = &a->clients[i];
+
+        if (c->fd == -1)
+            continue;
+        for (j = 0; j < count; j++) {
+            if (pfd[j].fd == c->fd && pfd[j].revents && admin_read(a, c))
+                break;
+        }
+        if (c->fd != -1 && c->deadline <= now) {
+            snprintf(reply, sizeof(reply), "ERROR not read whole in %d ms\n", ADMIN_TIMEOUT_MS);
+            a->failed++;
+            admin_close(c, reply);
+        }
+    }
+
+    /* New clients get a free slot each, their requests are read as they come */
+    for (i = 0; i < ADMIN_CLIENTS && a->fd != -1; i++) {
+        struct admin_client *c = &a->clients[i];
+
+        if (c->fd != -1)
+            continue;
+        if ((fd = accept4(a->fd, NULL, NULL, SOCK_NONBLOCK)) == -1)
+            break;
+        c->size = 4096;
+        c->len = 0;
+        if (!(c->text = malloc(c->size))) {
+            close(fd);
+            break;
+        }
+        c->fd = fd;
+        c->deadline = now + ADMIN_TIMEOUT_MS;
+        admin_read(a, c);
+    }
+}
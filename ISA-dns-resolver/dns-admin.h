@@ -0,0 +1,56 @@
+#ifndef DNS_ADMIN_H
+#define DNS_ADMIN_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <poll.h>
+
+/* Longest request over the control socket, and how long its client has from connecting
+ * to send it whole */
+#define ADMIN_MAX (1 << 20)
+#define ADMIN_TIMEOUT_MS 1000
+/* Clients of the control socket read at once, more of them wait in the backlog */
+#define ADMIN_CLIENTS 8
+
+/* Client of the control socket, its request is read as it comes in between the queries */
+struct admin_client {
+    int32_t fd;                         /* -1 if the slot is free */
+    char *text;
+    size_t len;
+    size_t size;
+    uint64_t deadline;                  /* ms, refused unless the request is whole by then */
+};
+
+/* Whole text of a request, the handler may cut it up and writes the line of the reply into reply */
+typedef void (*admin_handler)(void *ctx, char *text, char *reply, size_t size);
+
+/* Control socket of a resident mode. Each client sends its lines and shuts its side down
+ * within ADMIN_TIMEOUT_MS, the lines go to the handler as one request and the client gets
+ * its reply back. Nothing is ever waited for, the clients are read between the events of
+ * the loop they are polled in. */
+struct admin {
+    int32_t fd;                         /* -1 if none */
+    const char *path;
+    struct admin_client clients[ADMIN_CLIENTS];
+    admin_handler handle;
+    void *ctx;
+    uint64_t failed;                    /* requests too long, too slow or not text */
+};
+
+void admin_init(struct admin *a, admin_handler handle, void *ctx);
+void admin_free(struct admin *a);
+
+/* Listens on a UNIX socket at path, which only the user running the program can connect to */
+int admin_listen(struct admin *a, const char *path);
+
+/* Fills pfd with the control socket, unless it has no room for another client, and the
+ * clients being read, at most 1 + ADMIN_CLIENTS of them. Returns how many; wait gets
+ * the ms until the first client runs out of time, -1 if none. */
+uint32_t admin_poll(const struct admin *a, struct pollfd *pfd, int32_t *wait);
+
+/* Serves the clients with the events poll() found on pfd */
+void admin_serve(struct admin *a, const struct pollfd *pfd, uint32_t count);
+
+#endif
@@ -0,0 +1,632 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "dns-names.h"
+#include "dns-blocklist.h"
+
+#define BLOCK_BITS 512
+#define MAX_LABELS 128
+#define REGION_PREFETCH 256
+
+/* Growing array used during compilation */
+struct array {
+    uint8_t *data;
+    size_t size, cap;
+};
+
+static int array_append(struct array *a, const void *data, size_t len)
+{
+    if (a->size + len > a->cap) {
+        size_t cap = a->cap ? a->cap : 1 << 16;
+        while (cap < a->size + len)
+            cap *= 2;
+        a->data = realloc(a->data, cap);
+        if (!a->data)
+            return -1;
+        a->cap = cap;
+    }
+    memcpy(a->data + a->size, data, len);
+    a->size += len;
+    return 0;
+}
+
+/* Range reduction without division */
+static inline uint32_t reduce(uint32_t x, uint32_t n)
+{
+    return (uint32_t)(((uint64_t)x * n) >> 32);
+}
+
+/* Order of siblings in the trie */
+static inline uint32_t sibling_hash(const uint8_t *label)
+{
+    return (uint32_t)name_hash((const char *)label, label[0] + 1, 0x51b1);
+}
+
+/* Hash of a domain built from the sibling hashes of its labels from the top, every prefix
+ * of the walk is the hash of one parent domain, so each label is hashed only once */
+static inline uint64_t domain_hash(uint64_t parent, uint32_t sibling)
+{
+    uint64_t h = (parent ^ sibling) * 0xff51afd7ed558ccdULL;
+
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+static inline bool bloom_check(const uint64_t *bloom, uint32_t lines, uint64_t hash)
+{
+    const uint64_t *line = &bloom[(size_t)reduce(hash >> 32, lines) * BLOOM_LINE_WORDS];
+    uint32_t a = hash & 0xffff, b = ((hash >> 16) & 0xffff) | 1;
+    int i;
+
+    for (i = 0; i < BLOOM_HASHES; i++) {
+        uint32_t bit = (a + i * b) % BLOCK_BITS;
+        if (!(line[bit / 64] & (1ULL << (bit % 64))))
+            return false;
+    }
+    return true;
+}
+
+static inline void bloom_add(uint64_t *bloom, uint32_t lines, uint64_t hash)
+{
+    uint64_t *line = &bloom[(size_t)reduce(hash >> 32, lines) * BLOOM_LINE_WORDS];
+    uint32_t a = hash & 0xffff, b = ((hash >> 16) & 0xffff) | 1;
+    int i;
+
+    for (i = 0; i < BLOOM_HASHES; i++) {
+        uint32_t bit = (a + i * b) % BLOCK_BITS;
+        line[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+/* Labels with only letters, digits, hyphens and underscores, which are nearly all of them,
+ * are stored three characters in two bytes. The length byte has LABEL_PACKED set then. */
+#define LABEL_PACKED 0x80
+#define LABEL_LENGTH 0x3f
+#define LABEL_ENTRY_MAX (1 + LABEL_MAX)
+
+static inline uint32_t pack_char(uint8_t c)
+{
+    if (c >= 'a' && c <= 'z')
+        return c - 'a' + 1;
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A' + 1;
+    if (c >= '0' && c <= '9')
+        return c - '0' + 27;
+    return c == '-' ? 37 : c == '_' ? 38 : 0;
+}
+
+/* Stored form of the label (wire format), both the compiler and the lookup compare these.
+ * Returns its size. */
+static uint32_t label_pack(const uint8_t *label, uint8_t *out)
+{
+    uint32_t len = label[0], i, j;
+
+    for (i = 0; i < len; i += 3) {
+        uint32_t v = 0;
+
+        for (j = i; j < i + 3; j++) {
+            uint32_t c = j < len ? pack_char(label[1 + j]) : 0;
+            if (j < len && c == 0) {
+                out[0] = len;
+                name_lower(&out[1], &label[1], len);
+                return 1 + len;
+            }
+            v = v * 40 + c;
+        }
+        out[1 + i / 3 * 2] = v >> 8;
+        out[2 + i / 3 * 2] = v & 0xff;
+    }
+    out[0] = LABEL_PACKED | len;
+    return 1 + (len + 2) / 3 * 2;
+}
+
+static inline uint32_t label_size(const uint8_t *stored)
+{
+    return 1 + (stored[0] & LABEL_PACKED ? ((stored[0] & LABEL_LENGTH) + 2) / 3 * 2 : stored[0]);
+}
+
+/* Looks for the label with the hash among the edges of the node, in the one group where
+ * it has to be. Returns -1 if it's not there, 0 if its edge is a leaf and 1 if the edge
+ * leads further, to the node put in *node. */
+static int find_edge(const struct blocklist *bl, struct blocklist_node *node, const uint8_t *label,
+                     uint32_t hash)
+{
+    const uint8_t *region;
+    uint8_t key[LABEL_ENTRY_MAX];
+    uint32_t off = node->ref, key_size, rest, pos, i;
+    uint16_t edges;
+
+    if (node->groups == 0)
+        return -1;
+    if (node->groups > 1) {
+        if (node->ref > bl->header->groups || node->groups > bl->header->groups - node->ref)
+            return -1;
+        off = bl->groups[node->ref + reduce(hash, node->groups)];
+    }
+    if (off > bl->blob_size || bl->blob_size - off < sizeof(edges))
+        return -1;
+    region = &bl->blob[off];
+    rest = bl->blob_size - off;
+    /* The region spans a few cache lines, they are all asked for at once rather than one
+     * after another as the labels are walked */
+    for (pos = 64; pos < REGION_PREFETCH; pos += 64)
+        __builtin_prefetch(&region[pos]);
+    memcpy(&edges, region, sizeof(edges));
+    if (edges > (rest - sizeof(edges)) / 2)
+        return -1;
+    key_size = label_pack(label, key);
+
+    /* Tags first, the labels after them are walked only as far as the matching one */
+    for (pos = sizeof(edges) + 2 * edges, i = 0; i < edges; i++) {
+        uint16_t tag;
+        uint32_t size;
+
+        memcpy(&tag, &region[sizeof(edges) + 2 * i], sizeof(tag));
+        if (pos >= rest)
+            return -1;
+        size = label_size(&region[pos]) + (tag & TAG_HAS_CHILD ? sizeof(*node) : 0);
+        if (size > rest - pos)
+            return -1;
+        if ((tag & TAG_HASH) == (hash & TAG_HASH) && memcmp(&region[pos], key, key_size) == 0) {
+            if (!(tag & TAG_HAS_CHILD))
+                return 0;
+            memcpy(node, &region[pos + key_size], sizeof(*node));
+            return 1;
+        }
+        pos += size;
+    }
+    return -1;
+}
+
+bool blocklist_match(const struct blocklist *bl, const uint8_t *wire, size_t len)
+{
+    const struct blocklist_header *header = bl->header;
+    const uint8_t *labels[MAX_LABELS];
+    uint32_t hashes[MAX_LABELS];
+    struct blocklist_node node;
+    uint32_t count = 0, i;
+    size_t pos;
+    uint64_t hash;
+    bool candidate = false;
+
+    if (!header || header->edges == 0)
+        return false;
+
+    for (pos = 0; pos < len && wire[pos] != 0; pos += wire[pos] + 1) {
+        if (count == MAX_LABELS || wire[pos] > LABEL_MAX || pos + wire[pos] + 1 >= len)
+            return false;
+        hashes[count] = sibling_hash(&wire[pos]);
+        labels[count++] = &wire[pos];
+    }
+
+    /* Any parent in the filter? Most names stop here */
+    hash = header->seed;
+    for (i = count; i-- > 0; ) {
+        hash = domain_hash(hash, hashes[i]);
+        if (bloom_check(bl->bloom, header->bloom_lines, hash)) {
+            candidate = true;
+            break;
+        }
+    }
+    if (!candidate)
+        return false;
+
+    /* Walk the trie from the top level domain, a leaf is a blocked domain and the name
+     * is it or its subdomain */
+    node = header->root;
+    for (i = count; i-- > 0; ) {
+        int ret = find_edge(bl, &node, labels[i], hashes[i]);
+
+        if (ret != 1)
+            return ret == 0;
+    }
+
+    /* The name is a parent of some blocked domain, which doesn't block it */
+    return false;
+}
+
+/* Domain as a sequence of reversed labels, www.example.com is \3com\7example\3www.
+ * Every label is preceded by its sibling hash in big endian, so that sorting the
+ * sequences with memcmp gives the order of the trie. */
+struct domain {
+    uint32_t off;
+    uint16_t len;
+    uint8_t labels;
+};
+
+#define KEY_HASH_SIZE 4
+#define KEY_MAX (NAME_WIRE_MAX + KEY_HASH_SIZE * MAX_LABELS)
+
+/* qsort has no context argument, the arena for the comparison is kept here */
+static const uint8_t *sort_arena;
+
+static int domain_cmp(const void *a, const void *b)
+{
+    const struct domain *da = a, *db = b;
+    int cmp = memcmp(&sort_arena[da->off], &sort_arena[db->off], da->len < db->len ? da->len : db->len);
+    if (cmp)
+        return cmp;
+    return da->len - db->len;
+}
+
+static int parse_domains(FILE *in, struct array *arena, struct array *domains)
+{
+    char line[4096];
+    uint32_t lineno = 0;
+
+    while (fgets(line, sizeof(line), in)) {
+        char *save = NULL, *token, *next;
+        uint8_t wire[NAME_WIRE_MAX], reversed[KEY_MAX];
+        const uint8_t *labels[MAX_LABELS];
+        uint8_t addr[16];
+        struct domain d;
+        int len, count = 0, pos;
+
+        lineno++;
+        line[strcspn(line, "#\r\n")] = '\0';
+        token = strtok_r(line, " \t", &save);
+        if (!token)
+            continue;
+        /* Hosts-style line, the domain follows the address */
+        next = strtok_r(NULL, " \t", &save);
+        if (next && (inet_pton(AF_INET, token, addr) == 1 || inet_pton(AF_INET6, token, addr) == 1))
+            token = next;
+
+        len = name_encode(token, wire, true);
+        if (len == -1) {
+            fprintf(stderr, "Line %u: invalid domain %s\n", lineno, token);
+            return -1;
+        }
+        if (len == 1)
+            continue;   /* blocking the root would block everything, surely a mistake */
+
+        for (pos = 0; wire[pos] != 0; pos += wire[pos] + 1)
+            labels[count++] = &wire[pos];
+        d.len = 0;
+        d.labels = count;
+        while (count-- > 0) {
+            uint32_t hash = htonl(sibling_hash(labels[count]));
+            memcpy(&reversed[d.len], &hash, KEY_HASH_SIZE);
+            memcpy(&reversed[d.len + KEY_HASH_SIZE], labels[count], labels[count][0] + 1);
+            d.len += KEY_HASH_SIZE + labels[count][0] + 1;
+        }
+        if (arena->size > UINT32_MAX - KEY_MAX) {
+            fprintf(stderr, "Blocklist is too large\n");
+            return -1;
+        }
+        d.off = arena->size;
+        if (array_append(arena, reversed, d.len) == -1 || array_append(domains, &d, sizeof(d)) == -1)
+            return -1;
+    }
+    if (ferror(in)) {
+        fprintf(stderr, "Couldn't read the blocklist:\n%d %s\n", errno, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int write_file(const char *out_path, const struct array *image)
+{
+    char tmp_path[4096];
+    FILE *out;
+    bool ok;
+
+    /* Write next to the target and rename, so a running resolver never maps a half written file */
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", out_path) >= (int)sizeof(tmp_path))
+        return -1;
+    out = fopen(tmp_path, "wb");
+    if (!out) {
+        fprintf(stderr, "Couldn't create %s:\n%d %s\n", tmp_path, errno, strerror(errno));
+        return -1;
+    }
+    ok = fwrite(image->data, 1, image->size, out) == image->size;
+    ok = (fclose(out) == 0) && ok;
+    if (!ok || rename(tmp_path, out_path) == -1) {
+        fprintf(stderr, "Couldn't write %s:\n%d %s\n", out_path, errno, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Edge during compilation, the label stays in the arena */
+struct build_edge {
+    uint32_t hash;
+    uint32_t label;
+    bool first;         /* first edge of its node */
+    bool has_child;
+};
+
+/* Compilation state, nodes are numbered level by level and emitted from the last one,
+ * so the references of its children are known when a node is written */
+struct builder {
+    const uint8_t *arena;
+    const struct build_edge *edges;
+    struct blocklist_node *nodes;
+    uint32_t *child;    /* node of every edge with a child */
+    struct array groups;
+    struct array blob;
+};
+
+static int emit_region(struct builder *b, uint32_t first, uint32_t last)
+{
+    uint16_t edges = last - first;
+    uint32_t e;
+
+    if (last - first > UINT16_MAX) {
+        fprintf(stderr, "Blocklist is too large\n");
+        return -1;
+    }
+    if (array_append(&b->blob, &edges, sizeof(edges)) == -1)
+        return -1;
+    for (e = first; e < last; e++) {
+        uint16_t tag = (b->edges[e].hash & TAG_HASH) | (b->edges[e].has_child ? TAG_HAS_CHILD : 0);
+        if (array_append(&b->blob, &tag, sizeof(tag)) == -1)
+            return -1;
+    }
+    for (e = first; e < last; e++) {
+        uint8_t stored[LABEL_ENTRY_MAX];
+        if (array_append(&b->blob, stored, label_pack(&b->arena[b->edges[e].label], stored)) == -1 ||
+            (b->edges[e].has_child &&
+             array_append(&b->blob, &b->nodes[b->child[e]], sizeof(struct blocklist_node)) == -1))
+            return -1;
+    }
+    return 0;
+}
+
+/* Splits the edges [first, last) of a node into groups by the top bits of their hashes */
+static int emit_node(struct builder *b, uint32_t node, uint32_t first, uint32_t last)
+{
+    uint32_t count = (last - first + GROUP_EDGES - 1) / GROUP_EDGES, g, e = first, start;
+
+    b->nodes[node].groups = count;
+    if (count == 1) {
+        b->nodes[node].ref = b->blob.size;
+        return emit_region(b, first, last);
+    }
+    b->nodes[node].ref = b->groups.size / sizeof(uint32_t);
+    for (g = 0; g < count; g++) {
+        uint32_t off = b->blob.size;
+
+        for (start = e; e < last && reduce(b->edges[e].hash, count) == g; e++)
+            ;
+        if (array_append(&b->groups, &off, sizeof(off)) == -1 || emit_region(b, start, e) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+/* Regions of all nodes from the last one, the root ends up in the header */
+static int emit_trie(struct builder *b, uint32_t count, struct blocklist_header *header)
+{
+    uint32_t *starts, nodes = 0, children = 0, e, n;
+    int ret = -1;
+
+    for (e = 0; e < count; e++)
+        nodes += b->edges[e].first;
+    starts = malloc((nodes + 1) * sizeof(uint32_t));
+    b->nodes = malloc(nodes * sizeof(struct blocklist_node));
+    b->child = malloc(count * sizeof(uint32_t));
+    if (!starts || !b->nodes || !b->child)
+        goto out;
+    for (n = 0, e = 0; e < count; e++) {
+        if (b->edges[e].first)
+            starts[n++] = e;
+        if (b->edges[e].has_child)
+            b->child[e] = ++children;
+    }
+    starts[nodes] = count;
+    for (n = nodes; n-- > 0; ) {
+        if (emit_node(b, n, starts[n], starts[n + 1]) == -1)
+            goto out;
+    }
+    header->root = b->nodes[0];
+    ret = 0;
+
+out:
+    free(starts);
+    free(b->nodes);
+    free(b->child);
+    return ret;
+}
+
+int blocklist_compile(FILE *in, const char *out_path)
+{
+    struct array arena = { 0 }, domains_arr = { 0 }, edges = { 0 }, image = { 0 };
+    struct builder builder = { 0 };
+    struct blocklist_header header;
+    struct domain *domains;
+    uint16_t *cursor = NULL;
+    uint64_t *bloom = NULL;
+    size_t count, kept = 0, i;
+    uint32_t level;
+    int ret = -1;
+
+    if (parse_domains(in, &arena, &domains_arr) == -1)
+        goto out;
+    domains = (struct domain *)domains_arr.data;
+    count = domains_arr.size / sizeof(struct domain);
+
+    /* Sorting puts every parent right before its subdomains, these are dropped */
+    sort_arena = arena.data;
+    if (count)
+        qsort(domains, count, sizeof(struct domain), domain_cmp);
+    for (i = 0; i < count; i++) {
+        if (kept && domains[i].len >= domains[kept - 1].len &&
+            memcmp(&arena.data[domains[i].off], &arena.data[domains[kept - 1].off], domains[kept - 1].len) == 0)
+            continue;
+        domains[kept++] = domains[i];
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BLOCKLIST_MAGIC, sizeof(header.magic));
+    header.seed = 0xb10c;
+    header.domains = kept;
+    header.bloom_lines = kept * BLOOM_BITS_PER_DOMAIN / BLOCK_BITS + 1;
+    bloom = calloc((size_t)header.bloom_lines * BLOOM_LINE_WORDS, sizeof(uint64_t));
+    cursor = calloc(kept ? kept : 1, sizeof(uint16_t));
+    if (!bloom || !cursor)
+        goto out;
+
+    for (i = 0; i < kept; i++) {
+        uint64_t hash = header.seed;
+        uint32_t pos, sibling;
+        const uint8_t *key = &arena.data[domains[i].off];
+        for (pos = 0; pos < domains[i].len; pos += KEY_HASH_SIZE + key[pos + KEY_HASH_SIZE] + 1) {
+            memcpy(&sibling, &key[pos], KEY_HASH_SIZE);
+            hash = domain_hash(hash, ntohl(sibling));
+        }
+        bloom_add(bloom, header.bloom_lines, hash);
+    }
+
+    /* Edges level by level. Within a level the sorted order of the domains is also the
+     * order of the nodes, so one pass over the domains emits one level. */
+    for (level = 0; ; level++) {
+        size_t prev = SIZE_MAX;
+        bool any = false;
+
+        for (i = 0; i < kept; i++) {
+            const uint8_t *key = &arena.data[domains[i].off];
+            uint32_t start = cursor[i], end;
+            struct build_edge edge = { .first = true };
+
+            if (domains[i].labels <= level)
+                continue;
+            any = true;
+            end = start + KEY_HASH_SIZE + key[start + KEY_HASH_SIZE] + 1;
+
+            if (prev != SIZE_MAX) {
+                const uint8_t *prev_key = &arena.data[domains[prev].off];
+                uint32_t prev_start = cursor[prev];
+                uint32_t prev_end = prev_start + KEY_HASH_SIZE + prev_key[prev_start + KEY_HASH_SIZE] + 1;
+                bool same_parent = prev_start == start && memcmp(prev_key, key, start) == 0;
+
+                cursor[prev] = prev_end;
+                if (same_parent && prev_end == end && memcmp(prev_key, key, end) == 0) {
+                    /* Same edge, it was emitted already */
+                    prev = i;
+                    continue;
+                }
+                edge.first = !same_parent;
+            }
+
+            memcpy(&edge.hash, &key[start], KEY_HASH_SIZE);
+            edge.hash = ntohl(edge.hash);
+            edge.label = domains[i].off + start + KEY_HASH_SIZE;
+            edge.has_child = domains[i].labels > level + 1;
+            if (array_append(&edges, &edge, sizeof(edge)) == -1)
+                goto out;
+            prev = i;
+        }
+        if (prev != SIZE_MAX)
+            cursor[prev] += KEY_HASH_SIZE + arena.data[domains[prev].off + cursor[prev] + KEY_HASH_SIZE] + 1;
+        if (!any)
+            break;
+    }
+    header.edges = edges.size / sizeof(struct build_edge);
+
+    builder.arena = arena.data;
+    builder.edges = (const struct build_edge *)edges.data;
+    if (header.edges && emit_trie(&builder, header.edges, &header) == -1)
+        goto out;
+    header.groups = builder.groups.size / sizeof(uint32_t);
+
+    /* File image: header, bloom, groups, regions */
+    if (array_append(&image, &header, sizeof(header)) == -1)
+        goto out;
+    header.bloom_off = image.size;
+    if (array_append(&image, bloom, (size_t)header.bloom_lines * BLOOM_LINE_WORDS * sizeof(uint64_t)) == -1)
+        goto out;
+    header.group_off = image.size;
+    if (array_append(&image, builder.groups.data, builder.groups.size) == -1)
+        goto out;
+    header.blob_off = image.size;
+    if (array_append(&image, builder.blob.data, builder.blob.size) == -1)
+        goto out;
+    if (image.size > UINT32_MAX) {
+        fprintf(stderr, "Blocklist is too large\n");
+        goto out;
+    }
+    header.size = image.size;
+    memcpy(image.data, &header, sizeof(header));
+
+    ret = write_file(out_path, &image);
+    if (ret == 0)
+        printf("%u domains, %u edges, %zu bytes\n", header.domains, header.edges, image.size);
+
+out:
+    free(arena.data);
+    free(domains_arr.data);
+    free(edges.data);
+    free(builder.groups.data);
+    free(builder.blob.data);
+    free(image.data);
+    free(cursor);
+    free(bloom);
+    return ret;
+}
+
+int blocklist_load(struct blocklist *bl, const char *path)
+{
+    const struct blocklist_header *header;
+    struct stat st;
+    int fd;
+
+    memset(bl, 0, sizeof(*bl));
+    fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "Couldn't open %s:\n%d %s\n", path, errno, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(struct blocklist_header)) {
+        fprintf(stderr, "%s is not a compiled blocklist\n", path);
+        close(fd);
+        return -1;
+    }
+
+    bl->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (bl->map == MAP_FAILED) {
+        fprintf(stderr, "Couldn't map %s:\n%d %s\n", path, errno, strerror(errno));
+        bl->map = NULL;
+        return -1;
+    }
+    bl->size = st.st_size;
+
+    header = (const struct blocklist_header *)bl->map;
+    if (memcmp(header->magic, BLOCKLIST_MAGIC, sizeof(header->magic)) != 0 ||
+        header->size != bl->size || header->bloom_lines == 0 || header->bloom_off % 8 ||
+        (uint64_t)header->bloom_off + (uint64_t)header->bloom_lines * BLOOM_LINE_WORDS * 8 > bl->size ||
+        header->group_off % 4 ||
+        (uint64_t)header->group_off + (uint64_t)header->groups * sizeof(uint32_t) > header->blob_off ||
+        header->blob_off > bl->size) {
+        fprintf(stderr, "%s is not a compiled blocklist\n", path);
+        blocklist_unload(bl);
+        return -1;
+    }
+    bl->header = header;
+    bl->bloom = (const uint64_t *)(bl->map + header->bloom_off);
+    bl->groups = (const uint32_t *)(bl->map + header->group_off);
+    bl->blob = bl->map + header->blob_off;
+    bl->blob_size = header->size - header->blob_off;
+    return 0;
+}
+
+void blocklist_unload(struct blocklist *bl)
+{
+    if (bl->map)
+        munmap((void *)bl->map, bl->size);
+    memset(bl, 0, sizeof(*bl));
+}
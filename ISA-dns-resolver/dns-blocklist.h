@@ -0,0 +1,72 @@
+#ifndef DNS_BLOCKLIST_H
+#define DNS_BLOCKLIST_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define BLOCKLIST_MAGIC "DNSBLK2"
+
+/* Bloom filter is split into cache lines, every domain sets BLOOM_HASHES bits of one line */
+#define BLOOM_BITS_PER_DOMAIN 12
+#define BLOOM_HASHES 8
+#define BLOOM_LINE_WORDS 8
+
+/* Edges of a node are split into groups of about this many */
+#define GROUP_EDGES 16
+
+/* Layout of a compiled blocklist. Domains are stored as a trie over reversed labels
+ * (com -> example -> www). An edge without a child is a blocked domain, blocked
+ * subdomains are dropped already during compilation.
+ * Siblings are ordered by a 32-bit hash of their label and split into groups by its top
+ * bits, GROUP_EDGES of them on average. Every group is one region of the blob:
+ *   u16        number of edges
+ *   u16        tag of every edge, 15 bits of the hash and a bit telling it has a child
+ *   then for every edge its label (u8 length + lowercase bytes) and, if it has a child,
+ *   the node reference of the child
+ * A node of one group is referenced by the offset of its region, a larger one by the
+ * index of its first group in the table of region offsets. A step down the trie reads
+ * one region, a node with millions of children (com) one table entry before it. */
+struct blocklist_node {
+    uint32_t ref;
+    uint32_t groups;
+};
+
+struct blocklist_header {
+    char magic[8];
+    uint64_t seed;
+    uint32_t domains;
+    uint32_t edges;
+    uint32_t bloom_lines;
+    uint32_t bloom_off;
+    struct blocklist_node root;
+    uint32_t groups;
+    uint32_t group_off;                 /* u32 region offset of every group of larger nodes */
+    uint32_t blob_off;                  /* regions */
+    uint32_t size;
+};
+
+#define TAG_HAS_CHILD 0x8000u
+#define TAG_HASH 0x7fffu
+
+struct blocklist {
+    const uint8_t *map;
+    size_t size;
+    const struct blocklist_header *header;
+    const uint64_t *bloom;
+    const uint32_t *groups;
+    const uint8_t *blob;
+    uint32_t blob_size;
+};
+
+/* Compiles a list of domains, one per line. Hosts-style lines (0.0.0.0 domain) are accepted too. */
+int blocklist_compile(FILE *in, const char *out_path);
+
+int blocklist_load(struct blocklist *bl, const char *path);
+void blocklist_unload(struct blocklist *bl);
+
+/* Tells whether the wire-format name or any of its parents is blocked */
+bool blocklist_match(const struct blocklist *bl, const uint8_t *wire, size_t len);
+
+#endif
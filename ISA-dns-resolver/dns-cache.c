@@ -0,0 +1,391 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "dns-cache.h"
+
+static inline uint32_t label_hash(const uint8_t *label)
+{
+    return (uint32_t)name_hash_fast(label, label[0] + 1, 0xca5e);
+}
+
+void cache_init(struct cache *c, uint64_t grace)
+{
+    memset(c, 0, sizeof(*c));
+    c->nodes = 1;
+    c->grace = grace;
+}
+
+static void cut_free(struct zone_cut *cut)
+{
+    upstream_set_free(&cut->servers);
+    free(cut->ns);
+    free(cut);
+}
+
+/* The cut may still be asked by iterations in flight, it's freed once they are over */
+static void cut_retire(struct cache *c, struct zone_cut *cut, uint64_t now)
+{
+    cut->freed = now + c->grace;
+    cut->retired_next = NULL;
+    if (c->retired_tail)
+        c->retired_tail->retired_next = cut;
+    else
+        c->retired_head = cut;
+    c->retired_tail = cut;
+}
+
+/* Everything the node holds but its children */
+static void node_clear(struct cache_node *node)
+{
+    if (node->cut)
+        cut_free(node->cut);
+    if (node->addrs) {
+        free(node->addrs->ipv4);
+        free(node->addrs->ipv6);
+        free(node->addrs);
+    }
+    while (node->aliases) {
+        struct cached_alias *next = node->aliases->next;
+        free(node->aliases->rdata);
+        free(node->aliases);
+        node->aliases = next;
+    }
+}
+
+static void node_free(struct cache_node *node)
+{
+    uint32_t i;
+
+    for (i = 0; i < node->count; i++) {
+        node_free(node->children[i]);
+        free(node->children[i]);
+    }
+    free(node->children);
+    node_clear(node);
+}
+
+void cache_free(struct cache *c)
+{
+    uint64_t grace = c->grace;
+
+    node_free(&c->root);
+    while (c->retired_head) {
+        struct zone_cut *next = c->retired_head->retired_next;
+        cut_free(c->retired_head);
+        c->retired_head = next;
+    }
+    cache_init(c, grace);
+}
+
+/* Whether anything of the node is still alive */
+static bool node_live(const struct cache_node *node, uint64_t now)
+{
+    const struct cached_alias *a;
+
+    if (node->cut && node->cut->expires > now)
+        return true;
+    if (node->addrs && ((node->addrs->ipv4_count && node->addrs->ipv4_expires > now) ||
+                        (node->addrs->ipv6_count && node->addrs->ipv6_expires > now)))
+        return true;
+    for (a = node->aliases; a; a = a->next) {
+        if (a->expires > now)
+            return true;
+    }
+    return false;
+}
+
+/* Evicts the leaves below the node which hold nothing alive or weren't used since the
+ * use before, leaves are evicted again as their parents become ones */
+static void node_prune(struct cache *c, struct cache_node *node, uint64_t before, uint64_t now)
+{
+    uint32_t i, kept = 0;
+
+    for (i = 0; i < node->count; i++) {
+        struct cache_node *child = node->children[i];
+
+        node_prune(c, child, before, now);
+        if (child->count == 0 && (child->used < before || !node_live(child, now))) {
+            /* The cut is kept for the iterations still asking it, the rest goes now */
+            if (child->cut)
+                cut_retire(c, child->cut, now);
+            child->cut = NULL;
+            node_clear(child);
+            free(child->children);
+            free(child);
+            c->nodes--;
+            c->evicted++;
+            continue;
+        }
+        node->children[kept++] = child;
+    }
+    node->count = kept;
+}
+
+void cache_trim(struct cache *c, uint64_t now)
+{
+    uint64_t target = (uint64_t)(CACHE_MAX_NODES * CACHE_TRIM_TO), before = 0;
+
+    while (c->retired_head && c->retired_head->freed <= now) {
+        struct zone_cut *next = c->retired_head->retired_next;
+        cut_free(c->retired_head);
+        if (!(c->retired_head = next))
+            c->retired_tail = NULL;
+    }
+    if (c->nodes <= CACHE_MAX_NODES)
+        return;
+    /* The expired names first, then the older half of the uses left each time */
+    while (c->nodes > target) {
+        node_prune(c, &c->root, before, now);
+        if (before == c->uses + 1)
+            break;
+        before = before + (c->uses + 1 - before + 1) / 2;
+    }
+}
+
+/* Binary search over the children, index where the label is or would be inserted */
+static uint32_t child_index(const struct cache_node *node, const uint8_t *label, uint32_t hash,
+                            bool *found)
+{
+    uint32_t lo = 0, hi = node->count;
+
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (node->children[mid]->hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (*found = false; lo < node->count && node->children[lo]->hash == hash; lo++) {
+        if (label_equal(node->children[lo]->label, label)) {
+            *found = true;
+            break;
+        }
+    }
+    return lo;
+}
+
+static struct cache_node * add_child(struct cache *c, struct cache_node *node, const uint8_t *label,
+                                     uint32_t hash, uint32_t index)
+{
+    struct cache_node *child = calloc(1, sizeof(*child));
+    struct cache_node **children = realloc(node->children, (node->count + 1) * sizeof(*children));
+    if (children)
+        node->children = children;
+    if (!child || !children) {
+        free(child);
+        return NULL;
+    }
+    name_lower(child->label, label, label[0] + 1);
+    child->hash = hash;
+    memmove(&node->children[index + 1], &node->children[index],
+            (node->count - index) * sizeof(*children));
+    node->children[index] = child;
+    node->count++;
+    c->nodes++;
+    return child;
+}
+
+/* Labels of the name from the first one, -1 if the name is malformed */
+static int split_labels(const uint8_t *wire, size_t len, const uint8_t **labels)
+{
+    size_t pos;
+    int count = 0;
+
+    for (pos = 0; pos < len && wire[pos] != 0; pos += wire[pos] + 1) {
+        if (count == CACHE_MAX_LABELS || pos + wire[pos] + 1 >= len)
+            return -1;
+        labels[count++] = &wire[pos];
+    }
+    return pos < len ? count : -1;
+}
+
+struct cache_node * cache_node(struct cache *c, const uint8_t *wire, size_t len, bool create)
+{
+    const uint8_t *labels[CACHE_MAX_LABELS];
+    struct cache_node *node = &c->root;
+    int count = split_labels(wire, len, labels);
+
+    while (count-- > 0) {
+        uint32_t hash = label_hash(labels[count]);
+        bool found;
+        uint32_t index = child_index(node, labels[count], hash, &found);
+
+        if (found)
+            node = node->children[index];
+        else if (!create || !(node = add_child(c, node, labels[count], hash, index)))
+            return NULL;
+    }
+    node->used = ++c->uses;
+    return node;
+}
+
+struct cache_node * cache_closest_cut(struct cache *c, const uint8_t *wire, size_t len,
+                                      uint64_t now, size_t *zone_len)
+{
+    const uint8_t *labels[CACHE_MAX_LABELS];
+    struct cache_node *node = &c->root, *closest = NULL;
+    int count = split_labels(wire, len, labels);
+
+    if (count == -1)
+        return NULL;
+    if (node->cut && node->cut->expires > now) {
+        closest = node;
+        *zone_len = 1;
+    }
+    while (count-- > 0) {
+        bool found;
+        uint32_t index = child_index(node, labels[count], label_hash(labels[count]), &found);
+
+        if (!found)
+            break;
+        node = node->children[index];
+        if (node->cut && node->cut->expires > now) {
+            closest = node;
+            *zone_len = len - (labels[count] - wire);
+        }
+    }
+    if (closest)
+        closest->used = ++c->uses;
+    return closest;
+}
+
+struct zone_cut * cache_cut(struct cache *c, struct cache_node *node, uint64_t now)
+{
+    if (node->cut && node->cut->expires <= now) {
+        cut_retire(c, node->cut, now);
+        node->cut = NULL;
+    }
+    if (!node->cut)
+        node->cut = calloc(1, sizeof(*node->cut));
+    return node->cut;
+}
+
+int zone_cut_add_ns(struct zone_cut *cut, const uint8_t *wire, size_t len)
+{
+    uint8_t (*ns)[NAME_WIRE_MAX];
+    uint32_t i;
+
+    for (i = 0; i < cut->ns_count; i++) {
+        if (name_equal(cut->ns[i], len, wire, len))
+            return 0;
+    }
+    ns = realloc(cut->ns, (cut->ns_count + 1) * sizeof(*ns));
+    if (!ns)
+        return -1;
+    cut->ns = ns;
+    memcpy(cut->ns[cut->ns_count++], wire, len);
+    return 0;
+}
+
+struct cached_addrs * cache_addrs(struct cache_node *node, uint64_t now)
+{
+    struct cached_addrs *a = node->addrs;
+
+    if (!a)
+        return NULL;
+    if (a->ipv4_expires <= now)
+        a->ipv4_count = 0;
+    if (a->ipv6_expires <= now)
+        a->ipv6_count = 0;
+    return a->ipv4_count || a->ipv6_count ? a : NULL;
+}
+
+static struct cached_addrs * node_addrs(struct cache_node *node)
+{
+    if (!node->addrs)
+        node->addrs = calloc(1, sizeof(*node->addrs));
+    return node->addrs;
+}
+
+int cache_add_ipv4(struct cache_node *node, struct in_addr addr, uint64_t expires, uint64_t now)
+{
+    struct cached_addrs *a = node_addrs(node);
+    struct in_addr *ipv4;
+    uint32_t i;
+
+    if (!a)
+        return -1;
+    if (a->ipv4_expires <= now)
+        a->ipv4_count = 0;
+    for (i = 0; i < a->ipv4_count; i++) {
+        if (a->ipv4[i].s_addr == addr.s_addr)
+            return 0;
+    }
+    ipv4 = realloc(a->ipv4, (a->ipv4_count + 1) * sizeof(*ipv4));
+    if (!ipv4)
+        return -1;
+    a->ipv4 = ipv4;
+    a->ipv4[a->ipv4_count++] = addr;
+    if (a->ipv4_count == 1 || expires < a->ipv4_expires)
+        a->ipv4_expires = expires;
+    return 0;
+}
+
+int cache_add_ipv6(struct cache_node *node, const struct in6_addr *addr, uint64_t expires, uint64_t now)
+{
+    struct cached_addrs *a = node_addrs(node);
+    struct in6_addr *ipv6;
+    uint32_t i;
+
+    if (!a)
+        return -1;
+    if (a->ipv6_expires <= now)
+        a->ipv6_count = 0;
+    for (i = 0; i < a->ipv6_count; i++) {
+        if (memcmp(&a->ipv6[i], addr, sizeof(*addr)) == 0)
+            return 0;
+    }
+    ipv6 = realloc(a->ipv6, (a->ipv6_count + 1) * sizeof(*ipv6));
+    if (!ipv6)
+        return -1;
+    a->ipv6 = ipv6;
+    a->ipv6[a->ipv6_count++] = *addr;
+    if (a->ipv6_count == 1 || expires < a->ipv6_expires)
+        a->ipv6_expires = expires;
+    return 0;
+}
+
+const struct cached_alias * cache_alias(const struct cache_node *node, uint16_t type, uint64_t now)
+{
+    const struct cached_alias *a;
+
+    for (a = node->aliases; a; a = a->next) {
+        if (a->type == type)
+            return a->expires > now ? a : NULL;
+    }
+    return NULL;
+}
+
+int cache_set_alias(struct cache_node *node, uint16_t type, const uint8_t *target, size_t target_len,
+                    const uint8_t *rdata, size_t rdata_len, uint32_t count, uint64_t expires)
+{
+    struct cached_alias *a;
+    uint8_t *copy = malloc(rdata_len ? rdata_len : 1);
+
+    if (!copy)
+        return -1;
+    for (a = node->aliases; a && a->type != type; a = a->next)
+        ;
+    if (!a) {
+        a = calloc(1, sizeof(*a));
+        if (!a) {
+            free(copy);
+            return -1;
+        }
+        a->type = type;
+        a->next = node->aliases;
+        node->aliases = a;
+    }
+    free(a->rdata);
+    memcpy(copy, rdata, rdata_len);
+    a->rdata = copy;
+    a->rdata_len = rdata_len;
+    memcpy(a->target, target, target_len);
+    a->target_len = target_len;
+    a->count = count;
+    a->expires = expires;
+    return 0;
+}
@@ -0,0 +1,123 @@
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+
+#include "dns-names.h"
+#include "dns-upstream.h"
+
+/* What iterative resolution learned, in a trie over reversed labels, the same shape as
+ * the forwarding table but growing as replies come. Every node may be a zone cut (the
+ * nameservers a referral named) and a host with addresses (a nameserver). Entries past
+ * their TTL are treated as missing and replaced by fresh ones. Iterations in flight keep
+ * pointing at their zone cut and its servers, so a cut which is replaced or evicted is
+ * retired and freed only once the grace the cache was made with has passed; nodes are
+ * freed only by cache_trim, between events, when nobody holds them. */
+
+/* Most labels of a name, NAME_WIRE_MAX bytes hold at most 127 one-letter labels */
+#define CACHE_MAX_LABELS 128
+/* Longest time anything is cached for, in seconds */
+#define CACHE_MAX_TTL 86400
+/* Most names cached, past it the expired ones and then the least recently used ones are
+ * evicted down to CACHE_TRIM_TO of it */
+#define CACHE_MAX_NODES (1 << 20)
+#define CACHE_TRIM_TO 0.75
+
+/* Nameservers of a zone, built anew from the referral once it expires */
+struct zone_cut {
+    struct upstream_set servers;        /* the ones with a known address */
+    uint8_t (*ns)[NAME_WIRE_MAX];       /* names of all of them, wire format */
+    uint32_t ns_count;
+    uint64_t expires;                   /* ms, monotonic */
+    uint64_t freed;                     /* ms, when a retired cut is freed */
+    struct zone_cut *retired_next;
+};
+
+/* Addresses of a name, each family expires on its own */
+struct cached_addrs {
+    struct in_addr *ipv4;
+    uint32_t ipv4_count;
+    uint64_t ipv4_expires;
+    struct in6_addr *ipv6;
+    uint32_t ipv6_count;
+    uint64_t ipv6_expires;
+};
+
+/* Answer of an alias with its CNAME chain flattened, the name points right to the records
+ * at the end of the chain, which live as long as the shortest TTL of the chain and them */
+struct cached_alias {
+    uint16_t type;                      /* of the records */
+    uint8_t target[NAME_WIRE_MAX];      /* name at the end of the chain, owner of the records */
+    uint16_t target_len;
+    uint8_t *rdata;                     /* RDATA of every record after its u16 length, names unpacked */
+    size_t rdata_len;
+    uint32_t count;
+    uint64_t expires;
+    struct cached_alias *next;          /* of other types */
+};
+
+struct cache_node {
+    uint8_t label[LABEL_MAX + 1];       /* length byte and lowercase bytes */
+    uint32_t hash;
+    struct cache_node **children;       /* sorted by label hash */
+    uint32_t count;
+    struct zone_cut *cut;               /* NULL if no referral got here */
+    struct cached_addrs *addrs;         /* NULL if no address is known */
+    struct cached_alias *aliases;       /* NULL if the name is not a known alias */
+    uint64_t used;                      /* use of the cache it was last looked up by */
+};
+
+struct cache {
+    struct cache_node root;
+    uint64_t nodes;
+    uint64_t uses;                      /* lookups so far, the clock of least recent use */
+    uint64_t grace;                     /* ms a retired cut lives on */
+    struct zone_cut *retired_head, *retired_tail;  /* in the order they are freed */
+    uint64_t evicted;
+};
+
+/* grace is the longest time anything may hold a zone cut, the deadline of a lookup */
+void cache_init(struct cache *c, uint64_t grace);
+void cache_free(struct cache *c);
+
+/* Frees the retired cuts whose grace is over, and evicts names while there are more than
+ * CACHE_MAX_NODES of them; only to be called when no node is held */
+void cache_trim(struct cache *c, uint64_t now);
+
+/* Node of a wire name, added with its ancestors when create is set.
+ * NULL when it's missing (or couldn't be added). */
+struct cache_node * cache_node(struct cache *c, const uint8_t *wire, size_t len, bool create);
+
+/* Deepest node above or at the name with a zone cut which hasn't expired yet,
+ * zone_len is set to the length of the zone's name (a suffix of the wire name) */
+struct cache_node * cache_closest_cut(struct cache *c, const uint8_t *wire, size_t len,
+                                      uint64_t now, size_t *zone_len);
+
+/* Zone cut of the node which is to be filled with fresh nameservers. A live cut is
+ * returned as it is, an expired one is retired and an empty one takes its place, so
+ * that nameservers the zone no longer has aren't asked. */
+struct zone_cut * cache_cut(struct cache *c, struct cache_node *node, uint64_t now);
+int zone_cut_add_ns(struct zone_cut *cut, const uint8_t *wire, size_t len);
+
+/* Expiry of a record with the TTL (seconds) received now */
+static inline uint64_t cache_expiry(uint32_t ttl, uint64_t now)
+{
+    return now + (uint64_t)(ttl < CACHE_MAX_TTL ? ttl : CACHE_MAX_TTL) * 1000;
+}
+
+/* Live addresses of the node, expired families are emptied. NULL if there are none. */
+struct cached_addrs * cache_addrs(struct cache_node *node, uint64_t now);
+/* Adds an address, expired addresses of its family are dropped first */
+int cache_add_ipv4(struct cache_node *node, struct in_addr addr, uint64_t expires, uint64_t now);
+int cache_add_ipv6(struct cache_node *node, const struct in6_addr *addr, uint64_t expires, uint64_t now);
+
+/* Live flattened answer of the alias for the type, NULL if there is none */
+const struct cached_alias * cache_alias(const struct cache_node *node, uint16_t type, uint64_t now);
+/* Stores (or replaces) the flattened answer, rdata is copied */
+int cache_set_alias(struct cache_node *node, uint16_t type, const uint8_t *target, size_t target_len,
+                    const uint8_t *rdata, size_t rdata_len, uint32_t count, uint64_t expires);
+
+#endif
@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "dns-overrides.h"
+#include "dns-blocklist.h"
+#include "dns-zone.h"
+
+/* Build step for the tables the resolver maps at startup */
+
+static void print_usage(char *program_name)
+{
+    fprintf(stderr, "Usage: %s (overrides | blocklist | zone) input output\n", program_name);
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *in;
+    int ret;
+
+    if (argc == 2 && strcmp(argv[1], "-h") == 0) {
+        printf("Compiles text lists into files which the resolver can map.\n");
+        printf("dns-compile table input output\n");
+        printf("\n");
+        printf("overrides:\thosts-style list (address name [alias...]) for -o\n");
+        printf("blocklist:\tdomains, one per line (hosts-style lines too), for -b\n");
+        printf("zone:\t\tzone file (RFC 1035 master file), for -a\n");
+        printf("input:\t\ttext file, - for stdin\n");
+        printf("output:\t\tcompiled file\n");
+        return 0;
+    }
+    if (argc != 4) {
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    in = strcmp(argv[2], "-") == 0 ? stdin : fopen(argv[2], "r");
+    if (!in) {
+        fprintf(stderr, "Couldn't open %s:\n%d %s\n", argv[2], errno, strerror(errno));
+        return -1;
+    }
+
+    if (strcmp(argv[1], "overrides") == 0)
+        ret = overrides_compile(in, argv[3]);
+    else if (strcmp(argv[1], "blocklist") == 0)
+        ret = blocklist_compile(in, argv[3]);
+    else if (strcmp(argv[1], "zone") == 0)
+        ret = zone_compile(in, argv[3]);
+    else {
+        print_usage(argv[0]);
+        ret = -1;
+    }
+
+    if (in != stdin)
+        fclose(in);
+    return ret;
+}
@@ -0,0 +1,527 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "dns-engine.h"
+#include "dns-names.h"
+
+#define HEADER_SIZE 12
+
+/* Why a copy wasn't sent, besides an error */
+#define SEND_NO_ROOM 1
+#define SEND_TOO_LATE 2
+
+#define RCODE_SERVFAIL 2
+#define RCODE_REFUSED 5
+
+uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int engine_init(struct engine *e, struct upstream_pool *pool, uint32_t timeout)
+{
+    memset(e, 0, sizeof(*e));
+    e->pool = pool;
+    e->timeout = timeout;
+    timer_wheel_init(&e->wheel, now_ms());
+    return 0;
+}
+
+void engine_free(struct engine *e)
+{
+    /* Queries still in flight are the caller's, sockets belong to the pool */
+    e->head = NULL;
+    e->queue_head = e->queue_tail = NULL;
+}
+
+static void list_add(struct query **head, struct query *q)
+{
+    q->prev = NULL;
+    q->next = *head;
+    if (*head)
+        (*head)->prev = q;
+    *head = q;
+}
+
+static void list_remove(struct query **head, struct query *q)
+{
+    if (q->prev)
+        q->prev->next = q->next;
+    else
+        *head = q->next;
+    if (q->next)
+        q->next->prev = q->prev;
+}
+
+/* Queries waiting for room in a congestion window, first come first served */
+static void queue_push(struct engine *e, struct query *q)
+{
+    q->next = NULL;
+    q->prev = e->queue_tail;
+    if (e->queue_tail)
+        e->queue_tail->next = q;
+    else
+        e->queue_head = q;
+    e->queue_tail = q;
+    q->queued = true;
+}
+
+static void queue_remove(struct engine *e, struct query *q)
+{
+    if (q == e->queue_tail)
+        e->queue_tail = q->prev;
+    list_remove(&e->queue_head, q);
+    q->queued = false;
+}
+
+static void finish(struct engine *e, struct query *q, enum query_status status,
+                   const uint8_t *reply, size_t len)
+{
+    uint32_t i;
+
+    timer_cancel(&e->wheel, &q->retransmit_timer);
+    timer_cancel(&e->wheel, &q->hedge_timer);
+    timer_cancel(&e->wheel, &q->deadline_timer);
+    if (q->queued)
+        queue_remove(e, q);
+    else
+        list_remove(&e->head, q);
+    for (i = 0; i < q->attempts_count; i++)
+        id_release(&q->attempts[i].sock->ids, q->attempts[i].id);
+    e->count--;
+    q->done(q, status, reply, len);
+}
+
+/* Takes one extra query out of the budget if it has it */
+static bool budget_take(struct budget *b, double count)
+{
+    if (b->tokens < count)
+        return false;
+    b->tokens -= count;
+    return true;
+}
+
+static void budget_add(struct budget *b)
+{
+    b->tokens += b->ratio;
+    if (b->tokens > ENGINE_BUDGET_BURST)
+        b->tokens = ENGINE_BUDGET_BURST;
+}
+
+/* The timer fires when the first copy still pending runs out of its RTO */
+static void arm_retransmit(struct engine *e, struct query *q)
+{
+    uint64_t expires = UINT64_MAX;
+    uint32_t i;
+
+    for (i = 0; i < q->attempts_count; i++) {
+        if (q->attempts[i].pending && q->attempts[i].expires < expires)
+            expires = q->attempts[i].expires;
+    }
+    if (expires != UINT64_MAX)
+        timer_arm(&e->wheel, &q->retransmit_timer, expires);
+}
+
+/* Sends one more copy of the query to the best server it wasn't sent to yet. Windowed
+ * copy goes only to a server with room in its window, SEND_NO_ROOM if there is none.
+ * Another copy isn't sent when the server couldn't answer it before the deadline,
+ * the reply would be thrown away anyway. */
+static int send_copy(struct engine *e, struct query *q, bool windowed, uint64_t now)
+{
+    struct upstream *tried[QUERY_MAX_ATTEMPTS];
+    struct attempt *a;
+    struct upstream *up;
+    struct upstream_socket *sock;
+    int32_t id;
+    uint16_t header_id;
+    uint32_t i;
+
+    if (q->attempts_count == QUERY_MAX_ATTEMPTS)
+        return -1;
+    for (i = 0; i < q->attempts_count; i++)
+        tried[i] = q->attempts[i].upstream;
+    if (e->shard)
+        up = upstream_select_shard(q->servers, q->shard_hash, tried, q->attempts_count, windowed, now);
+    else
+        up = upstream_select(q->servers, tried, q->attempts_count, windowed, now);
+    if (!up && windowed)
+        return SEND_NO_ROOM;
+    if (up && q->attempts_count && up->srtt != 0 && now + up->srtt >= q->deadline)
+        return SEND_TOO_LATE;
+    if (!up || !(sock = upstream_socket(up)) || (id = id_alloc(&sock->ids, q)) == -1)
+        return -1;
+
+    a = &q->attempts[q->attempts_count++];
+    a->upstream = up;
+    a->sock = sock;
+    a->id = id;
+    a->sent = now;
+    a->expires = now + upstream_rto(up);
+    a->pending = true;
+    upstream_sent(up, now);
+    arm_retransmit(e, q);
+
+    header_id = htons(a->id);
+    memcpy(q->packet, &header_id, sizeof(header_id));
+
+    /* Failed send is a lost query, the timer will try again */
+    if (send(sock->socket_desc, q->packet, q->len, 0) == -1)
+        fprintf(stderr, "Couldn't send a datagram to %s:\n%d %s\n", up->name, errno, strerror(errno));
+    return 0;
+}
+
+/* Hedge goes out when the server of the first copy is slower than usual with the reply */
+static void arm_hedge(struct engine *e, struct query *q)
+{
+    const struct upstream *up = q->attempts[q->attempts_count - 1].upstream;
+    double delay = upstream_latency_percentile(up, ENGINE_HEDGE_PERCENTILE);
+    uint64_t hedge;
+
+    if (e->hedge_budget.ratio == 0 || q->servers->count < 2)
+        return;
+    /* Without enough samples for a percentile the latency estimate has to do */
+    if (delay == 0 && up->srtt != 0)
+        delay = up->srtt + 2 * up->rttvar;
+    hedge = q->attempts[0].sent + (uint64_t)delay + 1;
+    if (delay == 0 || hedge >= q->retransmit_timer.expires || hedge >= q->deadline)
+        return;
+    timer_arm(&e->wheel, &q->hedge_timer, hedge);
+}
+
+/* First copies of a query, more of them at once in a race when the budget allows.
+ * Returns SEND_NO_ROOM if no server has room for the query. */
+static int send_first(struct engine *e, struct query *q, uint64_t now)
+{
+    uint32_t copies = 1, i;
+    int ret = send_copy(e, q, true, now);
+
+    if (ret != 0)
+        return ret;
+    if (e->race > 1) {
+        copies = e->race < q->servers->count ? e->race : q->servers->count;
+        if (copies > 1 && budget_take(&e->race_budget, copies - 1))
+            e->raced++;
+        else
+            copies = 1;
+    }
+    for (i = 1; i < copies; i++) {
+        if (send_copy(e, q, true, now) != 0)
+            break;
+    }
+    q->tries = 1;
+    if (copies == 1)
+        arm_hedge(e, q);
+    return 0;
+}
+
+/* Sends queued queries while their servers have room */
+static void dispatch_queue(struct engine *e, uint64_t now)
+{
+    while (e->queue_head) {
+        struct query *q = e->queue_head;
+        int ret = send_first(e, q, now);
+
+        if (ret == SEND_NO_ROOM)
+            return;
+        if (ret == -1) {
+            finish(e, q, QUERY_TIMEOUT, NULL, 0);
+            continue;
+        }
+        queue_remove(e, q);
+        list_add(&e->head, q);
+    }
+}
+
+/* Copies still waited for are no longer needed, another one got answered or the query
+ * gave up */
+static void end_attempts(struct query *q)
+{
+    uint32_t i;
+
+    for (i = 0; i < q->attempts_count; i++) {
+        if (!q->attempts[i].pending)
+            continue;
+        q->attempts[i].pending = false;
+        upstream_cancelled(q->attempts[i].upstream);
+    }
+}
+
+/* Times out the copies of the query which ran out of their RTO by now, or those sent to
+ * the server up when it's not NULL. Returns the number of copies still pending. */
+static uint32_t expire_attempts(struct query *q, const struct upstream *up, uint64_t now)
+{
+    uint32_t i, pending = 0;
+
+    for (i = 0; i < q->attempts_count; i++) {
+        struct attempt *a = &q->attempts[i];
+
+        if (!a->pending)
+            continue;
+        if (up ? a->upstream != up : a->expires > now) {
+            pending++;
+            continue;
+        }
+        a->pending = false;
+        upstream_timed_out(a->upstream, now);
+    }
+    return pending;
+}
+
+static void on_hedge(struct timer *t, uint64_t now)
+{
+    struct query *q = container_of(t, struct query, hedge_timer);
+    struct engine *e = q->engine;
+
+    if (e->hedge_budget.tokens >= 1 && send_copy(e, q, true, now) == 0) {
+        e->hedge_budget.tokens -= 1;
+        q->hedge_attempt = q->attempts_count - 1;
+        e->hedged++;
+    }
+}
+
+static void on_retransmit(struct timer *t, uint64_t now)
+{
+    struct query *q = container_of(t, struct query, retransmit_timer);
+    struct engine *e = q->engine;
+
+    int ret = 0;
+
+    /* Copies to other servers which still have time may be answered yet, a race or
+     * a hedge is not lost with the first copy */
+    if (expire_attempts(q, NULL, now) > 0) {
+        arm_retransmit(e, q);
+        return;
+    }
+    /* Retransmission replaces a lost copy, it doesn't wait for room */
+    timer_cancel(&e->wheel, &q->hedge_timer);
+    if (q->tries >= ENGINE_MAX_TRIES || (ret = send_copy(e, q, false, now)) == -1)
+        finish(e, q, QUERY_TIMEOUT, NULL, 0);
+    else if (ret == SEND_TOO_LATE)
+        finish(e, q, QUERY_DEADLINE, NULL, 0);
+    else
+        q->tries++;
+}
+
+/* Copies still out may be answered yet, they just came too late to be of use */
+static void on_deadline(struct timer *t, uint64_t now)
+{
+    struct query *q = container_of(t, struct query, deadline_timer);
+
+    end_attempts(q);
+    finish(q->engine, q, QUERY_DEADLINE, NULL, 0);
+}
+
+/* Length of the question section, replies have to repeat it byte by byte */
+static uint16_t question_length(const uint8_t *packet, uint16_t len)
+{
+    uint16_t pos = HEADER_SIZE;
+
+    while (pos < len && packet[pos] != 0)
+        pos += packet[pos] + 1;
+    pos += 1 + 4;   /* zero byte, QTYPE and QCLASS */
+    return pos <= len ? pos - HEADER_SIZE : 0;
+}
+
+int engine_submit(struct engine *e, struct query *q)
+{
+    uint64_t now = now_ms();
+    int ret;
+
+    if (q->len < HEADER_SIZE || q->servers->count == 0)
+        return -1;
+    q->question_len = question_length(q->packet, q->len);
+    if (q->question_len == 0)
+        return -1;
+
+    if (e->shard)
+        q->shard_hash = name_hash_fast(q->packet + HEADER_SIZE, q->question_len - 4, 0);
+
+    q->tries = 0;
+    q->attempts_count = 0;
+    q->hedge_attempt = 0;
+    q->upstream = NULL;
+    q->started = now;
+    if (q->deadline == 0)
+        q->deadline = now + e->timeout;
+    if (q->deadline <= now)
+        return -1;
+    q->engine = e;
+    q->queued = false;
+    timer_init(&q->retransmit_timer, on_retransmit);
+    timer_init(&q->hedge_timer, on_hedge);
+    timer_init(&q->deadline_timer, on_deadline);
+    budget_add(&e->race_budget);
+    budget_add(&e->hedge_budget);
+
+    /* Queries behind others waiting for room keep their place */
+    ret = e->queue_head ? SEND_NO_ROOM : send_first(e, q, now);
+    if (ret == -1) {
+        timer_cancel(&e->wheel, &q->retransmit_timer);
+        timer_cancel(&e->wheel, &q->hedge_timer);
+        return -1;
+    }
+    if (ret == SEND_NO_ROOM) {
+        queue_push(e, q);
+        e->queued++;
+    }
+    else
+        list_add(&e->head, q);
+    timer_arm(&e->wheel, &q->deadline_timer, q->deadline);
+    e->submitted++;
+    e->count++;
+    return 0;
+}
+
+static void handle_reply(struct engine *e, struct upstream *up, struct upstream_socket *sock,
+                         const uint8_t *reply, size_t len, uint64_t now)
+{
+    struct query *q;
+    struct attempt *a = NULL;
+    uint16_t id;
+    uint32_t i, copies = 0;
+
+    if (len < HEADER_SIZE)
+        return;
+    memcpy(&id, reply, sizeof(id));
+    id = ntohs(id);
+    q = id_owner(&sock->ids, id);
+
+    /* Anything else is a late reply to a finished query, or spoofed */
+    if (!q || len < HEADER_SIZE + (size_t)q->question_len ||
+        memcmp(reply + HEADER_SIZE, q->packet + HEADER_SIZE, q->question_len) != 0)
+        return;
+
+    for (i = 0; i < q->attempts_count; i++) {
+        if (q->attempts[i].upstream != up)
+            continue;
+        if (q->attempts[i].sock == sock && q->attempts[i].id == id)
+            a = &q->attempts[i];
+        copies++;
+    }
+    if (!a)
+        return;
+
+    /* Latency is known only when the server got one copy, and late replies of timed
+     * out copies were already counted as lost */
+    if (a->pending) {
+        a->pending = false;
+        /* Server failing or refusing is most likely overloaded or rate limiting us */
+        if ((reply[3] & 0x0f) == RCODE_SERVFAIL || (reply[3] & 0x0f) == RCODE_REFUSED)
+            upstream_refused(up, now);
+        else
+            upstream_replied(up, now - a->sent, copies == 1);
+    }
+    if (q->hedge_attempt && a == &q->attempts[q->hedge_attempt])
+        e->hedges_won++;
+    end_attempts(q);
+    q->upstream = up;
+    finish(e, q, QUERY_OK, reply, len);
+}
+
+static void handle_readable(struct engine *e, struct upstream *up, struct upstream_socket *sock,
+                            uint64_t now)
+{
+    /* One byte more than the largest message, the reply is always followed by zeros */
+    uint8_t reply[UDP_MESSAGE_MAX + 1];
+
+    for (;;) {
+        ssize_t n = recv(sock->socket_desc, reply, UDP_MESSAGE_MAX, 0);
+        if (n == -1) {
+            struct query *q;
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+
+            /* ICMP unreachable on the connected socket. Only the copies sent to this
+             * server are lost; a query left with no copy out gets one replacement right
+             * away, one which can't have it is left to its timer, which gives up on it. */
+            for (q = e->head; q; q = q->next) {
+                uint32_t i, lost = 0;
+
+                for (i = 0; i < q->attempts_count; i++)
+                    lost += q->attempts[i].pending && q->attempts[i].upstream == up;
+                if (!lost || expire_attempts(q, up, now) > 0)
+                    continue;
+                if (q->tries < ENGINE_MAX_TRIES && send_copy(e, q, false, now) == 0)
+                    q->tries++;
+                else
+                    timer_arm(&e->wheel, &q->retransmit_timer, now);
+            }
+            continue;
+        }
+        memset(reply + n, 0, sizeof(reply) - n);
+        handle_reply(e, up, sock, reply, n, now);
+    }
+}
+
+/* The pool keeps the sockets ready to poll as they open and close, a wakeup costs no
+ * allocation and no walk over every upstream */
+int engine_poll(struct engine *e, int32_t wait, struct pollfd *extra, uint32_t count)
+{
+    struct upstream_pool *pool = e->pool;
+    uint64_t next;
+    uint32_t nfds, i;
+    uint64_t now = now_ms();
+
+    if (count > UPSTREAM_POLL_EXTRA) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* No reply is being read now, sockets can be closed */
+    upstream_pool_trim(pool, now);
+    nfds = pool->open_count;
+    if (count) {
+        /* Polling just the extra ones still needs the array */
+        if (!pool->fds && !(pool->fds = calloc(UPSTREAM_POLL_EXTRA, sizeof(*pool->fds))))
+            return -1;
+        memcpy(&pool->fds[nfds], extra, count * sizeof(*extra));
+    }
+
+    /* Sleep until the wheel has something to do */
+    next = timer_wheel_next(&e->wheel);
+    if (next != UINT64_MAX) {
+        int32_t left = next > now ? (int32_t)(next - now) : 0;
+        if (wait == -1 || left < wait)
+            wait = left;
+    }
+
+    if (poll(pool->fds, nfds + count, wait) == -1) {
+        for (i = 0; i < count; i++)
+            extra[i].revents = 0;
+        return errno == EINTR ? 0 : -1;
+    }
+
+    /* Sockets opened by the callbacks go after these and take the extra slots */
+    for (i = 0; i < count; i++)
+        extra[i].revents = pool->fds[nfds + i].revents;
+    now = now_ms();
+    for (i = 0; i < nfds; i++) {
+        if (pool->fds[i].revents)
+            handle_readable(e, pool->open[i]->upstream, pool->open[i], now);
+    }
+    now = now_ms();
+    timer_wheel_advance(&e->wheel, now);
+    dispatch_queue(e, now);
+    return 0;
+}
+
+void engine_report(const struct engine *e, FILE *out)
+{
+    fprintf(out, "Queries %llu, waited for a window %llu, raced %llu, hedged %llu "
+            "(%llu answered by the hedge)\n",
+            (unsigned long long)e->submitted, (unsigned long long)e->queued,
+            (unsigned long long)e->raced,
+            (unsigned long long)e->hedged, (unsigned long long)e->hedges_won);
+}
@@ -0,0 +1,117 @@
+#ifndef DNS_ENGINE_H
+#define DNS_ENGINE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "dns-upstream.h"
+#include "dns-timer.h"
+
+/* Largest DNS message over UDP (RFC 1035, 4.2.1) */
+#define UDP_MESSAGE_MAX 512
+
+/* How many times one query is retransmitted before giving up */
+#define ENGINE_MAX_TRIES 3
+
+/* Copies of one query in flight at most, first ones, hedges and retransmissions together */
+#define QUERY_MAX_ATTEMPTS 8
+
+/* Query not answered within this percentile of its server's latency is hedged */
+#define ENGINE_HEDGE_PERCENTILE 0.95
+
+/* Unused budget of extra queries is saved up to this many queries */
+#define ENGINE_BUDGET_BURST 10
+
+enum query_status {
+    QUERY_OK,
+    QUERY_TIMEOUT,                      /* no reply to any of the tries */
+    QUERY_DEADLINE,                     /* deadline passed before a reply came */
+    QUERY_NO_SERVER,                    /* referrals led to no nameserver which could be asked */
+};
+
+/* Extra queries a policy may send, ratio of them to queries submitted */
+struct budget {
+    double ratio;                       /* 0 disables the policy */
+    double tokens;
+};
+
+struct query;
+struct engine;
+typedef void (*query_done)(struct query *q, enum query_status status,
+                           const uint8_t *reply, size_t len);
+
+/* Copy of a query sent to one upstream */
+struct attempt {
+    struct upstream *upstream;
+    struct upstream_socket *sock;
+    uint16_t id;                        /* every copy has its own, from the ID space of its socket */
+    uint64_t sent;                      /* ms, monotonic */
+    uint64_t expires;                   /* sent plus the RTO of its server, then it's lost */
+    bool pending;                       /* neither answered nor timed out */
+};
+
+/* One question on its way to an upstream, owned by the caller until done is called */
+struct query {
+    uint8_t packet[UDP_MESSAGE_MAX];
+    uint16_t len;
+    uint16_t question_len;              /* QNAME, QTYPE and QCLASS, replies must repeat them */
+    uint64_t shard_hash;                /* of QNAME, when sharding */
+
+    const struct upstream_set *servers;
+    struct upstream *upstream;          /* which one answered, once done */
+    struct attempt attempts[QUERY_MAX_ATTEMPTS];
+    uint32_t attempts_count;
+    uint32_t tries;                     /* retransmissions are counted, hedges are not */
+    uint64_t started;                   /* ms, monotonic */
+    uint64_t deadline;                  /* when to give up, set by the caller or 0 for the default */
+    uint32_t hedge_attempt;             /* which copy is the hedge, 0 if none was sent */
+    struct timer retransmit_timer;      /* at the first copy pending to expire */
+    struct timer hedge_timer;           /* ask another server too */
+    struct timer deadline_timer;        /* give up */
+
+    query_done done;
+    void *ctx;
+    struct engine *engine;
+    bool queued;
+    struct query *prev, *next;          /* list of queries in flight, or the queue */
+};
+
+struct engine {
+    struct query *head;
+    struct query *queue_head, *queue_tail;  /* not sent yet, windows of their servers are full */
+    uint32_t count;
+    uint32_t timeout;                   /* default ms for the whole query, all attempts */
+    struct upstream_pool *pool;
+    struct timer_wheel wheel;           /* every timer of every query */
+
+    bool shard;                         /* send names to their servers on the hash ring */
+    uint32_t race;                      /* servers each query goes to at once, 1 is no race */
+    struct budget race_budget;
+    struct budget hedge_budget;
+
+    uint64_t submitted;
+    uint64_t queued;
+    uint64_t raced;
+    uint64_t hedged;
+    uint64_t hedges_won;                /* hedged queries answered by the hedge */
+};
+
+/* Monotonic time in ms */
+uint64_t now_ms(void);
+
+int engine_init(struct engine *e, struct upstream_pool *pool, uint32_t timeout);
+void engine_free(struct engine *e);
+
+/* Sends a query (header and one question in packet) to the best server of the set */
+int engine_submit(struct engine *e, struct query *q);
+
+/* Waits for replies until the next timer, at most wait ms (-1 for no limit). The count
+ * descriptors of extra (at most UPSTREAM_POLL_EXTRA) are polled too and get their revents.
+ * Returns -1 on error, 0 otherwise. */
+int engine_poll(struct engine *e, int32_t wait, struct pollfd *extra, uint32_t count);
+
+void engine_report(const struct engine *e, FILE *out);
+
+#endif
@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include "dns-names.h"
+#include "dns-forward.h"
+
+#define MAX_LABELS 128
+
+/* Trie the rules are first inserted into, it is flattened once all are read */
+struct build_node {
+    uint8_t label[LABEL_MAX + 1];
+    uint32_t hash;
+    int32_t set;
+    struct build_node **children;
+    uint32_t count;
+};
+
+static inline uint32_t label_hash(const uint8_t *label)
+{
+    return (uint32_t)name_hash_fast(label, label[0] + 1, 0xf0d);
+}
+
+static void build_free(struct build_node *node)
+{
+    uint32_t i;
+    for (i = 0; i < node->count; i++)
+        build_free(node->children[i]);
+    free(node->children);
+    free(node);
+}
+
+/* Finds or adds a child, added nodes are counted for the flat arrays */
+static struct build_node * build_child(struct build_node *node, const uint8_t *label,
+                                       uint32_t *nodes, size_t *labels_size)
+{
+    struct build_node *child, **children;
+    uint32_t i;
+
+    for (i = 0; i < node->count; i++) {
+        if (memcmp(node->children[i]->label, label, label[0] + 1) == 0)
+            return node->children[i];
+    }
+
+    child = calloc(1, sizeof(*child));
+    children = realloc(node->children, (node->count + 1) * sizeof(*children));
+    if (!child || !children) {
+        free(child);
+        return NULL;
+    }
+    memcpy(child->label, label, label[0] + 1);
+    child->hash = label_hash(label);
+    child->set = -1;
+    node->children = children;
+    node->children[node->count++] = child;
+    (*nodes)++;
+    *labels_size += label[0] + 1;
+    return child;
+}
+
+static int child_cmp(const void *a, const void *b)
+{
+    const struct build_node *na = *(struct build_node * const *)a, *nb = *(struct build_node * const *)b;
+    if (na->hash != nb->hash)
+        return na->hash < nb->hash ? -1 : 1;
+    return memcmp(na->label, nb->label, na->label[0] + 1);
+}
+
+/* Lays the trie out breadth first, the queue is the node array itself */
+static int flatten(struct forward_table *ft, struct build_node *root, uint32_t nodes, size_t labels_size)
+{
+    struct build_node **queue = malloc(nodes * sizeof(*queue));
+    uint32_t head = 0, tail = 0, edge = 0;
+    size_t label_pos = 0;
+
+    ft->nodes = malloc(nodes * sizeof(struct forward_node));
+    ft->edges = malloc((nodes > 1 ? nodes - 1 : 1) * sizeof(struct forward_edge));
+    ft->labels = malloc(labels_size ? labels_size : 1);
+    if (!queue || !ft->nodes || !ft->edges || !ft->labels) {
+        free(queue);
+        return -1;
+    }
+    ft->nodes_count = nodes;
+
+    queue[tail++] = root;
+    while (head < tail) {
+        struct build_node *node = queue[head];
+        struct forward_node *flat = &ft->nodes[head++];
+        uint32_t i;
+
+        qsort(node->children, node->count, sizeof(*node->children), child_cmp);
+        flat->first_edge = edge;
+        flat->edges = node->count;
+        flat->set = node->set;
+        for (i = 0; i < node->count; i++, edge++) {
+            struct build_node *child = node->children[i];
+            ft->edges[edge].hash = child->hash;
+            ft->edges[edge].label = label_pos;
+            ft->edges[edge].child = tail;
+            memcpy(&ft->labels[label_pos], child->label, child->label[0] + 1);
+            label_pos += child->label[0] + 1;
+            queue[tail++] = child;
+        }
+    }
+    free(queue);
+    return 0;
+}
+
+int forward_table_load(struct forward_table *ft, const char *path, struct upstream_pool *pool)
+{
+    struct build_node *root = calloc(1, sizeof(*root));
+    char line[4096];
+    uint32_t lineno = 0, nodes = 1;
+    size_t labels_size = 0;
+    FILE *in;
+    int ret = -1;
+
+    memset(ft, 0, sizeof(*ft));
+    if (!root)
+        return -1;
+    root->set = -1;
+
+    in = fopen(path, "r");
+    if (!in) {
+        fprintf(stderr, "Couldn't open %s:\n%d %s\n", path, errno, strerror(errno));
+        free(root);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), in)) {
+        char *save = NULL, *zone, *servers;
+        uint8_t wire[NAME_WIRE_MAX];
+        const uint8_t *labels[MAX_LABELS];
+        struct build_node *node = root;
+        struct upstream_set *sets;
+        int len, count = 0, pos;
+
+        lineno++;
+        line[strcspn(line, "#\r\n")] = '\0';
+        zone = strtok_r(line, " \t", &save);
+        if (!zone)
+            continue;
+        servers = strtok_r(NULL, " \t", &save);
+        len = name_encode(zone, wire, true);
+        if (!servers || strtok_r(NULL, " \t", &save) || len == -1) {
+            fprintf(stderr, "%s:%u: expected zone and servers\n", path, lineno);
+            goto out;
+        }
+
+        for (pos = 0; wire[pos] != 0; pos += wire[pos] + 1)
+            labels[count++] = &wire[pos];
+        while (count-- > 0) {
+            node = build_child(node, labels[count], &nodes, &labels_size);
+            if (!node)
+                goto out;
+        }
+        if (node->set != -1) {
+            fprintf(stderr, "%s:%u: zone %s is already forwarded\n", path, lineno, zone);
+            goto out;
+        }
+
+        sets = realloc(ft->sets, (ft->sets_count + 1) * sizeof(*sets));
+        if (!sets)
+            goto out;
+        ft->sets = sets;
+        if (upstream_set_parse(pool, servers, 0, &ft->sets[ft->sets_count]) == -1) {
+            fprintf(stderr, "%s:%u: invalid servers %s\n", path, lineno, servers);
+            goto out;
+        }
+        node->set = ft->sets_count++;
+    }
+    if (ferror(in)) {
+        fprintf(stderr, "Couldn't read %s:\n%d %s\n", path, errno, strerror(errno));
+        goto out;
+    }
+    ret = 0;
+
+out:
+    fclose(in);
+    if (ret == 0)
+        ret = flatten(ft, root, nodes, labels_size);
+    build_free(root);
+    if (ret == -1)
+        forward_table_free(ft);
+    return ret;
+}
+
+void forward_table_free(struct forward_table *ft)
+{
+    uint32_t i;
+    for (i = 0; i < ft->sets_count; i++)
+        upstream_set_free(&ft->sets[i]);
+    free(ft->sets);
+    free(ft->nodes);
+    free(ft->edges);
+    free(ft->labels);
+    memset(ft, 0, sizeof(*ft));
+}
+
+const struct upstream_set * forward_route(const struct forward_table *ft, const uint8_t *wire, size_t len)
+{
+    const uint8_t *labels[MAX_LABELS];
+    const struct forward_node *node;
+    int32_t set;
+    uint32_t count = 0;
+    size_t pos;
+
+    if (!ft->nodes)
+        return NULL;
+
+    for (pos = 0; pos < len && wire[pos] != 0; pos += wire[pos] + 1) {
+        if (count == MAX_LABELS || pos + wire[pos] + 1 >= len)
+            return NULL;
+        labels[count++] = &wire[pos];
+    }
+
+    /* Walk down from the root, the deepest zone with a rule wins */
+    node = &ft->nodes[0];
+    set = node->set;
+    while (count-- > 0 && node->edges) {
+        const struct forward_edge *edges = &ft->edges[node->first_edge];
+        uint32_t hash = label_hash(labels[count]);
+        uint32_t lo = 0, hi = node->edges;
+
+        while (lo < hi) {
+            uint32_t mid = (lo + hi) / 2;
+            if (edges[mid].hash < hash)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        for (; lo < node->edges && edges[lo].hash == hash; lo++) {
+            if (label_equal(&ft->labels[edges[lo].label], labels[count]))
+                break;
+        }
+        if (lo == node->edges || edges[lo].hash != hash)
+            break;
+
+        node = &ft->nodes[edges[lo].child];
+        if (node->set != -1)
+            set = node->set;
+    }
+    return set == -1 ? NULL : &ft->sets[set];
+}
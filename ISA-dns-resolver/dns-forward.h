@@ -0,0 +1,41 @@
+#ifndef DNS_FORWARD_H
+#define DNS_FORWARD_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dns-upstream.h"
+
+/* Conditional forwarding, zones are mapped to the servers their names are sent to.
+ * Rules are compiled into a trie over reversed labels kept in three flat arrays,
+ * nodes in breadth-first order and edges of every node next to each other. */
+
+struct forward_node {
+    uint32_t first_edge;
+    uint32_t edges;
+    int32_t set;            /* index of the upstream set of this zone, -1 if it has no rule */
+};
+
+struct forward_edge {
+    uint32_t hash;          /* edges of a node are sorted by label hash */
+    uint32_t label;         /* offset of the label (u8 length + lowercase bytes) */
+    uint32_t child;
+};
+
+struct forward_table {
+    struct forward_node *nodes;
+    struct forward_edge *edges;
+    uint8_t *labels;
+    uint32_t nodes_count;
+    struct upstream_set *sets;
+    uint32_t sets_count;
+};
+
+/* Reads rules "zone server[:port][,server...]", one per line. Zone . is the default route. */
+int forward_table_load(struct forward_table *ft, const char *path, struct upstream_pool *pool);
+void forward_table_free(struct forward_table *ft);
+
+/* Servers of the longest zone the wire-format name falls into, NULL if no rule matches */
+const struct upstream_set * forward_route(const struct forward_table *ft, const uint8_t *wire, size_t len);
+
+#endif
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "dns-hotkeys.h"
+
+int hotkeys_init(struct hotkeys *hk, uint32_t capacity)
+{
+    if (capacity == 0 || capacity > HOTKEYS_MAX) {
+        fprintf(stderr, "Number of tracked names must be between 1 and %d\n", HOTKEYS_MAX);
+        return -1;
+    }
+
+    memset(hk->sketch, 0, sizeof(hk->sketch));
+    /* Index at most half full, a lookup is a probe or two */
+    for (hk->mask = 1; hk->mask < 2 * capacity; hk->mask *= 2)
+        ;
+    hk->heap = malloc(capacity * sizeof(struct hotkey));
+    hk->index = calloc(hk->mask, sizeof(uint32_t));
+    hk->mask--;
+    if (!hk->heap || !hk->index) {
+        hotkeys_free(hk);
+        return -1;
+    }
+    hk->size = 0;
+    hk->capacity = capacity;
+    hk->total = 0;
+    return 0;
+}
+
+void hotkeys_free(struct hotkeys *hk)
+{
+    free(hk->heap);
+    free(hk->index);
+    hk->heap = NULL;
+    hk->index = NULL;
+}
+
+/* Slot of the index holding the name, or the empty one where it would go */
+static uint32_t index_find(const struct hotkeys *hk, uint64_t hash)
+{
+    uint32_t slot = hash & hk->mask;
+
+    while (hk->index[slot] && hk->heap[hk->index[slot] - 1].hash != hash)
+        slot = (slot + 1) & hk->mask;
+    return slot;
+}
+
+/* Empties the slot, entries after it move back so no probe sequence gets broken */
+static void index_remove(struct hotkeys *hk, uint32_t slot)
+{
+    uint32_t next = slot;
+
+    hk->index[slot] = 0;
+    for (;;) {
+        uint32_t home;
+
+        next = (next + 1) & hk->mask;
+        if (!hk->index[next])
+            return;
+        home = hk->heap[hk->index[next] - 1].hash & hk->mask;
+        /* Entry may fill the gap only if its home isn't between the gap and itself */
+        if (((next - home) & hk->mask) < ((next - slot) & hk->mask))
+            continue;
+        hk->index[slot] = hk->index[next];
+        hk->heap[hk->index[slot] - 1].slot = slot;
+        hk->index[next] = 0;
+        slot = next;
+    }
+}
+
+static void heap_swap(struct hotkeys *hk, uint32_t a, uint32_t b)
+{
+    struct hotkey tmp = hk->heap[a];
+
+    hk->heap[a] = hk->heap[b];
+    hk->heap[b] = tmp;
+    hk->index[hk->heap[a].slot] = a + 1;
+    hk->index[hk->heap[b].slot] = b + 1;
+}
+
+static void heap_sift_down(struct hotkeys *hk, uint32_t pos)
+{
+    for (;;) {
+        uint32_t smallest = pos, left = 2 * pos + 1, right = 2 * pos + 2;
+
+        if (left < hk->size && hk->heap[left].count < hk->heap[smallest].count)
+            smallest = left;
+        if (right < hk->size && hk->heap[right].count < hk->heap[smallest].count)
+            smallest = right;
+        if (smallest == pos)
+            return;
+        heap_swap(hk, pos, smallest);
+        pos = smallest;
+    }
+}
+
+static void heap_sift_up(struct hotkeys *hk, uint32_t pos)
+{
+    while (pos > 0) {
+        uint32_t parent = (pos - 1) / 2;
+        if (hk->heap[parent].count <= hk->heap[pos].count)
+            return;
+        heap_swap(hk, pos, parent);
+        pos = parent;
+    }
+}
+
+/* Increments all rows of the sketch and returns the new estimate (minimum over the rows).
+ * Row indexes are derived from two halves of one hash (Kirsch-Mitzenmacher). */
+static uint32_t sketch_add(struct hotkeys *hk, uint64_t hash)
+{
+    uint32_t h1 = (uint32_t)hash, h2 = (uint32_t)(hash >> 32) | 1u;
+    uint32_t estimate = UINT32_MAX;
+    int row;
+
+    for (row = 0; row < CMS_DEPTH; row++) {
+        uint32_t *cell = &hk->sketch[row][(h1 + row * h2) & (CMS_WIDTH - 1)];
+        if (*cell != UINT32_MAX)
+            (*cell)++;
+        if (*cell < estimate)
+            estimate = *cell;
+    }
+    return estimate;
+}
+
+void hotkeys_update(struct hotkeys *hk, const char *name)
+{
+    size_t len = strlen(name);
+    uint64_t hash;
+    uint32_t estimate, slot, i;
+
+    /* Trailing dot doesn't make it a different name */
+    if (len > 1 && name[len - 1] == '.')
+        len--;
+
+    hash = name_hash_fast(name, len, 0);
+    estimate = sketch_add(hk, hash);
+    hk->total++;
+
+    /* Names lighter than the weakest candidate can't enter the heap, which is the common
+     * case once the heap is full, so this is all the work most lookups do */
+    if (hk->size == hk->capacity && estimate <= hk->heap[0].count)
+        return;
+
+    slot = index_find(hk, hash);
+    if (hk->index[slot]) {
+        i = hk->index[slot] - 1;
+        hk->heap[i].count = estimate;
+        heap_sift_down(hk, i);
+        return;
+    }
+
+    if (len > HOSTNAME_MAX)
+        len = HOSTNAME_MAX;
+
+    if (hk->size < hk->capacity) {
+        i = hk->size++;
+    }
+    else {
+        /* Evict the weakest candidate, its removal may move the free slot */
+        i = 0;
+        index_remove(hk, hk->heap[0].slot);
+        slot = index_find(hk, hash);
+    }
+    hk->heap[i].hash = hash;
+    hk->heap[i].count = estimate;
+    hk->heap[i].slot = slot;
+    hk->index[slot] = i + 1;
+    memcpy(hk->heap[i].name, name, len);
+    hk->heap[i].name[len] = '\0';
+
+    if (i == 0)
+        heap_sift_down(hk, i);
+    else
+        heap_sift_up(hk, i);
+}
+
+static int hotkey_cmp_desc(const void *a, const void *b)
+{
+    const struct hotkey *ka = a, *kb = b;
+    if (ka->count != kb->count)
+        return ka->count < kb->count ? 1 : -1;
+    return strcmp(ka->name, kb->name);
+}
+
+void hotkeys_report(const struct hotkeys *hk, FILE *out)
+{
+    struct hotkey *sorted;
+    uint32_t i;
+
+    fprintf(out, "Top %u names (%llu lookups)\n", hk->size, (unsigned long long)hk->total);
+    if (hk->size == 0)
+        return;
+
+    /* Sort a copy, the heap keeps being updated after the report */
+    sorted = malloc(hk->size * sizeof(struct hotkey));
+    if (!sorted)
+        return;
+    memcpy(sorted, hk->heap, hk->size * sizeof(struct hotkey));
+    qsort(sorted, hk->size, sizeof(struct hotkey), hotkey_cmp_desc);
+
+    for (i = 0; i < hk->size; i++) {
+        fprintf(out, "\t%4u. %s, %u (%.2f%%)\n", i + 1, sorted[i].name, sorted[i].count,
+                hk->total ? 100.0 * sorted[i].count / hk->total : 0.0);
+    }
+    free(sorted);
+}
@@ -0,0 +1,44 @@
+#ifndef DNS_HOTKEYS_H
+#define DNS_HOTKEYS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "dns-names.h"
+
+/* Count-min sketch dimensions, width has to be a power of two. With these values
+ * the estimate is off by at most 0.07% of all lookups with 98% probability. */
+#define CMS_DEPTH 4
+#define CMS_WIDTH 4096
+
+/* Most names we are willing to track as heavy hitters */
+#define HOTKEYS_MAX 1024
+
+struct hotkey {
+    uint64_t hash;
+    uint32_t count;                 /* sketch estimate at the time of the last update */
+    uint32_t slot;                  /* where the index points to this entry */
+    char name[HOSTNAME_MAX + 1];
+};
+
+struct hotkeys {
+    uint32_t sketch[CMS_DEPTH][CMS_WIDTH];
+    struct hotkey *heap;            /* min-heap on count, root is the weakest candidate */
+    uint32_t size;
+    uint32_t capacity;
+    uint32_t *index;                /* hash to heap position + 1, linear probing, 0 is empty */
+    uint32_t mask;
+    uint64_t total;                 /* number of all lookups seen */
+};
+
+/* Sketch plus a heap of the `capacity` heaviest names, memory use doesn't grow with traffic */
+int hotkeys_init(struct hotkeys *hk, uint32_t capacity);
+void hotkeys_free(struct hotkeys *hk);
+
+/* Count one lookup of a name (dotted format, compared case-insensitively) */
+void hotkeys_update(struct hotkeys *hk, const char *name);
+
+/* Print the tracked names from the heaviest one */
+void hotkeys_report(const struct hotkeys *hk, FILE *out);
+
+#endif
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/random.h>
+
+#include "dns-ids.h"
+
+/* Bytes taken from the kernel at once, so that a query doesn't cost a system call */
+#define RANDOM_POOL_SIZE 256
+
+static int kernel_random(uint8_t *buf, size_t len)
+{
+    ssize_t got;
+    int fd;
+
+    while ((got = getrandom(buf, len, 0)) == -1 && errno == EINTR)
+        ;
+    if (got == (ssize_t)len)
+        return 0;
+    /* Kernels before getrandom() still have the device */
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd == -1)
+        return -1;
+    got = read(fd, buf, len);
+    close(fd);
+    return got == (ssize_t)len ? 0 : -1;
+}
+
+/* IDs are all a spoofed reply has to guess, the sockets are connected and keep their
+ * ports, so nothing may be derived from numbers already handed out. There's no safe
+ * way on without the kernel's CSPRNG. */
+static void random_bytes(void *out, size_t len)
+{
+    static uint8_t pool[RANDOM_POOL_SIZE];
+    static size_t left = 0;
+    uint8_t *dst = out;
+
+    while (len > 0) {
+        size_t n;
+
+        if (left == 0) {
+            if (kernel_random(pool, sizeof(pool)) == -1) {
+                fprintf(stderr, "Couldn't get random numbers from the kernel\n");
+                abort();
+            }
+            left = sizeof(pool);
+        }
+        n = len < left ? len : left;
+        memcpy(dst, &pool[sizeof(pool) - left], n);
+        left -= n;
+        dst += n;
+        len -= n;
+    }
+}
+
+uint64_t random64(void)
+{
+    uint64_t r;
+
+    random_bytes(&r, sizeof(r));
+    return r;
+}
+
+uint32_t random32(void)
+{
+    uint32_t r;
+
+    random_bytes(&r, sizeof(r));
+    return r;
+}
+
+int id_space_init(struct id_space *ids)
+{
+    memset(ids->used, 0, sizeof(ids->used));
+    ids->count = 0;
+    ids->owners = calloc(ID_SPACE, sizeof(*ids->owners));
+    return ids->owners ? 0 : -1;
+}
+
+void id_space_free(struct id_space *ids)
+{
+    free(ids->owners);
+    ids->owners = NULL;
+}
+
+int32_t id_alloc(struct id_space *ids, void *owner)
+{
+    uint32_t r = random32();
+    uint32_t word = (r >> 6) % (ID_SPACE / 64), bit = r & 63, i;
+
+    if (ids->count == ID_SPACE)
+        return -1;
+
+    /* Random ID if it's free, otherwise a free one close to it. Sockets are kept
+     * far from full, so it's rarely more than the first word. */
+    for (i = 0; i < ID_SPACE / 64; i++, word = (word + 1) % (ID_SPACE / 64), bit = 0) {
+        uint64_t free_bits = ~ids->used[word];
+        uint64_t rotated;
+        uint32_t id;
+
+        if (!free_bits)
+            continue;
+        rotated = bit ? (free_bits >> bit) | (free_bits << (64 - bit)) : free_bits;
+        id = word * 64 + ((__builtin_ctzll(rotated) + bit) & 63);
+
+        ids->used[word] |= 1ULL << (id & 63);
+        ids->owners[id] = owner;
+        ids->count++;
+        return id;
+    }
+    return -1;
+}
+
+void id_release(struct id_space *ids, uint16_t id)
+{
+    if (!(ids->used[id / 64] & (1ULL << (id & 63))))
+        return;
+    ids->used[id / 64] &= ~(1ULL << (id & 63));
+    ids->owners[id] = NULL;
+    ids->count--;
+}
+
+void * id_owner(const struct id_space *ids, uint16_t id)
+{
+    return ids->owners[id];
+}
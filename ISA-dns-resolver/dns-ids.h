@@ -0,0 +1,32 @@
+#ifndef DNS_IDS_H
+#define DNS_IDS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* DNS header ID is 16 bits, so one socket can tell apart this many queries */
+#define ID_SPACE 65536
+
+/* IDs of one socket in use, with the query owning each of them. IDs are handed out in
+ * random order, a spoofed reply has to guess both the source port and the ID. */
+struct id_space {
+    uint64_t used[ID_SPACE / 64];
+    void **owners;
+    uint32_t count;
+};
+
+/* Random numbers of the whole program, straight from the kernel's CSPRNG */
+uint64_t random64(void);
+uint32_t random32(void);
+
+int id_space_init(struct id_space *ids);
+void id_space_free(struct id_space *ids);
+
+/* Random unused ID, -1 if all of them are used */
+int32_t id_alloc(struct id_space *ids, void *owner);
+void id_release(struct id_space *ids, uint16_t id);
+
+/* Owner of the ID, NULL if it's not in use */
+void * id_owner(const struct id_space *ids, uint16_t id);
+
+#endif
@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+
+#include "dns-iterate.h"
+#include "dns-message.h"
+
+#define HEADER_SIZE 12
+
+int iterator_init(struct iterator *it, struct engine *e, struct upstream_pool *pool,
+                  struct cache *cache, const char *hints, int32_t port)
+{
+    struct zone_cut *root;
+
+    memset(it, 0, sizeof(*it));
+    it->engine = e;
+    it->pool = pool;
+    it->cache = cache;
+    it->port = port;
+
+    /* Hints never expire, they are where every name starts when nothing else is known */
+    root = cache_cut(cache, &cache->root, 0);
+    if (!root)
+        return -1;
+    root->expires = UINT64_MAX;
+    return upstream_set_parse(pool, hints, port, &root->servers);
+}
+
+static size_t wire_length(const uint8_t *wire)
+{
+    size_t pos = 0;
+
+    while (wire[pos] != 0)
+        pos += wire[pos] + 1;
+    return pos + 1;
+}
+
+static inline const uint8_t * qname_of(const struct iteration *i)
+{
+    return i->query.packet + HEADER_SIZE;
+}
+
+/* Puts the cached addresses of the name among the servers of the cut */
+static bool add_cached_servers(struct iteration *i, const uint8_t *name, size_t len, uint64_t now)
+{
+    struct iterator *it = i->iterator;
+    struct cache_node *node = cache_node(it->cache, name, len, false);
+    const struct cached_addrs *addrs = node ? cache_addrs(node, now) : NULL;
+    uint32_t j;
+
+    if (!addrs)
+        return false;
+    for (j = 0; j < addrs->ipv4_count; j++) {
+        struct upstream *up = upstream_get_addr(it->pool, addrs->ipv4[j], it->port);
+        if (up)
+            upstream_set_add(&i->cut->servers, up);
+    }
+    return true;
+}
+
+static void ask(struct iteration *i);
+static void start(struct iterator *it, struct iteration *i, const uint8_t *packet, size_t len,
+                  uint64_t deadline, uint32_t depth);
+
+static void on_ns_resolved(struct iteration *child, enum query_status status,
+                           const uint8_t *reply, size_t len)
+{
+    struct iteration *parent = child->ctx;
+    const uint8_t *ns = qname_of(child);
+    uint64_t now = now_ms();
+    struct message_index ix;
+    struct message m;
+    uint32_t j;
+
+    /* Addresses are stored under the nameserver's name, even if they came through an alias,
+     * so no owner name needs decoding */
+    if (status == QUERY_OK && message_parse(&m, reply, len) == 0 && m.rcode == RCODE_NOERROR &&
+        message_index(&m, &ix) == 0) {
+        struct cache_node *node = cache_node(parent->iterator->cache, ns, wire_length(ns), true);
+
+        for (j = 0; node && j < ix.count && ix.rr[j].section == SECTION_ANSWER; j++) {
+            const struct rr_ref *ref = &ix.rr[j];
+            struct in_addr addr;
+
+            if (ref->type != TYPE_A || ref->class != CLASS_IN || ref->rdlength != sizeof(addr))
+                continue;
+            memcpy(&addr, &reply[ref->rdata], sizeof(addr));
+            cache_add_ipv4(node, addr, cache_expiry(ref->ttl, now), now);
+        }
+        add_cached_servers(parent, ns, wire_length(ns), now);
+    }
+    free(child);
+    ask(parent);
+}
+
+/* Finds the address of the next nameserver of the cut. Returns 1 when the cache knew it,
+ * 0 when a lookup of it was started and -1 when there is no nameserver left. */
+static int resolve_next_ns(struct iteration *i)
+{
+    struct iterator *it = i->iterator;
+    const uint8_t *zone = qname_of(i) + wire_length(qname_of(i)) - i->zone_len;
+    uint64_t now = now_ms();
+
+    while (i->ns_next < i->cut->ns_count) {
+        const uint8_t *ns = i->cut->ns[i->ns_next++];
+        size_t len = wire_length(ns);
+        struct iteration *child;
+        uint8_t *packet;
+
+        if (add_cached_servers(i, ns, len, now))
+            return 1;
+        /* Nameserver inside its own zone can't be found without glue, asking the zone
+         * for it would only go round in circles */
+        if (i->depth == ITERATE_MAX_DEPTH || name_in_zone(ns, len, zone, i->zone_len))
+            continue;
+
+        child = malloc(sizeof(*child));
+        if (!child)
+            return -1;
+        packet = child->query.packet;
+        memset(packet, 0, HEADER_SIZE);
+        packet[5] = 1;                  /* QDCOUNT */
+        memcpy(&packet[HEADER_SIZE], ns, len);
+        packet[HEADER_SIZE + len] = 0;
+        packet[HEADER_SIZE + len + 1] = TYPE_A;
+        packet[HEADER_SIZE + len + 2] = 0;
+        packet[HEADER_SIZE + len + 3] = CLASS_IN;
+        child->done = on_ns_resolved;
+        child->ctx = i;
+        it->ns_lookups++;
+        start(it, child, packet, HEADER_SIZE + len + 4, i->deadline, i->depth + 1);
+        return 0;
+    }
+    return -1;
+}
+
+/* Sends the question to the servers of the current cut, looking up their addresses
+ * first if the referral came without them */
+static void ask(struct iteration *i)
+{
+    while (i->cut->servers.count == 0) {
+        int ret = resolve_next_ns(i);
+
+        /* The nested lookup carries the iteration on once it's done, which may be already */
+        if (ret == 0)
+            return;
+        if (ret == -1) {
+            i->done(i, QUERY_NO_SERVER, NULL, 0);
+            return;
+        }
+    }
+
+    i->query.servers = &i->cut->servers;
+    i->query.deadline = i->deadline;
+    if (engine_submit(i->iterator->engine, &i->query) == -1)
+        i->done(i, now_ms() >= i->deadline ? QUERY_DEADLINE : QUERY_NO_SERVER, NULL, 0);
+}
+
+/* Takes the referral of the reply into the cache. Returns the node of the zone
+ * it delegates to, NULL if the reply is not a referral closer to the name. */
+static struct cache_node * take_referral(struct iteration *i, const uint8_t *reply, size_t len,
+                                         uint64_t now, size_t *zone_len)
+{
+    struct iterator *it = i->iterator;
+    const uint8_t *qname = qname_of(i);
+    size_t qname_len = wire_length(qname);
+    const uint8_t *zone = qname + qname_len - i->zone_len;
+    uint8_t owner[NAME_WIRE_MAX], ns[NAME_WIRE_MAX];
+    size_t owner_len = 0;
+    struct cache_node *node = NULL;
+    struct zone_cut *cut = NULL;
+    uint32_t ttl = UINT32_MAX, k;
+    struct message_index ix;
+    struct message m;
+    struct rr rr;
+    int ns_len;
+
+    /* NS records of a zone between the one asked and the name, only their owners get
+     * decoded */
+    if (message_parse(&m, reply, len) == -1 || message_index(&m, &ix) == -1)
+        return NULL;
+    for (k = 0; k < ix.count; k++) {
+        const struct rr_ref *ref = &ix.rr[k];
+
+        if (ref->section != SECTION_AUTHORITY || ref->type != TYPE_NS || ref->class != CLASS_IN ||
+            message_rr(&m, ref, &rr, true) == -1)
+            continue;
+        if (owner_len == 0) {
+            if (rr.name_len <= i->zone_len || !name_in_zone(qname, qname_len, rr.name, rr.name_len) ||
+                !name_in_zone(rr.name, rr.name_len, zone, i->zone_len))
+                continue;
+            memcpy(owner, rr.name, rr.name_len);
+            owner_len = rr.name_len;
+            node = cache_node(it->cache, owner, owner_len, true);
+            cut = node ? cache_cut(it->cache, node, now) : NULL;
+            if (!cut)
+                return NULL;
+        }
+        else if (!name_equal(rr.name, rr.name_len, owner, owner_len))
+            continue;
+        ns_len = message_rdata_target(&m, &rr, ns);
+        if (ns_len == -1 || zone_cut_add_ns(cut, ns, ns_len) == -1)
+            continue;
+        if (rr.ttl < ttl)
+            ttl = rr.ttl;
+    }
+    if (!cut || cut->ns_count == 0)
+        return NULL;
+    if (cut->expires <= now)
+        cut->expires = cache_expiry(ttl, now);
+
+    /* Glue is taken only for the nameservers of the referral and only from within the
+     * zone asked, a server has no say over addresses outside of it */
+    for (k = 0; k < ix.count; k++) {
+        const struct rr_ref *ref = &ix.rr[k];
+        struct cache_node *host;
+        struct in_addr addr;
+        uint32_t j;
+
+        if (ref->section != SECTION_ADDITIONAL || ref->type != TYPE_A || ref->class != CLASS_IN ||
+            ref->rdlength != sizeof(addr) || message_rr(&m, ref, &rr, true) == -1 ||
+            !name_in_zone(rr.name, rr.name_len, zone, i->zone_len))
+            continue;
+        for (j = 0; j < cut->ns_count; j++) {
+            if (name_equal(cut->ns[j], rr.name_len, rr.name, rr.name_len))
+                break;
+        }
+        host = j < cut->ns_count ? cache_node(it->cache, rr.name, rr.name_len, true) : NULL;
+        if (!host)
+            continue;
+        memcpy(&addr, &reply[rr.rdata], sizeof(addr));
+        cache_add_ipv4(host, addr, cache_expiry(rr.ttl, now), now);
+    }
+    *zone_len = owner_len;
+    return node;
+}
+
+static void on_reply(struct query *q, enum query_status status, const uint8_t *reply, size_t len)
+{
+    struct iteration *i = q->ctx;
+    struct cache_node *node;
+    struct message m;
+    uint64_t now = now_ms();
+    size_t zone_len;
+    uint32_t j;
+
+    /* Answers, errors and truncated replies end the iteration, so does a reply which
+     * neither answers nor refers anywhere closer (no data, or a lame server) */
+    if (status != QUERY_OK || message_parse(&m, reply, len) == -1 || m.tc ||
+        m.rcode != RCODE_NOERROR || m.ancount > 0 || !(node = take_referral(i, reply, len, now, &zone_len))) {
+        i->done(i, status, reply, len);
+        return;
+    }
+
+    if (++i->referrals > ITERATE_MAX_REFERRALS) {
+        i->done(i, QUERY_NO_SERVER, NULL, 0);
+        return;
+    }
+    i->iterator->referrals++;
+    i->cut = node->cut;
+    i->zone_len = zone_len;
+    i->ns_next = 0;
+    for (j = 0; j < i->cut->ns_count; j++)
+        add_cached_servers(i, i->cut->ns[j], wire_length(i->cut->ns[j]), now);
+    ask(i);
+}
+
+static void start(struct iterator *it, struct iteration *i, const uint8_t *packet, size_t len,
+                  uint64_t deadline, uint32_t depth)
+{
+    const uint8_t *qname;
+    struct cache_node *node;
+
+    if (packet != i->query.packet)
+        memcpy(i->query.packet, packet, len);
+    i->query.len = len;
+    i->query.done = on_reply;
+    i->query.ctx = i;
+    i->iterator = it;
+    i->deadline = deadline;
+    i->referrals = 0;
+    i->depth = depth;
+    i->ns_next = 0;
+
+    /* The closest zone known, the root at worst */
+    qname = qname_of(i);
+    node = cache_closest_cut(it->cache, qname, wire_length(qname), now_ms(), &i->zone_len);
+    if (!node) {
+        i->done(i, QUERY_NO_SERVER, NULL, 0);
+        return;
+    }
+    i->cut = node->cut;
+    ask(i);
+}
+
+void iteration_start(struct iterator *it, struct iteration *i, const uint8_t *packet, size_t len,
+                     uint64_t deadline)
+{
+    start(it, i, packet, len, deadline, 0);
+}
+
+void iterator_report(const struct iterator *it, FILE *out)
+{
+    fprintf(out, "Referrals followed %llu, nameserver addresses looked up %llu, names cached %llu "
+            "(%llu evicted)\n",
+            (unsigned long long)it->referrals, (unsigned long long)it->ns_lookups,
+            (unsigned long long)it->cache->nodes, (unsigned long long)it->cache->evicted);
+}
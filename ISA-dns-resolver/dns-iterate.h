@@ -0,0 +1,65 @@
+#ifndef DNS_ITERATE_H
+#define DNS_ITERATE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dns-engine.h"
+#include "dns-cache.h"
+
+/* Iterative resolution, names are asked of the root servers and then of the nameservers
+ * each referral points to, until one of them answers. Zone cuts and nameserver addresses
+ * go to the cache, so later names start at the closest zone already known. */
+
+/* IPv4 addresses of a.root-servers.net to m.root-servers.net */
+#define ITERATE_ROOT_HINTS "198.41.0.4,170.247.170.2,192.33.4.12,199.7.91.13,192.203.230.10," \
+                           "192.5.5.241,192.112.36.4,198.97.190.53,192.36.148.17,192.58.128.30," \
+                           "193.0.14.129,199.7.83.42,202.12.27.33"
+
+/* Referrals one name may follow, more of them is a loop or a misconfigured zone */
+#define ITERATE_MAX_REFERRALS 16
+/* Lookups of nameserver addresses nested in each other */
+#define ITERATE_MAX_DEPTH 4
+
+struct iterator {
+    struct engine *engine;
+    struct upstream_pool *pool;
+    struct cache *cache;                /* shared with the rest of the resolver */
+    int32_t port;                       /* of every nameserver */
+
+    uint64_t referrals;
+    uint64_t ns_lookups;
+};
+
+struct iteration;
+typedef void (*iteration_done)(struct iteration *i, enum query_status status,
+                               const uint8_t *reply, size_t len);
+
+/* One name being resolved, owned by the caller until done is called */
+struct iteration {
+    struct query query;
+    struct iterator *iterator;
+    uint64_t deadline;                  /* for all queries of the iteration, nested ones too */
+    struct zone_cut *cut;               /* nameservers being asked */
+    size_t zone_len;                    /* their zone, a suffix of the question name */
+    uint32_t referrals;
+    uint32_t depth;
+    uint32_t ns_next;                   /* next nameserver of the cut to look up an address of */
+
+    iteration_done done;
+    void *ctx;
+};
+
+/* Root servers are the hints, a comma separated list like -s takes */
+int iterator_init(struct iterator *it, struct engine *e, struct upstream_pool *pool,
+                  struct cache *cache, const char *hints, int32_t port);
+
+/* Resolves the question of the packet (header and one question, RD clear).
+ * done is always called, possibly before this returns. */
+void iteration_start(struct iterator *it, struct iteration *i, const uint8_t *packet, size_t len,
+                     uint64_t deadline);
+
+void iterator_report(const struct iterator *it, FILE *out);
+
+#endif
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "dns-limit.h"
+#include "dns-ids.h"
+
+int rate_limit_set(struct rate_limit *rl, uint32_t rate, uint32_t slip, bool enforce)
+{
+    if (rate == 0 || rate > LIMIT_RATE_MAX) {
+        fprintf(stderr, "Rate limit must be 1 to %d responses a second\n", LIMIT_RATE_MAX);
+        return -1;
+    }
+    rl->rate = rate;
+    rl->slip = slip;
+    rl->enforce = enforce;
+    return 0;
+}
+
+int rate_limit_init(struct rate_limit *rl, uint32_t rate, uint32_t slip, bool enforce)
+{
+    memset(rl, 0, sizeof(*rl));
+    if (rate_limit_set(rl, rate, slip, enforce) == -1)
+        return -1;
+    /* Seed of the table's hash, so that nobody can pick prefixes which collide on purpose */
+    rl->seed = random64();
+    /* Buckets with no prefix are taken over by the first one hashed to them */
+    if (!(rl->buckets = calloc(LIMIT_BUCKETS, sizeof(struct limit_bucket)))) {
+        fprintf(stderr, "Couldn't allocate the rate limit table\n");
+        return -1;
+    }
+    return 0;
+}
+
+void rate_limit_free(struct rate_limit *rl)
+{
+    free(rl->buckets);
+    rl->buckets = NULL;
+}
+
+enum limit_verdict rate_limit_check(struct rate_limit *rl, uint32_t addr, uint64_t now)
+{
+    uint32_t prefix = addr >> (32 - LIMIT_PREFIX_BITS), full = rl->rate * 1000;
+    uint64_t hash = ((prefix ^ rl->seed) * 0x9e3779b97f4a7c15ULL) >> 32;
+    struct limit_bucket *b = &rl->buckets[hash & (LIMIT_BUCKETS - 1)];
+    uint64_t tokens;
+
+    /* Prefixes are stored plus one, zero is a bucket nobody took yet */
+    if (b->prefix != prefix + 1) {
+        b->prefix = prefix + 1;
+        b->tokens = full;
+        b->stamp = (uint32_t)now;
+        b->limited = 0;
+    }
+    tokens = b->tokens + (uint64_t)(uint32_t)((uint32_t)now - b->stamp) * rl->rate;
+    b->tokens = tokens > full ? full : (uint32_t)tokens;
+    b->stamp = (uint32_t)now;
+
+    if (b->tokens >= 1000) {
+        b->tokens -= 1000;
+        return b->tokens < full / 2 ? LIMIT_HEAVY : LIMIT_PASS;
+    }
+    if (!rl->enforce)
+        return LIMIT_HEAVY;
+    b->limited++;
+    return rl->slip && b->limited % rl->slip == 0 ? LIMIT_SLIP : LIMIT_DROP;
+}
@@ -0,0 +1,51 @@
+#ifndef DNS_LIMIT_H
+#define DNS_LIMIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Buckets of the table, a power of two. Prefixes colliding in it take the bucket over from
+ * each other, each one starting full, so a collision only ever lets more through. */
+#define LIMIT_BUCKETS 65536
+/* Clients are told apart by their /24, a flood with spoofed sources varies the last byte
+ * anyway (response rate limiting as of BIND and Knot) */
+#define LIMIT_PREFIX_BITS 24
+/* Most responses a second one prefix can be given, the tokens of a full bucket fit in 32 bits */
+#define LIMIT_RATE_MAX 1000000
+
+enum limit_verdict {
+    LIMIT_PASS,
+    LIMIT_HEAVY,                        /* passes, but has used up over half of its burst */
+    LIMIT_SLIP,                         /* over the rate, send a truncated reply instead */
+    LIMIT_DROP,                         /* over the rate, send nothing */
+};
+
+/* Token bucket of one prefix, refilled at the rate and holding a second's worth of it */
+struct limit_bucket {
+    uint32_t prefix;
+    uint32_t tokens;                    /* thousandths of a response */
+    uint32_t stamp;                     /* ms of the last refill */
+    uint32_t limited;                   /* responses over the rate, to pick those which slip */
+};
+
+/* Response rate limiting of clients. Without enforce the buckets only tell the prefixes
+ * which ask the most apart from the rest, nothing is limited. */
+struct rate_limit {
+    uint32_t rate;                      /* responses a second of one prefix */
+    uint32_t slip;                      /* every slip-th response over the rate goes out truncated, 0 none */
+    bool enforce;
+    uint64_t seed;
+    struct limit_bucket *buckets;
+};
+
+int rate_limit_init(struct rate_limit *rl, uint32_t rate, uint32_t slip, bool enforce);
+
+/* Changes the limit, the buckets stay as they are and only refill at the new rate */
+int rate_limit_set(struct rate_limit *rl, uint32_t rate, uint32_t slip, bool enforce);
+void rate_limit_free(struct rate_limit *rl);
+
+/* Takes a response from the bucket of the IPv4 address (host byte order) at time now (ms) */
+enum limit_verdict rate_limit_check(struct rate_limit *rl, uint32_t addr, uint64_t now);
+
+#endif
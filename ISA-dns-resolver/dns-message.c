@@ -0,0 +1,411 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "dns-message.h"
+
+#define HEADER_SIZE 12
+
+static inline uint16_t read_u16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+/* Moves pos past a name without decompressing it, a pointer ends it. Returns -1 if the
+ * name runs out of the message. */
+static int skip_name(const uint8_t *data, size_t len, size_t *pos)
+{
+    size_t at = *pos;
+
+    while (at < len) {
+        uint8_t c = data[at];
+
+        if ((c & 0xc0) == 0xc0) {
+            if (at + 2 > len)
+                return -1;
+            *pos = at + 2;
+            return 0;
+        }
+        if (c & 0xc0)
+            return -1;
+        at += c + 1;
+        if (c == 0) {
+            *pos = at;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int message_parse(struct message *m, const uint8_t *data, size_t len)
+{
+    uint16_t i;
+
+    if (len < HEADER_SIZE)
+        return -1;
+    m->data = data;
+    m->len = len;
+    m->aa = (data[2] & 0x04) != 0;
+    m->tc = (data[2] & 0x02) != 0;
+    m->rcode = data[3] & 0x0f;
+    m->qdcount = read_u16(&data[4]);
+    m->ancount = read_u16(&data[6]);
+    m->nscount = read_u16(&data[8]);
+    m->arcount = read_u16(&data[10]);
+    m->pos = HEADER_SIZE;
+    m->index = 0;
+
+    for (i = 0; i < m->qdcount; i++) {
+        if (skip_name(data, len, &m->pos) == -1 || m->pos + 4 > len)
+            return -1;
+        m->pos += 4;
+    }
+    return 0;
+}
+
+int message_next(struct message *m, struct rr *rr)
+{
+    int name_len;
+
+    if (m->index == (uint32_t)m->ancount + m->nscount + m->arcount)
+        return 0;
+
+    name_len = name_unpack(m->data, m->len, &m->pos, rr->name);
+    if (name_len == -1 || m->pos + 10 > m->len)
+        return -1;
+    rr->name_len = name_len;
+    rr->type = read_u16(&m->data[m->pos]);
+    rr->class = read_u16(&m->data[m->pos + 2]);
+    rr->ttl = (uint32_t)read_u16(&m->data[m->pos + 4]) << 16 | read_u16(&m->data[m->pos + 6]);
+    rr->rdlength = read_u16(&m->data[m->pos + 8]);
+    rr->rdata = m->pos + 10;
+    if (rr->rdata + rr->rdlength > m->len)
+        return -1;
+    m->pos = rr->rdata + rr->rdlength;
+
+    if (m->index < m->ancount)
+        rr->section = SECTION_ANSWER;
+    else if (m->index < (uint32_t)m->ancount + m->nscount)
+        rr->section = SECTION_AUTHORITY;
+    else
+        rr->section = SECTION_ADDITIONAL;
+    m->index++;
+    return 1;
+}
+
+int message_index(const struct message *m, struct message_index *ix)
+{
+    uint32_t total = (uint32_t)m->ancount + m->nscount + m->arcount;
+    uint32_t i;
+    size_t pos = m->pos;
+
+    ix->count = 0;
+    ix->partial = total - m->index > INDEX_MAX;
+    for (i = m->index; i < total && ix->count < INDEX_MAX; i++) {
+        struct rr_ref *ref = &ix->rr[ix->count++];
+        const uint8_t *p;
+
+        ref->name = pos;
+        if (skip_name(m->data, m->len, &pos) == -1 || pos + 10 > m->len)
+            return -1;
+        p = &m->data[pos];
+        ref->type = read_u16(p);
+        ref->class = read_u16(p + 2);
+        ref->ttl = (uint32_t)read_u16(p + 4) << 16 | read_u16(p + 6);
+        ref->rdlength = read_u16(p + 8);
+        ref->rdata = pos + 10;
+        pos += 10 + ref->rdlength;
+        if (pos > m->len)
+            return -1;
+        ref->section = i < m->ancount ? SECTION_ANSWER :
+                       i < (uint32_t)m->ancount + m->nscount ? SECTION_AUTHORITY : SECTION_ADDITIONAL;
+    }
+    return 0;
+}
+
+int message_rr(const struct message *m, const struct rr_ref *ref, struct rr *rr, bool name)
+{
+    size_t pos = ref->name;
+
+    rr->name_len = 0;
+    if (name) {
+        int name_len = name_unpack(m->data, m->len, &pos, rr->name);
+        if (name_len == -1)
+            return -1;
+        rr->name_len = name_len;
+    }
+    rr->type = ref->type;
+    rr->class = ref->class;
+    rr->ttl = ref->ttl;
+    rr->rdlength = ref->rdlength;
+    rr->rdata = ref->rdata;
+    rr->section = ref->section;
+    return 0;
+}
+
+/* Appends a name at pos of the message to out, returns -1 if it doesn't fit */
+static int unpack_name(const struct message *m, size_t *pos, uint8_t *out, size_t *len, size_t size)
+{
+    uint8_t wire[NAME_WIRE_MAX];
+    int name_len = name_unpack(m->data, m->len, pos, wire);
+
+    if (name_len == -1 || *len + name_len > size)
+        return -1;
+    memcpy(&out[*len], wire, name_len);
+    *len += name_len;
+    return 0;
+}
+
+int message_rdata_unpack(const struct message *m, const struct rr *rr, uint8_t *out, size_t size)
+{
+    const char *f = rr_type(rr->type)->layout;
+    size_t pos = rr->rdata, end = rr->rdata + rr->rdlength, len = 0;
+    int field;
+
+    /* Names are written out, the other fields copied as they are */
+    for (; *f; f++) {
+        if (*f == 'n' || *f == 'N') {
+            if (pos >= end || unpack_name(m, &pos, out, &len, size) == -1 || pos > end)
+                return -1;
+            continue;
+        }
+        field = rr_field_size(*f, &m->data[pos], end - pos);
+        if (field == -1 || len + field > size)
+            return -1;
+        memcpy(&out[len], &m->data[pos], field);
+        len += field;
+        pos += field;
+    }
+    return pos == end ? (int)len : -1;
+}
+
+int message_rdata_target(const struct message *m, const struct rr *rr, uint8_t *wire)
+{
+    const char *f = rr_type(rr->type)->layout;
+    size_t pos = rr->rdata, end = rr->rdata + rr->rdlength;
+    int len;
+
+    /* Fields in front of the target are skipped */
+    for (; *f && *f != 'N'; f++) {
+        if (*f == 'n') {
+            if (pos >= end || name_unpack(m->data, m->len, &pos, wire) == -1)
+                return -1;
+            continue;
+        }
+        len = rr_field_size(*f, &m->data[pos], end - pos);
+        if (len == -1)
+            return -1;
+        pos += len;
+    }
+    if (*f != 'N' || pos >= end)
+        return -1;
+    len = name_unpack(m->data, m->len, &pos, wire);
+    return len != -1 && pos <= end ? len : -1;
+}
+
+static inline void write_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+/* Compression pointers reach only the first 16 kB of a message */
+#define POINTER_MAX 0x3fff
+#define SUFFIX_SEED 0x5eed
+
+static inline uint8_t lower(uint8_t c)
+{
+    return c >= 'A' && c <= 'Z' ? c + 32 : c;
+}
+
+/* Whether the name at off of the message, maybe compressed itself, is the uncompressed suffix */
+static bool suffix_at(const uint8_t *data, size_t off, const uint8_t *suffix)
+{
+    uint8_t i;
+
+    for (;;) {
+        while ((data[off] & 0xc0) == 0xc0)
+            off = (data[off] & 0x3f) << 8 | data[off + 1];
+        if (data[off] != suffix[0])
+            return false;
+        if (suffix[0] == 0)
+            return true;
+        for (i = 1; i <= suffix[0]; i++) {
+            if (lower(data[off + i]) != lower(suffix[i]))
+                return false;
+        }
+        off += 1 + suffix[0];
+        suffix += 1 + suffix[0];
+    }
+}
+
+/* Slot a suffix goes to, by the bits of its hash which are kept next to the offset */
+static inline uint32_t slot_of(uint32_t hash)
+{
+    return (hash >> 14) & (BUILDER_SLOTS - 1);
+}
+
+/* Offset of a suffix written before, 0 if there is none */
+static size_t find_suffix(const struct builder *b, const uint8_t *suffix, uint32_t hash)
+{
+    uint32_t slot = slot_of(hash);
+
+    while (b->slots[slot]) {
+        size_t off = b->slots[slot] & POINTER_MAX;
+        if ((b->slots[slot] & ~POINTER_MAX) == (hash & ~POINTER_MAX) && suffix_at(b->data, off, suffix))
+            return off;
+        slot = (slot + 1) & (BUILDER_SLOTS - 1);
+    }
+    return 0;
+}
+
+/* Writes the name at the end of the message, as a pointer to the longest suffix written
+ * before if allowed to. Suffixes written out are put aside until the record fits. Returns
+ * the bytes written, -1 if they don't fit. */
+static int put_name(struct builder *b, size_t at, const uint8_t *name, size_t name_len, bool compress)
+{
+    size_t pos = 0, off = 0;
+
+    if (compress) {
+        for (; name[pos] != 0; pos += name[pos] + 1) {
+            uint32_t hash = (uint32_t)name_hash_fast(&name[pos], name_len - pos, SUFFIX_SEED);
+
+            if ((off = find_suffix(b, &name[pos], hash)) != 0)
+                break;
+            if (at + pos <= POINTER_MAX && b->pending_count < BUILDER_PENDING)
+                b->pending[b->pending_count++] = (hash & ~POINTER_MAX) | (at + pos);
+        }
+    }
+    else
+        pos = name_len - 1;
+
+    if (at + pos + (off ? 2 : 1) > b->size)
+        return -1;
+    memcpy(&b->data[at], name, pos);
+    if (off) {
+        write_u16(&b->data[at + pos], 0xc000 | off);
+        return pos + 2;
+    }
+    b->data[at + pos] = 0;
+    return pos + 1;
+}
+
+/* Notes the suffixes of the record which fit, a nearly full table takes no more */
+static void note_suffixes(struct builder *b)
+{
+    uint32_t i;
+
+    for (i = 0; i < b->pending_count && b->used < BUILDER_SLOTS * 3 / 4; i++) {
+        uint32_t slot = slot_of(b->pending[i]);
+
+        while (b->slots[slot])
+            slot = (slot + 1) & (BUILDER_SLOTS - 1);
+        b->slots[slot] = b->pending[i];
+        b->used++;
+    }
+    b->pending_count = 0;
+}
+
+int builder_init(struct builder *b, uint8_t *data, size_t size, uint16_t flags)
+{
+    if (size < HEADER_SIZE)
+        return -1;
+    b->data = data;
+    b->size = size;
+    b->len = HEADER_SIZE;
+    b->truncated = false;
+    b->used = 0;
+    b->pending_count = 0;
+    memset(b->slots, 0, sizeof(b->slots));
+    memset(data, 0, HEADER_SIZE);
+    write_u16(&data[2], flags);
+    return 0;
+}
+
+int builder_question(struct builder *b, const uint8_t *qname, size_t qname_len, uint16_t qtype)
+{
+    int len;
+
+    if (b->data[7] || b->data[9] || b->data[11] || b->truncated)
+        return -1;
+    b->pending_count = 0;
+    len = put_name(b, b->len, qname, qname_len, true);
+    if (len == -1 || b->len + len + 4 > b->size)
+        return -1;
+    write_u16(&b->data[b->len + len], qtype);
+    write_u16(&b->data[b->len + len + 2], CLASS_IN);
+    b->len += len + 4;
+    write_u16(&b->data[4], (b->data[4] << 8 | b->data[5]) + 1);
+    note_suffixes(b);
+    return 0;
+}
+
+int builder_add(struct builder *b, enum section section, const uint8_t *name, size_t name_len,
+                uint16_t type, uint32_t ttl, const uint8_t *rdata, uint16_t rdlength)
+{
+    uint8_t *count = &b->data[6 + 2 * section];
+    bool compress = rr_type_compressible(type);
+    const char *f = rr_type(type)->layout;
+    size_t at = b->len, start, pos = 0;
+    int len;
+
+    if (b->truncated)
+        return -1;
+    b->pending_count = 0;
+    if ((len = put_name(b, at, name, name_len, true)) == -1 || at + len + 10 > b->size)
+        goto full;
+    at += len;
+    write_u16(&b->data[at], type);
+    write_u16(&b->data[at + 2], CLASS_IN);
+    write_u16(&b->data[at + 4], ttl >> 16);
+    write_u16(&b->data[at + 6], ttl & 0xffff);
+    start = at + 10;
+    at = start;
+
+    /* Names of RDATA go through put_name, the other fields are copied */
+    for (; *f; f++) {
+        if (*f == 'n' || *f == 'N') {
+            size_t wire_len = 0;
+
+            while (pos + wire_len < rdlength && rdata[pos + wire_len] != 0)
+                wire_len += rdata[pos + wire_len] + 1;
+            if (pos + ++wire_len > rdlength)
+                break;
+            if ((len = put_name(b, at, &rdata[pos], wire_len, compress)) == -1)
+                goto full;
+            at += len;
+            pos += wire_len;
+            continue;
+        }
+        if ((len = rr_field_size(*f, &rdata[pos], rdlength - pos)) == -1)
+            break;
+        if (at + len > b->size)
+            goto full;
+        memcpy(&b->data[at], &rdata[pos], len);
+        at += len;
+        pos += len;
+    }
+    /* RDATA not matching its layout is copied as it is */
+    if (pos != rdlength) {
+        b->pending_count = 0;
+        at = start;
+        if (at + rdlength > b->size)
+            goto full;
+        memcpy(&b->data[at], rdata, rdlength);
+        at += rdlength;
+    }
+    write_u16(&b->data[start - 2], at - start);
+    b->len = at;
+    write_u16(count, (count[0] << 8 | count[1]) + 1);
+    note_suffixes(b);
+    return 0;
+
+full:
+    b->pending_count = 0;
+    if (section != SECTION_ADDITIONAL) {
+        b->truncated = true;
+        b->data[2] |= 0x02;             /* TC */
+    }
+    return -1;
+}
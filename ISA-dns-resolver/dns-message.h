@@ -0,0 +1,131 @@
+#ifndef DNS_MESSAGE_H
+#define DNS_MESSAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "dns-names.h"
+#include "dns-types.h"
+
+#define RCODE_NOERROR 0
+#define RCODE_FORMERR 1
+#define RCODE_SERVFAIL 2
+#define RCODE_NXDOMAIN 3
+#define RCODE_NOTIMP 4
+#define RCODE_REFUSED 5
+/* Dynamic update (RFC 2136, 2.2) */
+#define RCODE_YXDOMAIN 6
+#define RCODE_YXRRSET 7
+#define RCODE_NXRRSET 8
+#define RCODE_NOTAUTH 9
+#define RCODE_NOTZONE 10
+
+enum section {
+    SECTION_ANSWER,
+    SECTION_AUTHORITY,
+    SECTION_ADDITIONAL,
+};
+
+/* Resource record of a message, its name decompressed, RDATA left in the message */
+struct rr {
+    uint8_t name[NAME_WIRE_MAX];
+    uint16_t name_len;
+    uint16_t type;
+    uint16_t class;
+    uint32_t ttl;
+    uint16_t rdlength;
+    size_t rdata;                       /* offset of RDATA in the message */
+    enum section section;
+};
+
+/* Reader walking the records of a reply one by one, for the code that acts on
+ * the reply rather than printing it */
+struct message {
+    const uint8_t *data;
+    size_t len;
+    bool aa, tc;
+    uint8_t rcode;
+    uint16_t qdcount, ancount, nscount, arcount;
+    size_t pos;                         /* next record */
+    uint32_t index;                     /* records read, all sections together */
+};
+
+/* Reads the header and skips the questions. Returns -1 if the message is malformed. */
+int message_parse(struct message *m, const uint8_t *data, size_t len);
+
+/* Reads the next record. Returns 1 with a record, 0 after the last one, -1 if the
+ * rest of the message is malformed. */
+int message_next(struct message *m, struct rr *rr);
+
+/* Most records an index holds, replies of a resolver carry a few dozen at most */
+#define INDEX_MAX 64
+
+/* Record as the index found it, its fixed fields read and nothing else decoded */
+struct rr_ref {
+    uint16_t name;                      /* offset of the owner name, maybe compressed */
+    uint16_t type;
+    uint16_t class;
+    uint16_t rdlength;
+    uint32_t ttl;
+    uint16_t rdata;                     /* offset of RDATA */
+    uint8_t section;
+};
+
+/* Records of a message found in one pass, names skipped over rather than decompressed.
+ * Code which needs only the rcode, or records of one type, picks them from the index and
+ * decodes just those. */
+struct message_index {
+    uint32_t count;
+    bool partial;                       /* more than INDEX_MAX records, the rest isn't indexed */
+    struct rr_ref rr[INDEX_MAX];
+};
+
+/* Indexes the records from the reader's position on. Returns -1 if the message is malformed. */
+int message_index(const struct message *m, struct message_index *ix);
+
+/* The indexed record as message_next would have read it, the owner name is decompressed
+ * only if asked for. Returns -1 if the name is malformed. */
+int message_rr(const struct message *m, const struct rr_ref *ref, struct rr *rr, bool name);
+
+/* RDATA of the record with the names in it written out in full, so it can be stored
+ * or put into another message. Returns its length, -1 if it's malformed or longer than size. */
+int message_rdata_unpack(const struct message *m, const struct rr *rr, uint8_t *out, size_t size);
+
+/* Name the record points to, the one marked N in the layout of its type (NS, CNAME, PTR,
+ * MX, SRV, HTTPS).
+ * Returns its wire length, -1 if the record has none or it's malformed. */
+int message_rdata_target(const struct message *m, const struct rr *rr, uint8_t *wire);
+
+/* Slots of the builder's table of names written so far, names past them go uncompressed */
+#define BUILDER_SLOTS 256
+/* Names of one record whose suffixes are noted, the rest of a long one isn't */
+#define BUILDER_PENDING 64
+
+/* Message put together record by record with names compressed (RFC 1035, 4.1.4). Every
+ * suffix written is noted in a small open-addressed table by its hash, so a name is
+ * matched against a handful of earlier offsets rather than the whole message. Questions
+ * go first, then records section after section. A record which doesn't fit is left out
+ * whole; one of the answer or authority sections also sets TC and ends the message, the
+ * additional section is just cut short. */
+struct builder {
+    uint8_t *data;
+    size_t len;
+    size_t size;                        /* most the message may take, 512 for plain UDP */
+    bool truncated;
+    uint32_t slots[BUILDER_SLOTS];      /* hash bits above, offset in the low 14 bits, 0 empty */
+    uint32_t used;
+    uint32_t pending[BUILDER_PENDING];  /* suffixes of the record being added, noted once it fits */
+    uint32_t pending_count;
+};
+
+/* Header with the flags (third and fourth byte), no questions yet */
+int builder_init(struct builder *b, uint8_t *data, size_t size, uint16_t flags);
+/* Returns -1 if the question doesn't fit or records were added already */
+int builder_question(struct builder *b, const uint8_t *qname, size_t qname_len, uint16_t qtype);
+/* RDATA is given with its names in full, they are compressed where the type allows it.
+ * Returns -1 if the record doesn't fit or the message was truncated already. */
+int builder_add(struct builder *b, enum section section, const uint8_t *name, size_t name_len,
+                uint16_t type, uint32_t ttl, const uint8_t *rdata, uint16_t rdlength);
+
+#endif
@@ -0,0 +1,441 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "dns-names.h"
+
+static inline uint8_t ascii_lower(uint8_t c)
+{
+    return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+/* Eight bytes lowered at once: a byte is upper case when it is at least 'A', at most 'Z'
+ * and below 0x80. The flag bit 0x80 of those shifted down to 0x20 is the case bit. */
+static inline uint64_t ascii_lower8(uint64_t x)
+{
+    uint64_t low7 = x & 0x7f7f7f7f7f7f7f7fULL;
+    uint64_t ge_a = low7 + 0x3f3f3f3f3f3f3f3fULL;   /* 0x80 - 'A' */
+    uint64_t gt_z = low7 + 0x2525252525252525ULL;   /* 0x80 - 'Z' - 1 */
+
+    return x | ((ge_a & ~gt_z & ~x & 0x8080808080808080ULL) >> 2);
+}
+
+#ifdef __SSE2__
+/* Kernels working on a block of bytes at once. SSE2 is there on every x86-64, the AVX2
+ * scan is picked at run time when the CPU has it. Names are at most 255 bytes, so it's
+ * a handful of blocks per name, other architectures keep the one pass encoder. */
+#define SCAN_MAX (NAME_WIRE_MAX + 1)
+#define SCAN_WORDS (SCAN_MAX / 64 + 2)
+
+/* Sets the bits of a block mask at pos of the bit array, bits before 0 are dropped */
+static inline void put_bits(uint64_t *bits, long pos, uint64_t mask)
+{
+    if (pos < 0) {
+        mask >>= -pos;
+        pos = 0;
+    }
+    bits[pos / 64] |= mask << (pos % 64);
+    if (pos % 64)
+        bits[pos / 64 + 1] |= mask >> (64 - pos % 64);
+}
+
+/* Eight bytes at a time, the rest one by one */
+static void copy_scalar(uint8_t *dst, const char *src, size_t len, bool lower)
+{
+    size_t i = 0;
+    uint64_t w;
+
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&w, &src[i], 8);
+        if (lower)
+            w = ascii_lower8(w);
+        memcpy(&dst[i], &w, 8);
+    }
+    for (; i < len; i++)
+        dst[i] = lower ? ascii_lower(src[i]) : (uint8_t)src[i];
+}
+
+
+static inline __m128i lower16(__m128i v)
+{
+    /* 'A'..'Z' moved to the very bottom of the signed range, one compare finds them */
+    __m128i shifted = _mm_add_epi8(v, _mm_set1_epi8((char)(0x80 - 'A')));
+    __m128i upper = _mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(0x80 + 26)));
+    return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+/* Blocks are read aligned, an aligned block never reaches into a page the string doesn't.
+ * Bytes past the end are read all the same, which the address sanitizer would report. */
+__attribute__((no_sanitize_address))
+static int scan_sse2(const char *s, uint64_t *dots)
+{
+    long skip = (uintptr_t)s & 15;
+    const __m128i *block = (const __m128i *)(s - skip);
+    long pos;
+
+    for (pos = -skip; pos < SCAN_MAX; pos += 16, block++) {
+        __m128i v = _mm_load_si128(block);
+        uint32_t nul = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+        uint32_t dot = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('.')));
+
+        if (pos < 0)
+            nul &= ~0U << skip;
+        if (nul) {
+            long end = pos + __builtin_ctz(nul);
+            put_bits(dots, pos, dot & ((1U << (end - pos)) - 1));
+            return end < SCAN_MAX ? (int)end : -1;
+        }
+        put_bits(dots, pos, dot);
+    }
+    return -1;
+}
+
+/* The last block overlaps the one before it, so there's no byte by byte tail */
+static void copy_sse2(uint8_t *dst, const char *src, size_t len, bool lower)
+{
+    size_t i;
+
+    if (len < 16) {
+        copy_scalar(dst, src, len, lower);
+        return;
+    }
+    for (i = 0; ; i += 16) {
+        __m128i v;
+
+        if (i + 16 > len)
+            i = len - 16;
+        v = _mm_loadu_si128((const __m128i *)&src[i]);
+        _mm_storeu_si128((__m128i *)&dst[i], lower ? lower16(v) : v);
+        if (i + 16 == len)
+            return;
+    }
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_AVX2 1
+
+__attribute__((target("avx2"), no_sanitize_address))
+static int scan_avx2(const char *s, uint64_t *dots)
+{
+    long skip = (uintptr_t)s & 31;
+    const __m256i *block = (const __m256i *)(s - skip);
+    long pos;
+
+    for (pos = -skip; pos < SCAN_MAX; pos += 32, block++) {
+        __m256i v = _mm256_load_si256(block);
+        uint32_t nul = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+        uint32_t dot = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('.')));
+
+        if (pos < 0)
+            nul &= ~0U << skip;
+        if (nul) {
+            long end = pos + __builtin_ctz(nul);
+            put_bits(dots, pos, end - pos == 32 ? dot : dot & ((1U << (end - pos)) - 1));
+            return end < SCAN_MAX ? (int)end : -1;
+        }
+        put_bits(dots, pos, dot);
+    }
+    return -1;
+}
+#endif
+
+/* Whether the AVX2 scan can run here, found out on the first name */
+static inline bool use_avx2(void)
+{
+#ifdef HAVE_AVX2
+    static int avx2 = -1;
+    if (avx2 == -1)
+        avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    return avx2;
+#else
+    return false;
+#endif
+}
+
+/* Length of the hostname and a bit for each of its dots, -1 if it's longer than any name */
+static inline int scan_name(const char *s, uint64_t *dots)
+{
+#ifdef HAVE_AVX2
+    if (use_avx2())
+        return scan_avx2(s, dots);
+#endif
+    return scan_sse2(s, dots);
+}
+
+/* Names are short, a 32 byte copy was no faster than the 16 byte one */
+static inline void copy_name(uint8_t *dst, const char *src, size_t len, bool lower)
+{
+    copy_sse2(dst, src, len, lower);
+}
+
+/* The hostname is copied one byte further in the wire name as a whole, then each dot is
+ * overwritten by the length of the label after it and the first length goes in front */
+int name_encode(const char *hostname, uint8_t *wire, bool lower)
+{
+    uint64_t dots[SCAN_WORDS] = { 0 };
+    int len = scan_name(hostname, dots);
+    int start = 0, w;
+
+    /* Root is the only name allowed to be empty */
+    if (len == 1 && hostname[0] == '.') {
+        wire[0] = 0;
+        return 1;
+    }
+    if (len <= 0 || len > HOSTNAME_MAX + 1)
+        return -1;
+    copy_name(&wire[1], hostname, len, lower);
+
+    for (w = 0; w <= (len - 1) / 64; w++) {
+        uint64_t bits = dots[w];
+
+        while (bits) {
+            int dot = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            if (dot - start == 0 || dot - start > LABEL_MAX)
+                return -1;
+            wire[start] = dot - start;
+            start = dot + 1;
+        }
+    }
+
+    /* Empty label is allowed only as the trailing dot */
+    if (start == len) {
+        wire[len] = 0;
+        return len + 1;
+    }
+    if (len - start > LABEL_MAX || len > HOSTNAME_MAX)
+        return -1;
+    wire[start] = len - start;
+    wire[len + 1] = 0;
+    return len + 2;
+}
+
+#else
+
+/* One pass over the hostname, a block at a time doesn't pay off without vector compares */
+int name_encode(const char *hostname, uint8_t *wire, bool lower)
+{
+    size_t pos = 0;     /* position in the wire name, where the current label length goes */
+    size_t label = 0;   /* length of the current label */
+    const char *c;
+
+    /* Root is the only name allowed to be empty */
+    if (hostname[0] == '.' && hostname[1] == '\0') {
+        wire[0] = 0;
+        return 1;
+    }
+
+    for (c = hostname; ; c++) {
+        if (*c == '.' || *c == '\0') {
+            if (label == 0) {
+                /* Empty label is allowed only as the trailing dot */
+                if (*c == '\0' && c != hostname && c[-1] == '.')
+                    break;
+                return -1;
+            }
+            wire[pos] = (uint8_t)label;
+            pos += label + 1;
+            label = 0;
+            if (*c == '\0')
+                break;
+            continue;
+        }
+        if (label == LABEL_MAX || pos + label + 2 >= NAME_WIRE_MAX)
+            return -1;
+        wire[pos + 1 + label++] = lower ? ascii_lower(*c) : (uint8_t)*c;
+    }
+    wire[pos++] = 0;
+    return (int)pos;
+}
+#endif
+
+int name_encode_origin(const char *name, const uint8_t *origin, size_t origin_len, uint8_t *wire,
+                       bool lower)
+{
+    size_t len = strlen(name);
+    int ret;
+
+    if (!origin || (len > 0 && name[len - 1] == '.'))
+        return name_encode(name, wire, lower);
+    if (strcmp(name, "@") == 0) {
+        memcpy(wire, origin, origin_len);
+        return origin_len;
+    }
+    /* Labels of the name take the place of the root label, then the origin follows */
+    if ((ret = name_encode(name, wire, lower)) == -1 || ret - 1 + origin_len > NAME_WIRE_MAX)
+        return -1;
+    memcpy(&wire[ret - 1], origin, origin_len);
+    return ret - 1 + origin_len;
+}
+
+/* Final mixing step of MurmurHash3, spreads FNV's weak low bits over the whole word */
+static inline uint64_t fmix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t name_hash(const char *name, size_t len, uint64_t seed)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ seed; /* FNV-1a offset basis */
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= ascii_lower(name[i]);
+        h *= 0x100000001b3ULL; /* FNV-1a prime */
+    }
+    return fmix64(h);
+}
+
+uint64_t name_hash_fast(const void *name, size_t len, uint64_t seed)
+{
+    const uint8_t *p = name;
+    uint64_t h = seed ^ (len * 0x9e3779b97f4a7c15ULL);
+    uint64_t w;
+
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ ascii_lower8(w)) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    if (len) {
+        w = 0;
+        memcpy(&w, p, len);
+        h = (h ^ ascii_lower8(w)) * 0xff51afd7ed558ccdULL;
+    }
+    return fmix64(h);
+}
+
+int name_unpack(const uint8_t *msg, size_t len, size_t *pos, uint8_t *wire)
+{
+    size_t at = *pos, out = 0;
+    bool jumped = false;
+
+    for (;;) {
+        uint8_t c;
+
+        if (at >= len)
+            return -1;
+        c = msg[at];
+        if ((c & 0xc0) == 0xc0) {
+            size_t target;
+
+            if (at + 1 >= len)
+                return -1;
+            /* Only pointers to earlier names are accepted, so they can't loop */
+            target = ((size_t)(c & 0x3f) << 8) | msg[at + 1];
+            if (target >= at)
+                return -1;
+            if (!jumped)
+                *pos = at + 2;
+            jumped = true;
+            at = target;
+            continue;
+        }
+        if (c & 0xc0 || at + c + 1 > len || out + c + 1 > NAME_WIRE_MAX)
+            return -1;
+        memcpy(&wire[out], &msg[at], c + 1);
+        out += c + 1;
+        at += c + 1;
+        if (c == 0)
+            break;
+    }
+    if (!jumped)
+        *pos = at;
+    return (int)out;
+}
+
+bool name_equal(const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len)
+{
+    size_t i = 0;
+
+    if (a_len != b_len)
+        return false;
+    /* Length bytes are below 'A', lowering them changes nothing */
+#ifdef __SSE2__
+    for (; i + 16 <= a_len; i += 16) {
+        __m128i va = lower16(_mm_loadu_si128((const __m128i *)&a[i]));
+        __m128i vb = lower16(_mm_loadu_si128((const __m128i *)&b[i]));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xffff)
+            return false;
+    }
+#endif
+    for (; i + 8 <= a_len; i += 8) {
+        uint64_t wa, wb;
+        memcpy(&wa, &a[i], 8);
+        memcpy(&wb, &b[i], 8);
+        if (ascii_lower8(wa) != ascii_lower8(wb))
+            return false;
+    }
+    if (i == a_len)
+        return true;
+    /* The rest as the last eight or two overlapping four bytes, labels are mostly short */
+    if (a_len >= 8) {
+        uint64_t wa, wb;
+        memcpy(&wa, &a[a_len - 8], 8);
+        memcpy(&wb, &b[a_len - 8], 8);
+        return ascii_lower8(wa) == ascii_lower8(wb);
+    }
+    if (a_len >= 4) {
+        uint32_t ha, hb, ta, tb;
+        memcpy(&ha, a, 4);
+        memcpy(&hb, b, 4);
+        memcpy(&ta, &a[a_len - 4], 4);
+        memcpy(&tb, &b[a_len - 4], 4);
+        return ascii_lower8(((uint64_t)ta << 32) | ha) == ascii_lower8(((uint64_t)tb << 32) | hb);
+    }
+    for (; i < a_len; i++) {
+        if (ascii_lower(a[i]) != ascii_lower(b[i]))
+            return false;
+    }
+    return true;
+}
+
+void name_lower(uint8_t *dst, const uint8_t *src, size_t len)
+{
+#ifdef __SSE2__
+    copy_name(dst, (const char *)src, len, true);
+#else
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        dst[i] = ascii_lower(src[i]);
+#endif
+}
+
+bool name_in_zone(const uint8_t *name, size_t len, const uint8_t *zone, size_t zone_len)
+{
+    size_t pos = 0;
+
+    if (zone_len > len)
+        return false;
+    /* The zone has to start at a label of the name, not in the middle of one */
+    while (pos < len - zone_len)
+        pos += name[pos] + 1;
+    return pos == len - zone_len && name_equal(&name[pos], zone_len, zone, zone_len);
+}
+
+void name_to_text(const uint8_t *wire, char *text)
+{
+    size_t pos = 0, out = 0;
+
+    if (wire[0] == 0) {
+        strcpy(text, ".");
+        return;
+    }
+    while (wire[pos] != 0) {
+        memcpy(&text[out], &wire[pos + 1], wire[pos]);
+        out += wire[pos];
+        text[out++] = '.';
+        pos += wire[pos] + 1;
+    }
+    text[out] = '\0';
+}
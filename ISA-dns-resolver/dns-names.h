@@ -0,0 +1,54 @@
+#ifndef DNS_NAMES_H
+#define DNS_NAMES_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Longest hostname in dotted format and longest name in wire format (RFC 1035, 2.3.4) */
+#define HOSTNAME_MAX 253
+#define NAME_WIRE_MAX 255
+#define LABEL_MAX 63
+
+/* Converts dotted hostname to wire format, www.google.com would be \3www\6google\3com\0.
+ * Wire buffer has to hold NAME_WIRE_MAX bytes. Returns the length of the wire name
+ * or -1 if the hostname is not a valid name. */
+int name_encode(const char *hostname, uint8_t *wire, bool lower);
+
+/* The same for a name of a zone file, one without the trailing dot is relative to origin
+ * (wire format) and @ is the origin itself. NULL origin makes every name absolute. */
+int name_encode_origin(const char *name, const uint8_t *origin, size_t origin_len, uint8_t *wire,
+                       bool lower);
+
+/* Case-insensitive 64-bit hash of a name, works on both dotted and wire format,
+ * because only the bytes themselves are hashed. Different seeds give independent hashes. */
+uint64_t name_hash(const char *name, size_t len, uint64_t seed);
+
+/* The same, eight bytes at a time. Faster, but a different function, so only for
+ * structures built in memory; name_hash stays what compiled files were built with. */
+uint64_t name_hash_fast(const void *name, size_t len, uint64_t seed);
+
+/* Reads a possibly compressed name at *pos of a message into uncompressed wire format
+ * (NAME_WIRE_MAX bytes) and moves *pos past it. Returns the wire length or -1 if the
+ * name is malformed or runs out of the message. */
+int name_unpack(const uint8_t *msg, size_t len, size_t *pos, uint8_t *wire);
+
+/* Case-insensitive comparison of two uncompressed wire names */
+bool name_equal(const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len);
+
+/* The same for two labels with their length bytes in front */
+static inline bool label_equal(const uint8_t *a, const uint8_t *b)
+{
+    return a[0] == b[0] && name_equal(a, a[0] + 1, b, b[0] + 1);
+}
+
+/* Copies len bytes of a name with upper case letters lowered, either format */
+void name_lower(uint8_t *dst, const uint8_t *src, size_t len);
+
+/* Whether the wire name is the zone or a name under it */
+bool name_in_zone(const uint8_t *name, size_t len, const uint8_t *zone, size_t zone_len);
+
+/* Dotted form of a wire name with the trailing dot, text holds HOSTNAME_MAX + 2 bytes */
+void name_to_text(const uint8_t *wire, char *text);
+
+#endif
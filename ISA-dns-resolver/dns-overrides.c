@@ -0,0 +1,495 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "dns-names.h"
+#include "dns-overrides.h"
+
+/* How many displacements to try for one bucket before giving up on the seed */
+#define MAX_DISPLACEMENT (1u << 24)
+#define MAX_SEEDS 16
+
+/* One line of the input can give a name several addresses, every (name, address) pair
+ * becomes one record, records of one name are then grouped into an entry */
+struct record {
+    uint32_t name_off;      /* offset of the wire name in the names arena */
+    uint8_t name_len;
+    uint8_t family;
+    uint8_t addr[16];
+};
+
+struct key {
+    uint32_t name_off;
+    uint8_t name_len;
+    uint32_t first;         /* first record of this name */
+    uint32_t records;
+    uint32_t data_off;      /* where the serialized entry starts in the data block */
+    uint64_t hash;
+};
+
+struct compile_state {
+    uint8_t *names;         /* arena of wire names */
+    size_t names_size, names_cap;
+    struct record *records;
+    size_t nrecords, records_cap;
+};
+
+static inline uint32_t fmix32(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+/* Range reduction without division */
+static inline uint32_t reduce(uint32_t x, uint32_t n)
+{
+    return (uint32_t)(((uint64_t)x * n) >> 32);
+}
+
+static inline uint32_t override_bucket(uint64_t hash, uint32_t buckets)
+{
+    return reduce((uint32_t)(hash >> 32), buckets);
+}
+
+static inline uint32_t override_slot(uint64_t hash, uint32_t disp, uint32_t count)
+{
+    return reduce(fmix32((uint32_t)hash ^ (disp * 0x9e3779b9u)), count);
+}
+
+static int add_record(struct compile_state *st, const uint8_t *wire, int len,
+                      int family, const void *addr)
+{
+    struct record *rec;
+
+    if (st->names_size + len > st->names_cap) {
+        st->names_cap = st->names_cap ? st->names_cap * 2 : 1 << 16;
+        st->names = realloc(st->names, st->names_cap);
+        if (!st->names)
+            return -1;
+    }
+    if (st->nrecords == st->records_cap) {
+        st->records_cap = st->records_cap ? st->records_cap * 2 : 1 << 12;
+        st->records = realloc(st->records, st->records_cap * sizeof(struct record));
+        if (!st->records)
+            return -1;
+    }
+    if (st->names_size > UINT32_MAX - NAME_WIRE_MAX) {
+        fprintf(stderr, "Override list is too large\n");
+        return -1;
+    }
+
+    rec = &st->records[st->nrecords++];
+    memset(rec, 0, sizeof(*rec));
+    rec->name_off = st->names_size;
+    rec->name_len = len;
+    rec->family = family;
+    memcpy(rec->addr, addr, family == AF_INET ? 4 : 16);
+    memcpy(&st->names[st->names_size], wire, len);
+    st->names_size += len;
+    return 0;
+}
+
+static int parse_list(FILE *in, struct compile_state *st)
+{
+    char line[4096];
+    uint32_t lineno = 0;
+
+    while (fgets(line, sizeof(line), in)) {
+        char *save = NULL, *token;
+        uint8_t addr[16];
+        int family;
+
+        lineno++;
+        line[strcspn(line, "#\r\n")] = '\0';
+        token = strtok_r(line, " \t", &save);
+        if (!token)
+            continue;
+
+        if (inet_pton(AF_INET, token, addr) == 1)
+            family = AF_INET;
+        else if (inet_pton(AF_INET6, token, addr) == 1)
+            family = AF_INET6;
+        else {
+            fprintf(stderr, "Line %u: invalid address %s\n", lineno, token);
+            return -1;
+        }
+
+        while ((token = strtok_r(NULL, " \t", &save))) {
+            uint8_t wire[NAME_WIRE_MAX];
+            int len = name_encode(token, wire, true);
+            if (len == -1) {
+                fprintf(stderr, "Line %u: invalid name %s\n", lineno, token);
+                return -1;
+            }
+            if (add_record(st, wire, len, family, addr) == -1)
+                return -1;
+        }
+    }
+    if (ferror(in)) {
+        fprintf(stderr, "Couldn't read the override list:\n%d %s\n", errno, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* qsort has no context argument, names arena for the comparison is kept here */
+static const uint8_t *sort_names;
+
+static int record_cmp(const void *a, const void *b)
+{
+    const struct record *ra = a, *rb = b;
+    int cmp;
+
+    if (ra->name_len != rb->name_len)
+        return ra->name_len - rb->name_len;
+    cmp = memcmp(&sort_names[ra->name_off], &sort_names[rb->name_off], ra->name_len);
+    if (cmp)
+        return cmp;
+    if (ra->family != rb->family)
+        return ra->family - rb->family;
+    return memcmp(ra->addr, rb->addr, 16);
+}
+
+static bool same_name(const uint8_t *names, const struct record *a, const struct record *b)
+{
+    return a->name_len == b->name_len &&
+           memcmp(&names[a->name_off], &names[b->name_off], a->name_len) == 0;
+}
+
+/* Hash and displace (CHD): buckets are placed from the largest, each gets the first
+ * displacement which moves all of its names into free slots */
+static int build_hash(struct key *keys, uint32_t count, uint32_t buckets,
+                      const uint8_t *names, uint64_t seed, uint32_t *disp, uint32_t *slot_of)
+{
+    uint32_t *bucket_start = calloc(buckets + 1, sizeof(uint32_t));
+    uint32_t *bucket_keys = malloc(count * sizeof(uint32_t));
+    uint32_t *order = malloc(buckets * sizeof(uint32_t));
+    uint8_t *taken = calloc(count, 1);
+    uint32_t i, b, max_size = 0;
+    int ret = -1;
+
+    if (!bucket_start || !bucket_keys || !order || !taken)
+        goto out;
+
+    for (i = 0; i < count; i++) {
+        keys[i].hash = name_hash((const char *)&names[keys[i].name_off], keys[i].name_len, seed);
+        bucket_start[override_bucket(keys[i].hash, buckets) + 1]++;
+    }
+    for (b = 0; b < buckets; b++) {
+        if (bucket_start[b + 1] > max_size)
+            max_size = bucket_start[b + 1];
+        bucket_start[b + 1] += bucket_start[b];
+    }
+    {
+        /* Counting sort of the keys into their buckets */
+        uint32_t *fill = malloc(buckets * sizeof(uint32_t));
+        if (!fill)
+            goto out;
+        memcpy(fill, bucket_start, buckets * sizeof(uint32_t));
+        for (i = 0; i < count; i++)
+            bucket_keys[fill[override_bucket(keys[i].hash, buckets)]++] = i;
+        free(fill);
+    }
+    {
+        /* Counting sort of the buckets by size, largest first */
+        uint32_t *by_size = calloc(max_size + 2, sizeof(uint32_t));
+        if (!by_size)
+            goto out;
+        for (b = 0; b < buckets; b++)
+            by_size[max_size - (bucket_start[b + 1] - bucket_start[b]) + 1]++;
+        for (i = 0; i <= max_size; i++)
+            by_size[i + 1] += by_size[i];
+        for (b = 0; b < buckets; b++)
+            order[by_size[max_size - (bucket_start[b + 1] - bucket_start[b])]++] = b;
+        free(by_size);
+    }
+
+    for (i = 0; i < buckets; i++) {
+        uint32_t first, size, d, k;
+
+        b = order[i];
+        first = bucket_start[b];
+        size = bucket_start[b + 1] - first;
+        disp[b] = 0;
+        if (size == 0)
+            continue;
+
+        for (d = 0; d < MAX_DISPLACEMENT; d++) {
+            for (k = 0; k < size; k++) {
+                uint32_t slot = override_slot(keys[bucket_keys[first + k]].hash, d, count);
+                if (taken[slot])
+                    break;
+                taken[slot] = 1;
+                slot_of[bucket_keys[first + k]] = slot;
+            }
+            if (k == size)
+                break;
+            /* Release the slots of this attempt */
+            while (k-- > 0)
+                taken[slot_of[bucket_keys[first + k]]] = 0;
+        }
+        if (d == MAX_DISPLACEMENT)
+            goto out;
+        disp[b] = d;
+    }
+    ret = 0;
+
+out:
+    free(bucket_start);
+    free(bucket_keys);
+    free(order);
+    free(taken);
+    return ret;
+}
+
+static int write_file(const char *out_path, const struct overrides_header *header,
+                      const uint32_t *disp, const uint32_t *slots, const uint8_t *data, size_t data_size)
+{
+    char tmp_path[4096];
+    FILE *out;
+    bool ok;
+
+    /* Write next to the target and rename, so a running resolver never maps a half written file */
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", out_path) >= (int)sizeof(tmp_path))
+        return -1;
+    out = fopen(tmp_path, "wb");
+    if (!out) {
+        fprintf(stderr, "Couldn't create %s:\n%d %s\n", tmp_path, errno, strerror(errno));
+        return -1;
+    }
+    ok = fwrite(header, sizeof(*header), 1, out) == 1 &&
+         fwrite(disp, sizeof(uint32_t), header->buckets, out) == header->buckets &&
+         fwrite(slots, sizeof(uint32_t), header->count, out) == header->count &&
+         fwrite(data, 1, data_size, out) == data_size;
+    ok = (fclose(out) == 0) && ok;
+    if (!ok || rename(tmp_path, out_path) == -1) {
+        fprintf(stderr, "Couldn't write %s:\n%d %s\n", out_path, errno, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+int overrides_compile(FILE *in, const char *out_path)
+{
+    struct compile_state st = { 0 };
+    struct overrides_header header;
+    struct key *keys = NULL;
+    uint32_t *disp = NULL, *slots = NULL, *slot_of = NULL;
+    uint8_t *data = NULL;
+    size_t data_size = 0, r, prev;
+    uint32_t count = 0, i, attempt;
+    uint64_t seed;
+    int ret = -1;
+
+    if (parse_list(in, &st) == -1)
+        goto out;
+
+    sort_names = st.names;
+    qsort(st.records, st.nrecords, sizeof(struct record), record_cmp);
+
+    /* Group the records by name, drop repeated addresses */
+    keys = malloc((st.nrecords ? st.nrecords : 1) * sizeof(struct key));
+    if (!keys)
+        goto out;
+    for (r = 0, prev = 0; r < st.nrecords; r++) {
+        struct record *rec = &st.records[r];
+        if (r == 0 || !same_name(st.names, rec, &st.records[prev])) {
+            keys[count].name_off = rec->name_off;
+            keys[count].name_len = rec->name_len;
+            keys[count].first = r;
+            keys[count].records = 0;
+            count++;
+        }
+        else if (rec->family == st.records[prev].family &&
+                 memcmp(rec->addr, st.records[prev].addr, 16) == 0) {
+            /* Stays in the range of its name, but it's skipped when serializing */
+            rec->family = 0;
+            keys[count - 1].records++;
+            continue;
+        }
+        keys[count - 1].records++;
+        prev = r;
+    }
+
+    /* Serialize the entries, worst case every record is a name with IPv6 address */
+    data = malloc(st.names_size + st.nrecords * (3 + 16) + 1);
+    if (!data)
+        goto out;
+    for (i = 0; i < count; i++) {
+        uint32_t ipv4 = 0, ipv6 = 0;
+        uint8_t *counts;
+
+        keys[i].data_off = data_size;
+        data[data_size++] = keys[i].name_len;
+        memcpy(&data[data_size], &st.names[keys[i].name_off], keys[i].name_len);
+        data_size += keys[i].name_len;
+        counts = &data[data_size];
+        data_size += 2;
+
+        /* Records are sorted by family, so IPv4 addresses come before IPv6 ones */
+        for (r = keys[i].first; r < keys[i].first + keys[i].records; r++) {
+            const struct record *rec = &st.records[r];
+            if (rec->family == AF_INET && ipv4 < UINT8_MAX) {
+                memcpy(&data[data_size], rec->addr, 4);
+                data_size += 4;
+                ipv4++;
+            }
+        }
+        for (r = keys[i].first; r < keys[i].first + keys[i].records; r++) {
+            const struct record *rec = &st.records[r];
+            if (rec->family == AF_INET6 && ipv6 < UINT8_MAX) {
+                memcpy(&data[data_size], rec->addr, 16);
+                data_size += 16;
+                ipv6++;
+            }
+        }
+        counts[0] = ipv4;
+        counts[1] = ipv6;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, OVERRIDES_MAGIC, sizeof(header.magic));
+    header.count = count;
+    header.buckets = count / OVERRIDES_BUCKET_SIZE + 1;
+    header.disp_off = sizeof(header);
+    header.slots_off = header.disp_off + header.buckets * sizeof(uint32_t);
+    header.data_off = header.slots_off + count * sizeof(uint32_t);
+    if ((uint64_t)header.data_off + data_size > UINT32_MAX) {
+        fprintf(stderr, "Override list is too large\n");
+        goto out;
+    }
+    header.size = header.data_off + data_size;
+
+    disp = malloc(header.buckets * sizeof(uint32_t));
+    slots = malloc((count ? count : 1) * sizeof(uint32_t));
+    slot_of = malloc((count ? count : 1) * sizeof(uint32_t));
+    if (!disp || !slots || !slot_of)
+        goto out;
+
+    /* A seed can fail when two names of one bucket share the lower half of the hash */
+    seed = 0x5eed;
+    for (attempt = 0; attempt < MAX_SEEDS; attempt++, seed = seed * 6364136223846793005ULL + 1) {
+        if (build_hash(keys, count, header.buckets, st.names, seed, disp, slot_of) == 0)
+            break;
+    }
+    if (attempt == MAX_SEEDS) {
+        fprintf(stderr, "Couldn't build a perfect hash of the override list\n");
+        goto out;
+    }
+    header.seed = seed;
+    for (i = 0; i < count; i++)
+        slots[slot_of[i]] = header.data_off + keys[i].data_off;
+
+    ret = write_file(out_path, &header, disp, slots, data, data_size);
+    if (ret == 0)
+        printf("%u names, %zu bytes\n", count, (size_t)header.size);
+
+out:
+    free(st.names);
+    free(st.records);
+    free(keys);
+    free(data);
+    free(disp);
+    free(slots);
+    free(slot_of);
+    return ret;
+}
+
+int overrides_load(struct overrides *ov, const char *path)
+{
+    struct stat st;
+    const struct overrides_header *header;
+    int fd;
+
+    memset(ov, 0, sizeof(*ov));
+    fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "Couldn't open %s:\n%d %s\n", path, errno, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(struct overrides_header)) {
+        fprintf(stderr, "%s is not a compiled override list\n", path);
+        close(fd);
+        return -1;
+    }
+
+    /* Pages are brought in by lookups, so loading costs the same for any size */
+    ov->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ov->map == MAP_FAILED) {
+        fprintf(stderr, "Couldn't map %s:\n%d %s\n", path, errno, strerror(errno));
+        ov->map = NULL;
+        return -1;
+    }
+    ov->size = st.st_size;
+
+    header = (const struct overrides_header *)ov->map;
+    if (memcmp(header->magic, OVERRIDES_MAGIC, sizeof(header->magic)) != 0 ||
+        header->size != ov->size || header->buckets == 0 ||
+        header->disp_off != sizeof(*header) ||
+        header->slots_off != header->disp_off + (uint64_t)header->buckets * sizeof(uint32_t) ||
+        header->data_off != header->slots_off + (uint64_t)header->count * sizeof(uint32_t) ||
+        header->data_off > header->size) {
+        fprintf(stderr, "%s is not a compiled override list\n", path);
+        overrides_unload(ov);
+        return -1;
+    }
+    ov->header = header;
+    ov->disp = (const uint32_t *)(ov->map + header->disp_off);
+    ov->slots = (const uint32_t *)(ov->map + header->slots_off);
+    return 0;
+}
+
+void overrides_unload(struct overrides *ov)
+{
+    if (ov->map)
+        munmap((void *)ov->map, ov->size);
+    memset(ov, 0, sizeof(*ov));
+}
+
+int overrides_find(const struct overrides *ov, const uint8_t *wire, size_t len,
+                   struct override_entry *entry)
+{
+    const struct overrides_header *header = ov->header;
+    const uint8_t *e;
+    uint64_t hash;
+    uint32_t off;
+
+    if (!header || header->count == 0)
+        return 0;
+
+    hash = name_hash((const char *)wire, len, header->seed);
+    off = ov->slots[override_slot(hash, ov->disp[override_bucket(hash, header->buckets)],
+                                  header->count)];
+
+    /* The slot holds some name for any key, the compare tells whether it is this one */
+    if (off < header->data_off || (size_t)off + 1 + len + 2 > ov->size)
+        return 0;
+    e = ov->map + off;
+    if (e[0] != len || !name_equal(&e[1], len, wire, len))
+        return 0;
+
+    e += 1 + len;
+    entry->ipv4_count = e[0];
+    entry->ipv6_count = e[1];
+    entry->ipv4 = e + 2;
+    entry->ipv6 = e + 2 + 4 * e[0];
+    if ((size_t)(entry->ipv6 - ov->map) + 16 * e[1] > ov->size)
+        return 0;
+    return 1;
+}
@@ -0,0 +1,57 @@
+#ifndef DNS_OVERRIDES_H
+#define DNS_OVERRIDES_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define OVERRIDES_MAGIC "DNSOVR1"
+
+/* Average number of names in one displacement bucket of the perfect hash */
+#define OVERRIDES_BUCKET_SIZE 4
+
+/* Layout of a compiled override file, all numbers are in host byte order, offsets
+ * are from the start of the file:
+ *   header
+ *   uint32_t disp[buckets]     displacement chosen for each bucket
+ *   uint32_t slots[count]      offset of the entry stored in each slot
+ *   entries                    u8 name length, wire name (lowercase), u8 number of IPv4
+ *                              and u8 number of IPv6 addresses, addresses in network order */
+struct overrides_header {
+    char magic[8];
+    uint64_t seed;
+    uint32_t count;
+    uint32_t buckets;
+    uint32_t disp_off;
+    uint32_t slots_off;
+    uint32_t data_off;
+    uint32_t size;      /* size of the whole file */
+};
+
+struct overrides {
+    const uint8_t *map;
+    size_t size;
+    const struct overrides_header *header;
+    const uint32_t *disp;
+    const uint32_t *slots;
+};
+
+/* One override as found in the file, addresses point directly into the mapping */
+struct override_entry {
+    uint8_t ipv4_count;
+    uint8_t ipv6_count;
+    const uint8_t *ipv4;
+    const uint8_t *ipv6;
+};
+
+/* Compiles a hosts-style list (address name [alias...]) into a file which can be mapped */
+int overrides_compile(FILE *in, const char *out_path);
+
+int overrides_load(struct overrides *ov, const char *path);
+void overrides_unload(struct overrides *ov);
+
+/* Finds a wire-format name, one hash and one compare. Returns 1 if it is overridden, 0 if not */
+int overrides_find(const struct overrides *ov, const uint8_t *wire, size_t len,
+                   struct override_entry *entry);
+
+#endif
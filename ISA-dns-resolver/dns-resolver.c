@@ -9,36 +9,460 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <assert.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
 
 #include "dns-resolver.h"
+#include "dns-hotkeys.h"
+
+static volatile sig_atomic_t report_requested = 0;
+static volatile sig_atomic_t stop_requested = 0;
+static volatile sig_atomic_t reload_requested = 0;
+
+static const char * type_name(uint16_t type)
+{
+    static char text[RR_NAME_SIZE];
+    return rr_type_name(type, text);
+}
+
+/* Types of the table for the help, wrapped under the option's description */
+static void print_type_list(void)
+{
+    static const char *names[] = {
+#define X(name, number, layout, labels) #name,
+        RR_TYPES(X)
+#undef X
+    };
+    size_t i, column = 16;
+
+    printf("\t\t%s", names[0]);
+    for (i = 1; i < sizeof(names) / sizeof(*names); i++) {
+        if (column + strlen(names[i]) + 2 > 96) {
+            printf(",\n\t\t");
+            column = 16;
+        }
+        else
+            column += printf(", ");
+        column += printf("%s", names[i]);
+    }
+    printf(" or TYPEn for any other type (RFC 3597),\n");
+}
+
+static void request_report(int signum)
+{
+    (void)signum;
+    report_requested = 1;
+}
+
+static void request_stop(int signum)
+{
+    (void)signum;
+    stop_requested = 1;
+}
+
+static void request_reload(int signum)
+{
+    (void)signum;
+    reload_requested = 1;
+}
+
+/* Forwarding rules and -s servers replaced by a reload, freed once no query can use them */
+struct retired_rules {
+    struct forward_table *forward;
+    struct upstream_set *servers;
+    uint64_t expires;
+    struct retired_rules *next;
+};
+
+/* Files of -o, -b and -F and the servers of -s, loaded again on SIGHUP or on "reload"
+ * over the control socket */
+struct config {
+    const char *overrides;
+    const char *blocklist;
+    const char *forward;
+    char *servers;                      /* -s, NULL in iterative mode where it's the root hints */
+    int32_t port;
+    struct retired_rules *retired;
+};
+
+static void config_unload(struct overrides *overrides, struct blocklist *blocklist, struct forward_table *forward,
+                          struct upstream_set *servers)
+{
+    if (overrides)
+        overrides_unload(overrides);
+    if (blocklist)
+        blocklist_unload(blocklist);
+    if (forward)
+        forward_table_free(forward);
+    if (servers)
+        upstream_set_free(servers);
+    free(overrides);
+    free(blocklist);
+    free(forward);
+    free(servers);
+}
+
+/* Loads the files of the configuration and looks the -s servers up, all of them or none;
+ * what isn't configured stays NULL */
+static int config_load(const struct config *cfg, struct upstream_pool *pool, struct overrides **overrides,
+                       struct blocklist **blocklist, struct forward_table **forward,
+                       struct upstream_set **servers)
+{
+    struct overrides *ov = NULL;
+    struct blocklist *bl = NULL;
+    struct forward_table *ft = NULL;
+    struct upstream_set *set = NULL;
+
+    if (cfg->overrides && (!(ov = malloc(sizeof(*ov))) || overrides_load(ov, cfg->overrides) == -1)) {
+        free(ov);
+        return -1;
+    }
+    if (cfg->blocklist && (!(bl = malloc(sizeof(*bl))) || blocklist_load(bl, cfg->blocklist) == -1)) {
+        free(bl);
+        config_unload(ov, NULL, NULL, NULL);
+        return -1;
+    }
+    if (cfg->forward && (!(ft = malloc(sizeof(*ft))) || forward_table_load(ft, cfg->forward, pool) == -1)) {
+        free(ft);
+        config_unload(ov, bl, NULL, NULL);
+        return -1;
+    }
+    if (cfg->servers && (!(set = malloc(sizeof(*set))) ||
+                         upstream_set_parse(pool, cfg->servers, cfg->port, set) == -1)) {
+        free(set);
+        config_unload(ov, bl, ft, NULL);
+        return -1;
+    }
+    *overrides = ov;
+    *blocklist = bl;
+    *forward = ft;
+    *servers = set;
+    return 0;
+}
+
+/* Loads the configuration again aside and swaps it in whole, the old one stays if any file
+ * doesn't load or a server isn't found. The cache, the sockets and what's known of the
+ * servers are kept; lookups in flight finish with the rules and servers they started with.
+ * Returns -1 if the old configuration stays, message says what happened either way. */
+static int config_reload(struct resolver *res, struct config *cfg, char *message, size_t size)
+{
+    struct overrides *overrides;
+    struct blocklist *blocklist;
+    struct forward_table *forward;
+    struct upstream_set *servers;
+    struct retired_rules *r;
+
+    if (config_load(cfg, &res->pool, &overrides, &blocklist, &forward, &servers) == -1) {
+        snprintf(message, size, "Configuration kept as it was");
+        return -1;
+    }
+    if (res->forward || res->servers) {
+        if (!(r = malloc(sizeof(*r)))) {
+            snprintf(message, size, "Configuration kept as it was");
+            config_unload(overrides, blocklist, forward, servers);
+            return -1;
+        }
+        r->forward = res->forward;
+        r->servers = res->servers;
+        r->expires = now_ms() + res->timeout + RELOAD_GRACE_MS;
+        r->next = cfg->retired;
+        cfg->retired = r;
+    }
+    /* Overrides and the blocklist are only read when a lookup starts */
+    config_unload(res->overrides, res->blocklist, NULL, NULL);
+    res->overrides = overrides;
+    res->blocklist = blocklist;
+    res->forward = forward;
+    res->servers = servers;
+    snprintf(message, size, "Configuration reloaded");
+    return 0;
+}
+
+/* Frees the retired rules which expired by now, all of them if all */
+static void config_retire(struct config *cfg, uint64_t now, bool all)
+{
+    struct retired_rules **p = &cfg->retired, *r;
+
+    while ((r = *p)) {
+        if (!all && r->expires > now) {
+            p = &r->next;
+            continue;
+        }
+        *p = r->next;
+        config_unload(NULL, NULL, r->forward, r->servers);
+        free(r);
+    }
+}
+
+/* What the control socket of a bulk run can change */
+struct control {
+    struct resolver *res;
+    struct config *cfg;
+};
+
+/* Handler of the control socket in resolver mode. "reload" does what SIGHUP does, "servers
+ * list" replaces the -s servers and reloads with them, "parallel n", "hedge percent|off"
+ * and "race count[/percent]|off" change -j, -H and -R of the run. The reply starts with
+ * OK or ERROR. */
+static void control_command(void *ctx, char *text, char *reply, size_t size)
+{
+    struct control *c = ctx;
+    struct resolver *res = c->res;
+    struct engine *e = &res->engine;
+    char message[128], list[256], *old, rest;
+    uint32_t count;
+    double percent = 100;
+
+    if (sscanf(text, " reload %c", &rest) == EOF) {
+        if (config_reload(res, c->cfg, message, sizeof(message)) == -1)
+            snprintf(reply, size, "ERROR %s\n", message);
+        else
+            snprintf(reply, size, "OK %s\n", message);
+        return;
+    }
+    if (strncmp(text + strspn(text, " \t"), "servers", 7) == 0) {
+        if (sscanf(text, " servers %255s %c", list, &rest) != 1) {
+            snprintf(reply, size, "ERROR servers is \"servers host[:port][,host[:port]...]\"\n");
+            return;
+        }
+        if (!c->cfg->servers) {
+            snprintf(reply, size, "ERROR no -s servers to replace, -i takes them as the root hints\n");
+            return;
+        }
+        old = c->cfg->servers;
+        if (!(c->cfg->servers = strdup(list))) {
+            c->cfg->servers = old;
+            snprintf(reply, size, "ERROR out of memory\n");
+            return;
+        }
+        /* The old list stays for the next reload unless this one goes through */
+        if (config_reload(res, c->cfg, message, sizeof(message)) == -1) {
+            free(c->cfg->servers);
+            c->cfg->servers = old;
+            snprintf(reply, size, "ERROR %s\n", message);
+            return;
+        }
+        free(old);
+        snprintf(reply, size, "OK %s, %u servers\n", message, res->servers->count);
+        return;
+    }
+    if (strncmp(text + strspn(text, " \t"), "parallel", 8) == 0) {
+        if (sscanf(text, " parallel %u %c", &count, &rest) == 1 && count > 0 && count <= MAX_PARALLEL) {
+            res->parallel = count;
+            snprintf(reply, size, "OK parallel %u\n", count);
+        }
+        else
+            snprintf(reply, size, "ERROR parallel is \"parallel n\", 1 to %d\n", MAX_PARALLEL);
+        return;
+    }
+    if (sscanf(text, " hedge off %c", &rest) == EOF) {
+        e->hedge_budget.ratio = 0;
+        snprintf(reply, size, "OK no hedging\n");
+        return;
+    }
+    if (strncmp(text + strspn(text, " \t"), "hedge", 5) == 0) {
+        if (sscanf(text, " hedge %lf %c", &percent, &rest) == 1 && percent > 0) {
+            e->hedge_budget.ratio = percent / 100;
+            snprintf(reply, size, "OK hedge %g %%\n", percent);
+        }
+        else
+            snprintf(reply, size, "ERROR hedge is \"hedge percent\" or \"hedge off\"\n");
+        return;
+    }
+    if (sscanf(text, " race off %c", &rest) == EOF) {
+        e->race = 1;
+        snprintf(reply, size, "OK no race\n");
+        return;
+    }
+    if (strncmp(text + strspn(text, " \t"), "race", 4) == 0) {
+        if ((sscanf(text, " race %u %c", &count, &rest) == 1 ||
+             sscanf(text, " race %u/%lf %c", &count, &percent, &rest) == 2) &&
+            count >= 2 && count <= MAX_RACE && percent > 0) {
+            e->race = count;
+            e->race_budget.ratio = percent / 100;
+            snprintf(reply, size, "OK race %u/%g %%\n", count, percent);
+        }
+        else
+            snprintf(reply, size, "ERROR race is \"race count[/percent]\", count 2 to %d, or \"race off\"\n",
+                     MAX_RACE);
+        return;
+    }
+    snprintf(reply, size, "ERROR unknown command, reload, servers, parallel, hedge or race\n");
+}
+
+/* Names for a bulk run are read with plain read() and only when poll() says there is
+ * something, so that waiting for input never holds up replies of lookups in flight */
+struct name_reader {
+    int32_t fd;
+    char buf[4096];
+    size_t start, end;
+    bool eof;
+};
+
+/* Returns 1 with the next name in line, 0 if no whole line can be read without
+ * blocking, -1 at the end of the input */
+static int next_name(struct name_reader *nr, char *line, size_t size)
+{
+    for (;;) {
+        char *newline = memchr(&nr->buf[nr->start], '\n', nr->end - nr->start);
+        size_t len;
+
+        if (newline || (nr->eof && nr->start < nr->end)) {
+            len = newline ? (size_t)(newline - &nr->buf[nr->start]) : nr->end - nr->start;
+            if (len >= size)
+                len = size - 1;
+            memcpy(line, &nr->buf[nr->start], len);
+            line[len] = '\0';
+            nr->start = newline ? (size_t)(newline - nr->buf) + 1 : nr->end;
+
+            line[strcspn(line, " \t\r\n")] = '\0';
+            if (line[0] == '\0' || line[0] == '#')
+                continue;
+            return 1;
+        }
+        if (nr->eof)
+            return -1;
+
+        /* Make room, a line longer than the whole buffer is not a name and is dropped */
+        if (nr->start > 0) {
+            memmove(nr->buf, &nr->buf[nr->start], nr->end - nr->start);
+            nr->end -= nr->start;
+            nr->start = 0;
+        }
+        if (nr->end == sizeof(nr->buf))
+            nr->end = 0;
+
+        struct pollfd pfd = { .fd = nr->fd, .events = POLLIN };
+        if (poll(&pfd, 1, 0) <= 0)
+            return 0;
+
+        ssize_t n = read(nr->fd, &nr->buf[nr->end], sizeof(nr->buf) - nr->end);
+        if (n == -1 && (errno == EINTR || errno == EAGAIN))
+            return 0;
+        if (n <= 0)
+            nr->eof = true;
+        else
+            nr->end += n;
+    }
+}
+
+static void print_reports(struct resolver *res, struct hotkeys *hotkeys)
+{
+    if (hotkeys)
+        hotkeys_report(hotkeys, stderr);
+    if (res->stats) {
+        upstream_report(&res->pool, stderr);
+        engine_report(&res->engine, stderr);
+        if (res->iterator)
+            iterator_report(res->iterator, stderr);
+        fprintf(stderr, "Alias links queried %llu, lookups answered by cached aliases %llu\n",
+                (unsigned long long)res->aliases_followed, (unsigned long long)res->aliases_cached);
+        if (res->resolve_targets)
+            fprintf(stderr, "Target addresses from additional sections %llu, looked up %llu\n",
+                    (unsigned long long)res->glue_used, (unsigned long long)res->target_lookups);
+    }
+}
+
+/* Answers queries for the zones and takes changes on the control socket until SIGINT or
+ * SIGTERM, loads the changed zone files again on SIGHUP, reports on SIGUSR1 and at the end
+ * with -v. No signal restarts poll(), so they're handled right away. */
+static int serve(struct server *srv, bool stats)
+{
+    struct pollfd pfd[2 + ADMIN_CLIENTS] = { { .fd = srv->fd, .events = POLLIN } };
+    char message[128];
+    struct sigaction sa;
+    uint32_t count;
+    int32_t wait;
+    int ret = 0;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = request_report;
+    sigaction(SIGUSR1, &sa, NULL);
+    sa.sa_handler = request_reload;
+    sigaction(SIGHUP, &sa, NULL);
+
+    while (!stop_requested) {
+        /* Clients of the control socket are read as they send, never waited for */
+        count = 1 + admin_poll(&srv->admin, &pfd[1], &wait);
+        if (poll(pfd, count, wait) == -1 && errno != EINTR) {
+            fprintf(stderr, "Couldn't wait for queries:\n%d %s\n", errno, strerror(errno));
+            ret = -1;
+            break;
+        }
+        if (server_receive(srv) == -1) {
+            fprintf(stderr, "Couldn't read queries:\n%d %s\n", errno, strerror(errno));
+            ret = -1;
+            break;
+        }
+        admin_serve(&srv->admin, &pfd[1], count - 1);
+        if (report_requested) {
+            report_requested = 0;
+            server_report(srv, stderr);
+        }
+        if (reload_requested) {
+            reload_requested = 0;
+            server_reload(srv, message, sizeof(message));
+            fprintf(stderr, "%s\n", message);
+        }
+    }
+    if (stats)
+        server_report(srv, stderr);
+    return ret;
+}
 
 int main(int argc, char *argv[])
 {
     int32_t ret;
     int32_t opt;
-    bool recursive = false, reverse = false, ipv6 = false;
-    char *hostname;
+    struct resolver res = { .query = { .recursive = false, .reverse = false, .ipv6 = false }, .parallel = 1 };
+    struct query_opts *query = &res.query;
+    struct config config = { 0 };
+    struct control control = { .res = &res, .cfg = &config };
+    struct admin admin;
+    struct pollfd pfd[1 + 1 + ADMIN_CLIENTS];
+    uint32_t count;
+    int32_t wait;
+    char message[128];
+    struct iterator iterator;
+    bool iterative = false;
+    char *hostname = NULL;
+    char *names_file = NULL;
+    struct name_reader reader = { .fd = -1 };
+    bool input_done = false;
+    double hedge_ratio = 0, race_ratio = 1;
+    uint32_t race = 1;
+    bool shard = false;
+    char *end, *name;
+    char *mirror_file = NULL;
+    uint32_t ixfr_serial = 0;
+    char *zone_files[SERVER_ZONES_MAX];
+    uint32_t zones_count = 0;
+    char *listen_address = NULL;
+    char *admin_path = NULL;
+    uint32_t limit_rate = 0, limit_slip = SERVER_SLIP;
 
-    struct sockaddr_in *server;
     char *server_hostname = NULL;
     int32_t server_port = 0;
 
-    int32_t id = 0;
-    int32_t socket_desc = 0;
-
-    struct buffer datagram;
+    struct hotkeys hotkeys;
+    int32_t top_count = 0;
 
     /* Arguments parsing */
-    while ((opt = getopt(argc, argv, "hrx6s:p:")) != -1) {
+    while ((opt = getopt(argc, argv, "hrx6s:p:f:k:o:b:BF:it:Tj:vH:R:Sd:z:a:l:c:L:")) != -1) {
         switch (opt) {
             case 'r':
-                recursive = true;
+                query->recursive = true;
                 break;
             case 'x':
-                reverse = true;
+                query->reverse = true;
                 break;
             case '6':
-                ipv6 = true;
+                query->ipv6 = true;
                 break;
             case 's':
                 /* get an IP of a DNS server */
@@ -51,6 +475,127 @@ int main(int argc, char *argv[])
             case 'p':
                 server_port = (int) strtol(optarg, NULL, 10);
                 break;
+            case 'f':
+                names_file = optarg;
+                break;
+            case 'j':
+                res.parallel = (uint32_t) strtol(optarg, NULL, 10);
+                if (res.parallel == 0 || res.parallel > MAX_PARALLEL) {
+                    print_input_error(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'k':
+                top_count = (int) strtol(optarg, NULL, 10);
+                if (top_count <= 0) {
+                    print_input_error(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'H':
+                hedge_ratio = strtod(optarg, &end) / 100;
+                if (*end != '\0' || hedge_ratio <= 0) {
+                    print_input_error(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'R':
+                race = (uint32_t) strtol(optarg, &end, 10);
+                if (*end == '/')
+                    race_ratio = strtod(end + 1, &end) / 100;
+                if (*end != '\0' || race < 2 || race > MAX_RACE || race_ratio <= 0) {
+                    print_input_error(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'S':
+                shard = true;
+                break;
+            case 'd':
+                res.timeout = (uint32_t) strtol(optarg, &end, 10);
+                if (*end != '\0' || res.timeout == 0) {
+                    print_input_error(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'i':
+                iterative = true;
+                break;
+            case 't':
+                query->types_count = 0;
+                for (name = strtok(optarg, ","); name; name = strtok(NULL, ",")) {
+                    char *serial = strchr(name, '=');
+                    int type;
+
+                    if (serial)
+                        *serial++ = '\0';
+                    type = rr_type_parse(name);
+                    if (type == -1) {
+                        fprintf(stderr, "Unknown type %s\n", name);
+                        return -1;
+                    }
+                    /* IXFR=serial, the version of the zone the deltas start at */
+                    if (serial) {
+                        ixfr_serial = strtoul(serial, &end, 10);
+                        if (type != TYPE_IXFR || *serial == '\0' || *end != '\0') {
+                            print_input_error(argv[0]);
+                            return -1;
+                        }
+                    }
+                    else if (type == TYPE_IXFR) {
+                        fprintf(stderr, "IXFR needs the serial of the version to start at, IXFR=serial\n");
+                        return -1;
+                    }
+                    if (query->types_count == MAX_TYPES) {
+                        fprintf(stderr, "At most %d types can be asked for at once\n", MAX_TYPES);
+                        return -1;
+                    }
+                    query->types[query->types_count++] = type;
+                }
+                break;
+            case 'T':
+                res.resolve_targets = true;
+                break;
+            case 'z':
+                mirror_file = optarg;
+                break;
+            case 'a':
+                if (zones_count == SERVER_ZONES_MAX) {
+                    fprintf(stderr, "At most %d zones can be served\n", SERVER_ZONES_MAX);
+                    return -1;
+                }
+                zone_files[zones_count++] = optarg;
+                break;
+            case 'l':
+                listen_address = optarg;
+                break;
+            case 'c':
+                admin_path = optarg;
+                break;
+            case 'L':
+                limit_rate = (uint32_t) strtol(optarg, &end, 10);
+                if (*end == '/')
+                    limit_slip = (uint32_t) strtol(end + 1, &end, 10);
+                if (*end != '\0' || limit_rate == 0) {
+                    print_input_error(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'v':
+                res.stats = true;
+                break;
+            case 'o':
+                config.overrides = optarg;
+                break;
+            case 'b':
+                config.blocklist = optarg;
+                break;
+            case 'B':
+                res.sinkhole = true;
+                break;
+            case 'F':
+                config.forward = optarg;
+                break;
             case 'h':
                 if (argc != 2) {
                     print_input_error(argv[0]);
@@ -58,13 +603,60 @@ int main(int argc, char *argv[])
                 }
                 printf("Program for sending DNS queries to a DNS server and receiving it's response"
                        " in readable format.\n");
-                printf("dns [-r] [-x] [-6] -s server [-p port] address\n");
+                printf("dns [-r] [-x] [-6] [-j count] [-k count] [-v] [-H budget] [-R count[/budget]] [-S] [-d ms]\n"
+                       "    [-o overrides] [-b blocklist [-B]] [-F rules] [-i] [-t type[,type...] [-T]] [-z file] [-c socket]\n"
+                       "    -s server[,server...] [-p port] (-f file | address)\n"
+                       "dns -l [address:]port -a zone [-a zone...] [-c socket] [-L rate[/slip]] [-v]\n");
                 printf("\n");
                 printf("-r:\t\trecursive query\n");
-                printf("-x:\t\treverse query\n");
+                printf("-x:\t\treverse query, an address block (10.0.0.0/16, 2001:db8::/48) is swept\n"
+                       "\t\twhole, IPv6 nibble by nibble skipping the ones which don't exist\n");
                 printf("-6:\t\tquery for AAAA record\n");
-                printf("-s:\t\tserver where to send query\n");
+                printf("-t:\t\tquery for a record of the type:\n");
+                print_type_list();
+                printf("\t\tmore types are asked for at once and printed together with their latencies,\n"
+                       "\t\tAXFR transfers the whole zone, IXFR=serial the changes since the serial\n");
+                printf("-T:\t\tlook up addresses of MX, NS and SRV targets too, the ones in the additional\n"
+                       "\t\tsection (within the zone which answered) and the cache aren't asked for\n");
+                printf("-s:\t\tservers where to send queries, each query goes to the one expected\n"
+                       "\t\tto answer first\n");
                 printf("-p:\t\tport, on which to send a query (default  53)\n");
+                printf("-f:\t\tbulk mode, read addresses from a file, one per line (- for stdin),\n"
+                       "\t\tSIGHUP loads -o, -b and -F and looks up -s again keeping the cache\n");
+                printf("-j:\t\thow many lookups of a bulk run are in flight at once (default 1), each\n"
+                       "\t\tserver gets only as many as its congestion window allows\n");
+                printf("-k:\t\ttrack the most queried names and report top count of them at the end\n"
+                       "\t\tor on SIGUSR1\n");
+                printf("-v:\t\treport latency, loss and windows of the servers at the end or on SIGUSR1\n");
+                printf("-H:\t\task another server too when the reply is later than 95 %% of replies\n"
+                       "\t\tof the first one, at most budget %% more queries\n");
+                printf("-R:\t\tsend each query to count servers at once and take the first reply,\n"
+                       "\t\tat most budget %% more queries (default 100)\n");
+                printf("-d:\t\ttime a lookup has for an answer, it gives up when it runs out\n"
+                       "\t\t(default %d ms)\n", LOOKUP_TIMEOUT_MS);
+                printf("-S:\t\tshard names among the servers by consistent hashing, each server is\n"
+                       "\t\tasked for its own share of names and caches them\n");
+                printf("-o:\t\tcompiled override list (dns-compile overrides), names found there\n"
+                       "\t\tare answered locally\n");
+                printf("-b:\t\tcompiled blocklist (dns-compile blocklist), queries for blocked domains\n"
+                       "\t\tand their subdomains are refused\n");
+                printf("-B:\t\tanswer blocked queries with the unspecified address instead\n");
+                printf("-F:\t\tforwarding rules, lines \"zone server[:port][,server...]\", names are sent\n"
+                       "\t\tto the servers of the longest matching zone, -s is the default\n");
+                printf("-i:\t\tresolve iteratively from the root servers (or from -s), following\n"
+                       "\t\treferrals, names not forwarded by -F only\n");
+                printf("-z:\t\tkeep a copy of the zone in the zone file, updated by IXFR once it exists\n");
+                printf("-l:\t\tserve the zones of -a on the port, until SIGINT or SIGTERM, SIGHUP loads\n"
+                       "\t\tthe zone files which changed again\n");
+                printf("-a:\t\tzone file or compiled zone (dns-compile zone) to answer for\n"
+                       "\t\tauthoritatively, changed by dynamic updates (RFC 2136) from this machine\n");
+                printf("-c:\t\tcontrol socket taking changes of the zones as lines \"add name ttl type data\",\n"
+                       "\t\t\"delete name [type [data]]\", \"require name [type [data]]\", \"absent name [type]\",\n"
+                       "\t\tor commands \"reload\", \"limit rate[/slip]\", \"limit off\"; without -l it changes\n"
+                       "\t\tthe bulk run: \"reload\", \"servers server[,server...]\", \"parallel count\",\n"
+                       "\t\t\"hedge budget|off\", \"race count[/budget]|off\"\n");
+                printf("-L:\t\tanswer each /24 of clients at most rate times a second, drop the rest but\n"
+                       "\t\tevery slip-th, which goes out truncated (default %d, 0 drops all)\n", SERVER_SLIP);
                 printf("address:\taddress of which to ask a server\n");
                 return 0;
             default:
@@ -73,81 +665,253 @@ int main(int argc, char *argv[])
         }
     }
 
-    /* There must be one non-option argument left for address */
-    if (optind + 1 != argc) {
+    /* A server takes no names, it serves the zones of -a */
+    if (listen_address || zones_count || limit_rate) {
+        struct server srv;
+        uint32_t i;
+
+        if (!listen_address || optind != argc || names_file) {
+            print_input_error(argv[0]);
+            return -1;
+        }
+        if (server_init(&srv, listen_address) == -1)
+            return -1;
+        if ((admin_path && admin_listen(&srv.admin, admin_path) == -1) ||
+            (limit_rate && server_set_limit(&srv, limit_rate, limit_slip) == -1)) {
+            server_free(&srv);
+            return -1;
+        }
+        for (i = 0; i < zones_count; i++) {
+            if (server_add_zone(&srv, zone_files[i]) == -1) {
+                server_free(&srv);
+                return -1;
+            }
+        }
+        ret = serve(&srv, res.stats) == -1 ? 1 : 0;
+        server_free(&srv);
+        return ret;
+    }
+
+    /* Either a file with addresses, or one non-option argument left for address */
+    if (names_file) {
+        if (optind != argc) {
+            print_input_error(argv[0]);
+            return -1;
+        }
+        reader.fd = strcmp(names_file, "-") == 0 ? STDIN_FILENO : open(names_file, O_RDONLY);
+        if (reader.fd == -1) {
+            fprintf(stderr, "Couldn't open %s:\n%d %s\n", names_file, errno, strerror(errno));
+            return -1;
+        }
+    }
+    else {
+        if (optind + 1 != argc) {
+            print_input_error(argv[0]);
+            return -1;
+        }
+        /* Then the last argument must be the hostname for a query */
+        hostname = argv[optind];
+    }
+
+    /* Fill in destination servers info, without them every name needs a forwarding rule.
+     * Iterative resolution starts at them instead of the root servers. */
+    if (server_hostname && !iterative && !(config.servers = strdup(server_hostname)))
+        return -1;
+    config.port = server_port;
+    if (config_load(&config, &res.pool, &res.overrides, &res.blocklist, &res.forward, &res.servers) == -1)
+        return -1;
+    if (!res.servers && !res.forward && !iterative) {
         print_input_error(argv[0]);
         return -1;
     }
-    /* Then the last argument must be the hostname for a query */
-    hostname = argv[optind];
+    if (top_count && hotkeys_init(&hotkeys, top_count) == -1)
+        return -1;
 
-    /* Assign a socket */
-    socket_desc = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (socket_desc == -1) {
-        fprintf(stderr, "Couldn't assign a socket:\n%d %s\n", errno, strerror(errno));
+    /* Report and reload can be requested in the middle of a bulk run. No SA_RESTART, so
+     * that waiting in poll() gets interrupted and they're handled right away */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_report;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    sa.sa_handler = request_reload;
+    sigaction(SIGHUP, &sa, NULL);
+
+    /* Give every lookup 5 seconds for all its queries unless told otherwise */
+    if (!res.timeout)
+        res.timeout = LOOKUP_TIMEOUT_MS;
+
+    /* Zone transfers go over TCP on their own, a transfer is all the run does */
+    if (mirror_file || (query->types_count && (query->types[0] == TYPE_AXFR || query->types[0] == TYPE_IXFR))) {
+        if (!hostname || !res.servers || query->types_count > 1) {
+            print_input_error(argv[0]);
+            return -1;
+        }
+        ret = transfer_zone(&res, hostname, mirror_file, query->types[0], ixfr_serial) == -1 ? 1 : 0;
+        config_unload(res.overrides, res.blocklist, res.forward, res.servers);
+        free(config.servers);
+        upstream_pool_free(&res.pool);
+        return ret;
+    }
+    if (engine_init(&res.engine, &res.pool, res.timeout) == -1)
         return -1;
+    res.engine.hedge_budget.ratio = hedge_ratio;
+    res.engine.race = race;
+    res.engine.shard = shard;
+    res.engine.race_budget.ratio = race_ratio;
+    if (query->types_count == 0)
+        query->types[query->types_count++] = query->ipv6 ? TYPE_AAAA : TYPE_A;
+    /* Zone cuts replaced in the cache are asked until the lookups which took them give up */
+    cache_init(&res.cache, res.timeout + RELOAD_GRACE_MS);
+    if (iterative) {
+        if (iterator_init(&iterator, &res.engine, &res.pool, &res.cache,
+                          server_hostname ? server_hostname : ITERATE_ROOT_HINTS, server_port) == -1)
+            return -1;
+        res.iterator = &iterator;
     }
+    /* The control socket changes the run while it goes, it's read between the replies */
+    admin_init(&admin, control_command, &control);
+    if (admin_path && admin_listen(&admin, admin_path) == -1)
+        return -1;
 
-    /* Fill in destination server info into a socket structure */
-    server = get_dest_server(server_hostname, server_port);
-
-    /* Set a timeout of 5 seconds for connection with provided server */
-    /* Implementation of timeout used from https://stackoverflow.com/questions/2876024/linux-is-there-a-read-or-recv-from-socket-with-timeout */
-    struct timeval tv;
-    tv.tv_sec = 5;
-    tv.tv_usec = 0;
-    setsockopt(socket_desc, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof(tv));
-
-    /* Use connected UDP socket method (for server checking server availability) */
-    ret = connect(socket_desc, (struct sockaddr *)server, sizeof(*server));
-    if (ret == -1) {
-        fprintf(stderr, "Couldn't connect to the server:\n%d %s\n", errno, strerror(errno));
-        return ret;
+    if (hostname) {
+        if (top_count)
+            hotkeys_update(&hotkeys, hostname);
+        if (lookup_start(&res, hostname) != 0)
+            res.failed++;
+        input_done = true;
     }
 
-    /* Initialize buffer */
-    init_buffer(&datagram);
+    for (;;) {
+        char line[HOSTNAME_MAX + 2];
 
-    /* Generate identifier which will be used to identify dns packets */
-    id = htons(getpid());
+        /* Keep the number of lookups in flight at the limit. A sweep takes all of it
+         * until its names are done, the input waits for it. */
+        while (res.active < res.parallel) {
+            int got;
 
-    /* Fill the DNS Header into buffer */
-    add_dns_header(&datagram, id, reverse, recursive);
+            if (res.sweep) {
+                if (sweep_run(&res, res.parallel) == 1)
+                    break;
+                continue;
+            }
+            if (input_done)
+                break;
+            got = next_name(&reader, line, sizeof(line));
+            if (got != 1) {
+                input_done = got == -1;
+                break;
+            }
+            if (top_count)
+                hotkeys_update(&hotkeys, line);
+            /* A failed lookup doesn't stop the run, but it's reflected in the return code */
+            if (lookup_start(&res, line) != 0)
+                res.failed++;
+        }
+        if (input_done && res.active == 0 && !res.sweep)
+            break;
 
-    /* Question data */
-    if (reverse)
-        ret = add_reverse_question(&datagram, hostname);
-    else
-        add_question(&datagram, hostname, ipv6);
+        /* Names are read only when there's room for their lookups */
+        count = 0;
+        if (!input_done && !res.sweep && res.active < res.parallel) {
+            pfd[0].fd = reader.fd;
+            pfd[0].events = POLLIN;
+            count++;
+        }
+        count += admin_poll(&admin, &pfd[count], &wait);
+        if (engine_poll(&res.engine, wait, pfd, count) == -1) {
+            fprintf(stderr, "Couldn't wait for replies:\n%d %s\n", errno, strerror(errno));
+            break;
+        }
+        admin_serve(&admin, pfd, count);
 
-    if (ret == -1) {
-        return ret;
+        if (report_requested) {
+            report_requested = 0;
+            print_reports(&res, top_count ? &hotkeys : NULL);
+        }
+        if (reload_requested) {
+            reload_requested = 0;
+            config_reload(&res, &config, message, sizeof(message));
+            fprintf(stderr, "%s\n", message);
+        }
+        if (config.retired)
+            config_retire(&config, now_ms(), false);
+        cache_trim(&res.cache, now_ms());
     }
+    ret = res.failed ? 1 : 0;
+
+    if (names_file || top_count || res.stats)
+        print_reports(&res, top_count ? &hotkeys : NULL);
+    if (top_count)
+        hotkeys_free(&hotkeys);
+    if (reader.fd > STDIN_FILENO)
+        close(reader.fd);
+    admin_free(&admin);
+    cache_free(&res.cache);
+    engine_free(&res.engine);
+    config_unload(res.overrides, res.blocklist, res.forward, res.servers);
+    config_retire(&config, 0, true);
+    free(config.servers);
+    upstream_pool_free(&res.pool);
+
+    return ret;
+}
 
-    /* Send data */
-    ret = send(socket_desc, datagram.data, datagram.pos, 0);
-    if (ret == -1) {
-        fprintf(stderr, "Couldn't send a datagram:\n%d %s\n", errno, strerror(errno));
-        return ret;
-    }
+static int print_transfer_record(void *ctx, enum xfr_op op, const struct xfr_record *r)
+{
+    const struct xfr *x = ctx;
 
-    /* Initialize the buffer again for receiving data back */
-    empty_buffer(&datagram);
+    /* Deltas are marked like a diff */
+    if (x->type == TYPE_IXFR && !x->full)
+        fputc(op == XFR_ADD ? '+' : '-', stdout);
+    xfr_print_record(stdout, r);
+    return 0;
+}
 
-    /* Receive data */
-    ret = recv(socket_desc, datagram.data, MAX_BUFF_SIZE, 0);
-    if (ret <= 0) {
-        fprintf(stderr, "Couldn't receive reply from the server:\n%d %s\n", errno, strerror(errno));
-        return ret;
+/* Transfers the zone from the first -s server, printing its records or keeping a mirror
+ * file of it. Returns -1 if the transfer fails. */
+int transfer_zone(struct resolver *res, const char *zone, const char *mirror, uint16_t type,
+                  uint32_t serial)
+{
+    const struct sockaddr_in *server = &res->servers->servers[0]->addr;
+    uint8_t wire[NAME_WIRE_MAX];
+    uint64_t started = now_ms();
+    struct xfr *x;
+    int len = name_encode(zone, wire, false), ret;
+
+    if (len == -1) {
+        fprintf(stderr, "Invalid zone name %s\n", zone);
+        return -1;
     }
+    if (mirror)
+        return xfr_mirror(mirror, server, wire, len, res->timeout);
 
-    struct dns_header *header = (struct dns_header *)&datagram.data[datagram.pos];
-    datagram.pos += sizeof(*header);
-
-    if (id != header->id) {
-        printf("TODO ID\n");
-        return 1;
+    /* The buffer of the transfer is too big for the stack */
+    x = malloc(sizeof(*x));
+    if (!x || xfr_start(x, server, wire, len, type ? type : TYPE_AXFR, serial, res->timeout) == -1) {
+        free(x);
+        return -1;
     }
+    ret = xfr_run(x, print_transfer_record, x);
+    xfr_close(x);
+    fflush(stdout);
+    if (ret == 0 && x->current)
+        fprintf(stderr, "Zone %s is current, serial %u\n", zone, serial);
+    else if (ret == 0)
+        fprintf(stderr, "Transfer of %s: serial %u, %s, %llu records, %llu messages, %llu bytes, %llu ms\n",
+                zone, x->new_serial, x->full ? "whole zone" : "deltas",
+                (unsigned long long)x->records, (unsigned long long)x->messages,
+                (unsigned long long)x->bytes, (unsigned long long)(now_ms() - started));
+    free(x);
+    return ret;
+}
+
+/* Prints a reply of the server */
+void print_reply(const uint8_t *reply, size_t len)
+{
+    struct buffer datagram = { .data = (char *)reply, .pos = 0 };
+    struct dns_header *header = (struct dns_header *)datagram.data;
+    datagram.pos += sizeof(*header);
 
     printf("Authoritative: %s, ", header->aa ? "Yes" : "No");
     printf("Recursive: %s, ", header->rd && header->ra ? "Yes" : "No");
@@ -155,42 +919,959 @@ int main(int argc, char *argv[])
     printf("Question section (%d)\n", ntohs(header->qdcount));
     print_questions(&datagram, ntohs(header->qdcount));
     printf("Answer section (%d)\n", ntohs(header->ancount));
-    print_resource(&datagram, ntohs(header->ancount));
+    print_resource(&datagram, len, ntohs(header->ancount));
     printf("Authority section (%d)\n", ntohs(header->nscount));
-    print_resource(&datagram, ntohs(header->nscount));
+    print_resource(&datagram, len, ntohs(header->nscount));
     printf("Additional section (%d)\n", ntohs(header->arcount));
-    print_resource(&datagram, ntohs(header->arcount));
+    print_resource(&datagram, len, ntohs(header->arcount));
+}
 
-    free(datagram.data);
+/* Sends the question in the datagram to the servers of its forwarded zone, to the nameservers
+ * found iteratively or to the -s servers. The caller sets up done and ctx of both the query
+ * and the iteration, iteration calls done even when it fails. Returns -1 if the question
+ * couldn't be sent, done is not called then. */
+static int send_question(struct resolver *res, struct query *q, struct iteration *it,
+                         struct buffer *datagram, uint64_t deadline, bool *iterative)
+{
+    char *qname = &datagram->data[sizeof(struct dns_header)];
+    const struct upstream_set *servers = NULL;
+
+    /* Pick the servers by the longest forwarded zone the question name falls into */
+    if (res->forward)
+        servers = forward_route(res->forward, (uint8_t *)qname, namelen(qname));
+    *iterative = !servers && res->iterator;
+    if (*iterative) {
+        /* Nameservers don't recurse, the question goes out without RD */
+        ((struct dns_header *)datagram->data)->rd = 0;
+        iteration_start(res->iterator, it, (uint8_t *)datagram->data, datagram->pos, deadline);
+        return 0;
+    }
+    if (!servers)
+        servers = res->servers;
+    if (!servers || servers->count == 0)
+        return -1;
 
+    memcpy(q->packet, datagram->data, datagram->pos);
+    q->len = datagram->pos;
+    q->servers = servers;
+    q->deadline = deadline;
+    return engine_submit(&res->engine, q);
+}
+
+/* Question about a wire name taken from a reply, built straight into the packet so that the
+ * name never goes through text. Returns -1 if it doesn't fit. */
+static int build_question(const struct resolver *res, uint8_t *packet, const uint8_t *name,
+                          size_t name_len, uint16_t qtype, struct buffer *datagram)
+{
+    struct builder b;
+
+    if (builder_init(&b, packet, UDP_MESSAGE_MAX, res->query.recursive ? 0x0100 : 0) == -1 ||
+        builder_question(&b, name, name_len, qtype) == -1)
+        return -1;
+    datagram->data = (char *)packet;
+    datagram->pos = b.len;
     return 0;
 }
 
-/* Function for converting standard dotted hostname format to network format
- * www.google.com\0 would be \3www\6google\3com\0 */
-static char * encode_hostname(char *hostname)
+static void lookup_print(struct lookup *lk, const struct query *q, enum query_status status,
+                         const uint8_t *reply, size_t len);
+
+/* Addresses of a target are cached under its name, whatever aliases the answer went through */
+static void target_finish(struct target *t, enum query_status status, const uint8_t *reply, size_t len)
+{
+    struct lookup *lk = t->lookup;
+    struct cache_node *node = cache_node(&lk->res->cache, t->name, t->name_len, true);
+    uint64_t now = now_ms();
+    struct message_index ix;
+    struct message m;
+    uint32_t i;
+
+    t->source = "not found";
+    if (status == QUERY_OK && node && message_parse(&m, reply, len) == 0 && message_index(&m, &ix) == 0) {
+        for (i = 0; i < ix.count && ix.rr[i].section == SECTION_ANSWER; i++) {
+            const struct rr_ref *ref = &ix.rr[i];
+
+            if (ref->class != CLASS_IN)
+                continue;
+            if (ref->type == TYPE_A && ref->rdlength == sizeof(struct in_addr)) {
+                struct in_addr addr;
+                memcpy(&addr, &reply[ref->rdata], sizeof(addr));
+                cache_add_ipv4(node, addr, cache_expiry(ref->ttl, now), now);
+                t->source = "looked up";
+            }
+            else if (ref->type == TYPE_AAAA && ref->rdlength == sizeof(struct in6_addr)) {
+                struct in6_addr addr;
+                memcpy(&addr, &reply[ref->rdata], sizeof(addr));
+                cache_add_ipv6(node, &addr, cache_expiry(ref->ttl, now), now);
+                t->source = "looked up";
+            }
+        }
+    }
+    else if (status != QUERY_OK)
+        t->source = "lookup failed";
+
+    if (--lk->pending == 0)
+        lookup_print(lk, NULL, QUERY_OK, lk->reply, lk->reply_len);
+}
+
+static void target_done(struct query *q, enum query_status status, const uint8_t *reply, size_t len)
+{
+    target_finish(q->ctx, status, reply, len);
+}
+
+static void target_iterated(struct iteration *i, enum query_status status,
+                            const uint8_t *reply, size_t len)
+{
+    target_finish(i->ctx, status, reply, len);
+}
+
+/* Whether the cache has addresses of the family the lookup asks for */
+static bool target_cached(struct lookup *lk, const struct target *t, uint64_t now)
+{
+    struct cache_node *node = cache_node(&lk->res->cache, t->name, t->name_len, false);
+    struct cached_addrs *addrs = node ? cache_addrs(node, now) : NULL;
+
+    return addrs && (lk->res->query.ipv6 ? addrs->ipv6_count : addrs->ipv4_count);
+}
+
+/* Collects the hosts MX, NS and SRV records of the answer point to. Their addresses are
+ * taken from the additional section, from a nameserver only if they are within its zone,
+ * it has no say over names outside of it. A recursive server would be asked for the
+ * missing ones anyway, so it's trusted with all of them. Only targets neither there nor
+ * in the cache are looked up. Returns how many lookups are in flight. */
+static uint32_t lookup_targets(struct lookup *lk, const uint8_t *reply, size_t len)
+{
+    struct resolver *res = lk->res;
+    static const uint8_t root = 0;
+    uint8_t qname[NAME_WIRE_MAX], target[NAME_WIRE_MAX];
+    const uint8_t *zone = &root;
+    int qname_len, target_len;
+    size_t zone_len = 1, pos = sizeof(struct dns_header);
+    uint64_t now = now_ms();
+    struct message_index ix;
+    struct message m;
+    struct rr rr;
+    uint32_t i, k;
+
+    if ((lk->type != TYPE_MX && lk->type != TYPE_NS && lk->type != TYPE_SRV) ||
+        message_parse(&m, reply, len) == -1 || (qname_len = name_unpack(reply, len, &pos, qname)) == -1 ||
+        message_index(&m, &ix) == -1)
+        return 0;
+    if (lk->iterative) {
+        zone = qname + qname_len - lk->iteration.zone_len;
+        zone_len = lk->iteration.zone_len;
+    }
+
+    /* Owner names of the answer don't matter, only glue owners get decoded */
+    for (k = 0; k < ix.count && ix.rr[k].section == SECTION_ANSWER; k++) {
+        struct target *targets;
+
+        if (ix.rr[k].type != lk->type || ix.rr[k].class != CLASS_IN || message_rr(&m, &ix.rr[k], &rr, false) == -1 ||
+            (target_len = message_rdata_target(&m, &rr, target)) == -1 || target_len == 1)
+            continue;
+        for (i = 0; i < lk->targets_count; i++) {
+            if (name_equal(lk->targets[i].name, lk->targets[i].name_len, target, target_len))
+                break;
+        }
+        if (i < lk->targets_count)
+            continue;
+        targets = realloc(lk->targets, (lk->targets_count + 1) * sizeof(*targets));
+        if (!targets)
+            break;
+        lk->targets = targets;
+        memcpy(targets[i].name, target, target_len);
+        targets[i].name_len = target_len;
+        targets[i].source = NULL;
+        targets[i].lookup = lk;
+        lk->targets_count++;
+    }
+    if (lk->targets_count == 0)
+        return 0;
+
+    /* Harvest the glue */
+    for (; k < ix.count; k++) {
+        const struct rr_ref *ref = &ix.rr[k];
+        struct cache_node *node;
+
+        if (ref->section != SECTION_ADDITIONAL || ref->class != CLASS_IN ||
+            (ref->type != TYPE_A && ref->type != TYPE_AAAA) || message_rr(&m, ref, &rr, true) == -1 ||
+            !name_in_zone(rr.name, rr.name_len, zone, zone_len))
+            continue;
+        for (i = 0; i < lk->targets_count; i++) {
+            if (name_equal(lk->targets[i].name, lk->targets[i].name_len, rr.name, rr.name_len))
+                break;
+        }
+        if (i == lk->targets_count || !(node = cache_node(&res->cache, rr.name, rr.name_len, true)))
+            continue;
+        if (rr.type == TYPE_A && rr.rdlength == sizeof(struct in_addr)) {
+            struct in_addr addr;
+            memcpy(&addr, &reply[rr.rdata], sizeof(addr));
+            cache_add_ipv4(node, addr, cache_expiry(rr.ttl, now), now);
+        }
+        else if (rr.type == TYPE_AAAA && rr.rdlength == sizeof(struct in6_addr)) {
+            struct in6_addr addr;
+            memcpy(&addr, &reply[rr.rdata], sizeof(addr));
+            cache_add_ipv6(node, &addr, cache_expiry(rr.ttl, now), now);
+        }
+        else
+            continue;
+        lk->targets[i].source = "additional section";
+        res->glue_used++;
+    }
+
+    lk->reply = malloc(len);
+    if (!lk->reply)
+        return 0;
+    memcpy(lk->reply, reply, len);
+    lk->reply_len = len;
+
+    /* Held at one until all are started, a lookup done right away must not finish the answer */
+    lk->pending = 1;
+    for (i = 0; i < lk->targets_count; i++) {
+        struct target *t = &lk->targets[i];
+        uint8_t packet[UDP_MESSAGE_MAX];
+        struct buffer datagram;
+        bool iterative;
+
+        if (t->source)
+            continue;
+        if (target_cached(lk, t, now)) {
+            t->source = "cache";
+            continue;
+        }
+
+        if (build_question(res, packet, t->name, t->name_len, res->query.ipv6 ? TYPE_AAAA : TYPE_A,
+                           &datagram) == -1) {
+            t->source = "not looked up";
+            continue;
+        }
+        t->query.done = target_done;
+        t->query.ctx = t;
+        t->iteration.done = target_iterated;
+        t->iteration.ctx = t;
+        lk->pending++;
+        res->target_lookups++;
+        if (send_question(res, &t->query, &t->iteration, &datagram, lk->deadline, &iterative) == -1) {
+            t->source = "not looked up";
+            lk->pending--;
+        }
+    }
+    return --lk->pending;
+}
+
+/* Addresses the cache has for the targets of the answer */
+static void print_targets(struct lookup *lk)
+{
+    uint64_t now = now_ms();
+    uint32_t i, j;
+
+    printf("Targets (%u)\n", lk->targets_count);
+    for (i = 0; i < lk->targets_count; i++) {
+        const struct target *t = &lk->targets[i];
+        struct cache_node *node = cache_node(&lk->res->cache, t->name, t->name_len, false);
+        struct cached_addrs *addrs = node ? cache_addrs(node, now) : NULL;
+        char name[HOSTNAME_MAX + 2], address[IPV6_STR_SIZE];
+
+        name_to_text(t->name, name);
+        if (!addrs) {
+            printf("\t%s, no address (%s)\n", name, t->source);
+            continue;
+        }
+        for (j = 0; j < addrs->ipv4_count; j++) {
+            inet_ntop(AF_INET, &addrs->ipv4[j], address, sizeof(address));
+            printf("\t%s, A, IN, %llu, %s (%s)\n", name,
+                   (unsigned long long)(addrs->ipv4_expires - now) / 1000, address, t->source);
+        }
+        for (j = 0; j < addrs->ipv6_count; j++) {
+            inet_ntop(AF_INET6, &addrs->ipv6[j], address, sizeof(address));
+            printf("\t%s, AAAA, IN, %llu, %s (%s)\n", name,
+                   (unsigned long long)(addrs->ipv6_expires - now) / 1000, address, t->source);
+        }
+    }
+}
+
+static void lookup_free(struct lookup *lk)
 {
-    unsigned subpart = 0; /* tells us where next hostname part starts */
-    unsigned pos, hostname_len = strlen(hostname) + 1;
-    char *qname = malloc(hostname_len + 1);
+    free(lk->chain);
+    free(lk->answer);
+    free(lk->reply);
+    free(lk->targets);
+    free(lk);
+}
 
-    for (pos = 0; pos < hostname_len; pos++) {
-        if (hostname[pos] == '.' || hostname[pos] == '\0') {
-            /* if we meet dot or zero byte that means we are at the end of the hostname subpart
-             * and we save it's length (position - base) */
-            qname[subpart] = (char)(pos - subpart);
-            /* copy the subpart */
-            strncpy(&qname[subpart + 1], &hostname[subpart], pos - subpart);
-            if (hostname[pos] == '\0')
+/* Prints the answer of the lookup, or why there is none */
+static void lookup_report(struct lookup *lk, enum query_status status, uint32_t tries,
+                          const uint8_t *reply, size_t len)
+{
+    struct resolver *res = lk->res;
+
+    if (status == QUERY_TIMEOUT) {
+        fprintf(stderr, "Couldn't receive reply from the server for %s:\nno reply after %u tries\n",
+                lk->hostname, tries);
+        res->failed++;
+    }
+    else if (status == QUERY_NO_SERVER) {
+        fprintf(stderr, "Couldn't resolve %s:\nreferrals led to no nameserver which could be asked\n",
+                lk->hostname);
+        res->failed++;
+    }
+    else if (status == QUERY_DEADLINE) {
+        fprintf(stderr, "Couldn't resolve %s in time:\nno answer within %llu ms\n",
+                lk->hostname, (unsigned long long)(now_ms() - lk->started));
+        res->failed++;
+    }
+    else if (lk->local && !lk->answer)
+        print_local_answer(lk->local, lk->hostname, lk->type, &lk->local_entry);
+    else {
+        if (lk->local)
+            printf("%s\n", lk->local);
+        print_reply(reply, len);
+        if (lk->targets_count)
+            print_targets(lk);
+    }
+}
+
+/* Prints the types of the name in the order -t gave them, each with its own latency */
+static void group_done(struct lookup_group *g)
+{
+    uint32_t i;
+
+    if (--g->pending > 0)
+        return;
+    for (i = 0; i < g->count; i++) {
+        struct lookup *lk = g->lookups[i];
+        if (!lk)
+            continue;
+        if (lk->local)
+            printf("Type %s, answered locally\n", type_name(lk->type));
+        else
+            printf("Type %s, %llu ms\n", type_name(lk->type), (unsigned long long)(lk->finished - lk->started));
+        lookup_report(lk, lk->status, lk->tries, lk->result, lk->result_len);
+        lookup_free(lk);
+    }
+    free(g);
+}
+
+static void lookup_print(struct lookup *lk, const struct query *q, enum query_status status,
+                         const uint8_t *reply, size_t len)
+{
+    struct lookup_group *g = lk->group;
+    uint32_t tries = q ? q->tries : 0;
+
+    lk->res->active--;
+    if (!g) {
+        lookup_report(lk, status, tries, reply, len);
+        lookup_free(lk);
+        return;
+    }
+
+    /* The reply of the query is gone once this returns, the rest of the group may take longer */
+    if (reply && reply != lk->reply && reply != lk->answer) {
+        lk->reply = malloc(len + 1);
+        if (!lk->reply) {
+            fprintf(stderr, "Couldn't keep the reply for %s\n", lk->hostname);
+            lk->res->failed++;
+            lookup_free(lk);
+            group_done(g);
+            return;
+        }
+        memcpy(lk->reply, reply, len);
+        lk->reply[len] = 0;
+        reply = lk->reply;
+    }
+    lk->status = status;
+    lk->tries = tries;
+    lk->finished = now_ms();
+    lk->result = reply;
+    lk->result_len = len;
+    g->lookups[lk->index] = lk;
+    group_done(g);
+}
+
+/* Puts the chain followed so far together with the records of the last reply into one
+ * answer, as a recursive server would have given it. Records at the end of a complete
+ * chain go to the cache under every alias of it. */
+static void chain_answer(struct lookup *lk, const uint8_t *reply, size_t len, uint16_t qtype,
+                         const uint8_t *end, size_t end_len)
+{
+    struct resolver *res = lk->res;
+    uint8_t rdata[UDP_MESSAGE_MAX], records[ANSWER_MAX];
+    size_t records_len = 0;
+    uint32_t count = 0, ttl = UINT32_MAX, i;
+    uint64_t now = now_ms();
+    struct builder b;
+    struct message m;
+    struct rr rr;
+    int rdlength;
+
+    lk->answer = calloc(1, ANSWER_MAX + 1);
+    if (!lk->answer || message_parse(&m, reply, len) == -1 ||
+        builder_init(&b, lk->answer, ANSWER_MAX, (uint16_t)(reply[2] << 8 | reply[3])) == -1 ||
+        builder_question(&b, lk->chain[0].owner, lk->chain[0].owner_len, qtype) == -1) {
+        free(lk->answer);
+        lk->answer = NULL;
+        return;
+    }
+    for (i = 0; i < lk->chain_count; i++) {
+        const struct alias_link *link = &lk->chain[i];
+        builder_add(&b, SECTION_ANSWER, link->owner, link->owner_len, TYPE_CNAME, link->ttl,
+                    link->target, link->target_len);
+        if (link->ttl < ttl)
+            ttl = link->ttl;
+    }
+
+    /* The links of the reply are in the chain already, the rest is copied as it is */
+    while (message_next(&m, &rr) == 1) {
+        if (rr.section == SECTION_ANSWER && rr.type == TYPE_CNAME)
+            continue;
+        rdlength = message_rdata_unpack(&m, &rr, rdata, sizeof(rdata));
+        if (rdlength == -1 || builder_add(&b, rr.section, rr.name, rr.name_len, rr.type, rr.ttl,
+                                          rdata, rdlength) == -1)
+            continue;
+        if (rr.section != SECTION_ANSWER || rr.type != qtype || rr.class != CLASS_IN ||
+            !name_equal(rr.name, rr.name_len, end, end_len) || records_len + 2 + rdlength > sizeof(records))
+            continue;
+        records[records_len] = rdlength >> 8;
+        records[records_len + 1] = rdlength & 0xff;
+        memcpy(&records[records_len + 2], rdata, rdlength);
+        records_len += 2 + rdlength;
+        count++;
+        if (rr.ttl < ttl)
+            ttl = rr.ttl;
+    }
+    lk->answer_len = b.len;
+
+    /* Flattened, every alias points right to the records */
+    if (count == 0)
+        return;
+    for (i = 0; i < lk->chain_count; i++) {
+        struct cache_node *node = cache_node(&res->cache, lk->chain[i].owner, lk->chain[i].owner_len, true);
+        if (node)
+            cache_set_alias(node, qtype, end, end_len, records, records_len, count, cache_expiry(ttl, now));
+    }
+}
+
+/* Follows the CNAME chain the reply starts or continues, taking the links the reply has
+ * and asking for the name at the end of them if the reply doesn't have its records.
+ * Returns 1 when a query for the next link is on its way, 0 when the lookup is done
+ * (with lk->answer set if it went through aliases), -1 when the chain is too long. */
+static int lookup_chase(struct lookup *lk, const uint8_t *reply, size_t len)
+{
+    struct resolver *res = lk->res;
+    uint8_t name[NAME_WIRE_MAX], packet[UDP_MESSAGE_MAX];
+    size_t pos = sizeof(struct dns_header);
+    struct buffer datagram;
+    struct message_index ix;
+    struct message m;
+    struct rr rr;
+    uint16_t qtype;
+    uint32_t links = 0, i;
+    int name_len;
+    bool linked, answered = false;
+
+    if (message_parse(&m, reply, len) == -1 || m.qdcount != 1 ||
+        (name_len = name_unpack(reply, len, &pos, name)) == -1)
+        return 0;
+    qtype = reply[pos] << 8 | reply[pos + 1];
+    if (qtype == TYPE_CNAME || message_index(&m, &ix) == -1)
+        return 0;
+
+    /* Links of the chain can come in any order, only owners of aliases get decoded */
+    do {
+        linked = false;
+        for (i = 0; i < ix.count && ix.rr[i].section == SECTION_ANSWER; i++) {
+            struct alias_link *link;
+            int target_len;
+
+            if (ix.rr[i].type != TYPE_CNAME || message_rr(&m, &ix.rr[i], &rr, true) == -1 ||
+                !name_equal(rr.name, rr.name_len, name, name_len))
+                continue;
+            if (lk->chain_count == CNAME_MAX_CHAIN)
+                return -1;
+            if (!lk->chain && !(lk->chain = malloc(CNAME_MAX_CHAIN * sizeof(*lk->chain))))
+                return 0;
+            link = &lk->chain[lk->chain_count];
+            target_len = message_rdata_target(&m, &rr, link->target);
+            if (target_len == -1)
                 break;
-            subpart = pos + 1; /* update the base to where hostname part ended and skip the dot */
+            memcpy(link->owner, name, name_len);
+            link->owner_len = name_len;
+            link->target_len = target_len;
+            link->ttl = rr.ttl;
+            lk->chain_count++;
+            links++;
+            memcpy(name, link->target, target_len);
+            name_len = target_len;
+            linked = true;
+            break;
+        }
+    } while (linked);
+    if (lk->chain_count == 0)
+        return 0;
+
+    for (i = 0; i < ix.count && ix.rr[i].section == SECTION_ANSWER && !answered; i++) {
+        if (ix.rr[i].type == qtype && message_rr(&m, &ix.rr[i], &rr, true) == 0 &&
+            name_equal(rr.name, rr.name_len, name, name_len))
+            answered = true;
+    }
+
+    /* The server gave the alias but not what it points to, most likely it's outside
+     * of its zone. What it did say about the end of the chain (no such name, no data)
+     * is the answer. */
+    if (answered || links == 0 || m.rcode != RCODE_NOERROR) {
+        free(lk->answer);
+        lk->answer = NULL;
+        chain_answer(lk, reply, len, qtype, name, name_len);
+        return 0;
+    }
+    if (lk->chain_count == CNAME_MAX_CHAIN)
+        return -1;
+
+    if (build_question(res, packet, name, name_len, qtype, &datagram) == -1 ||
+        send_question(res, &lk->query, &lk->iteration, &datagram, lk->deadline, &lk->iterative) == -1)
+        return 0;
+    res->aliases_followed++;
+    return 1;
+}
+
+/* Prints the names of a swept address. Existing IPv6 nibbles are swept further, NXDOMAIN
+ * of one cuts off everything below it. */
+static void sweep_finish(struct lookup *lk, const uint8_t *reply, size_t len)
+{
+    struct resolver *res = lk->res;
+    struct sweep *s = res->sweep;
+    uint8_t qname[NAME_WIRE_MAX], target[NAME_WIRE_MAX];
+    char address[INET6_ADDRSTRLEN], name[HOSTNAME_MAX + 2];
+    size_t pos = sizeof(struct dns_header);
+    struct message_index ix;
+    struct message m;
+    struct rr rr;
+    int qname_len, target_len;
+    bool found = false;
+    uint32_t i;
+
+    res->active--;
+    s->pending--;
+    if (!reply || message_parse(&m, reply, len) == -1 ||
+        (qname_len = name_unpack(reply, len, &pos, qname)) == -1 ||
+        (m.rcode != RCODE_NOERROR && m.rcode != RCODE_NXDOMAIN)) {
+        s->failed++;
+        res->failed++;
+    }
+    else if (m.rcode == RCODE_NXDOMAIN) {
+        if (sweep_leaf(s, qname, qname_len))
+            s->missing++;
+        else
+            s->pruned++;
+    }
+    else if (!sweep_leaf(s, qname, qname_len)) {
+        if (sweep_descend(s, qname, qname_len) == -1)
+            s->failed++;
+    }
+    else if (sweep_address(s, qname, qname_len, address) == 0) {
+        if (message_index(&m, &ix) == -1)
+            ix.count = 0;
+        for (i = 0; i < ix.count && ix.rr[i].section == SECTION_ANSWER; i++) {
+            if (ix.rr[i].type != TYPE_PTR || message_rr(&m, &ix.rr[i], &rr, false) == -1 ||
+                (target_len = message_rdata_target(&m, &rr, target)) == -1)
+                continue;
+            name_to_text(target, name);
+            printf("%s\t%s\n", address, name);
+            found = true;
+        }
+        if (found)
+            s->found++;
+        else
+            s->missing++;
+    }
+    lookup_free(lk);
+}
+
+static void lookup_finish(struct lookup *lk, const struct query *q, enum query_status status,
+                          const uint8_t *reply, size_t len)
+{
+    struct resolver *res = lk->res;
+
+    if (status == QUERY_OK) {
+        int chased = lookup_chase(lk, reply, len);
+
+        if (chased == 1)
+            return;
+        if (chased == -1 && !lk->swept) {
+            fprintf(stderr, "Couldn't resolve %s:\nalias chain longer than %d links\n",
+                    lk->hostname, CNAME_MAX_CHAIN);
+            res->failed++;
+            res->active--;
+            lookup_free(lk);
+            return;
         }
+        if (lk->answer) {
+            reply = lk->answer;
+            len = lk->answer_len;
+        }
+        if (lk->swept) {
+            sweep_finish(lk, chased == -1 ? NULL : reply, len);
+            return;
+        }
+        /* The answer waits for the addresses of its targets */
+        if (res->resolve_targets && lookup_targets(lk, reply, len) > 0)
+            return;
     }
-    qname[hostname_len] = '\0';
+    else if (lk->swept) {
+        sweep_finish(lk, NULL, 0);
+        return;
+    }
+    lookup_print(lk, q, status, reply, len);
+}
+
+static void lookup_done(struct query *q, enum query_status status, const uint8_t *reply, size_t len)
+{
+    lookup_finish(q->ctx, q, status, reply, len);
+}
+
+static void lookup_iterated(struct iteration *i, enum query_status status,
+                            const uint8_t *reply, size_t len)
+{
+    lookup_finish(i->ctx, &i->query, status, reply, len);
+}
+
+/* Answers the question from a flattened alias chain in the cache, the alias points
+ * right to the records at the end of the chain with the time they have left. Returns
+ * the length of the answer. */
+static size_t cached_alias_answer(uint8_t *answer, const uint8_t *qname, size_t qname_len, uint16_t type,
+                                  const struct cached_alias *alias, uint64_t now)
+{
+    uint32_t ttl = (alias->expires - now) / 1000;
+    struct builder b;
+    size_t pos = 0;
+    uint32_t i;
+
+    builder_init(&b, answer, ANSWER_MAX, 0x8180);
+    builder_question(&b, qname, qname_len, type);
+    builder_add(&b, SECTION_ANSWER, qname, qname_len, TYPE_CNAME, ttl, alias->target, alias->target_len);
+    for (i = 0; i < alias->count; i++) {
+        uint16_t rdlength = alias->rdata[pos] << 8 | alias->rdata[pos + 1];
 
-    return qname;
+        builder_add(&b, SECTION_ANSWER, alias->target, alias->target_len, type, ttl,
+                    &alias->rdata[pos + 2], rdlength);
+        pos += 2 + rdlength;
+    }
+    return b.len;
 }
 
+/* Keeps an answer made here in the slot of its type, the group prints it in -t order
+ * along with the replies of the servers. The addresses of entry (and the answer, if
+ * any) are copied, a reload may unload them before the group is done. */
+static int group_local(struct resolver *res, struct lookup_group *group, uint32_t index, const char *hostname,
+                       uint16_t type, const char *source, const struct override_entry *entry,
+                       const uint8_t *answer, size_t len)
+{
+    struct lookup *lk = calloc(1, sizeof(*lk));
+    size_t ipv4 = entry ? entry->ipv4_count * 4 : 0, ipv6 = entry ? entry->ipv6_count * 16 : 0;
+
+    if (!lk)
+        return -1;
+    if ((ipv4 + ipv6 && !(lk->reply = malloc(ipv4 + ipv6))) || (answer && !(lk->answer = malloc(len + 1)))) {
+        lookup_free(lk);
+        return -1;
+    }
+    if (ipv4 + ipv6) {
+        if (ipv4)
+            memcpy(lk->reply, entry->ipv4, ipv4);
+        if (ipv6)
+            memcpy(lk->reply + ipv4, entry->ipv6, ipv6);
+        lk->local_entry.ipv4_count = entry->ipv4_count;
+        lk->local_entry.ipv6_count = entry->ipv6_count;
+        lk->local_entry.ipv4 = lk->reply;
+        lk->local_entry.ipv6 = lk->reply + ipv4;
+    }
+    if (answer) {
+        memcpy(lk->answer, answer, len);
+        lk->answer[len] = 0;
+        lk->answer_len = len;
+        lk->result = lk->answer;
+        lk->result_len = len;
+    }
+    lk->res = res;
+    snprintf(lk->hostname, sizeof(lk->hostname), "%s", hostname);
+    lk->type = type;
+    lk->group = group;
+    lk->index = index;
+    lk->status = QUERY_OK;
+    lk->local = source;
+    group->lookups[index] = lk;
+    return 0;
+}
+
+/* Starts a lookup of one type of the name, the reply is printed once it comes (with the
+ * rest of the group, if any). Names answered locally are printed right away, or kept for
+ * the group. Returns 0 if the lookup is on its way or done. */
+static int lookup_type(struct resolver *res, char *hostname, uint16_t type,
+                       struct lookup_group *group, uint32_t index)
+{
+    const struct query_opts *query = &res->query;
+    struct lookup *lk;
+    int32_t ret = 0;
+    struct buffer datagram;
+
+    /* Local overrides win over anything the server would say */
+    if (res->overrides && !query->reverse) {
+        uint8_t wire[NAME_WIRE_MAX];
+        struct override_entry entry;
+        int len = name_encode(hostname, wire, false);
+
+        if (len != -1 && overrides_find(res->overrides, wire, len, &entry)) {
+            if (group)
+                return group_local(res, group, index, hostname, type, "Local override", &entry, NULL, 0);
+            print_local_answer("Local override", hostname, type, &entry);
+            return 0;
+        }
+    }
+
+    /* Initialize buffer */
+    init_buffer(&datagram);
+
+    /* Fill the DNS Header into buffer, identifier is assigned when the query is sent */
+    add_dns_header(&datagram, 0, query->reverse, query->recursive);
+
+    /* Question data */
+    if (query->reverse)
+        ret = add_reverse_question(&datagram, hostname);
+    else
+        ret = add_question(&datagram, hostname, type);
+
+    if (ret == -1) {
+        free(datagram.data);
+        return ret;
+    }
+
+    /* Blocked names never reach the server, the check runs on the encoded question name */
+    if (res->blocklist) {
+        char *qname = &datagram.data[sizeof(struct dns_header)];
+
+        if (blocklist_match(res->blocklist, (uint8_t *)qname, namelen(qname))) {
+            static const uint8_t unspecified[16];
+            const struct override_entry sinkhole = { 1, 1, unspecified, unspecified };
+            const char *source = res->sinkhole ? "Blocked (sinkhole)" : "Blocked";
+            char *name = decode_name(&datagram, qname);
+
+            if (group)
+                ret = group_local(res, group, index, name, type, source, res->sinkhole ? &sinkhole : NULL,
+                                  NULL, 0);
+            else
+                print_local_answer(source, name, type, res->sinkhole ? &sinkhole : NULL);
+            free(name);
+            free(datagram.data);
+            return ret == -1 ? -1 : res->sinkhole ? 0 : 1;
+        }
+    }
+
+    /* Alias chains resolved before cost one cache lookup */
+    {
+        const uint8_t *qname = (uint8_t *)&datagram.data[sizeof(struct dns_header)];
+        size_t qname_len = namelen((char *)qname);
+        struct cache_node *node = cache_node(&res->cache, qname, qname_len, false);
+        uint64_t now = now_ms();
+        const struct cached_alias *alias = node ? cache_alias(node, type, now) : NULL;
+
+        if (alias) {
+            uint8_t answer[ANSWER_MAX + 1] = { 0 };
+            size_t len = cached_alias_answer(answer, qname, qname_len, type, alias, now);
+
+            res->aliases_cached++;
+            if (group)
+                ret = group_local(res, group, index, hostname, type, "Cached alias", NULL, answer, len);
+            else {
+                printf("Cached alias\n");
+                print_reply(answer, len);
+            }
+            free(datagram.data);
+            return ret;
+        }
+    }
+
+    lk = calloc(1, sizeof(*lk));
+    if (!lk) {
+        free(datagram.data);
+        return -1;
+    }
+    lk->query.done = lookup_done;
+    lk->query.ctx = lk;
+    lk->iteration.done = lookup_iterated;
+    lk->iteration.ctx = lk;
+    lk->res = res;
+    lk->started = now_ms();
+    lk->deadline = lk->started + res->timeout;
+    snprintf(lk->hostname, sizeof(lk->hostname), "%s", hostname);
+    lk->type = type;
+    lk->group = group;
+    lk->index = index;
+
+    /* Counted before sending, an iteration may be done before it returns */
+    res->active++;
+    if (group)
+        group->pending++;
+    ret = send_question(res, &lk->query, &lk->iteration, &datagram, lk->deadline, &lk->iterative);
+    free(datagram.data);
+    if (ret == -1) {
+        fprintf(stderr, "Couldn't send a query for %s\n", hostname);
+        res->active--;
+        if (group)
+            group->pending--;
+        free(lk);
+        return -1;
+    }
+    return 0;
+}
+
+/* Starts a lookup of the next name of the sweep, the question is put together right
+ * in the packet. Returns 1 if one was started, 0 if the sweep has no name ready and -1
+ * if it couldn't be sent. */
+static int sweep_lookup(struct resolver *res)
+{
+    struct sweep *s = res->sweep;
+    uint8_t packet[sizeof(struct dns_header) + NAME_WIRE_MAX + 4];
+    struct buffer datagram = { .data = (char *)packet, .pos = 0 };
+    struct lookup *lk;
+    size_t len;
+
+    len = sweep_next(s, &packet[sizeof(struct dns_header)]);
+    if (len == 0)
+        return 0;
+    add_dns_header(&datagram, 0, true, res->query.recursive);
+    datagram.pos += len;
+    packet[datagram.pos++] = 0;
+    packet[datagram.pos++] = TYPE_PTR;
+    packet[datagram.pos++] = 0;
+    packet[datagram.pos++] = CLASS_IN;
+
+    lk = calloc(1, sizeof(*lk));
+    if (!lk) {
+        s->failed++;
+        return -1;
+    }
+    lk->query.done = lookup_done;
+    lk->query.ctx = lk;
+    lk->iteration.done = lookup_iterated;
+    lk->iteration.ctx = lk;
+    lk->res = res;
+    lk->started = now_ms();
+    lk->deadline = lk->started + res->timeout;
+    lk->type = TYPE_PTR;
+    lk->swept = true;
+
+    res->active++;
+    s->pending++;
+    if (send_question(res, &lk->query, &lk->iteration, &datagram, lk->deadline, &lk->iterative) == -1) {
+        res->active--;
+        s->pending--;
+        s->failed++;
+        free(lk);
+        return -1;
+    }
+    return 1;
+}
+
+/* Starts as many lookups of the sweep as the limit allows. Once the sweep is done, its
+ * summary is printed and 0 returned, 1 while it still goes on. */
+int sweep_run(struct resolver *res, uint32_t parallel)
+{
+    struct sweep *s = res->sweep;
+
+    while (res->active < parallel) {
+        int started = sweep_lookup(res);
+        if (started == 0)
+            break;
+        if (started == -1)
+            res->failed++;
+    }
+    if (!sweep_done(s))
+        return 1;
+
+    printf("Sweep of %s: %llu names asked, %llu addresses with names, %llu without",
+           s->cidr, (unsigned long long)s->asked, (unsigned long long)s->found,
+           (unsigned long long)s->missing);
+    if (s->ipv6)
+        printf(", %llu empty nibbles cut off", (unsigned long long)s->pruned);
+    printf(", %llu failed\n", (unsigned long long)s->failed);
+    sweep_free(s);
+    free(s);
+    res->sweep = NULL;
+    return 0;
+}
+
+/* Starts lookups of all -t types of the name at once, an address block with -x starts
+ * a sweep of it instead */
+int lookup_start(struct resolver *res, char *hostname)
+{
+    const struct query_opts *query = &res->query;
+    struct lookup_group *g;
+    int ret = 0;
+    uint32_t i;
+
+    if (query->reverse && strchr(hostname, '/')) {
+        struct sweep *s = malloc(sizeof(*s));
+
+        if (!s || sweep_init(s, hostname) == -1) {
+            fprintf(stderr, "Couldn't parse %s as an address block\n", hostname);
+            free(s);
+            return -1;
+        }
+        res->sweep = s;
+        return 0;
+    }
+    if (query->reverse)
+        return lookup_type(res, hostname, TYPE_PTR, NULL, 0);
+    if (query->types_count == 1)
+        return lookup_type(res, hostname, query->types[0], NULL, 0);
+
+    g = calloc(1, sizeof(*g));
+    if (!g)
+        return -1;
+    g->count = query->types_count;
+    /* Held while starting, lookups may be done before the rest is sent */
+    g->pending = 1;
+    for (i = 0; i < query->types_count; i++) {
+        int started = lookup_type(res, hostname, query->types[i], g, i);
+        if (started != 0)
+            ret = started;
+    }
+    group_done(g);
+    return ret;
+}
+
+/* Prints a locally made answer the same way as a reply from the server. Only addresses
+ * of the asked type are printed, a name without them (or no entry) gets an empty answer. */
+void print_local_answer(const char *status, const char *hostname, enum TYPE type,
+                        const struct override_entry *entry)
+{
+    char address[IPV6_STR_SIZE];
+    size_t len = strlen(hostname);
+    const char *dot = (len && hostname[len - 1] == '.') ? "" : ".";
+    char text[RR_NAME_SIZE];
+    const char *type_str = rr_type_name(type, text);
+    int count = 0;
+    int i;
+
+    if (entry && type == TYPE_A)
+        count = entry->ipv4_count;
+    else if (entry && type == TYPE_AAAA)
+        count = entry->ipv6_count;
+
+    printf("%s\n", status);
+    printf("Question section (1)\n");
+    printf("\t%s%s, %s, IN\n", hostname, dot, type_str);
+    printf("Answer section (%d)\n", count);
+    for (i = 0; i < count; i++) {
+        if (type == TYPE_AAAA)
+            inet_ntop(AF_INET6, entry->ipv6 + 16 * i, address, sizeof(address));
+        else
+            inet_ntop(AF_INET, entry->ipv4 + 4 * i, address, sizeof(address));
+        printf("\t%s%s, %s, IN, 0, %s\n", hostname, dot, type_str, address);
+    }
+    printf("Authority section (0)\n");
+    printf("Additional section (0)\n");
+}
 
 size_t namelen(const char *name)
 {
@@ -255,101 +1936,24 @@ static char * decode_name(struct buffer *buff, char *name)
 
 char * buff_to_type(struct buffer *buff, enum TYPE *type)
 {
-    uint16_t *type_addr = (uint16_t *)&buff->data[buff->pos];
-    if (!type)
-        type = alloca(sizeof(enum TYPE));
-
-    *type = ntohs(*type_addr);
-    char *str;
+    char text[RR_NAME_SIZE];
+    uint16_t number = (uint8_t)buff->data[buff->pos] << 8 | (uint8_t)buff->data[buff->pos + 1];
 
-    switch (*type) {
-        case TYPE_A:
-            str = strdup("A");
-            break;
-        case TYPE_NS:
-            str = strdup("NS");
-            break;
-        case TYPE_MD:
-            str = strdup("MD");
-            break;
-        case TYPE_MF:
-            str = strdup("MF");
-            break;
-        case TYPE_CNAME:
-            str = strdup("CNAME");
-            break;
-        case TYPE_SOA:
-            str = strdup("SOA");
-            break;
-        case TYPE_MB:
-            str = strdup("MB");
-            break;
-        case TYPE_MG:
-            str = strdup("MG");
-            break;
-        case TYPE_MR:
-            str = strdup("MR");
-            break;
-        case TYPE_NULL:
-            str = strdup("NULL");
-            break;
-        case TYPE_WKS:
-            str = strdup("WKS");
-            break;
-        case TYPE_PTR:
-            str = strdup("PTR");
-            break;
-        case TYPE_HINFO:
-            str = strdup("HINFO");
-            break;
-        case TYPE_MINFO:
-            str = strdup("MINFO");
-            break;
-        case TYPE_MX:
-            str = strdup("MX");
-            break;
-        case TYPE_TXT:
-            str = strdup("TXT");
-            break;
-        case TYPE_AAAA:
-            str = strdup("AAAA");
-            break;
-        default:
-            fprintf(stderr, "Warning: unhandled TYPE value (%d)\n", *type);
-            str = strdup("Unknown");
-    }
+    if (type)
+        *type = number;
     buff->pos += sizeof(uint16_t);
-    return str;
+    return strdup(rr_type_name(number, text));
 }
 
 char * buff_to_class(struct buffer *buff, enum CLASS *class)
 {
-    uint16_t *class_addr = (uint16_t *)&buff->data[buff->pos];
-    if (!class)
-        class = alloca(sizeof(enum CLASS));
-
-    *class = ntohs(*class_addr);
-    char *str;
+    char text[RR_NAME_SIZE];
+    uint16_t number = (uint8_t)buff->data[buff->pos] << 8 | (uint8_t)buff->data[buff->pos + 1];
 
-    switch (*class) {
-        case CLASS_IN:
-            str = strdup("IN");
-            break;
-        case CLASS_CS:
-            str = strdup("CS");
-            break;
-        case CLASS_CH:
-            str = strdup("CH");
-            break;
-        case CLASS_HS:
-            str = strdup("HS");
-            break;
-        default:
-            fprintf(stderr, "Warning: unhandled CLASS value (%d)\n", *class);
-            str = strdup("Unknown");
-    }
+    if (class)
+        *class = number;
     buff->pos += sizeof(uint16_t);
-    return str;
+    return strdup(rr_class_name(number, text));
 }
 
 void print_questions(struct buffer *buff, int32_t count)
@@ -364,6 +1968,9 @@ void print_questions(struct buffer *buff, int32_t count)
         char *class = buff_to_class(buff, NULL);
 
         printf("\t%s, %s, %s\n", hostname, type, class);
+        free(hostname);
+        free(type);
+        free(class);
     }
 }
 
@@ -383,81 +1990,15 @@ uint16_t buff_to_rdlength(struct buffer *buff)
 }
 
 
-char * print_rdata(struct buffer *buff, enum TYPE type,
-                   enum CLASS class, uint16_t rdlength)
+/* RDATA as the type descriptor lays it out */
+void print_rdata(struct buffer *buff, size_t len, enum TYPE type, uint16_t rdlength)
 {
-    char *rdata = NULL;
-    char *buffer = &buff->data[buff->pos];
-
-    switch(type) {
-        case TYPE_A:
-            rdata = malloc(IPV4_STR_SIZE);
-            if (!inet_ntop(AF_INET, buffer, rdata, IPV4_STR_SIZE))
-                fprintf(stderr, "inet_ntop: %d %s\n", errno, strerror(errno));
-            printf("%s", rdata);
-            buff->pos += rdlength;
-            break;
-        case TYPE_MINFO:
-            rdata = buff_to_hostname(buff);
-            printf("\n\t\tresponsible mailbox: %s\n", rdata);
-            rdata = buff_to_hostname(buff);
-            printf("\n\t\terrors mailbox: %s", rdata);
-            break;
-        case TYPE_CNAME:
-        case TYPE_NS:
-        case TYPE_MR:
-        case TYPE_MG:
-        case TYPE_MF:
-        case TYPE_MD:
-        case TYPE_MB:
-        case TYPE_PTR:
-            rdata = buff_to_hostname(buff);
-            printf("%s", rdata);
-            break;
-        case TYPE_AAAA:
-            rdata = malloc(IPV6_STR_SIZE);
-            if (!inet_ntop(AF_INET6, buffer, rdata, IPV6_STR_SIZE))
-                fprintf(stderr, "inet_ntop: %d %s\n", errno, strerror(errno));
-            printf("%s", rdata);
-            buff->pos += rdlength;
-            break;
-        case TYPE_SOA: {
-            char *mname = buff_to_hostname(buff);
-            char *rname = buff_to_hostname(buff);
-            int serial = buff_to_int32(buff);
-            int refresh = buff_to_int32(buff);
-            int retry = buff_to_int32(buff);
-            int expire = buff_to_int32(buff);
-            int minimum = buff_to_int32(buff);
-
-            printf("\n\t\t");
-            printf("primary server name: %s\n\t\t"
-                   "responsible authority's mailbox: %s\n\t\t"
-                   "serial number: %d\n\t\t"
-                   "refresh interval: %d\n\t\t"
-                   "retry interval: %d\n\t\t"
-                   "expire limit: %d\n\t\t"
-                   "minimum TTL: %d",
-                   mname, rname, serial, refresh, retry, expire, minimum);
-            break;
-        }
-        case TYPE_TXT:
-            printf("%s", buffer);
-            buff->pos += strlen(buffer) + 1;
-            break;
-        case TYPE_HINFO:
-            printf("\n\t\tCPU: %s", buffer);
-            buff->pos += strlen(buffer) + 1;
-            printf("\n\t\tOS: %s", buffer);
-            buff->pos += strlen(buffer) + 1;
-        default:
-            fprintf(stderr, "Unhandled TYPE when parsing RDATA (%d)\n", type);
-    }
-    return rdata;
+    rr_rdata_print(stdout, (const uint8_t *)buff->data, len, buff->pos, rdlength, type, true);
+    buff->pos += rdlength;
 }
 
 
-static void print_resource(struct buffer *buff, int32_t count)
+static void print_resource(struct buffer *buff, size_t len, int32_t count)
 {
     uint32_t i;
     for (i = 0; i < count; i++) {
@@ -472,34 +2013,14 @@ static void print_resource(struct buffer *buff, int32_t count)
         uint32_t ttl = buff_to_int32(buff);
 
         printf("\t%s, %s, %s, %d, ", hostname, type, class, ttl);
-        print_rdata(buff, num_type, num_class, buff_to_rdlength(buff));
+        print_rdata(buff, len, num_type, buff_to_rdlength(buff));
         printf("\n");
+        free(hostname);
+        free(type);
+        free(class);
     }
 }
 
-struct sockaddr_in * get_dest_server(char *hostname, int32_t server_port)
-{
-    /* Get the ip from the hostname */
-    struct hostent *he_server = gethostbyname(hostname);
-    if (!he_server) {
-        return NULL;
-    }
-
-    /* Default port is 53 */
-    if (!server_port) {
-        server_port = 53;
-    }
-
-    struct sockaddr_in *server = malloc(sizeof(struct sockaddr_in));
-
-    memset(server, 0, sizeof(*server)); // Initialize everything to 0
-    memcpy(&server->sin_addr, he_server->h_addr_list[0], he_server->h_length);
-    server->sin_family = AF_INET;
-    server->sin_port = htons(server_port);
-
-    return server;
-}
-
 void add_dns_header(struct buffer *buff, int id, bool reverse, bool recursive)
 {
     struct dns_header *header = (struct dns_header *)&buff->data[buff->pos];
@@ -523,27 +2044,27 @@ void add_dns_header(struct buffer *buff, int id, bool reverse, bool recursive)
     buff->pos += sizeof(*header);
 }
 
-void add_question(struct buffer *buff, char *hostname, bool ipv6)
+int add_question(struct buffer *buff, char *hostname, uint16_t type)
 {
-    char *qname;
     struct dns_question_info *question;
+    int len;
 
     /* Encoding Qname and saving to buffer */
-    qname = encode_hostname(hostname);
-    memcpy(&buff->data[buff->pos], qname, strlen(qname)+1);
-    buff->pos += strlen(qname) + 1; // Update buffer position
+    len = name_encode(hostname, (uint8_t *)&buff->data[buff->pos], false);
+    if (len == -1) {
+        fprintf(stderr, "Could not encode a question name %s\n", hostname);
+        return -1;
+    }
+    buff->pos += len; // Update buffer position
 
     /* Question info (Qtype, Qclass) */
     question = (struct dns_question_info *)&buff->data[buff->pos];
-    if (ipv6)
-        question->qtype = htons(TYPE_AAAA);
-    else
-        question->qtype = htons(TYPE_A);
-    
+    question->qtype = htons(type);
     question->qclass = htons(CLASS_IN);
 
     /* Update buffer position */
     buff->pos += sizeof(struct dns_question_info);
+    return 1;
 }
 
 char hex_to_char(uint8_t hex)
@@ -554,41 +2075,34 @@ char hex_to_char(uint8_t hex)
 /* Reverses the address and adds suffix */
 int add_reverse_question(struct buffer *buff, char *address)
 {
-    char *qname;
-    size_t qname4_length = strlen(address) + 14; /* ipv4 address + .in-addr.arpa + 0 byte is in total 14 bytes */
-    size_t qname6_length = 32*2 + 9;
+    static const char ip6_suffix[] = "\3ip6\4arpa";
+    uint8_t *qname = (uint8_t *)&buff->data[buff->pos];
     struct dns_question_info *question;
     struct in6_addr addr;
 
     /* Inverse the address and save it into qname */
     if (inet_pton(AF_INET6, address, &addr) == 1) {
-        qname = malloc(qname6_length);
         uint8_t *addr8 = addr.s6_addr;
-        char c[4];
         int iter = 0;
 
         /* Each byte contains 2 address characters each in 4 bits, this reads them and also directly adds
          * the lengths for network hostname format */
         for (int i = 15; i >= 0; i--) {
-            c[0] = 1;
-            c[1] = hex_to_char(addr8[i] & 0x0f);
-            c[2] = 1;
-            c[3] = hex_to_char(addr8[i] >> 4);
-            memcpy(&qname[iter], c, 4); // Copy the parsed byte into string
-            iter += 4;
+            qname[iter++] = 1;
+            qname[iter++] = hex_to_char(addr8[i] & 0x0f);
+            qname[iter++] = 1;
+            qname[iter++] = hex_to_char(addr8[i] >> 4);
         }
-        memcpy(&qname[iter], encode_hostname("ip6.arpa"), 9); // Add suffix
-        memcpy(&buff->data[buff->pos], qname, qname6_length); // Copy the string into buffer
-        buff->pos += qname6_length + 1; // Update buffer position
+        memcpy(&qname[iter], ip6_suffix, sizeof(ip6_suffix)); // Add suffix
+        buff->pos += iter + sizeof(ip6_suffix); // Update buffer position
     }
     else if (inet_pton(AF_INET, address, &addr) == 1) {
-        int octets[4];
-        qname = malloc(qname4_length);
+        uint8_t *octets = (uint8_t *)&addr;
+        char reversed[sizeof("255.255.255.255.in-addr.arpa")];
+
         /* Reverse the octets and add suffix */
-        sscanf(address, "%d.%d.%d.%d", &octets[0], &octets[1], &octets[2], &octets[3]);
-        sprintf(qname, "%d.%d.%d.%d.%s", octets[3], octets[2], octets[1], octets[0], "in-addr.arpa");
-        memcpy(&buff->data[buff->pos], encode_hostname(qname), qname4_length + 1);
-        buff->pos += qname4_length + 1; // Update buffer position
+        sprintf(reversed, "%d.%d.%d.%d.%s", octets[3], octets[2], octets[1], octets[0], "in-addr.arpa");
+        buff->pos += name_encode(reversed, qname, false); // Update buffer position
     }
     else {
         fprintf(stderr, "Could not parse a question address\n");
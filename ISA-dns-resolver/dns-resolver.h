@@ -9,36 +9,40 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 
-#define MAX_BUFF_SIZE 255
+#include "dns-overrides.h"
+#include "dns-blocklist.h"
+#include "dns-upstream.h"
+#include "dns-forward.h"
+#include "dns-engine.h"
+#include "dns-iterate.h"
+#include "dns-cache.h"
+#include "dns-names.h"
+#include "dns-message.h"
+#include "dns-sweep.h"
+#include "dns-xfr.h"
+#include "dns-server.h"
+
+/* Query of one question: header, the longest name a wire name can be, type and class */
+#define MAX_BUFF_SIZE (12 + NAME_WIRE_MAX + 4)
 #define IPV4_STR_SIZE 16
 #define IPV6_STR_SIZE 40
 
-enum TYPE {
-    TYPE_A = 1,
-    TYPE_NS,
-    TYPE_MD,
-    TYPE_MF,
-    TYPE_CNAME,
-    TYPE_SOA,
-    TYPE_MB,
-    TYPE_MG,
-    TYPE_MR,
-    TYPE_NULL,
-    TYPE_WKS,
-    TYPE_PTR,
-    TYPE_HINFO,
-    TYPE_MINFO,
-    TYPE_MX,
-    TYPE_TXT,
-    TYPE_AAAA = 28,
-};
-
-enum CLASS {
-    CLASS_IN = 1,
-    CLASS_CS,
-    CLASS_CH,
-    CLASS_HS,
-};
+/* Time one lookup gets for all its queries, unless -d says otherwise */
+#define LOOKUP_TIMEOUT_MS 5000
+/* Most lookups of a bulk run in flight at once */
+#define MAX_PARALLEL 1000000
+/* Most servers one query races to */
+#define MAX_RACE 4
+/* Forwarding rules and -s servers replaced by a reload, and zone cuts replaced in the
+ * cache, are kept this long past the deadline of the last lookup which could have picked
+ * them, its queries still point at their servers */
+#define RELOAD_GRACE_MS 1000
+/* Most types -t asks for at once */
+#define MAX_TYPES 8
+/* Longest CNAME chain followed, longer ones are most likely loops */
+#define CNAME_MAX_CHAIN 8
+/* Largest answer put together from the replies along a chain */
+#define ANSWER_MAX 4096
 
 struct dns_header{
     uint16_t	id :16;		/* identification number */
@@ -85,32 +89,135 @@ struct buffer {
     uint32_t pos;
 };
 
+/* Flags shared by all queries of one run */
+struct query_opts {
+    bool recursive;
+    bool reverse;
+    bool ipv6;
+    uint16_t types[MAX_TYPES];          /* asked for, A or AAAA unless -t says otherwise */
+    uint32_t types_count;
+};
+
+/* Everything one lookup needs, set up once in main() */
+struct resolver {
+    struct query_opts query;
+    struct engine engine;
+    struct upstream_pool pool;
+    struct upstream_set *servers;       /* given by -s, used when no forwarding rule matches, NULL if none */
+    struct forward_table *forward;      /* zones forwarded elsewhere, NULL if none */
+    struct iterator *iterator;          /* resolves names itself from the root, NULL if not */
+    struct cache cache;                 /* zone cuts and addresses learned from replies */
+    bool resolve_targets;               /* look up addresses of MX, NS and SRV targets */
+    struct overrides *overrides;        /* local names which win over the server, NULL if none */
+    struct blocklist *blocklist;        /* domains never asked for, NULL if none */
+    struct sweep *sweep;                /* block of addresses being swept with -x, NULL if none */
+    bool sinkhole;                      /* answer blocked names with 0.0.0.0 or :: instead of refusing */
+    bool stats;                         /* report upstreams along with the other reports */
+    uint32_t timeout;                   /* ms from the start of a lookup to its deadline */
+    uint32_t parallel;                  /* most lookups of a bulk run in flight at once */
+    uint32_t active;                    /* lookups in flight */
+    uint32_t failed;
+    uint64_t glue_used;                 /* target addresses taken from additional sections */
+    uint64_t target_lookups;            /* and looked up because they were missing */
+    uint64_t aliases_followed;          /* CNAME links which needed a query of their own */
+    uint64_t aliases_cached;            /* lookups answered by a flattened chain in the cache */
+};
+
+/* CNAME record of a chain being followed */
+struct alias_link {
+    uint8_t owner[NAME_WIRE_MAX];
+    uint8_t target[NAME_WIRE_MAX];
+    uint16_t owner_len, target_len;
+    uint32_t ttl;
+};
+
+struct lookup;
+
+/* Host an answer points to, its addresses are looked up along with the answer */
+struct target {
+    struct query query;
+    struct iteration iteration;
+    struct lookup *lookup;
+    uint8_t name[NAME_WIRE_MAX];
+    uint16_t name_len;
+    const char *source;                 /* where the addresses came from, NULL until known */
+};
+
+/* Name being resolved */
+struct lookup_group;
+
+struct lookup {
+    struct query query;
+    struct iteration iteration;         /* used instead of the query when resolving iteratively */
+    struct resolver *res;
+    uint64_t started;
+    uint64_t deadline;                  /* every query of the lookup has to be done by then */
+    bool iterative;                     /* resolved from the root, not by a recursive server */
+    char hostname[HOSTNAME_MAX + 1];
+    uint16_t type;
+    bool swept;                         /* one of the names of the sweep */
+
+    struct lookup_group *group;         /* other types of the name, NULL if asked for one */
+    uint32_t index;                     /* of the type in -t */
+    enum query_status status;           /* how it ended, kept until the whole group is */
+    uint32_t tries;
+    uint64_t finished;
+    const uint8_t *result;
+    size_t result_len;
+    const char *local;                  /* what answered it here instead of a server, NULL if one did */
+    struct override_entry local_entry;  /* addresses of a local answer, kept in reply */
+
+    struct alias_link *chain;           /* NULL until the answer turns out to be an alias */
+    uint32_t chain_count;
+    uint8_t *answer;                    /* chain and the records at its end, printed instead of the reply */
+    size_t answer_len;
+
+    uint8_t *reply;                     /* kept while addresses of its targets are looked up */
+    size_t reply_len;
+    struct target *targets;
+    uint32_t targets_count;
+    uint32_t pending;                   /* target lookups in flight */
+};
+
+/* Lookups of all -t types of one name, sent at once and printed together once the last
+ * of them is done */
+struct lookup_group {
+    uint32_t count;
+    uint32_t pending;
+    struct lookup *lookups[MAX_TYPES];  /* done ones in -t order, local answers too */
+};
+
 /* Custom function for counting size of the name. I needed this because for some reason whoever
  * made name compression decided that after a pointer there will be no 0 ending byte,
  * which makes very hard to count how many bytes of space it occupies, without function like this */
 size_t namelen(const char *name);
 
-struct sockaddr_in * get_dest_server(char *hostname, int32_t server_port);
+int lookup_start(struct resolver *res, char *hostname);
+int sweep_run(struct resolver *res, uint32_t parallel);
+int transfer_zone(struct resolver *res, const char *zone, const char *mirror, uint16_t type,
+                  uint32_t serial);
+void print_reply(const uint8_t *reply, size_t len);
+void print_local_answer(const char *status, const char *hostname, enum TYPE type,
+                        const struct override_entry *entry);
 
 void init_buffer(struct buffer *buff);
 void empty_buffer(struct buffer *buff);
 
 void add_dns_header(struct buffer *buff, int id, bool reverse, bool recursive);
-void add_question(struct buffer *buff, char *hostname, bool ipv6);
+int add_question(struct buffer *buff, char *hostname, uint16_t type);
 int add_reverse_question(struct buffer *buff, char *address);
 
-static char * encode_hostname(char *hostname);
 static char * decode_name(struct buffer *buff, char *name);
 
 void print_questions(struct buffer *buff, int32_t count);
-static void print_resource(struct buffer *buff, int32_t count);
+static void print_resource(struct buffer *buff, size_t len, int32_t count);
 
 char * buff_to_hostname(struct buffer *buff);
 char * buff_to_type(struct buffer *buff, enum TYPE *type);
 char * buff_to_class(struct buffer *buff, enum CLASS *class);
 uint32_t buff_to_int32(struct buffer *buff);
 uint16_t buff_to_rdlength(struct buffer *buff);
-char * print_rdata(struct buffer *buff, enum TYPE type, enum CLASS class, uint16_t rdlength);
+void print_rdata(struct buffer *buff, size_t len, enum TYPE type, uint16_t rdlength);
 
 char hex_to_char(uint8_t hex);
 size_t namelen(const char *name);
@@ -118,7 +225,9 @@ uint16_t pointer_to_offset(const char *bytes);
 
 extern inline void print_input_error(char *program_name)
 {
-    fprintf(stderr, "Usage: %s [-r] [-x] [-6] -s server [-p port] address\n", program_name);
+    fprintf(stderr, "Usage: %s [-r] [-x] [-6] [-j count] [-k count] [-v] [-H budget] [-R count[/budget]] [-S] [-d ms]\n"
+                    "    [-o overrides] [-b blocklist [-B]] [-F rules] [-i] [-t type[,type...] [-T]] [-z file] -s server[,server...] [-p port] (-f file | address)\n"
+                    "       %s -l [address:]port -a zone [-a zone...] [-c socket] [-L rate[/slip]] [-v]\n", program_name, program_name);
 }
 
 extern inline bool isPointer(uint8_t c)
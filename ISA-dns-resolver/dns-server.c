@@ -0,0 +1,508 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "dns-server.h"
+#include "dns-message.h"
+#include "dns-engine.h"
+#include "dns-update.h"
+
+#define HEADER_SIZE 12
+#define TYPE_OPT 41
+/* OPT record of a reply: root name, type, payload size, extended rcode and flags, no options */
+#define OPT_SIZE 11
+
+static inline uint16_t read_u16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline void write_u16(uint8_t *p, uint16_t value)
+{
+    p[0] = value >> 8;
+    p[1] = value & 0xff;
+}
+
+int server_init(struct server *s, const char *address)
+{
+    char host[64];
+    const char *port = address, *colon = strrchr(address, ':');
+    int32_t buffer = SERVER_SOCKET_BUFFER, on = 1;
+    char *end;
+    long number;
+
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+    admin_init(&s->admin, server_admin, s);
+    s->addr.sin_family = AF_INET;
+    s->addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (colon) {
+        if ((size_t)(colon - address) >= sizeof(host)) {
+            fprintf(stderr, "Invalid address to listen on %s\n", address);
+            return -1;
+        }
+        memcpy(host, address, colon - address);
+        host[colon - address] = '\0';
+        if (inet_pton(AF_INET, host, &s->addr.sin_addr) != 1) {
+            fprintf(stderr, "Invalid address to listen on %s\n", address);
+            return -1;
+        }
+        port = colon + 1;
+    }
+    number = strtol(port, &end, 10);
+    if (*port == '\0' || *end != '\0' || number <= 0 || number > UINT16_MAX) {
+        fprintf(stderr, "Invalid port to listen on %s\n", address);
+        return -1;
+    }
+    s->addr.sin_port = htons(number);
+
+    s->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s->fd == -1 || bind(s->fd, (struct sockaddr *)&s->addr, sizeof(s->addr)) == -1) {
+        fprintf(stderr, "Couldn't listen on %s:\n%d %s\n", address, errno, strerror(errno));
+        if (s->fd != -1)
+            close(s->fd);
+        s->fd = -1;
+        return -1;
+    }
+    setsockopt(s->fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+    /* Time of arrival of each query, to tell how long it waited */
+    setsockopt(s->fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+    if (rate_limit_init(&s->limit, SERVER_FAIR_RATE, 0, false) == -1) {
+        close(s->fd);
+        s->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int server_set_limit(struct server *s, uint32_t rate, uint32_t slip)
+{
+    if (rate == 0)
+        return rate_limit_set(&s->limit, SERVER_FAIR_RATE, 0, false);
+    return rate_limit_set(&s->limit, rate, slip, true);
+}
+
+void server_free(struct server *s)
+{
+    uint32_t i;
+
+    for (i = 0; i < s->zones_count; i++)
+        zone_unload(&s->zones[i]);
+    if (s->fd != -1)
+        close(s->fd);
+    admin_free(&s->admin);
+    rate_limit_free(&s->limit);
+    s->zones_count = 0;
+    s->fd = -1;
+}
+
+static int source_stat(struct zone_source *src, const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) == -1) {
+        fprintf(stderr, "Couldn't open %s:\n%d %s\n", path, errno, strerror(errno));
+        return -1;
+    }
+    src->path = path;
+    src->dev = st.st_dev;
+    src->ino = st.st_ino;
+    src->size = st.st_size;
+    src->mtime = st.st_mtim;
+    return 0;
+}
+
+static inline bool source_same(const struct zone_source *a, const struct zone_source *b)
+{
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size && a->mtime.tv_sec == b->mtime.tv_sec &&
+           a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+/* Index of another zone of zones with the same apex as zones[at], -1 if none */
+static int32_t same_apex(const struct zone *zones, uint32_t count, uint32_t at)
+{
+    const struct zone_header *header = zones[at].header;
+    uint32_t i;
+
+    for (i = 0; i < count; i++) {
+        if (i != at && name_equal(zones[i].header->apex, zones[i].header->apex_len, header->apex, header->apex_len))
+            return i;
+    }
+    return -1;
+}
+
+int server_add_zone(struct server *s, const char *path)
+{
+    uint32_t at = s->zones_count;
+
+    if (at == SERVER_ZONES_MAX) {
+        fprintf(stderr, "At most %d zones can be served\n", SERVER_ZONES_MAX);
+        return -1;
+    }
+    if (source_stat(&s->sources[at], path) == -1 || zone_load(&s->zones[at], path) == -1)
+        return -1;
+    if (same_apex(s->zones, at, at) != -1) {
+        fprintf(stderr, "Zone of %s is served already\n", path);
+        zone_unload(&s->zones[at]);
+        return -1;
+    }
+    s->zones_count++;
+    return 0;
+}
+
+int server_reload(struct server *s, char *message, size_t size)
+{
+    struct zone zones[SERVER_ZONES_MAX];
+    struct zone_source sources[SERVER_ZONES_MAX];
+    bool fresh[SERVER_ZONES_MAX] = { false };
+    uint32_t i, loaded = 0;
+    int32_t other;
+
+    /* The new set is put together aside, the zones which didn't change are shared with it */
+    memcpy(zones, s->zones, s->zones_count * sizeof(struct zone));
+    for (i = 0; i < s->zones_count; i++) {
+        if (source_stat(&sources[i], s->sources[i].path) == -1)
+            goto failed;
+        if (source_same(&sources[i], &s->sources[i]))
+            continue;
+        if (zone_load(&zones[i], sources[i].path) == -1)
+            goto failed;
+        fresh[i] = true;
+        loaded++;
+    }
+    for (i = 0; i < s->zones_count; i++) {
+        if (fresh[i] && (other = same_apex(zones, s->zones_count, i)) != -1) {
+            fprintf(stderr, "Zone of %s is served from %s already\n", sources[i].path, sources[other].path);
+            goto failed;
+        }
+    }
+
+    /* Questions are answered from the new zones from here on */
+    for (i = 0; i < s->zones_count; i++) {
+        if (!fresh[i])
+            continue;
+        zone_unload(&s->zones[i]);
+        s->zones[i] = zones[i];
+        s->sources[i] = sources[i];
+    }
+    snprintf(message, size, "%u zones reloaded, %u unchanged", loaded, s->zones_count - loaded);
+    return 0;
+
+failed:
+    for (i = 0; i < s->zones_count; i++) {
+        if (fresh[i])
+            zone_unload(&zones[i]);
+    }
+    snprintf(message, size, "zones kept as they were, a file didn't load");
+    return -1;
+}
+
+/* Zone with the longest apex the name falls into, NULL if none */
+static const struct zone * find_zone(const struct server *s, const uint8_t *name, size_t len)
+{
+    const struct zone *best = NULL;
+    uint32_t i;
+
+    for (i = 0; i < s->zones_count; i++) {
+        const struct zone_header *h = s->zones[i].header;
+        if (name_in_zone(name, len, h->apex, h->apex_len) && (!best || h->apex_len > best->header->apex_len))
+            best = &s->zones[i];
+    }
+    return best;
+}
+
+/* Applies the update of the message, returns the rcode of the reply */
+static int server_update(struct server *s, const struct sockaddr_in *from, const uint8_t *msg, size_t len)
+{
+    struct update u;
+    uint32_t rebuilt;
+    int rcode;
+
+    if ((ntohl(from->sin_addr.s_addr) >> 24) != 127)
+        rcode = RCODE_REFUSED;
+    else if ((rcode = update_parse(&u, msg, len, s->zones, s->zones_count)) == RCODE_NOERROR) {
+        rcode = zone_update(u.zone, u.changes, u.count, &rebuilt);
+        update_free(&u);
+    }
+    if (rcode == RCODE_NOERROR)
+        s->updates++;
+    else
+        s->updates_failed++;
+    return rcode;
+}
+
+size_t server_answer(struct server *s, const struct sockaddr_in *from, const uint8_t *query, size_t len,
+                     uint8_t *reply, size_t size)
+{
+    uint8_t qname[NAME_WIRE_MAX];
+    size_t pos = HEADER_SIZE, limit = UDP_MESSAGE_MAX, reply_len;
+    enum limit_verdict verdict;
+    const struct zone *z;
+    uint16_t qtype, qclass;
+    bool edns = false;
+    int qname_len;
+
+    s->queries++;
+    /* Replies, and messages too short to say where to send one, get nothing */
+    if (len < HEADER_SIZE || (query[2] & 0x80)) {
+        s->malformed++;
+        return 0;
+    }
+    memcpy(reply, query, HEADER_SIZE);
+    reply[2] = 0x80 | (query[2] & 0x79);
+    reply[3] = 0;
+    memset(&reply[4], 0, 8);
+
+    /* The reply to an update is just its header (RFC 2136, 3.8) */
+    if ((query[2] >> 3 & 0x0f) == OPCODE_UPDATE) {
+        reply[3] = server_update(s, from, query, len);
+        return HEADER_SIZE;
+    }
+    if ((query[2] & 0x78) != 0) {
+        reply[3] = RCODE_NOTIMP;
+        s->refused++;
+        return HEADER_SIZE;
+    }
+    if (read_u16(&query[4]) != 1 || (qname_len = name_unpack(query, len, &pos, qname)) == -1 ||
+        pos + 4 > len) {
+        reply[3] = RCODE_FORMERR;
+        s->refused++;
+        return HEADER_SIZE;
+    }
+    qtype = read_u16(&query[pos]);
+    qclass = read_u16(&query[pos + 2]);
+    pos += 4;
+
+    /* OPT right after the question says how large a reply the client takes */
+    if (read_u16(&query[6]) == 0 && read_u16(&query[8]) == 0 && read_u16(&query[10]) == 1 &&
+        pos + OPT_SIZE <= len && query[pos] == 0 && read_u16(&query[pos + 1]) == TYPE_OPT) {
+        uint16_t payload = read_u16(&query[pos + 3]);
+        edns = true;
+        limit = payload < UDP_MESSAGE_MAX ? UDP_MESSAGE_MAX : payload > SERVER_UDP_MAX ? SERVER_UDP_MAX : payload;
+    }
+    if (limit > size)
+        limit = size;
+    if (edns)
+        limit -= OPT_SIZE;
+
+    /* The question goes back with the name as the client wrote it, uncompressed */
+    write_u16(&reply[4], 1);
+    memcpy(&reply[HEADER_SIZE], qname, qname_len);
+    write_u16(&reply[HEADER_SIZE + qname_len], qtype);
+    write_u16(&reply[HEADER_SIZE + qname_len + 2], qclass);
+    reply_len = HEADER_SIZE + qname_len + 4;
+
+    verdict = rate_limit_check(&s->limit, ntohl(from->sin_addr.s_addr), s->now);
+    if (verdict == LIMIT_DROP) {
+        s->limited++;
+        return 0;
+    }
+    if (verdict == LIMIT_SLIP) {
+        reply[2] |= 0x02;
+        s->slipped++;
+    }
+    else if (verdict == LIMIT_HEAVY && s->behind == SERVER_DROPPING) {
+        s->shed_dropped++;
+        return 0;
+    }
+    else if (verdict == LIMIT_HEAVY && s->behind == SERVER_SHEDDING) {
+        reply[3] = RCODE_REFUSED;
+        s->shed++;
+    }
+    else if (qclass != CLASS_IN || qtype == TYPE_AXFR || qtype == TYPE_IXFR ||
+             !(z = find_zone(s, qname, qname_len))) {
+        reply[3] = RCODE_REFUSED;
+        s->refused++;
+    }
+    else {
+        reply_len = zone_answer(z, reply, qname_len, qtype, limit);
+        s->answered++;
+        if (reply[2] & 0x02)
+            s->truncated++;
+    }
+
+    if (edns) {
+        uint8_t *opt = &reply[reply_len];
+        opt[0] = 0;
+        write_u16(&opt[1], TYPE_OPT);
+        write_u16(&opt[3], SERVER_UDP_MAX);
+        memset(&opt[5], 0, 6);
+        reply_len += OPT_SIZE;
+        write_u16(&reply[10], read_u16(&reply[10]) + 1);
+    }
+    return reply_len;
+}
+
+/* How long the query waited in the socket, in us */
+static uint64_t batch_wait(struct server *s, struct msghdr *msg)
+{
+    struct cmsghdr *c;
+    struct timespec now;
+    int64_t wait;
+
+    for (c = CMSG_FIRSTHDR(msg); c; c = CMSG_NXTHDR(msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec arrived;
+            memcpy(&arrived, CMSG_DATA(c), sizeof(arrived));
+            /* The kernel stamps the arrival by the wall clock */
+            clock_gettime(CLOCK_REALTIME, &now);
+            wait = (int64_t)(now.tv_sec - arrived.tv_sec) * 1000000 + (now.tv_nsec - arrived.tv_nsec) / 1000;
+            if (wait < 0)
+                return 0;
+            if ((uint64_t)wait > s->longest_wait)
+                s->longest_wait = wait;
+            return wait;
+        }
+    }
+    return 0;
+}
+
+int server_receive(struct server *s)
+{
+    static uint8_t queries[SERVER_BATCH][SERVER_UDP_MAX];
+    static uint8_t replies[SERVER_BATCH][SERVER_UDP_MAX];
+    struct mmsghdr in[SERVER_BATCH], out[SERVER_BATCH];
+    struct iovec in_iov[SERVER_BATCH], out_iov[SERVER_BATCH];
+    struct sockaddr_in from[SERVER_BATCH];
+    int32_t got, i, count;
+    uint64_t wait;
+    /* Only the first query of a batch has its time of arrival read, it waited the longest */
+    union {
+        struct cmsghdr align;
+        uint8_t data[CMSG_SPACE(sizeof(struct timespec))];
+    } control;
+
+    for (;;) {
+        for (i = 0; i < SERVER_BATCH; i++) {
+            in_iov[i].iov_base = queries[i];
+            in_iov[i].iov_len = sizeof(queries[i]);
+            memset(&in[i], 0, sizeof(in[i]));
+            in[i].msg_hdr.msg_iov = &in_iov[i];
+            in[i].msg_hdr.msg_iovlen = 1;
+            in[i].msg_hdr.msg_name = &from[i];
+            in[i].msg_hdr.msg_namelen = sizeof(from[i]);
+        }
+        in[0].msg_hdr.msg_control = control.data;
+        in[0].msg_hdr.msg_controllen = sizeof(control.data);
+        got = recvmmsg(s->fd, in, SERVER_BATCH, MSG_DONTWAIT, NULL);
+        if (got == -1)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        s->now = now_ms();
+        wait = batch_wait(s, &in[0].msg_hdr);
+        s->behind = wait >= SERVER_DROP_US ? SERVER_DROPPING : wait >= SERVER_SHED_US ? SERVER_SHEDDING
+                                                                                      : SERVER_KEEPING_UP;
+
+        for (i = 0, count = 0; i < got; i++) {
+            size_t len = server_answer(s, &from[i], queries[i], in[i].msg_len, replies[count], sizeof(replies[count]));
+            if (len == 0)
+                continue;
+            out_iov[count].iov_base = replies[count];
+            out_iov[count].iov_len = len;
+            memset(&out[count], 0, sizeof(out[count]));
+            out[count].msg_hdr.msg_iov = &out_iov[count];
+            out[count].msg_hdr.msg_iovlen = 1;
+            out[count].msg_hdr.msg_name = &from[i];
+            out[count].msg_hdr.msg_namelen = in[i].msg_hdr.msg_namelen;
+            count++;
+        }
+        /* A reply which can't be sent is lost like one lost on the way, the client asks again */
+        for (i = 0; i < count; ) {
+            int32_t sent = sendmmsg(s->fd, &out[i], count - i, 0);
+            if (sent <= 0)
+                break;
+            i += sent;
+        }
+        if (got < SERVER_BATCH)
+            return 0;
+    }
+}
+
+/* Commands of the control socket other than updates, false if the text is not one of them */
+static bool admin_command(struct server *s, const char *text, char *reply, size_t size)
+{
+    char message[128], rest;
+    uint32_t rate, slip = SERVER_SLIP;
+
+    if (sscanf(text, " reload %c", &rest) == EOF) {
+        if (server_reload(s, message, sizeof(message)) == -1)
+            snprintf(reply, size, "ERROR %s\n", message);
+        else
+            snprintf(reply, size, "OK %s\n", message);
+        return true;
+    }
+    if (sscanf(text, " limit off %c", &rest) == EOF) {
+        server_set_limit(s, 0, 0);
+        snprintf(reply, size, "OK no limit\n");
+        return true;
+    }
+    if (strncmp(text + strspn(text, " \t"), "limit", 5) == 0) {
+        if ((sscanf(text, " limit %u %c", &rate, &rest) == 1 ||
+             sscanf(text, " limit %u/%u %c", &rate, &slip, &rest) == 2) && rate > 0 &&
+            server_set_limit(s, rate, slip) == 0)
+            snprintf(reply, size, "OK limit %u/%u\n", rate, slip);
+        else
+            snprintf(reply, size, "ERROR limit is \"limit rate[/slip]\" or \"limit off\"\n");
+        return true;
+    }
+    return false;
+}
+
+/* Applies the whole request of a client of the control socket, the reply is its line */
+void server_admin(void *ctx, char *text, char *reply, size_t size)
+{
+    struct server *s = ctx;
+    char error[128];
+    struct update u;
+    uint32_t rebuilt;
+    int rcode;
+
+    if (admin_command(s, text, reply, size))
+        return;
+    if (update_parse_text(&u, text, s->zones, s->zones_count, error, sizeof(error)) == -1)
+        snprintf(reply, size, "ERROR %s\n", error);
+    else {
+        if ((rcode = zone_update(u.zone, u.changes, u.count, &rebuilt)) == RCODE_NOERROR)
+            snprintf(reply, size, "OK serial %u, %u names built\n", zone_serial(u.zone), rebuilt);
+        else
+            snprintf(reply, size, "FAILED %s\n", update_rcode_name(rcode));
+        update_free(&u);
+    }
+    if (strncmp(reply, "OK", 2) == 0)
+        s->updates++;
+    else
+        s->updates_failed++;
+}
+
+void server_report(const struct server *s, FILE *out)
+{
+    uint32_t i;
+
+    for (i = 0; i < s->zones_count; i++) {
+        char text[HOSTNAME_MAX + 2];
+        name_to_text(s->zones[i].header->apex, text);
+        fprintf(out, "Zone %s: %u names, %u records, %s, serial %u, %u names updated\n", text,
+                s->zones[i].header->count, s->zones[i].header->records,
+                s->zones[i].mapped ? "mapped" : "compiled at load", zone_serial(&s->zones[i]),
+                zone_changed(&s->zones[i]));
+    }
+    fprintf(out, "Queries %llu, answered %llu, refused %llu, truncated %llu, dropped %llu\n",
+            (unsigned long long)s->queries, (unsigned long long)s->answered,
+            (unsigned long long)s->refused, (unsigned long long)s->truncated,
+            (unsigned long long)s->malformed);
+    fprintf(out, "Rate limited %llu, truncated %llu, refused while behind %llu, dropped while behind %llu, "
+            "longest wait %.1f ms\n", (unsigned long long)s->limited, (unsigned long long)s->slipped,
+            (unsigned long long)s->shed, (unsigned long long)s->shed_dropped, s->longest_wait / 1000.0);
+    fprintf(out, "Updates %llu, failed %llu\n", (unsigned long long)s->updates,
+            (unsigned long long)(s->updates_failed + s->admin.failed));
+}
@@ -0,0 +1,114 @@
+#ifndef DNS_SERVER_H
+#define DNS_SERVER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+#include <poll.h>
+#include <netinet/in.h>
+
+#include "dns-zone.h"
+#include "dns-limit.h"
+#include "dns-admin.h"
+
+/* Most zones one server serves */
+#define SERVER_ZONES_MAX 64
+/* Datagrams read and answered with one call each */
+#define SERVER_BATCH 64
+/* Largest reply over UDP to a client which says it takes more (EDNS, RFC 6891), the size
+ * which gets through without fragments on practically every path */
+#define SERVER_UDP_MAX 1232
+/* Room for bursts of queries */
+#define SERVER_SOCKET_BUFFER (8 << 20)
+/* Rate by which prefixes asking for more are told apart when nothing is limited */
+#define SERVER_FAIR_RATE 1000
+/* Every this many responses over the rate goes out truncated by default, without records,
+ * so that a real client learns it's being limited while a spoofed victim isn't flooded */
+#define SERVER_SLIP 2
+/* Queries which waited in the socket longer than this (us) mean the server can't keep up:
+ * the prefixes asking the most are refused, and if refusing them doesn't catch up, past
+ * the second limit, their queries are dropped */
+#define SERVER_SHED_US 2000
+#define SERVER_DROP_US 5000
+/* File a zone was loaded from, a reload loads only the files which changed since */
+struct zone_source {
+    const char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+};
+
+/* Authoritative server of the loaded zones over UDP. Every question is answered from the
+ * zone it falls into by zone_answer, names of no zone are refused. Zones are changed by
+ * dynamic updates (RFC 2136) from this machine, or by lines of update_parse_text over
+ * the control socket.
+ * server_set_limit limits responses to a client prefix to a rate, those over it are dropped
+ * or, every slip-th one, truncated. When queries wait in the socket longer than
+ * SERVER_SHED_US the server is behind, and the prefixes asking the most (over half their
+ * burst used) are refused right away without a lookup until it catches up, so that the
+ * queue of the rest doesn't grow. */
+struct server {
+    int32_t fd;
+    struct sockaddr_in addr;
+    struct admin admin;                 /* control socket, served by server_admin */
+    struct rate_limit limit;
+    uint64_t now;                       /* ms, when the batch was read */
+    enum { SERVER_KEEPING_UP, SERVER_SHEDDING, SERVER_DROPPING } behind;   /* with the batch */
+    struct zone zones[SERVER_ZONES_MAX];
+    struct zone_source sources[SERVER_ZONES_MAX];
+    uint32_t zones_count;
+
+    uint64_t queries;
+    uint64_t answered;                  /* NOERROR or NXDOMAIN from a zone */
+    uint64_t refused;                   /* not in any zone, or not a question */
+    uint64_t truncated;
+    uint64_t malformed;                 /* dropped without a reply */
+    uint64_t limited;                   /* over the rate, dropped */
+    uint64_t slipped;                   /* over the rate, truncated */
+    uint64_t shed;                      /* refused while behind */
+    uint64_t shed_dropped;              /* dropped while behind */
+    uint64_t longest_wait;              /* us a batch waited in the socket */
+    uint64_t updates;                   /* applied, from either socket */
+    uint64_t updates_failed;            /* refused, malformed or with prerequisites not met */
+};
+
+/* Binds the socket, address is [address:]port */
+int server_init(struct server *s, const char *address);
+void server_free(struct server *s);
+
+/* Limits responses to each client prefix to rate a second, see struct server; rate 0 lifts
+ * the limit. The buckets of the prefixes are kept whenever it changes. */
+int server_set_limit(struct server *s, uint32_t rate, uint32_t slip);
+
+/* Loads a zone file or a compiled zone (dns-compile zone) */
+int server_add_zone(struct server *s, const char *path);
+
+/* Loads again the zones whose files changed, all of them next to the ones being answered
+ * from, and swaps them in only if every one loads; changes made by updates to a zone which
+ * is loaded again are gone. The socket and the buckets of the rate limit stay. Returns -1
+ * if the zones are kept as they were, message says what happened either way. */
+int server_reload(struct server *s, char *message, size_t size);
+
+/* Reply to the query from the address in reply, at most size bytes. Returns its length,
+ * 0 if the query is dropped. Updates are taken only from loopback addresses, there's no
+ * TSIG to tell other clients apart. */
+size_t server_answer(struct server *s, const struct sockaddr_in *from, const uint8_t *query, size_t len,
+                     uint8_t *reply, size_t size);
+
+/* Answers every query waiting in the socket. Returns -1 if reading it fails. */
+int server_receive(struct server *s);
+
+/* Handler of the control socket (admin_listen on s->admin). The lines of a request are
+ * applied as one update and the reply is a line: "OK serial n, m names built", "ERROR reason"
+ * if they don't read, "FAILED rcode" if the update fails. A line "reload" instead calls
+ * server_reload, "limit rate[/slip]" or "limit off" changes the rate limit; the reply starts
+ * with OK or ERROR. */
+void server_admin(void *ctx, char *text, char *reply, size_t size);
+
+void server_report(const struct server *s, FILE *out);
+
+#endif
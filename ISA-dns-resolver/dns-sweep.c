@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <arpa/inet.h>
+
+#include "dns-sweep.h"
+
+static const uint8_t ipv4_suffix[] = "\7in-addr\4arpa";
+static const uint8_t ipv6_suffix[] = "\3ip6\4arpa";
+static const char hex[] = "0123456789abcdef";
+
+/* Wire length of a full IPv6 name, 32 nibble labels and the suffix */
+#define IPV6_LEAF_LEN (32 * 2 + sizeof(ipv6_suffix))
+
+/* Writes the changing label so that it ends where it should, returns where it begins */
+static uint16_t put_label(struct sweep_job *j, uint32_t i)
+{
+    uint16_t pos = j->ends[i];
+    uint8_t v = j->value[i];
+
+    if (j->ipv6) {
+        j->name[--pos] = hex[v];
+    }
+    else {
+        do {
+            j->name[--pos] = '0' + v % 10;
+            v /= 10;
+        } while (v);
+    }
+    j->name[pos - 1] = j->ends[i] - pos;
+    return pos - 1;
+}
+
+/* Writes labels i down to 0, each of them ends where the one after it begins now */
+static void put_labels(struct sweep_job *j, uint32_t i)
+{
+    for (;;) {
+        uint16_t start = put_label(j, i);
+        if (i == 0) {
+            j->start = start;
+            return;
+        }
+        j->ends[--i] = start;
+    }
+}
+
+/* Moves to the next name, the labels which didn't change stay as they are */
+static void advance(struct sweep_job *j)
+{
+    uint32_t i;
+
+    for (i = 0; i < j->free && j->value[i] == j->hi[i]; i++)
+        j->value[i] = j->lo[i];
+    if (i == j->free) {
+        j->done = true;
+        return;
+    }
+    j->value[i]++;
+    put_labels(j, i);
+}
+
+/* New job on top of the stack with the fixed part set, its changing labels are set up
+ * by the caller and written by start_job() */
+static struct sweep_job * push_job(struct sweep *s, bool ipv6, const uint8_t *fixed, size_t len)
+{
+    struct sweep_job *j;
+
+    if (s->count == s->size) {
+        uint32_t size = s->size ? s->size * 2 : 16;
+        struct sweep_job *jobs = realloc(s->jobs, size * sizeof(*jobs));
+        if (!jobs)
+            return NULL;
+        s->jobs = jobs;
+        s->size = size;
+    }
+    j = &s->jobs[s->count++];
+    memcpy(&j->name[SWEEP_ROOM], fixed, len);
+    j->end = SWEEP_ROOM + len;
+    j->start = SWEEP_ROOM;
+    j->ipv6 = ipv6;
+    j->done = false;
+    j->free = 0;
+    return j;
+}
+
+static void start_job(struct sweep_job *j)
+{
+    uint32_t i;
+
+    for (i = 0; i < j->free; i++)
+        j->value[i] = j->lo[i];
+    if (j->free) {
+        j->ends[j->free - 1] = SWEEP_ROOM;
+        put_labels(j, j->free - 1);
+    }
+}
+
+int sweep_init(struct sweep *s, const char *cidr)
+{
+    const char *slash = strchr(cidr, '/');
+    uint8_t addr[16], fixed[NAME_WIRE_MAX];
+    size_t len = 0;
+    char text[INET6_ADDRSTRLEN];
+    struct sweep_job *j;
+    char *end;
+    long prefix;
+    int i;
+
+    memset(s, 0, sizeof(*s));
+    if (!slash || (size_t)(slash - cidr) >= sizeof(text))
+        return -1;
+    memcpy(text, cidr, slash - cidr);
+    text[slash - cidr] = '\0';
+    prefix = strtol(slash + 1, &end, 10);
+    if (end == slash + 1 || *end != '\0' || prefix < 0)
+        return -1;
+    if (inet_pton(AF_INET, text, addr) == 1 && prefix <= 32)
+        s->ipv6 = false;
+    else if (inet_pton(AF_INET6, text, addr) == 1 && prefix <= 128)
+        s->ipv6 = true;
+    else
+        return -1;
+    snprintf(s->cidr, sizeof(s->cidr), "%s", cidr);
+
+    if (!s->ipv6) {
+        /* Octets of the prefix, least significant first, each written once */
+        int octets = prefix / 8;
+        uint8_t mask = prefix % 8 ? 0xff << (8 - prefix % 8) : 0;
+
+        if (octets == 4)
+            octets = 3;
+        for (i = octets - 1; i >= 0; i--) {
+            uint8_t v = addr[i];
+            char digits[4];
+            int n = 0;
+            do {
+                digits[n++] = '0' + v % 10;
+                v /= 10;
+            } while (v);
+            fixed[len++] = n;
+            while (n)
+                fixed[len++] = digits[--n];
+        }
+        memcpy(&fixed[len], ipv4_suffix, sizeof(ipv4_suffix));
+        len += sizeof(ipv4_suffix);
+
+        j = push_job(s, false, fixed, len);
+        if (!j)
+            return -1;
+        j->free = 4 - octets;
+        for (i = 0; i < j->free; i++) {
+            j->lo[i] = 0;
+            j->hi[i] = 255;
+        }
+        /* Host bits of a /32 are none, its one value is the octet itself */
+        if (prefix == 32)
+            mask = 0xff;
+        j->lo[j->free - 1] = addr[octets] & mask;
+        j->hi[j->free - 1] = j->lo[j->free - 1] | (uint8_t)~mask;
+    }
+    else {
+        int nibbles = prefix / 4;
+        uint8_t mask = prefix % 4 ? (0xf << (4 - prefix % 4)) & 0xf : 0;
+
+        for (i = nibbles - 1; i >= 0; i--) {
+            fixed[len++] = 1;
+            fixed[len++] = hex[i % 2 ? addr[i / 2] & 0xf : addr[i / 2] >> 4];
+        }
+        memcpy(&fixed[len], ipv6_suffix, sizeof(ipv6_suffix));
+        len += sizeof(ipv6_suffix);
+
+        j = push_job(s, true, fixed, len);
+        if (!j)
+            return -1;
+        if (nibbles < 32) {
+            uint8_t nibble = nibbles % 2 ? addr[nibbles / 2] & 0xf : addr[nibbles / 2] >> 4;
+            j->free = 1;
+            j->lo[0] = nibble & mask;
+            j->hi[0] = j->lo[0] | (~mask & 0xf);
+        }
+    }
+    start_job(j);
+    return 0;
+}
+
+void sweep_free(struct sweep *s)
+{
+    free(s->jobs);
+    s->jobs = NULL;
+    s->count = s->size = 0;
+}
+
+size_t sweep_next(struct sweep *s, uint8_t *wire)
+{
+    while (s->count > 0) {
+        struct sweep_job *j = &s->jobs[s->count - 1];
+        size_t len;
+
+        if (j->done) {
+            s->count--;
+            continue;
+        }
+        len = j->end - j->start;
+        memcpy(wire, &j->name[j->start], len);
+        /* A job without changing labels is the one name */
+        if (j->free)
+            advance(j);
+        else
+            j->done = true;
+        s->asked++;
+        return len;
+    }
+    return 0;
+}
+
+bool sweep_leaf(const struct sweep *s, const uint8_t *wire, size_t len)
+{
+    (void)wire;
+    return !s->ipv6 || len == IPV6_LEAF_LEN;
+}
+
+int sweep_descend(struct sweep *s, const uint8_t *wire, size_t len)
+{
+    struct sweep_job *j;
+
+    if (sweep_leaf(s, wire, len))
+        return 0;
+    j = push_job(s, true, wire, len);
+    if (!j)
+        return -1;
+    j->free = 1;
+    j->lo[0] = 0;
+    j->hi[0] = 15;
+    start_job(j);
+    return 0;
+}
+
+int sweep_address(const struct sweep *s, const uint8_t *wire, size_t len, char *text)
+{
+    uint8_t addr[16] = { 0 };
+    size_t pos = 0;
+    int i;
+
+    if (!sweep_leaf(s, wire, len))
+        return -1;
+    if (s->ipv6) {
+        /* Label i is nibble i from the end of the address */
+        for (i = 0; i < 32; i++, pos += 2) {
+            const char *digit = memchr(hex, wire[pos + 1], 16);
+            if (wire[pos] != 1 || !digit)
+                return -1;
+            addr[15 - i / 2] |= (digit - hex) << (i % 2 ? 4 : 0);
+        }
+        return inet_ntop(AF_INET6, addr, text, INET6_ADDRSTRLEN) ? 0 : -1;
+    }
+    for (i = 0; i < 4; i++) {
+        uint32_t v = 0, k;
+        for (k = 1; k <= wire[pos]; k++)
+            v = v * 10 + wire[pos + k] - '0';
+        addr[3 - i] = v;
+        pos += wire[pos] + 1;
+    }
+    return inet_ntop(AF_INET, addr, text, INET6_ADDRSTRLEN) ? 0 : -1;
+}
@@ -0,0 +1,66 @@
+#ifndef DNS_SWEEP_H
+#define DNS_SWEEP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "dns-names.h"
+
+/* Most labels of a name which change while sweeping, the free octets of an IPv4 block */
+#define SWEEP_MAX_FREE 4
+/* Room in front of the fixed part of a name for the labels which change */
+#define SWEEP_ROOM (SWEEP_MAX_FREE * 4)
+
+/* Reversed names of a range, counted like an odometer. The fixed part (the prefix labels
+ * and the arpa suffix) is written once, only the labels which changed are written again in
+ * front of it. Label 0 is the first one of the name, the least significant part of the
+ * address. */
+struct sweep_job {
+    uint8_t name[SWEEP_ROOM + NAME_WIRE_MAX];
+    uint16_t start;                     /* where the current name begins */
+    uint16_t end;                       /* past the fixed part */
+    uint16_t ends[SWEEP_MAX_FREE];      /* where each changing label ends */
+    uint8_t value[SWEEP_MAX_FREE], lo[SWEEP_MAX_FREE], hi[SWEEP_MAX_FREE];
+    uint8_t free;
+    bool ipv6;
+    bool done;
+};
+
+/* Sweep of a CIDR block. IPv4 blocks are swept name by name. IPv6 blocks are too large for
+ * that, they are walked nibble by nibble instead, descending only into names which exist,
+ * NXDOMAIN of a name means there is nothing below it (RFC 8020). */
+struct sweep {
+    char cidr[64];
+    bool ipv6;
+    struct sweep_job *jobs;             /* stack, names of the deepest nibbles come first */
+    uint32_t count, size;
+    uint32_t pending;                   /* lookups of the sweep in flight */
+
+    uint64_t asked, found, missing, pruned, failed;
+};
+
+/* Parses the block (address/prefix). Returns -1 if it's not one. */
+int sweep_init(struct sweep *s, const char *cidr);
+void sweep_free(struct sweep *s);
+
+/* Copies the next name into wire (NAME_WIRE_MAX bytes) and returns its length, 0 when
+ * there is no name to ask for now (more may come once the lookups in flight are done) */
+size_t sweep_next(struct sweep *s, uint8_t *wire);
+
+/* Whether the name is an address, not an IPv6 nibble on the way to one */
+bool sweep_leaf(const struct sweep *s, const uint8_t *wire, size_t len);
+
+/* The name exists, its nibbles get asked for too. Returns -1 if out of memory. */
+int sweep_descend(struct sweep *s, const uint8_t *wire, size_t len);
+
+/* Address of a leaf name, text holds INET6_ADDRSTRLEN bytes */
+int sweep_address(const struct sweep *s, const uint8_t *wire, size_t len, char *text);
+
+/* Nothing left to ask for and nothing in flight */
+static inline bool sweep_done(const struct sweep *s)
+{
+    return s->count == 0 && s->pending == 0;
+}
+
+#endif
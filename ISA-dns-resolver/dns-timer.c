@@ -0,0 +1,142 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "dns-timer.h"
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now)
+{
+    memset(w, 0, sizeof(*w));
+    w->now = now;
+}
+
+/* Slot index of a tick on a level */
+static inline uint32_t slot_of(uint64_t tick, uint32_t level)
+{
+    return (tick >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1);
+}
+
+static void insert(struct timer_wheel *w, struct timer *t)
+{
+    uint32_t level, index;
+    struct timer **slot;
+
+    /* Lowest level whose slots still reach the expiry from the current one */
+    for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+        if ((t->expires >> (level * WHEEL_BITS)) - (w->now >> (level * WHEEL_BITS)) < WHEEL_SLOTS)
+            break;
+    }
+    /* Beyond the top level, the timer waits in its last slot and moves down from there */
+    if ((t->expires >> (level * WHEEL_BITS)) - (w->now >> (level * WHEEL_BITS)) >= WHEEL_SLOTS)
+        index = slot_of(w->now, level) == 0 ? WHEEL_SLOTS - 1 : slot_of(w->now, level) - 1;
+    else
+        index = slot_of(t->expires, level);
+
+    slot = &w->slots[level][index];
+    t->prev = NULL;
+    t->next = *slot;
+    if (*slot)
+        (*slot)->prev = t;
+    *slot = t;
+    t->slot = slot;
+    w->occupied[level] |= 1ULL << index;
+}
+
+static void unlink_timer(struct timer_wheel *w, struct timer *t)
+{
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        *t->slot = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+
+    if (!*t->slot) {
+        uint32_t index = t->slot - &w->slots[0][0];
+        w->occupied[index / WHEEL_SLOTS] &= ~(1ULL << (index % WHEEL_SLOTS));
+    }
+    t->slot = NULL;
+}
+
+void timer_arm(struct timer_wheel *w, struct timer *t, uint64_t expires)
+{
+    if (t->slot)
+        unlink_timer(w, t);
+    else
+        w->count++;
+    t->expires = expires > w->now ? expires : w->now + 1;
+    insert(w, t);
+}
+
+void timer_cancel(struct timer_wheel *w, struct timer *t)
+{
+    if (!t->slot)
+        return;
+    unlink_timer(w, t);
+    w->count--;
+}
+
+/* Moves the timers of a slot one or more levels down */
+static void cascade(struct timer_wheel *w, uint32_t level)
+{
+    struct timer **slot = &w->slots[level][slot_of(w->now, level)];
+    struct timer *t;
+
+    while ((t = *slot)) {
+        unlink_timer(w, t);
+        insert(w, t);
+    }
+}
+
+void timer_wheel_advance(struct timer_wheel *w, uint64_t now)
+{
+    while (w->now < now) {
+        struct timer **slot;
+        struct timer *t;
+        uint32_t level;
+
+        /* Nothing armed, the wheel can jump right there */
+        if (w->count == 0) {
+            w->now = now;
+            break;
+        }
+
+        /* Higher levels first, their timers may move into the slot cascaded next */
+        w->now++;
+        for (level = 1; level < WHEEL_LEVELS && slot_of(w->now, level - 1) == 0; level++)
+            ;
+        while (--level > 0)
+            cascade(w, level);
+
+        /* Callbacks may arm timers again, those land at least a tick later */
+        slot = &w->slots[0][slot_of(w->now, 0)];
+        while ((t = *slot)) {
+            unlink_timer(w, t);
+            w->count--;
+            t->fire(t, w->now);
+        }
+    }
+}
+
+uint64_t timer_wheel_next(const struct timer_wheel *w)
+{
+    uint64_t next = UINT64_MAX;
+    uint32_t level;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        uint32_t shift = level * WHEEL_BITS;
+        uint32_t current = slot_of(w->now, level);
+        uint64_t bits = w->occupied[level];
+        uint64_t rotated, tick;
+        uint32_t distance;
+
+        if (!bits)
+            continue;
+        /* Slots after the current one in the order the wheel reaches them */
+        rotated = current == WHEEL_SLOTS - 1 ? bits : (bits >> (current + 1)) | (bits << (WHEEL_SLOTS - 1 - current));
+        distance = __builtin_ctzll(rotated) + 1;
+        tick = ((w->now >> shift) + distance) << shift;
+        if (tick < next)
+            next = tick;
+    }
+    return next;
+}
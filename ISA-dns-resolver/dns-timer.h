@@ -0,0 +1,60 @@
+#ifndef DNS_TIMER_H
+#define DNS_TIMER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Hierarchical timing wheel with 1 ms ticks. Every level has 64 slots, a slot of level l
+ * spans 64^l ticks, so four levels reach over 4.6 hours ahead. A timer sits in the lowest
+ * level its expiry fits into and moves down when the wheel gets to its slot, arming and
+ * cancelling is a list insert and unlink, whatever the number of timers. */
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+
+/* Struct holding the member the pointer points to */
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+struct timer;
+typedef void (*timer_fired)(struct timer *t, uint64_t now);
+
+struct timer {
+    uint64_t expires;               /* ms, monotonic */
+    struct timer *prev, *next;
+    struct timer **slot;            /* list the timer is in, NULL when not armed */
+    timer_fired fire;
+};
+
+struct timer_wheel {
+    uint64_t now;                   /* every timer up to this tick has fired */
+    uint32_t count;
+    uint64_t occupied[WHEEL_LEVELS];    /* bit per non-empty slot */
+    struct timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now);
+
+static inline void timer_init(struct timer *t, timer_fired fire)
+{
+    t->slot = NULL;
+    t->fire = fire;
+}
+
+static inline bool timer_armed(const struct timer *t)
+{
+    return t->slot != NULL;
+}
+
+/* (Re)arms the timer, expiry in the past fires on the next tick */
+void timer_arm(struct timer_wheel *w, struct timer *t, uint64_t expires);
+void timer_cancel(struct timer_wheel *w, struct timer *t);
+
+/* Fires all timers expired by now, fired timers are disarmed before their callback */
+void timer_wheel_advance(struct timer_wheel *w, uint64_t now);
+
+/* Tick the wheel has to be advanced at, either a timer expires or one moves down
+ * a level then. UINT64_MAX with no timers armed. */
+uint64_t timer_wheel_next(const struct timer_wheel *w);
+
+#endif
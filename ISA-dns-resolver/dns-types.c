@@ -0,0 +1,563 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <arpa/inet.h>
+
+#include "dns-types.h"
+#include "dns-names.h"
+
+/* Position of each type in the table, 0 is left for the types it doesn't have */
+enum {
+    RR_INDEX_UNKNOWN,
+#define X(name, number, layout, labels) RR_INDEX_##name,
+    RR_TYPES(X)
+#undef X
+    RR_INDEX_COUNT
+};
+
+#define X(name, number, layout, labels) \
+    _Static_assert(number <= RR_TYPE_MAX, "type " #name " is past RR_TYPE_MAX");
+RR_TYPES(X)
+#undef X
+
+static const struct rr_type types[RR_INDEX_COUNT] = {
+    [RR_INDEX_UNKNOWN] = { NULL, 0, "x", NULL },
+#define X(name, number, layout, labels) [RR_INDEX_##name] = { #name, number, layout, labels },
+    RR_TYPES(X)
+#undef X
+};
+
+static const uint8_t type_index[RR_TYPE_MAX + 1] = {
+#define X(name, number, layout, labels) [number] = RR_INDEX_##name,
+    RR_TYPES(X)
+#undef X
+};
+
+static const char *class_names[RR_CLASS_MAX + 1] = {
+#define X(name, number) [number] = #name,
+    RR_CLASSES(X)
+#undef X
+};
+
+/* Keys of SvcParams with names of their own (RFC 9460, 14.3.2) */
+static const char *svc_keys[] = {
+    "mandatory", "alpn", "no-default-alpn", "port", "ipv4hint", "ech", "ipv6hint",
+};
+#define SVC_KEYS (sizeof(svc_keys) / sizeof(*svc_keys))
+
+const struct rr_type * rr_type(uint16_t type)
+{
+    return &types[type <= RR_TYPE_MAX ? type_index[type] : RR_INDEX_UNKNOWN];
+}
+
+int rr_type_parse(const char *name)
+{
+    char *end;
+    unsigned long number;
+    size_t i;
+
+    for (i = 1; i < RR_INDEX_COUNT; i++) {
+        if (strcasecmp(types[i].name, name) == 0)
+            return types[i].type;
+    }
+    if (strncasecmp(name, "TYPE", 4) != 0 || !isdigit((unsigned char)name[4]))
+        return -1;
+    number = strtoul(&name[4], &end, 10);
+    return *end == '\0' && number <= UINT16_MAX ? (int)number : -1;
+}
+
+const char * rr_type_name(uint16_t type, char *text)
+{
+    const struct rr_type *t = rr_type(type);
+
+    if (t->name)
+        return t->name;
+    snprintf(text, RR_NAME_SIZE, "TYPE%u", type);
+    return text;
+}
+
+const char * rr_class_name(uint16_t class, char *text)
+{
+    if (class <= RR_CLASS_MAX && class_names[class])
+        return class_names[class];
+    snprintf(text, RR_NAME_SIZE, "CLASS%u", class);
+    return text;
+}
+
+int rr_field_size(char field, const uint8_t *p, size_t len)
+{
+    size_t size;
+
+    switch (field) {
+        case '4': size = 4; break;
+        case '6': size = 16; break;
+        case 'b': size = 1; break;
+        case 'h': size = 2; break;
+        case 'i': size = 4; break;
+        case 's':
+            if (len == 0)
+                return -1;
+            size = 1 + p[0];
+            break;
+        default:                        /* the rest of RDATA */
+            return (int)len;
+    }
+    return size <= len ? (int)size : -1;
+}
+
+static inline uint16_t get_u16(const uint8_t *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+/* Bytes of a character-string, quoted, with quotes, backslashes and unprintable bytes escaped */
+static void print_string(FILE *out, const uint8_t *p, size_t len, bool quoted)
+{
+    size_t i;
+
+    if (quoted)
+        fputc('"', out);
+    for (i = 0; i < len; i++) {
+        if (p[i] == '"' || p[i] == '\\')
+            fprintf(out, "\\%c", p[i]);
+        else if (p[i] < 0x20 || p[i] >= 0x7f || (!quoted && (p[i] == ' ' || p[i] == ',')))
+            fprintf(out, "\\%03u", p[i]);
+        else
+            fputc(p[i], out);
+    }
+    if (quoted)
+        fputc('"', out);
+}
+
+static void print_hex(FILE *out, const uint8_t *p, size_t len)
+{
+    size_t i;
+    for (i = 0; i < len; i++)
+        fprintf(out, "%02x", p[i]);
+}
+
+/* Checks the SvcParams, printing them if out is set. Returns -1 if they're malformed. */
+static int walk_params(FILE *out, const uint8_t *p, size_t len)
+{
+    char address[INET6_ADDRSTRLEN];
+    size_t pos = 0, at;
+    int32_t last = -1;
+
+    while (pos < len) {
+        uint16_t key, vlen;
+        const uint8_t *v;
+
+        if (pos + 4 > len)
+            return -1;
+        key = get_u16(&p[pos]);
+        vlen = get_u16(&p[pos + 2]);
+        v = &p[pos + 4];
+        pos += 4 + vlen;
+        /* Keys go in increasing order, the values of the known ones have their own form */
+        if (pos > len || key <= last || (key == 0 && vlen % 2) || (key == 2 && vlen) ||
+            (key == 3 && vlen != 2) || (key == 4 && (vlen == 0 || vlen % 4)) ||
+            (key == 6 && (vlen == 0 || vlen % 16)))
+            return -1;
+        for (at = 0; key == 1 && at < vlen; at += 1 + v[at]) {
+            if (at + 1 + v[at] > vlen)
+                return -1;
+        }
+        last = key;
+        if (!out)
+            continue;
+
+        fputc(' ', out);
+        if (key < SVC_KEYS && key != 5)
+            fprintf(out, "%s", svc_keys[key]);
+        else
+            fprintf(out, "key%u", key);
+        if (key == 2)
+            continue;
+        fputc('=', out);
+        for (at = 0; at < vlen; ) {
+            if (at > 0)
+                fputc(',', out);
+            switch (key) {
+                case 0:
+                    if (get_u16(&v[at]) < SVC_KEYS && get_u16(&v[at]) != 5)
+                        fprintf(out, "%s", svc_keys[get_u16(&v[at])]);
+                    else
+                        fprintf(out, "key%u", get_u16(&v[at]));
+                    at += 2;
+                    break;
+                case 1:
+                    print_string(out, &v[at + 1], v[at], false);
+                    at += 1 + v[at];
+                    break;
+                case 3:
+                    fprintf(out, "%u", get_u16(v));
+                    at += 2;
+                    break;
+                case 4:
+                case 6:
+                    inet_ntop(key == 4 ? AF_INET : AF_INET6, &v[at], address, sizeof(address));
+                    fprintf(out, "%s", address);
+                    at += key == 4 ? 4 : 16;
+                    break;
+                default:
+                    print_string(out, v, vlen, true);
+                    at = vlen;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Goes through RDATA by the layout of its type, printing the fields if out is set.
+ * Returns -1 if RDATA doesn't match the layout. */
+static int walk_rdata(FILE *out, const struct rr_type *t, const char *labels, const uint8_t *msg,
+                      size_t len, size_t pos, size_t end)
+{
+    const char *f;
+    uint8_t wire[NAME_WIRE_MAX];
+    char text[HOSTNAME_MAX + 2];
+    int size;
+
+    for (f = t->layout; *f; f++) {
+        const uint8_t *p = &msg[pos];
+
+        if (out && labels) {
+            fprintf(out, "\n\t\t%s: ", labels);
+            labels += strlen(labels) + 1;
+        }
+        else if (out && f != t->layout && *f != 'p')
+            fputc(' ', out);
+
+        if (*f == 'n' || *f == 'N') {
+            if (pos >= end || name_unpack(msg, len, &pos, wire) == -1 || pos > end)
+                return -1;
+            if (out) {
+                name_to_text(wire, text);
+                fprintf(out, "%s", text);
+            }
+            continue;
+        }
+        if ((size = rr_field_size(*f, p, end - pos)) == -1)
+            return -1;
+        if (*f == 'S' && size == 0)
+            return -1;
+        if (*f == 'S') {
+            /* The strings have to end right at the end of RDATA */
+            int at = 0;
+            while (at < size)
+                at += 1 + p[at];
+            if (at != size)
+                return -1;
+        }
+        if (*f == 'p' && walk_params(out, p, size) == -1)
+            return -1;
+        pos += size;
+        if (!out)
+            continue;
+
+        switch (*f) {
+            case '4':
+            case '6':
+                inet_ntop(*f == '4' ? AF_INET : AF_INET6, p, text, sizeof(text));
+                fprintf(out, "%s", text);
+                break;
+            case 'b': fprintf(out, "%u", p[0]); break;
+            case 'h': fprintf(out, "%u", get_u16(p)); break;
+            case 'i': fprintf(out, "%u", (uint32_t)get_u16(p) << 16 | get_u16(p + 2)); break;
+            case 's': print_string(out, p + 1, p[0], true); break;
+            case 't': print_string(out, p, size, true); break;
+            case 'x': print_hex(out, p, size); break;
+            case 'S': {
+                int at;
+                for (at = 0; at < size; at += 1 + p[at]) {
+                    if (at > 0)
+                        fputc(' ', out);
+                    print_string(out, &p[at + 1], p[at], true);
+                }
+                break;
+            }
+        }
+    }
+    return pos == end ? 0 : -1;
+}
+
+void rr_rdata_print(FILE *out, const uint8_t *msg, size_t len, size_t pos, uint16_t rdlength,
+                    uint16_t type, bool labelled)
+{
+    const struct rr_type *t = rr_type(type);
+
+    if (pos + rdlength > len)
+        return;
+    if (t->name && walk_rdata(NULL, t, NULL, msg, len, pos, pos + rdlength) == 0) {
+        walk_rdata(out, t, labelled ? t->labels : NULL, msg, len, pos, pos + rdlength);
+        return;
+    }
+    fprintf(out, "\\# %u%s", rdlength, rdlength ? " " : "");
+    print_hex(out, &msg[pos], rdlength);
+}
+
+/* Reads the next field of presentation format into tok, with quotes taken off and escapes
+ * resolved. Returns the position after it, NULL when there is no field left or it's too
+ * long. */
+static const char * next_field(const char *p, uint8_t *tok, size_t size, size_t *len)
+{
+    bool quoted = false;
+
+    *len = 0;
+    while (isspace((unsigned char)*p))
+        p++;
+    if (*p == '\0')
+        return NULL;
+    while (*p != '\0' && (quoted || !isspace((unsigned char)*p))) {
+        uint8_t c = *p++;
+
+        if (c == '"') {
+            quoted = !quoted;
+            continue;
+        }
+        if (c == '\\') {
+            if (isdigit((unsigned char)p[0]) && isdigit((unsigned char)p[1]) && isdigit((unsigned char)p[2])) {
+                unsigned value = (p[0] - '0') * 100 + (p[1] - '0') * 10 + (p[2] - '0');
+                if (value > 255)
+                    return NULL;
+                c = value;
+                p += 3;
+            }
+            else if (*p != '\0')
+                c = *p++;
+        }
+        if (*len == size)
+            return NULL;
+        tok[(*len)++] = c;
+    }
+    return quoted ? NULL : p;
+}
+
+static int parse_number(const uint8_t *tok, size_t len, uint32_t max, uint32_t *value)
+{
+    char text[16];
+    char *end;
+    unsigned long v;
+
+    if (len == 0 || len >= sizeof(text) || !isdigit(tok[0]))
+        return -1;
+    memcpy(text, tok, len);
+    text[len] = '\0';
+    v = strtoul(text, &end, 10);
+    if (*end != '\0' || v > max)
+        return -1;
+    *value = v;
+    return 0;
+}
+
+static int parse_hex(const uint8_t *tok, size_t len, uint8_t *out, size_t size)
+{
+    size_t i;
+
+    if (len % 2 || len / 2 > size)
+        return -1;
+    for (i = 0; i < len; i += 2) {
+        char byte[3] = { tok[i], tok[i + 1], '\0' };
+        if (!isxdigit(tok[i]) || !isxdigit(tok[i + 1]))
+            return -1;
+        out[i / 2] = strtoul(byte, NULL, 16);
+    }
+    return (int)(len / 2);
+}
+
+static inline void put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+static int svc_key(const uint8_t *tok, size_t len)
+{
+    uint32_t key;
+    size_t i;
+
+    for (i = 0; i < SVC_KEYS; i++) {
+        if (i != 5 && strlen(svc_keys[i]) == len && memcmp(svc_keys[i], tok, len) == 0)
+            return i;
+    }
+    if (len > 3 && memcmp(tok, "key", 3) == 0 && parse_number(tok + 3, len - 3, UINT16_MAX, &key) == 0)
+        return key;
+    return -1;
+}
+
+/* One SvcParam given as key=value, comma separated lists of values are split here */
+static int encode_param(const uint8_t *tok, size_t len, uint8_t *out, size_t size)
+{
+    const uint8_t *eq = memchr(tok, '=', len);
+    const uint8_t *v = eq ? eq + 1 : tok + len;
+    size_t vlen = tok + len - v, at = 0, out_len = 4;
+    int key = svc_key(tok, eq ? (size_t)(eq - tok) : len);
+
+    if (key == -1 || size < 4 || (key == 2) != (eq == NULL))
+        return -1;
+    put_u16(out, key);
+    while (at < vlen || (key > 6 && at == 0 && vlen == 0)) {
+        const uint8_t *comma = key == 1 || key == 0 || key == 4 || key == 6 ? memchr(&v[at], ',', vlen - at) : NULL;
+        size_t item = comma ? (size_t)(comma - &v[at]) : vlen - at;
+        char text[INET6_ADDRSTRLEN];
+        uint32_t number;
+        int k;
+
+        switch (key) {
+            case 0:
+                if ((k = svc_key(&v[at], item)) == -1 || out_len + 2 > size)
+                    return -1;
+                put_u16(&out[out_len], k);
+                out_len += 2;
+                break;
+            case 1:
+                if (item == 0 || item > 255 || out_len + 1 + item > size)
+                    return -1;
+                out[out_len] = item;
+                memcpy(&out[out_len + 1], &v[at], item);
+                out_len += 1 + item;
+                break;
+            case 3:
+                if (parse_number(&v[at], item, UINT16_MAX, &number) == -1 || out_len + 2 > size)
+                    return -1;
+                put_u16(&out[out_len], number);
+                out_len += 2;
+                break;
+            case 4:
+            case 6:
+                if (item >= sizeof(text) || out_len + (key == 4 ? 4 : 16) > size)
+                    return -1;
+                memcpy(text, &v[at], item);
+                text[item] = '\0';
+                if (inet_pton(key == 4 ? AF_INET : AF_INET6, text, &out[out_len]) != 1)
+                    return -1;
+                out_len += key == 4 ? 4 : 16;
+                break;
+            default:
+                if (out_len + item > size)
+                    return -1;
+                memcpy(&out[out_len], &v[at], item);
+                out_len += item;
+        }
+        at += item + (comma ? 1 : 0);
+        if (key > 6 || key == 3)
+            break;
+    }
+    put_u16(&out[2], out_len - 4);
+    return (int)out_len;
+}
+
+int rr_rdata_encode(uint16_t type, const char *text, const uint8_t *origin, size_t origin_len,
+                    uint8_t *out, size_t size)
+{
+    const struct rr_type *t = rr_type(type);
+    uint8_t tok[1024];
+    size_t len, out_len = 0;
+    const char *f, *p;
+    int ret;
+
+    /* Generic format, \# length and the bytes in hex */
+    p = next_field(text, tok, sizeof(tok), &len);
+    if (p && len == 1 && tok[0] == '#' && text[strspn(text, " \t")] == '\\') {
+        uint32_t rdlength;
+
+        if (!(p = next_field(p, tok, sizeof(tok), &len)) || parse_number(tok, len, UINT16_MAX, &rdlength) == -1)
+            return -1;
+        while ((p = next_field(p, tok, sizeof(tok), &len))) {
+            if ((ret = parse_hex(tok, len, &out[out_len], size - out_len)) == -1)
+                return -1;
+            out_len += ret;
+        }
+        return out_len == rdlength ? (int)out_len : -1;
+    }
+    if (!t->name)
+        return -1;
+
+    p = text;
+    for (f = t->layout; *f; f++) {
+        uint8_t *o = &out[out_len];
+        size_t room = size - out_len;
+        uint32_t number;
+
+        /* Fields up to the end take whatever is left, there may be nothing for them */
+        if (!(p = next_field(p, tok, sizeof(tok) - 1, &len))) {
+            if (*f == 'x' || *f == 'p' || *f == 't')
+                break;
+            return -1;
+        }
+        switch (*f) {
+            case 'n':
+            case 'N':
+                tok[len] = '\0';
+                if (room < NAME_WIRE_MAX || (ret = name_encode_origin((char *)tok, origin, origin_len, o, false)) == -1)
+                    return -1;
+                out_len += ret;
+                break;
+            case '4':
+            case '6':
+                tok[len] = '\0';
+                if (room < (*f == '4' ? 4 : 16) || inet_pton(*f == '4' ? AF_INET : AF_INET6, (char *)tok, o) != 1)
+                    return -1;
+                out_len += *f == '4' ? 4 : 16;
+                break;
+            case 'b':
+            case 'h':
+            case 'i': {
+                uint32_t bytes = *f == 'b' ? 1 : *f == 'h' ? 2 : 4;
+                if (parse_number(tok, len, bytes == 4 ? UINT32_MAX : (1u << 8 * bytes) - 1, &number) == -1 ||
+                    room < bytes)
+                    return -1;
+                while (bytes-- > 0) {
+                    out[out_len++] = number >> 8 * bytes;
+                }
+                break;
+            }
+            case 's':
+            case 'S':
+                /* TXT takes every string left */
+                do {
+                    if (len > 255 || size - out_len < 1 + len)
+                        return -1;
+                    out[out_len] = len;
+                    memcpy(&out[out_len + 1], tok, len);
+                    out_len += 1 + len;
+                } while (*f == 'S' && (p = next_field(p, tok, sizeof(tok), &len)));
+                break;
+            case 't':
+                if (room < len)
+                    return -1;
+                memcpy(o, tok, len);
+                out_len += len;
+                break;
+            case 'x':
+                do {
+                    if ((ret = parse_hex(tok, len, &out[out_len], size - out_len)) == -1)
+                        return -1;
+                    out_len += ret;
+                } while ((p = next_field(p, tok, sizeof(tok), &len)));
+                break;
+            case 'p': {
+                int32_t last = -1;
+                do {
+                    /* Keys go in increasing order */
+                    if ((ret = encode_param(tok, len, &out[out_len], size - out_len)) == -1 ||
+                        get_u16(&out[out_len]) <= last)
+                        return -1;
+                    last = get_u16(&out[out_len]);
+                    out_len += ret;
+                } while ((p = next_field(p, tok, sizeof(tok), &len)));
+                break;
+            }
+        }
+        if (!p)
+            break;
+    }
+    /* Nothing may be left over */
+    if (p && next_field(p, tok, sizeof(tok), &len))
+        return -1;
+    return out_len <= UINT16_MAX ? (int)out_len : -1;
+}
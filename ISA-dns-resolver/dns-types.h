@@ -0,0 +1,107 @@
+#ifndef DNS_TYPES_H
+#define DNS_TYPES_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Every record type the resolver knows, with the layout of its RDATA, one character per field:
+ *   n  domain name             N  domain name the record points to (targets of -T)
+ *   4  IPv4 address            6  IPv6 address
+ *   b  8-bit number            h  16-bit number        i  32-bit number
+ *   s  character-string        S  character-strings up to the end
+ *   t  text up to the end      x  bytes up to the end, in hex
+ *   p  SvcParams up to the end (RFC 9460)
+ * Types with labels print each field on a line of its own, the others on one line separated
+ * by spaces. Decoding, encoding and printing of RDATA all go by this table, a new type needs
+ * just its line here. */
+#define RR_TYPES(X) \
+    X(A,       1, "4",       NULL) \
+    X(NS,      2, "N",       NULL) \
+    X(MD,      3, "n",       NULL) \
+    X(MF,      4, "n",       NULL) \
+    X(CNAME,   5, "N",       NULL) \
+    X(SOA,     6, "nniiiii", "primary server name\0responsible authority's mailbox\0serial number\0" \
+                             "refresh interval\0retry interval\0expire limit\0minimum TTL\0") \
+    X(MB,      7, "n",       NULL) \
+    X(MG,      8, "n",       NULL) \
+    X(MR,      9, "n",       NULL) \
+    X(NULL,   10, "x",       NULL) \
+    X(WKS,    11, "4bx",     NULL) \
+    X(PTR,    12, "N",       NULL) \
+    X(HINFO,  13, "ss",      "CPU\0OS\0") \
+    X(MINFO,  14, "nn",      "responsible mailbox\0errors mailbox\0") \
+    X(MX,     15, "hN",      NULL) \
+    X(TXT,    16, "S",       NULL) \
+    X(AAAA,   28, "6",       NULL) \
+    X(SRV,    33, "hhhN",    NULL) \
+    X(HTTPS,  65, "hNp",     NULL) \
+    X(IXFR,  251, "x",       NULL)       /* zone transfers, only asked for */ \
+    X(AXFR,  252, "x",       NULL) \
+    X(CAA,   257, "bst",     NULL)
+
+/* Highest type number of the table, types are looked up by an array up to it */
+#define RR_TYPE_MAX 257
+
+#define RR_CLASSES(X) \
+    X(IN, 1) \
+    X(CS, 2) \
+    X(CH, 3) \
+    X(HS, 4)
+
+#define RR_CLASS_MAX 4
+
+enum TYPE {
+#define X(name, number, layout, labels) TYPE_##name = number,
+    RR_TYPES(X)
+#undef X
+};
+
+enum CLASS {
+#define X(name, number) CLASS_##name = number,
+    RR_CLASSES(X)
+#undef X
+};
+
+struct rr_type {
+    const char *name;                   /* NULL for types the table doesn't have */
+    uint16_t type;
+    const char *layout;
+    const char *labels;                 /* each ended by \0, NULL when printed on one line */
+};
+
+/* Descriptor of a type, one indexed load. Types not in the table get one with the name
+ * NULL and RDATA handled as opaque bytes (RFC 3597). */
+const struct rr_type * rr_type(uint16_t type);
+
+/* Type by its name, case-insensitive, -1 if not known. TYPEn of RFC 3597 works for any type. */
+int rr_type_parse(const char *name);
+
+/* Name of a type or class, TYPEn or CLASSn if not known. text holds RR_NAME_SIZE bytes. */
+#define RR_NAME_SIZE 16
+const char * rr_type_name(uint16_t type, char *text);
+const char * rr_class_name(uint16_t class, char *text);
+
+/* Names in RDATA may be compressed only in the types of RFC 1035 (RFC 3597, section 4) */
+static inline bool rr_type_compressible(uint16_t type)
+{
+    return type <= TYPE_TXT;
+}
+
+/* Size of a field other than a name at the start of len bytes, -1 if it doesn't fit */
+int rr_field_size(char field, const uint8_t *p, size_t len);
+
+/* Prints RDATA at pos of the message in presentation format, labelled fields on lines of
+ * their own if asked for, otherwise all on one line as in a zone file. RDATA not matching
+ * the layout of its type is printed in the generic format (\# length hex). */
+void rr_rdata_print(FILE *out, const uint8_t *msg, size_t len, size_t pos, uint16_t rdlength,
+                    uint16_t type, bool labelled);
+
+/* Encodes RDATA given in presentation format into out, names uncompressed. Names without
+ * the trailing dot are relative to origin (wire format, NULL if all names are absolute).
+ * The generic format works for any type. Returns the RDATA length, -1 if the text is not valid. */
+int rr_rdata_encode(uint16_t type, const char *text, const uint8_t *origin, size_t origin_len,
+                    uint8_t *out, size_t size);
+
+#endif
@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "dns-update.h"
+#include "dns-message.h"
+
+#define HEADER_SIZE 12
+/* Classes of prerequisites and deletions (RFC 2136, 2.4 and 2.5) */
+#define CLASS_NONE 254
+#define CLASS_ANY 255
+#define QTYPE_ANY 255
+/* Types 128 to 255 are only asked for (RFC 6895, 3.1), none of them is a record of a zone */
+#define QTYPE_FIRST 128
+#define RDATA_MAX 65535
+
+static inline uint16_t read_u16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static int add_change(struct update *u, enum zone_op op, const uint8_t *name, size_t name_len, uint16_t type,
+                      uint32_t ttl, const uint8_t *rdata, uint16_t rdlength)
+{
+    struct zone_change *c;
+    uint8_t *copy;
+
+    if (u->count == u->cap) {
+        uint32_t cap = u->cap ? u->cap * 2 : 16;
+        struct zone_change *changes = realloc(u->changes, cap * sizeof(struct zone_change));
+        if (!changes)
+            return -1;
+        u->changes = changes;
+        u->cap = cap;
+    }
+    if (!(copy = malloc(name_len + rdlength)))
+        return -1;
+    memcpy(copy, name, name_len);
+    memcpy(copy + name_len, rdata, rdlength);
+    c = &u->changes[u->count++];
+    c->op = op;
+    c->name = copy;
+    c->name_len = name_len;
+    c->rr.type = type;
+    c->rr.ttl = ttl;
+    c->rr.rdata = copy + name_len;
+    c->rr.rdlength = rdlength;
+    return 0;
+}
+
+void update_free(struct update *u)
+{
+    uint32_t i;
+
+    for (i = 0; i < u->count; i++)
+        free((void *)u->changes[i].name);
+    free(u->changes);
+    memset(u, 0, sizeof(*u));
+}
+
+static inline bool record_type(uint16_t type)
+{
+    return type != TYPE_AXFR && type != TYPE_IXFR && (type < QTYPE_FIRST || type > QTYPE_ANY);
+}
+
+/* Prerequisite or change a record of the message stands for, -1 if none */
+static int change_op(const struct rr *rr)
+{
+    if (rr->section == SECTION_ANSWER) {
+        if (rr->ttl != 0)
+            return -1;
+        if (rr->class == CLASS_ANY && rr->rdlength == 0)
+            return rr->type == QTYPE_ANY ? ZONE_REQUIRE_NAME : ZONE_REQUIRE_RRSET;
+        if (rr->class == CLASS_NONE && rr->rdlength == 0)
+            return rr->type == QTYPE_ANY ? ZONE_REQUIRE_NO_NAME : ZONE_REQUIRE_NO_RRSET;
+        if (rr->class == CLASS_IN && record_type(rr->type))
+            return ZONE_REQUIRE_RR;
+        return -1;
+    }
+    if (rr->class == CLASS_IN && record_type(rr->type))
+        return ZONE_ADD;
+    if (rr->class == CLASS_ANY && rr->ttl == 0 && rr->rdlength == 0)
+        return rr->type == QTYPE_ANY ? ZONE_DELETE_NAME : record_type(rr->type) ? ZONE_DELETE_RRSET : -1;
+    if (rr->class == CLASS_NONE && rr->ttl == 0 && record_type(rr->type))
+        return ZONE_DELETE_RR;
+    return -1;
+}
+
+int update_parse(struct update *u, const uint8_t *msg, size_t len, struct zone *zones, uint32_t count)
+{
+    uint8_t zone[NAME_WIRE_MAX], *rdata;
+    size_t pos = HEADER_SIZE;
+    struct message m;
+    struct rr rr;
+    int zone_len, got, op, rdlength, rcode = RCODE_FORMERR;
+    uint32_t i;
+
+    memset(u, 0, sizeof(*u));
+    if (len < HEADER_SIZE || read_u16(&msg[4]) != 1 ||
+        (zone_len = name_unpack(msg, len, &pos, zone)) == -1 || pos + 4 > len ||
+        read_u16(&msg[pos]) != TYPE_SOA)
+        return RCODE_FORMERR;
+    for (i = 0; i < count; i++) {
+        if (name_equal(zones[i].header->apex, zones[i].header->apex_len, zone, zone_len))
+            u->zone = &zones[i];
+    }
+    if (!u->zone || read_u16(&msg[pos + 2]) != CLASS_IN)
+        return RCODE_NOTAUTH;
+    if (message_parse(&m, msg, len) == -1 || !(rdata = malloc(RDATA_MAX)))
+        return RCODE_FORMERR;
+
+    /* Prerequisites, then the changes; the additional section would have just TSIG */
+    while ((got = message_next(&m, &rr)) == 1 && rr.section != SECTION_ADDITIONAL) {
+        if (!name_in_zone(rr.name, rr.name_len, zone, zone_len)) {
+            rcode = RCODE_NOTZONE;
+            goto out;
+        }
+        if ((op = change_op(&rr)) == -1)
+            goto out;
+        rdlength = 0;
+        if (rr.rdlength > 0 && (rdlength = message_rdata_unpack(&m, &rr, rdata, RDATA_MAX)) == -1)
+            goto out;
+        if (add_change(u, op, rr.name, rr.name_len, rr.type, rr.ttl, rdata, rdlength) == -1) {
+            rcode = RCODE_SERVFAIL;
+            goto out;
+        }
+    }
+    if (got != -1)
+        rcode = RCODE_NOERROR;
+
+out:
+    free(rdata);
+    if (rcode != RCODE_NOERROR)
+        update_free(u);
+    return rcode;
+}
+
+static char * next_token(char **p)
+{
+    char *start;
+
+    while (**p == ' ' || **p == '\t' || **p == '\r')
+        (*p)++;
+    if (**p == '\0')
+        return NULL;
+    start = *p;
+    while (**p != '\0' && **p != ' ' && **p != '\t' && **p != '\r')
+        (*p)++;
+    if (**p != '\0')
+        *(*p)++ = '\0';
+    return start;
+}
+
+/* Zone with the longest apex the name falls into */
+static struct zone * find_zone(struct zone *zones, uint32_t count, const uint8_t *name, size_t len)
+{
+    struct zone *best = NULL;
+    uint32_t i;
+
+    for (i = 0; i < count; i++) {
+        const struct zone_header *h = zones[i].header;
+        if (name_in_zone(name, len, h->apex, h->apex_len) && (!best || h->apex_len > best->header->apex_len))
+            best = &zones[i];
+    }
+    return best;
+}
+
+/* One line of the text, the reason it doesn't read in error */
+static int parse_line(struct update *u, char *line, struct zone *zones, uint32_t count, uint8_t *rdata,
+                      const char **error)
+{
+    const struct zone *z = u->zone ? u->zone : count == 1 ? &zones[0] : NULL;
+    const uint8_t *origin = z ? z->header->apex : NULL;
+    size_t origin_len = z ? z->header->apex_len : 0;
+    uint8_t name[NAME_WIRE_MAX];
+    char *p = line, *command, *token;
+    int32_t name_len, type = 0, len = 0;
+    uint32_t ttl = 0;
+    enum zone_op op;
+
+    if (!(command = next_token(&p)) || command[0] == ';')
+        return 0;
+    if (!(token = next_token(&p))) {
+        *error = "no name";
+        return -1;
+    }
+    /* The zone itself is named in full, with the dot or without */
+    if (strcasecmp(command, "zone") == 0)
+        origin = NULL;
+    else if (!origin && token[strlen(token) - 1] != '.') {
+        *error = "relative name before the zone";
+        return -1;
+    }
+    if ((name_len = name_encode_origin(token, origin, origin_len, name, false)) == -1) {
+        *error = "invalid name";
+        return -1;
+    }
+
+    if (strcasecmp(command, "zone") == 0) {
+        if (u->zone) {
+            *error = "zone must come first, once";
+            return -1;
+        }
+        if (!(u->zone = find_zone(zones, count, name, name_len)) ||
+            !name_equal(u->zone->header->apex, u->zone->header->apex_len, name, name_len)) {
+            *error = "not a zone served";
+            return -1;
+        }
+        return 0;
+    }
+    if (!u->zone && !(u->zone = find_zone(zones, count, name, name_len))) {
+        *error = "name of no zone served";
+        return -1;
+    }
+
+    if (strcasecmp(command, "add") == 0) {
+        if (!(token = next_token(&p)) || strspn(token, "0123456789") != strlen(token)) {
+            *error = "no TTL";
+            return -1;
+        }
+        ttl = strtoul(token, NULL, 10);
+        if ((token = next_token(&p)) && strcasecmp(token, "IN") == 0)
+            token = next_token(&p);
+        op = ZONE_ADD;
+    }
+    else if (strcasecmp(command, "delete") == 0 || strcasecmp(command, "require") == 0 ||
+             strcasecmp(command, "absent") == 0) {
+        token = next_token(&p);
+        if (strcasecmp(command, "delete") == 0)
+            op = !token ? ZONE_DELETE_NAME : *p ? ZONE_DELETE_RR : ZONE_DELETE_RRSET;
+        else if (strcasecmp(command, "require") == 0)
+            op = !token ? ZONE_REQUIRE_NAME : *p ? ZONE_REQUIRE_RR : ZONE_REQUIRE_RRSET;
+        else
+            op = !token ? ZONE_REQUIRE_NO_NAME : ZONE_REQUIRE_NO_RRSET;
+    }
+    else {
+        *error = "unknown command";
+        return -1;
+    }
+
+    if (token && ((type = rr_type_parse(token)) == -1 || !record_type(type))) {
+        *error = "unknown type";
+        return -1;
+    }
+    if (op == ZONE_ADD || op == ZONE_DELETE_RR || op == ZONE_REQUIRE_RR) {
+        if (!token) {
+            *error = "no type";
+            return -1;
+        }
+        len = rr_rdata_encode(type, p, u->zone->header->apex, u->zone->header->apex_len, rdata, RDATA_MAX);
+        if (len == -1) {
+            *error = "invalid data";
+            return -1;
+        }
+    }
+    if (!name_in_zone(name, name_len, u->zone->header->apex, u->zone->header->apex_len)) {
+        *error = "name outside the zone";
+        return -1;
+    }
+    if (add_change(u, op, name, name_len, type, ttl, rdata, len) == -1) {
+        *error = "out of memory";
+        return -1;
+    }
+    return 0;
+}
+
+int update_parse_text(struct update *u, char *text, struct zone *zones, uint32_t count, char *error,
+                      size_t error_size)
+{
+    uint8_t *rdata = malloc(RDATA_MAX);
+    const char *reason = "out of memory";
+    uint32_t lineno = 0;
+    char *line, *next;
+
+    memset(u, 0, sizeof(*u));
+    for (line = text; rdata && line; line = next) {
+        if ((next = strchr(line, '\n')))
+            *next++ = '\0';
+        lineno++;
+        if (parse_line(u, line, zones, count, rdata, &reason) == -1)
+            break;
+    }
+    free(rdata);
+    if (rdata && !line) {
+        if (u->zone)
+            return 0;
+        reason = "no changes";
+    }
+    snprintf(error, error_size, "line %u: %s", lineno, reason);
+    update_free(u);
+    return -1;
+}
+
+const char * update_rcode_name(int rcode)
+{
+    static const char *names[] = {
+        "NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED",
+        "YXDOMAIN", "YXRRSET", "NXRRSET", "NOTAUTH", "NOTZONE",
+    };
+
+    return rcode >= 0 && rcode < (int)(sizeof(names) / sizeof(names[0])) ? names[rcode] : "?";
+}
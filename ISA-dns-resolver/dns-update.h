@@ -0,0 +1,41 @@
+#ifndef DNS_UPDATE_H
+#define DNS_UPDATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "dns-zone.h"
+
+/* Opcode of dynamic updates (RFC 2136) */
+#define OPCODE_UPDATE 5
+
+/* Changes of one dynamic update for zone_update, each with its name and RDATA copied */
+struct update {
+    struct zone *zone;
+    struct zone_change *changes;
+    uint32_t count, cap;
+};
+
+/* Reads an UPDATE message (RFC 2136, 2 and 3.1) into the changes of the zone it names, one
+ * of zones. The additional section is not looked at, there's no TSIG. Returns the rcode to
+ * answer with, RCODE_NOERROR if the changes are ready. */
+int update_parse(struct update *u, const uint8_t *msg, size_t len, struct zone *zones, uint32_t count);
+
+/* Reads changes given as text, one per line, names relative to the zone unless they end
+ * with a dot. Of more zones served, the zone is named first or by an absolute name.
+ *   zone name                          the zone, otherwise the one of the first name
+ *   add name ttl [IN] type rdata
+ *   delete name [type [rdata]]
+ *   require name [type [rdata]]        name in use, records of the type, exactly these records
+ *   absent name [type]                 name not in use, no records of the type
+ * Returns -1 with the reason in error if they don't read. */
+int update_parse_text(struct update *u, char *text, struct zone *zones, uint32_t count, char *error,
+                      size_t error_size);
+
+void update_free(struct update *u);
+
+/* Mnemonic of an rcode of an answer to an update */
+const char * update_rcode_name(int rcode);
+
+#endif
@@ -0,0 +1,667 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "dns-upstream.h"
+#include "dns-names.h"
+
+struct sockaddr_in * get_dest_server(char *hostname, int32_t server_port)
+{
+    /* Get the ip from the hostname */
+    struct hostent *he_server = gethostbyname(hostname);
+    if (!he_server) {
+        return NULL;
+    }
+
+    /* Default port is 53 */
+    if (!server_port) {
+        server_port = 53;
+    }
+
+    struct sockaddr_in *server = malloc(sizeof(struct sockaddr_in));
+
+    memset(server, 0, sizeof(*server)); // Initialize everything to 0
+    memcpy(&server->sin_addr, he_server->h_addr_list[0], he_server->h_length);
+    server->sin_family = AF_INET;
+    server->sin_port = htons(server_port);
+
+    return server;
+}
+
+bool upstream_match(const struct upstream *up, const struct sockaddr_in *from)
+{
+    return up->addr.sin_addr.s_addr == from->sin_addr.s_addr && up->addr.sin_port == from->sin_port;
+}
+
+struct upstream * upstream_get(struct upstream_pool *pool, const char *spec, int32_t default_port)
+{
+    char host[UPSTREAM_NAME_MAX];
+    char *colon;
+    struct sockaddr_in *addr;
+    struct upstream *up;
+    int32_t port = default_port;
+    uint32_t count = pool->count;
+
+    if (strlen(spec) >= sizeof(host)) {
+        fprintf(stderr, "Server name %s is too long\n", spec);
+        return NULL;
+    }
+    strcpy(host, spec);
+    colon = strchr(host, ':');
+    if (colon) {
+        char *end;
+        *colon = '\0';
+        port = (int32_t) strtol(colon + 1, &end, 10);
+        if (*end != '\0' || port <= 0 || port > UINT16_MAX) {
+            fprintf(stderr, "Invalid port in %s\n", spec);
+            return NULL;
+        }
+    }
+
+    addr = get_dest_server(host, port);
+    if (!addr) {
+        fprintf(stderr, "Couldn't resolve the server address %s\n", host);
+        return NULL;
+    }
+
+    up = upstream_get_addr(pool, addr->sin_addr, port);
+    free(addr);
+    /* New upstream goes by the name the user gave it */
+    if (up && pool->count != count)
+        strcpy(up->name, spec);
+    return up;
+}
+
+/* Slot of the address in the index, the port is a part of the key */
+static inline uint32_t index_slot(const struct upstream_pool *pool, const struct sockaddr_in *sa)
+{
+    uint64_t key = (uint64_t)sa->sin_addr.s_addr << 16 | sa->sin_port;
+
+    return (uint32_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) & pool->mask;
+}
+
+/* Keeps the index at most half full, upstreams are never removed from it */
+static int index_grow(struct upstream_pool *pool)
+{
+    uint32_t size = pool->index ? 2 * (pool->mask + 1) : 64, i, slot;
+    struct upstream **old = pool->index;
+    uint32_t old_size = old ? pool->mask + 1 : 0;
+
+    if (2 * (pool->count + 1) <= old_size)
+        return 0;
+    pool->index = calloc(size, sizeof(*pool->index));
+    if (!pool->index) {
+        pool->index = old;
+        return -1;
+    }
+    pool->mask = size - 1;
+    for (i = 0; i < old_size; i++) {
+        if (!old[i])
+            continue;
+        for (slot = index_slot(pool, &old[i]->addr); pool->index[slot]; slot = (slot + 1) & pool->mask)
+            ;
+        pool->index[slot] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+struct upstream * upstream_get_addr(struct upstream_pool *pool, struct in_addr addr, int32_t port)
+{
+    struct sockaddr_in sa;
+    struct upstream *up, **list;
+    uint32_t slot;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr = addr;
+    sa.sin_port = htons(port ? port : 53);
+
+    if (pool->index) {
+        for (slot = index_slot(pool, &sa); pool->index[slot]; slot = (slot + 1) & pool->mask) {
+            if (upstream_match(pool->index[slot], &sa))
+                return pool->index[slot];
+        }
+    }
+
+    if (index_grow(pool) == -1)
+        return NULL;
+    up = calloc(1, sizeof(*up));
+    list = realloc(pool->list, (pool->count + 1) * sizeof(*list));
+    if (list)
+        pool->list = list;
+    if (!up || !list) {
+        free(up);
+        return NULL;
+    }
+    up->addr = sa;
+    up->pool = pool;
+    up->window = UPSTREAM_INITIAL_WINDOW;
+    up->ssthresh = UPSTREAM_MAX_WINDOW;
+    inet_ntop(AF_INET, &addr, up->name, sizeof(up->name));
+    pool->list[pool->count++] = up;
+    for (slot = index_slot(pool, &sa); pool->index[slot]; slot = (slot + 1) & pool->mask)
+        ;
+    pool->index[slot] = up;
+    return up;
+}
+
+static void close_socket(struct upstream_pool *pool, struct upstream_socket *sock)
+{
+    struct upstream *up = sock->upstream;
+    uint32_t i;
+
+    for (i = 0; up->sockets[i] != sock; i++)
+        ;
+    up->sockets[i] = up->sockets[--up->sockets_count];
+    pool->open[sock->slot] = pool->open[--pool->open_count];
+    pool->open[sock->slot]->slot = sock->slot;
+    pool->fds[sock->slot] = pool->fds[pool->open_count];
+    close(sock->socket_desc);
+    id_space_free(&sock->ids);
+    free(sock);
+}
+
+void upstream_pool_free(struct upstream_pool *pool)
+{
+    uint32_t i;
+
+    while (pool->open_count > 0)
+        close_socket(pool, pool->open[pool->open_count - 1]);
+    for (i = 0; i < pool->count; i++)
+        free(pool->list[i]);
+    free(pool->list);
+    free(pool->index);
+    free(pool->open);
+    free(pool->fds);
+    memset(pool, 0, sizeof(*pool));
+}
+
+void upstream_pool_trim(struct upstream_pool *pool, uint64_t now)
+{
+    bool over = pool->open_count > UPSTREAM_OPEN_MAX;
+    uint32_t i;
+
+    if (over ? now == pool->trimmed : now < pool->trimmed + UPSTREAM_TRIM_INTERVAL_MS)
+        return;
+    pool->trimmed = now;
+
+    /* Going from the end, the socket moved in place of a closed one was looked at already */
+    for (i = pool->open_count; i-- > 0; ) {
+        struct upstream_socket *sock = pool->open[i];
+
+        if (sock->ids.count == 0 && now - sock->upstream->last_sent >= UPSTREAM_IDLE_MS)
+            close_socket(pool, sock);
+    }
+    for (i = pool->open_count; i-- > 0 && pool->open_count > UPSTREAM_OPEN_MAX; ) {
+        if (pool->open[i]->ids.count == 0)
+            close_socket(pool, pool->open[i]);
+    }
+}
+
+static struct upstream_socket * open_socket(struct upstream *up)
+{
+    struct upstream_pool *pool = up->pool;
+    struct upstream_socket *sock;
+    int32_t socket_desc;
+    int32_t buffer = UPSTREAM_SOCKET_BUFFER;
+
+    if (pool->open_count == pool->open_size) {
+        uint32_t size = pool->open_size ? 2 * pool->open_size : 16;
+        struct upstream_socket **open = realloc(pool->open, size * sizeof(*open));
+        struct pollfd *fds;
+
+        if (!open)
+            return NULL;
+        pool->open = open;
+        if (!(fds = realloc(pool->fds, (size + UPSTREAM_POLL_EXTRA) * sizeof(*fds))))
+            return NULL;
+        pool->fds = fds;
+        pool->open_size = size;
+    }
+
+    /* Assign a socket */
+    socket_desc = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (socket_desc == -1) {
+        fprintf(stderr, "Couldn't assign a socket:\n%d %s\n", errno, strerror(errno));
+        return NULL;
+    }
+
+    /* Replies of many queries are waited for at once, in the event loop */
+    fcntl(socket_desc, F_SETFL, fcntl(socket_desc, F_GETFL) | O_NONBLOCK);
+    setsockopt(socket_desc, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+
+    /* Use connected UDP socket method (for server checking server availability) */
+    if (connect(socket_desc, (struct sockaddr *)&up->addr, sizeof(up->addr)) == -1) {
+        fprintf(stderr, "Couldn't connect to the server %s:\n%d %s\n", up->name, errno, strerror(errno));
+        close(socket_desc);
+        return NULL;
+    }
+
+    sock = malloc(sizeof(*sock));
+    if (!sock || id_space_init(&sock->ids) == -1) {
+        free(sock);
+        close(socket_desc);
+        return NULL;
+    }
+    sock->socket_desc = socket_desc;
+    sock->upstream = up;
+    sock->slot = pool->open_count;
+    pool->fds[sock->slot].fd = socket_desc;
+    pool->fds[sock->slot].events = POLLIN;
+    pool->fds[sock->slot].revents = 0;
+    pool->open[pool->open_count++] = sock;
+    up->sockets[up->sockets_count++] = sock;
+    return sock;
+}
+
+struct upstream_socket * upstream_socket(struct upstream *up)
+{
+    struct upstream_socket *best = NULL;
+    uint32_t i;
+
+    for (i = 0; i < up->sockets_count; i++) {
+        struct upstream_socket *sock = up->sockets[i];
+        if (sock->ids.count < UPSTREAM_SOCKET_HOT)
+            return sock;
+        if (!best || sock->ids.count < best->ids.count)
+            best = sock;
+    }
+    if (up->sockets_count < UPSTREAM_MAX_SOCKETS) {
+        struct upstream_socket *sock = open_socket(up);
+        if (sock)
+            return sock;
+    }
+    /* Hot socket is still better than none */
+    return best && best->ids.count < ID_SPACE ? best : NULL;
+}
+
+static int compare_points(const void *a, const void *b)
+{
+    const struct ring_point *pa = a, *pb = b;
+
+    return pa->hash < pb->hash ? -1 : pa->hash > pb->hash;
+}
+
+/* Points of a server are hashes of its name, the ring doesn't depend on the order
+ * of the list and a server added to it takes names only from its neighbours */
+static int build_ring(struct upstream_set *set)
+{
+    uint32_t i, j;
+
+    set->ring = malloc(set->count * UPSTREAM_RING_POINTS * sizeof(*set->ring));
+    if (!set->ring)
+        return -1;
+    for (i = 0; i < set->count; i++) {
+        struct upstream *up = set->servers[i];
+        for (j = 0; j < UPSTREAM_RING_POINTS; j++) {
+            struct ring_point *point = &set->ring[i * UPSTREAM_RING_POINTS + j];
+            point->hash = name_hash(up->name, strlen(up->name), j);
+            point->upstream = up;
+        }
+    }
+    qsort(set->ring, set->count * UPSTREAM_RING_POINTS, sizeof(*set->ring), compare_points);
+    return 0;
+}
+
+int upstream_set_parse(struct upstream_pool *pool, const char *list, int32_t default_port,
+                       struct upstream_set *set)
+{
+    char *copy = strdup(list);
+    char *save = NULL, *spec;
+
+    set->servers = NULL;
+    set->count = 0;
+    set->ring = NULL;
+    if (!copy)
+        return -1;
+
+    for (spec = strtok_r(copy, ",", &save); spec; spec = strtok_r(NULL, ",", &save)) {
+        struct upstream *up = upstream_get(pool, spec, default_port);
+        struct upstream **servers;
+
+        if (!up)
+            goto fail;
+        servers = realloc(set->servers, (set->count + 1) * sizeof(*servers));
+        if (!servers)
+            goto fail;
+        set->servers = servers;
+        set->servers[set->count++] = up;
+    }
+    free(copy);
+
+    if (set->count == 0) {
+        fprintf(stderr, "Empty list of servers\n");
+        return -1;
+    }
+    if (build_ring(set) == -1)
+        goto fail;
+    return 0;
+
+fail:
+    free(copy);
+    upstream_set_free(set);
+    return -1;
+}
+
+int upstream_set_add(struct upstream_set *set, struct upstream *up)
+{
+    struct upstream **servers;
+    uint32_t i;
+
+    for (i = 0; i < set->count; i++) {
+        if (set->servers[i] == up)
+            return 0;
+    }
+    servers = realloc(set->servers, (set->count + 1) * sizeof(*servers));
+    if (!servers)
+        return -1;
+    set->servers = servers;
+    set->servers[set->count++] = up;
+    free(set->ring);
+    return build_ring(set);
+}
+
+void upstream_set_free(struct upstream_set *set)
+{
+    free(set->servers);
+    free(set->ring);
+    set->servers = NULL;
+    set->ring = NULL;
+    set->count = 0;
+}
+
+void upstream_sent(struct upstream *up, uint64_t now)
+{
+    up->inflight++;
+    up->sent++;
+    up->last_sent = now;
+}
+
+/* Bucket of a latency, the top bit of microseconds and two bits after it */
+static uint32_t latency_bucket(double rtt)
+{
+    uint32_t us = rtt > 0 ? (uint32_t)(rtt * 1000) : 0;
+    uint32_t msb, bucket;
+
+    if (us < 4)
+        return us;
+    msb = 31 - __builtin_clz(us);
+    bucket = msb * 4 + ((us >> (msb - 2)) & 3) - 4;
+    return bucket < UPSTREAM_LATENCY_BUCKETS ? bucket : UPSTREAM_LATENCY_BUCKETS - 1;
+}
+
+/* Upper bound of the bucket in ms */
+static double latency_bucket_limit(uint32_t bucket)
+{
+    uint32_t msb;
+
+    if (bucket < 4)
+        return (bucket + 1) / 1000.0;
+    msb = (bucket + 4) / 4;
+    return (double)((uint64_t)(4 + (bucket & 3) + 1) << (msb - 2)) / 1000;
+}
+
+static void latency_add(struct upstream *up, double rtt)
+{
+    uint32_t i;
+
+    if (up->latency_samples == UPSTREAM_LATENCY_DECAY) {
+        up->latency_samples = 0;
+        for (i = 0; i < UPSTREAM_LATENCY_BUCKETS; i++) {
+            up->latency[i] /= 2;
+            up->latency_samples += up->latency[i];
+        }
+    }
+    up->latency[latency_bucket(rtt)]++;
+    up->latency_samples++;
+}
+
+double upstream_latency_percentile(const struct upstream *up, double share)
+{
+    uint32_t want, seen = 0, i;
+
+    if (up->latency_samples < UPSTREAM_LATENCY_MIN_SAMPLES)
+        return 0;
+    want = (uint32_t)(share * up->latency_samples + 0.5);
+    for (i = 0; i < UPSTREAM_LATENCY_BUCKETS - 1; i++) {
+        seen += up->latency[i];
+        if (seen >= want)
+            break;
+    }
+    return latency_bucket_limit(i);
+}
+
+void upstream_replied(struct upstream *up, double rtt, bool sample)
+{
+    if (up->inflight)
+        up->inflight--;
+    up->replies++;
+    up->loss *= 1 - UPSTREAM_LOSS_WEIGHT;
+    if (up->window < up->ssthresh)
+        up->window += 1;
+    else
+        up->window += 1 / up->window;
+    if (up->window > UPSTREAM_MAX_WINDOW)
+        up->window = UPSTREAM_MAX_WINDOW;
+    if (!sample)
+        return;
+
+    latency_add(up, rtt);
+    if (up->srtt == 0) {
+        up->srtt = rtt;
+        up->rttvar = rtt / 2;
+    }
+    else {
+        up->rttvar += ((rtt > up->srtt ? rtt - up->srtt : up->srtt - rtt) - up->rttvar) / 4;
+        up->srtt += (rtt - up->srtt) / 8;
+    }
+}
+
+/* Halves the window, at most once per round trip */
+static void congested(struct upstream *up, uint64_t now)
+{
+    if (up->cuts && now - up->window_cut < up->srtt)
+        return;
+    up->ssthresh = up->window / 2 < 1 ? 1 : up->window / 2;
+    up->window = up->ssthresh;
+    up->window_cut = now;
+    up->cuts++;
+}
+
+void upstream_timed_out(struct upstream *up, uint64_t now)
+{
+    if (up->inflight)
+        up->inflight--;
+    up->timeouts++;
+    up->loss = up->loss * (1 - UPSTREAM_LOSS_WEIGHT) + UPSTREAM_LOSS_WEIGHT;
+    congested(up, now);
+}
+
+/* The query got nowhere, so it's a loss like a timeout. Such a reply comes back fast,
+ * its latency would make the server look like the best one to ask. */
+void upstream_refused(struct upstream *up, uint64_t now)
+{
+    if (up->inflight)
+        up->inflight--;
+    up->refused++;
+    up->loss = up->loss * (1 - UPSTREAM_LOSS_WEIGHT) + UPSTREAM_LOSS_WEIGHT;
+    congested(up, now);
+}
+
+bool upstream_has_room(const struct upstream *up)
+{
+    return up->inflight < (uint32_t)up->window;
+}
+
+void upstream_cancelled(struct upstream *up)
+{
+    if (up->inflight)
+        up->inflight--;
+}
+
+uint32_t upstream_rto(const struct upstream *up)
+{
+    double rto;
+
+    if (up->srtt == 0)
+        return UPSTREAM_INITIAL_RTO_MS;
+    /* A very steady server drives the deviation to almost nothing, the timer would then
+     * fire on replies only a little late and cut the window for no loss */
+    rto = up->srtt + (4 * up->rttvar > up->srtt / 4 ? 4 * up->rttvar : up->srtt / 4);
+    if (rto < UPSTREAM_MIN_RTO_MS)
+        return UPSTREAM_MIN_RTO_MS;
+    if (rto > UPSTREAM_MAX_RTO_MS)
+        return UPSTREAM_MAX_RTO_MS;
+    return (uint32_t)rto;
+}
+
+/* Expected time until a query sent now is answered. Queries already in flight are
+ * ahead in the queue, a lost query costs the retransmission timeout. Server which
+ * hasn't answered yet is taken to be as slow as its initial RTO, so that one which may
+ * be dead doesn't win over a busy one; the probes find out what it's really like. */
+static double expected_completion(const struct upstream *up)
+{
+    double srtt = up->srtt != 0 ? up->srtt : UPSTREAM_INITIAL_RTO_MS;
+
+    return srtt * (1 + up->inflight) + up->loss * upstream_rto(up);
+}
+
+static bool excluded_upstream(const struct upstream *up, struct upstream *const *exclude, uint32_t excluded)
+{
+    uint32_t i;
+
+    for (i = 0; i < excluded; i++) {
+        if (exclude[i] == up)
+            return true;
+    }
+    return false;
+}
+
+static bool candidate(const struct upstream *up, struct upstream *const *exclude, uint32_t excluded,
+                      bool windowed)
+{
+    return !excluded_upstream(up, exclude, excluded) && (!windowed || upstream_has_room(up));
+}
+
+/* The n-th server of the set which can take the query */
+static struct upstream * nth_candidate(const struct upstream_set *set, struct upstream *const *exclude,
+                                       uint32_t excluded, bool windowed, uint32_t n)
+{
+    uint32_t i;
+
+    for (i = 0; i < set->count; i++) {
+        if (!candidate(set->servers[i], exclude, excluded, windowed))
+            continue;
+        if (n-- == 0)
+            break;
+    }
+    return set->servers[i];
+}
+
+struct upstream * upstream_select(const struct upstream_set *set, struct upstream *const *exclude,
+                                  uint32_t excluded, bool windowed, uint64_t now)
+{
+    struct upstream *first, *second;
+    uint32_t candidates = 0, i, a, b;
+
+    if (set->count == 0)
+        return NULL;
+
+    for (i = 0; i < set->count; i++) {
+        if (candidate(set->servers[i], exclude, excluded, windowed))
+            candidates++;
+    }
+    if (candidates == 0) {
+        if (windowed)
+            return NULL;
+        excluded = 0;
+        candidates = set->count;
+    }
+    if (set->count == 1)
+        return set->servers[0];
+
+    /* Idle servers are probed with a real query, one never asked yet right away */
+    for (i = 0; i < set->count; i++) {
+        struct upstream *up = set->servers[i];
+        if (up->inflight == 0 && (!up->sent || now - up->last_sent >= UPSTREAM_PROBE_INTERVAL_MS) &&
+            candidate(up, exclude, excluded, windowed))
+            return up;
+    }
+
+    /* Two distinct random candidates */
+    a = random32() % candidates;
+    b = candidates > 1 ? (a + 1 + random32() % (candidates - 1)) % candidates : a;
+    first = nth_candidate(set, exclude, excluded, windowed, a);
+    second = nth_candidate(set, exclude, excluded, windowed, b);
+
+    return expected_completion(second) < expected_completion(first) ? second : first;
+}
+
+struct upstream * upstream_select_shard(const struct upstream_set *set, uint64_t hash,
+                                        struct upstream *const *exclude, uint32_t excluded,
+                                        bool windowed, uint64_t now)
+{
+    uint32_t points = set->count * UPSTREAM_RING_POINTS;
+    uint32_t low = 0, high = points, i, pass;
+    uint32_t total = 0, bound;
+
+    if (set->count == 0)
+        return NULL;
+    if (set->count == 1)
+        return !windowed || upstream_has_room(set->servers[0]) ? set->servers[0] : NULL;
+
+    /* The first point clockwise from the hash */
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (set->ring[mid].hash < hash)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    for (i = 0; i < set->count; i++)
+        total += set->servers[i]->inflight;
+    bound = (uint32_t)(UPSTREAM_SHARD_BALANCE * (total + 1) / set->count + 0.999);
+
+    /* Walk around the ring, the first pass respects the bound and loss, the second
+     * only the excluded and full servers, the last one takes the owner whatever it is */
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < points; i++) {
+            struct upstream *up = set->ring[(low + i) % points].upstream;
+            if (!candidate(up, exclude, excluded, windowed))
+                continue;
+            if (pass == 0 && (up->inflight + 1 > bound || (up->loss > UPSTREAM_SHARD_MAX_LOSS &&
+                              now - up->last_sent < UPSTREAM_PROBE_INTERVAL_MS)))
+                continue;
+            return up;
+        }
+    }
+    return windowed ? NULL : set->ring[low % points].upstream;
+}
+
+void upstream_report(const struct upstream_pool *pool, FILE *out)
+{
+    uint32_t i;
+
+    fprintf(out, "Upstreams (%u)\n", pool->count);
+    for (i = 0; i < pool->count; i++) {
+        const struct upstream *up = pool->list[i];
+        fprintf(out, "\t%s, latency %.1f ms (+-%.1f, p95 %.1f), loss %.1f%%, in flight %u, "
+                "window %.1f (cut %llu times), sockets %u, sent %llu, replies %llu, refused %llu, "
+                "timeouts %llu\n",
+                up->name, up->srtt, up->rttvar, upstream_latency_percentile(up, 0.95),
+                100 * up->loss, up->inflight, up->window, (unsigned long long)up->cuts, up->sockets_count,
+                (unsigned long long)up->sent, (unsigned long long)up->replies,
+                (unsigned long long)up->refused, (unsigned long long)up->timeouts);
+    }
+}
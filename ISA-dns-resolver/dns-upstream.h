@@ -0,0 +1,190 @@
+#ifndef DNS_UPSTREAM_H
+#define DNS_UPSTREAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <poll.h>
+#include <netinet/in.h>
+
+#include "dns-ids.h"
+
+#define UPSTREAM_NAME_MAX 64
+
+/* Retransmission timeout is computed like TCP's (RFC 6298) and kept in these bounds,
+ * before the first reply the upstream gets the initial one */
+#define UPSTREAM_INITIAL_RTO_MS 1000
+#define UPSTREAM_MIN_RTO_MS 50
+#define UPSTREAM_MAX_RTO_MS 5000
+
+/* Upstream not asked for this long gets the next query of its set whatever its score,
+ * otherwise a server penalized once would never get a chance to show it recovered */
+#define UPSTREAM_PROBE_INTERVAL_MS 2000
+
+/* Weight of a new sample in the loss rate average */
+#define UPSTREAM_LOSS_WEIGHT 0.1
+
+/* Latency histogram, buckets are a quarter of a power of two wide (microseconds), so
+ * any percentile is within 25 %. Counts are halved once there are this many samples,
+ * old samples fade out and percentiles follow changes of the server. */
+#define UPSTREAM_LATENCY_BUCKETS 96
+#define UPSTREAM_LATENCY_DECAY 1024
+/* Percentiles of fewer samples are not trusted */
+#define UPSTREAM_LATENCY_MIN_SAMPLES 16
+
+/* Socket with this many IDs in use is hot, the next query gets a new socket (and source
+ * port) with IDs of its own. Picking a free ID stays cheap and a late reply is unlikely
+ * to hit a reused ID. */
+#define UPSTREAM_SOCKET_HOT (ID_SPACE / 4)
+#define UPSTREAM_MAX_SOCKETS 64
+/* Room for bursts of replies to a socket */
+#define UPSTREAM_SOCKET_BUFFER (4 << 20)
+/* Iteration meets new nameservers all the time and each would keep its sockets until
+ * exit. Sockets no query waits on are closed once their server wasn't asked for a while,
+ * or right away when more than this many are open. */
+#define UPSTREAM_OPEN_MAX 256
+#define UPSTREAM_IDLE_MS 10000
+/* How often the open sockets are looked over when there aren't too many of them */
+#define UPSTREAM_TRIM_INTERVAL_MS 1000
+/* Descriptors of the caller polled along with the sockets, in the room after them */
+#define UPSTREAM_POLL_EXTRA 16
+
+/* Queries in flight to one upstream are limited by a congestion window. It starts
+ * small, doubles every round trip until the first loss (slow start), then grows by
+ * one query per window of replies and halves on a timeout, SERVFAIL or REFUSED
+ * (at most once per round trip, a burst of losses is one congestion event). */
+#define UPSTREAM_INITIAL_WINDOW 2
+#define UPSTREAM_MAX_WINDOW (UPSTREAM_MAX_SOCKETS * UPSTREAM_SOCKET_HOT)
+
+struct upstream;
+struct upstream_pool;
+
+/* Connected socket to an upstream */
+struct upstream_socket {
+    int32_t socket_desc;
+    struct id_space ids;
+    struct upstream *upstream;
+    uint32_t slot;                  /* position among the open sockets of the pool */
+};
+
+/* Points of every server on the hash ring of its set, more of them spread names evenly */
+#define UPSTREAM_RING_POINTS 64
+/* Sharded query skips a server with more queries in flight than this multiple of the
+ * average of its set (consistent hashing with bounded loads) */
+#define UPSTREAM_SHARD_BALANCE 1.25
+/* and a server losing more than this share of queries, unless it's due for a probe */
+#define UPSTREAM_SHARD_MAX_LOSS 0.5
+
+/* Server queries can be sent to */
+struct upstream {
+    struct sockaddr_in addr;
+    struct upstream_pool *pool;
+    char name[UPSTREAM_NAME_MAX];   /* as the user wrote it, for messages */
+    struct upstream_socket *sockets[UPSTREAM_MAX_SOCKETS];  /* opened as needed */
+    uint32_t sockets_count;
+
+    double srtt;                    /* smoothed latency in ms, 0 before the first reply */
+    double rttvar;                  /* its mean deviation */
+    double loss;                    /* average share of queries left without a reply */
+    uint32_t inflight;              /* queries sent and not answered or timed out yet */
+    uint64_t last_sent;             /* ms, monotonic */
+    uint32_t latency[UPSTREAM_LATENCY_BUCKETS];
+    uint32_t latency_samples;
+    double window;                  /* congestion window, queries */
+    double ssthresh;                /* slow start ends here */
+    uint64_t window_cut;            /* ms of the last decrease */
+    uint64_t cuts;
+
+    uint64_t sent;
+    uint64_t replies;
+    uint64_t refused;               /* SERVFAIL or REFUSED, not counted among replies */
+    uint64_t timeouts;
+};
+
+/* All upstreams known to the resolver, every server is there once no matter how many
+ * sets it belongs to, so anything learned about it is shared */
+struct upstream_pool {
+    struct upstream **list;
+    uint32_t count;
+    struct upstream **index;        /* open addressing by address and port, NULL is empty */
+    uint32_t mask;
+    struct upstream_socket **open;  /* every socket open, of all the upstreams */
+    struct pollfd *fds;             /* the same ones to poll, with UPSTREAM_POLL_EXTRA more after them */
+    uint32_t open_count;
+    uint32_t open_size;
+    uint64_t trimmed;               /* ms of the last look over them */
+};
+
+struct ring_point {
+    uint64_t hash;
+    struct upstream *upstream;
+};
+
+/* Servers one query can go to */
+struct upstream_set {
+    struct upstream **servers;
+    uint32_t count;
+    struct ring_point *ring;        /* sorted by hash, UPSTREAM_RING_POINTS per server */
+};
+
+struct sockaddr_in * get_dest_server(char *hostname, int32_t server_port);
+
+/* Finds or adds the upstream given as host[:port] */
+struct upstream * upstream_get(struct upstream_pool *pool, const char *spec, int32_t default_port);
+/* Finds or adds the upstream at the address, port 0 is the default one */
+struct upstream * upstream_get_addr(struct upstream_pool *pool, struct in_addr addr, int32_t port);
+void upstream_pool_free(struct upstream_pool *pool);
+/* Closes the sockets no query waits on which aren't worth keeping. Replies of a closed
+ * socket are lost, so it's not called while replies are being read. */
+void upstream_pool_trim(struct upstream_pool *pool, uint64_t now);
+
+/* Connected non-blocking socket of the upstream with free IDs, a new one is opened
+ * when all the open ones are hot. NULL if none can be had. */
+struct upstream_socket * upstream_socket(struct upstream *up);
+
+/* Parses a comma separated list of host[:port] */
+int upstream_set_parse(struct upstream_pool *pool, const char *list, int32_t default_port,
+                       struct upstream_set *set);
+/* Adds the upstream unless the set has it already, sets can grow while queries use them */
+int upstream_set_add(struct upstream_set *set, struct upstream *up);
+void upstream_set_free(struct upstream_set *set);
+
+/* Whether a reply came from this upstream */
+bool upstream_match(const struct upstream *up, const struct sockaddr_in *from);
+
+/* Bookkeeping of every query sent to the upstream, it ends with a reply, a refusal or a timeout.
+ * Latency of a reply to a retransmitted query is ambiguous and it is not sampled (Karn). */
+void upstream_sent(struct upstream *up, uint64_t now);
+void upstream_replied(struct upstream *up, double rtt, bool sample);
+void upstream_timed_out(struct upstream *up, uint64_t now);
+/* Reply saying the server is overloaded or refuses us, a loss rather than an answer */
+void upstream_refused(struct upstream *up, uint64_t now);
+/* Query answered by another upstream first, no longer waited for */
+void upstream_cancelled(struct upstream *up);
+
+/* Whether the congestion window allows one more query */
+bool upstream_has_room(const struct upstream *up);
+
+/* How long to wait for a reply before asking again */
+uint32_t upstream_rto(const struct upstream *up);
+
+/* Latency in ms which the given share (0 to 1) of replies came within,
+ * 0 if there aren't enough samples yet */
+double upstream_latency_percentile(const struct upstream *up, double share);
+
+/* Picks the upstream with the lowest expected completion time out of two random ones
+ * (power of two choices). Upstreams in exclude are skipped unless there is no other.
+ * When windowed, full upstreams are skipped too and NULL means all of them are full. */
+struct upstream * upstream_select(const struct upstream_set *set, struct upstream *const *exclude,
+                                  uint32_t excluded, bool windowed, uint64_t now);
+
+/* Picks the server owning the name hash on the ring of the set, so every name is asked
+ * of the same server and its cache holds a slice of the names instead of all of them.
+ * Overloaded and failing servers pass the name on to the next one on the ring. */
+struct upstream * upstream_select_shard(const struct upstream_set *set, uint64_t hash,
+                                        struct upstream *const *exclude, uint32_t excluded,
+                                        bool windowed, uint64_t now);
+
+void upstream_report(const struct upstream_pool *pool, FILE *out);
+
+#endif
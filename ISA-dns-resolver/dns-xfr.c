@@ -0,0 +1,577 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "dns-xfr.h"
+#include "dns-engine.h"
+#include "dns-ids.h"
+
+#define HEADER_SIZE 12
+#define SOA_FIXED 20
+
+static inline uint32_t read_u32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/* Serial of SOA RDATA with its names written out, the first of the numbers after them */
+static uint32_t soa_serial(const uint8_t *rdata, uint16_t rdlength)
+{
+    return rdlength >= SOA_FIXED ? read_u32(&rdata[rdlength - SOA_FIXED]) : 0;
+}
+
+/* Serial a is older than b (RFC 1982) */
+static inline bool serial_older(uint32_t a, uint32_t b)
+{
+    return (int32_t)(a - b) < 0;
+}
+
+int xfr_start(struct xfr *x, const struct sockaddr_in *server, const uint8_t *zone, size_t zone_len,
+              uint16_t type, uint32_t serial, uint32_t timeout)
+{
+    uint8_t query[2 + HEADER_SIZE + 2 * (NAME_WIRE_MAX + 4) + 10 + 2 + SOA_FIXED];
+    uint8_t soa[2 + SOA_FIXED] = { 0 };
+    struct timeval tv = { .tv_sec = timeout / 1000, .tv_usec = timeout % 1000 * 1000 };
+    struct builder b;
+    size_t sent = 0, len;
+
+    x->type = type;
+    x->serial = serial;
+    x->id = random32() & 0xffff;
+    memcpy(x->zone, zone, zone_len);
+    x->zone_len = zone_len;
+    x->full = x->current = false;
+    x->new_serial = 0;
+    x->messages = x->records = x->bytes = 0;
+    x->start = x->end = 0;
+
+    /* IXFR carries the SOA the client has in the authority section, only its serial
+     * matters, the names are the root */
+    builder_init(&b, &query[2], sizeof(query) - 2, 0);
+    if (builder_question(&b, zone, zone_len, type) == -1)
+        return -1;
+    if (type == TYPE_IXFR) {
+        soa[2] = serial >> 24;
+        soa[3] = serial >> 16;
+        soa[4] = serial >> 8;
+        soa[5] = serial;
+        builder_add(&b, SECTION_AUTHORITY, zone, zone_len, TYPE_SOA, 0, soa, sizeof(soa));
+    }
+    query[2] = x->id >> 8;
+    query[3] = x->id & 0xff;
+    query[0] = b.len >> 8;
+    query[1] = b.len & 0xff;
+    len = b.len + 2;
+
+    x->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (x->fd == -1) {
+        fprintf(stderr, "Couldn't open a socket:\n%d %s\n", errno, strerror(errno));
+        return -1;
+    }
+    setsockopt(x->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(x->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(x->fd, (const struct sockaddr *)server, sizeof(*server)) == -1) {
+        fprintf(stderr, "Couldn't connect to %s:\n%d %s\n", inet_ntoa(server->sin_addr), errno, strerror(errno));
+        xfr_close(x);
+        return -1;
+    }
+    while (sent < len) {
+        ssize_t n = send(x->fd, &query[sent], len - sent, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            fprintf(stderr, "Couldn't send the transfer request:\n%d %s\n", errno, strerror(errno));
+            xfr_close(x);
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+void xfr_close(struct xfr *x)
+{
+    if (x->fd != -1)
+        close(x->fd);
+    x->fd = -1;
+}
+
+/* Reads until the buffer has a whole message. Returns 1 with it parsed, 0 when the
+ * server closed the connection between messages, -1 on error. The message stays in the
+ * buffer only until the next call. */
+static int next_message(struct xfr *x, struct message *m)
+{
+    for (;;) {
+        size_t have = x->end - x->start;
+        ssize_t n;
+
+        if (have >= 2) {
+            size_t len = x->buf[x->start] << 8 | x->buf[x->start + 1];
+
+            if (have >= 2 + len) {
+                const uint8_t *msg = &x->buf[x->start + 2];
+
+                x->start += 2 + len;
+                x->messages++;
+                x->bytes += 2 + len;
+                if (message_parse(m, msg, len) == -1) {
+                    fprintf(stderr, "Malformed message in the transfer\n");
+                    return -1;
+                }
+                return 1;
+            }
+        }
+
+        /* Moved to the front only when a whole message might not fit after it */
+        if (sizeof(x->buf) - x->end < XFR_MESSAGE_MAX + 2) {
+            memmove(x->buf, &x->buf[x->start], have);
+            x->start = 0;
+            x->end = have;
+        }
+        n = recv(x->fd, &x->buf[x->end], sizeof(x->buf) - x->end, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            fprintf(stderr, "Couldn't read the transfer:\n%d %s\n", errno, strerror(errno));
+            return -1;
+        }
+        if (n == 0) {
+            if (have)
+                fprintf(stderr, "Transfer cut off in the middle of a message\n");
+            return have ? -1 : 0;
+        }
+        x->end += n;
+    }
+}
+
+/* Where the transfer is. IXFR can't tell deltas from the whole zone until its second record. */
+enum xfr_state {
+    XFR_FIRST,
+    XFR_SECOND,
+    XFR_ZONE,
+    XFR_DELETING,
+    XFR_ADDING,
+    XFR_DONE,
+};
+
+int xfr_run(struct xfr *x, xfr_record_fn fn, void *ctx)
+{
+    static uint8_t rdata[XFR_MESSAGE_MAX];
+    uint8_t first_name[NAME_WIRE_MAX], first_rdata[2 * NAME_WIRE_MAX + SOA_FIXED];
+    struct xfr_record first = { .name = first_name, .rdata = first_rdata };
+    enum xfr_state state = XFR_FIRST;
+    struct message m;
+    struct rr rr;
+    int ret;
+
+    while (state != XFR_DONE) {
+        ret = next_message(x, &m);
+        if (ret == 0)
+            fprintf(stderr, "Transfer ended before the final SOA\n");
+        if (ret != 1)
+            return -1;
+        if ((m.data[0] << 8 | m.data[1]) != x->id) {
+            fprintf(stderr, "Transfer message with a wrong ID\n");
+            return -1;
+        }
+        if (m.rcode != RCODE_NOERROR) {
+            fprintf(stderr, "Server refused the transfer (rcode %u)\n", m.rcode);
+            return -1;
+        }
+
+        while (state != XFR_DONE && (ret = message_next(&m, &rr)) == 1) {
+            struct xfr_record r;
+            int rdlength;
+            bool soa = rr.type == TYPE_SOA;
+            uint32_t serial;
+
+            /* TSIG and the like of the additional section are not records of the zone */
+            if (rr.section != SECTION_ANSWER)
+                continue;
+            rdlength = message_rdata_unpack(&m, &rr, rdata, sizeof(rdata));
+            if (rdlength == -1 || (soa && rdlength < SOA_FIXED)) {
+                fprintf(stderr, "Malformed record in the transfer\n");
+                return -1;
+            }
+            r = (struct xfr_record){ rr.name, rr.name_len, rr.type, rr.class, rr.ttl, rdata, rdlength };
+            serial = soa ? soa_serial(rdata, rdlength) : 0;
+            x->records++;
+
+            switch (state) {
+                case XFR_FIRST:
+                    if (!soa || !name_equal(rr.name, rr.name_len, x->zone, x->zone_len)) {
+                        fprintf(stderr, "Transfer doesn't start with the SOA of the zone\n");
+                        return -1;
+                    }
+                    x->new_serial = serial;
+                    if (x->type == TYPE_AXFR) {
+                        x->full = true;
+                        state = XFR_ZONE;
+                        if (fn(ctx, XFR_ADD, &r) == -1)
+                            return -1;
+                        break;
+                    }
+                    /* Nothing newer than what the client has, the SOA is all there is */
+                    if (!serial_older(x->serial, serial)) {
+                        x->current = true;
+                        state = XFR_DONE;
+                        break;
+                    }
+                    if (rdlength > (int)sizeof(first_rdata))
+                        return -1;
+                    memcpy(first_name, rr.name, rr.name_len);
+                    memcpy(first_rdata, rdata, rdlength);
+                    first.name_len = rr.name_len;
+                    first.type = rr.type;
+                    first.class = rr.class;
+                    first.ttl = rr.ttl;
+                    first.rdlength = rdlength;
+                    state = XFR_SECOND;
+                    break;
+                case XFR_SECOND:
+                    /* Deltas start with the SOA the client has */
+                    if (soa && serial == x->serial) {
+                        state = XFR_DELETING;
+                        if (fn(ctx, XFR_DELETE, &r) == -1)
+                            return -1;
+                        break;
+                    }
+                    x->full = true;
+                    if (fn(ctx, XFR_ADD, &first) == -1)
+                        return -1;
+                    state = soa ? XFR_DONE : XFR_ZONE;
+                    if (!soa && fn(ctx, XFR_ADD, &r) == -1)
+                        return -1;
+                    break;
+                case XFR_ZONE:
+                    if (soa)
+                        state = XFR_DONE;
+                    else if (fn(ctx, XFR_ADD, &r) == -1)
+                        return -1;
+                    break;
+                case XFR_DELETING:
+                    /* The SOA of the new version ends the deletions of a delta */
+                    if (soa)
+                        state = XFR_ADDING;
+                    if (fn(ctx, soa ? XFR_ADD : XFR_DELETE, &r) == -1)
+                        return -1;
+                    break;
+                case XFR_ADDING:
+                    /* Either the final SOA or the old one of the next delta */
+                    if (soa && serial == x->new_serial) {
+                        state = XFR_DONE;
+                        break;
+                    }
+                    if (soa)
+                        state = XFR_DELETING;
+                    if (fn(ctx, soa ? XFR_DELETE : XFR_ADD, &r) == -1)
+                        return -1;
+                    break;
+                case XFR_DONE:
+                    break;
+            }
+        }
+        if (ret == -1) {
+            fprintf(stderr, "Malformed record in the transfer\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void xfr_print_record(FILE *out, const struct xfr_record *r)
+{
+    char name[HOSTNAME_MAX + 2], type[RR_NAME_SIZE], class[RR_NAME_SIZE];
+
+    name_to_text(r->name, name);
+    fprintf(out, "%s\t%u\t%s\t%s\t", name, r->ttl, rr_class_name(r->class, class), rr_type_name(r->type, type));
+    rr_rdata_print(out, r->rdata, r->rdlength, 0, r->rdlength, r->type, false);
+    fputc('\n', out);
+}
+
+/* Lines of a zone file by the record they hold, TTLs aside: the record a delta deletes
+ * is the same whatever its TTL (RFC 1995) */
+struct line_set {
+    char **lines;
+    uint32_t count, size;
+};
+
+/* Owner, then what's after the TTL */
+static void line_parts(const char *line, size_t *owner, const char **rest)
+{
+    const char *tab = strchr(line, '\t');
+
+    *owner = tab ? (size_t)(tab - line) : strlen(line);
+    *rest = tab && strchr(tab + 1, '\t') ? strchr(tab + 1, '\t') : "";
+}
+
+static uint64_t line_hash(const char *line)
+{
+    const char *rest;
+    size_t owner;
+
+    line_parts(line, &owner, &rest);
+    return name_hash_fast(line, owner, name_hash_fast(rest, strlen(rest), 0x11fe));
+}
+
+static bool line_same(const char *a, const char *b)
+{
+    const char *a_rest, *b_rest;
+    size_t a_owner, b_owner;
+
+    line_parts(a, &a_owner, &a_rest);
+    line_parts(b, &b_owner, &b_rest);
+    return a_owner == b_owner && strncasecmp(a, b, a_owner) == 0 && strcmp(a_rest, b_rest) == 0;
+}
+
+/* Slot of the line or the empty one it would go to */
+static char ** line_slot(const struct line_set *s, const char *line)
+{
+    uint32_t i = line_hash(line) & (s->size - 1);
+
+    while (s->lines[i] && !line_same(s->lines[i], line))
+        i = (i + 1) & (s->size - 1);
+    return &s->lines[i];
+}
+
+static int line_set_add(struct line_set *s, const char *line)
+{
+    char **slot;
+
+    if (2 * (s->count + 1) > s->size) {
+        struct line_set bigger = { .size = s->size ? 2 * s->size : 64 };
+        uint32_t i;
+
+        bigger.lines = calloc(bigger.size, sizeof(char *));
+        if (!bigger.lines)
+            return -1;
+        for (i = 0; i < s->size; i++) {
+            if (s->lines[i])
+                *line_slot(&bigger, s->lines[i]) = s->lines[i];
+        }
+        free(s->lines);
+        s->lines = bigger.lines;
+        s->size = bigger.size;
+    }
+    slot = line_slot(s, line);
+    if (*slot)
+        free(*slot);
+    else
+        s->count++;
+    *slot = strdup(line);
+    return *slot ? 0 : -1;
+}
+
+/* Takes the line out, moving the ones after it in its run back so that lookups still find them */
+static bool line_set_remove(struct line_set *s, const char *line)
+{
+    char **slot;
+    uint32_t i, j;
+
+    if (!s->size || !*(slot = line_slot(s, line)))
+        return false;
+    free(*slot);
+    *slot = NULL;
+    s->count--;
+    i = slot - s->lines;
+    for (j = (i + 1) & (s->size - 1); s->lines[j]; j = (j + 1) & (s->size - 1)) {
+        char *moved = s->lines[j];
+        s->lines[j] = NULL;
+        *line_slot(s, moved) = moved;
+    }
+    return true;
+}
+
+static bool line_set_has(const struct line_set *s, const char *line)
+{
+    return s->size && *line_slot(s, line) != NULL;
+}
+
+static void line_set_free(struct line_set *s)
+{
+    uint32_t i;
+    for (i = 0; i < s->size; i++)
+        free(s->lines[i]);
+    free(s->lines);
+}
+
+struct mirror {
+    const struct xfr *x;
+    FILE *out;                          /* the new file, written as records come in a full transfer */
+    FILE *line;                         /* a record formatted as a line, for the deltas */
+    char *line_buf;
+    size_t line_size;
+    char *soa;                          /* the SOA of the newest version */
+    struct line_set deleted, added;
+    uint64_t deletions, additions;
+};
+
+static int mirror_record(void *ctx, enum xfr_op op, const struct xfr_record *r)
+{
+    struct mirror *mr = ctx;
+
+    if (op == XFR_ADD)
+        mr->additions++;
+    else
+        mr->deletions++;
+    /* Deltas are held until the end, the whole zone goes right to the file */
+    if (!mr->line || mr->x->full) {
+        xfr_print_record(mr->out, r);
+        return ferror(mr->out) ? -1 : 0;
+    }
+
+    rewind(mr->line);
+    xfr_print_record(mr->line, r);
+    fputc('\0', mr->line);
+    fflush(mr->line);
+    if (ferror(mr->line))
+        return -1;
+    mr->line_buf[strcspn(mr->line_buf, "\n")] = '\0';
+
+    if (op == XFR_ADD && r->type == TYPE_SOA) {
+        free(mr->soa);
+        if (!(mr->soa = strdup(mr->line_buf)))
+            return -1;
+    }
+    /* A record added by one delta and deleted by a later one was never in the file */
+    if (op == XFR_DELETE)
+        return line_set_remove(&mr->added, mr->line_buf) ? 0 : line_set_add(&mr->deleted, mr->line_buf);
+    return line_set_add(&mr->added, mr->line_buf);
+}
+
+/* Serial of the SOA line a zone file starts with, false if it doesn't */
+static bool file_serial(FILE *f, uint32_t *serial)
+{
+    char *line = NULL, *rest;
+    size_t size = 0, owner;
+    bool found = false;
+
+    if (getline(&line, &size, f) > 0) {
+        line_parts(line, &owner, (const char **)&rest);
+        found = strncmp(rest, "\tIN\tSOA\t", 8) == 0 && sscanf(rest + 8, "%*s %*s %u", serial) == 1;
+    }
+    free(line);
+    return found;
+}
+
+/* New file of the old one with the deltas applied */
+static int apply_deltas(struct mirror *mr, FILE *old)
+{
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    uint32_t i;
+
+    rewind(old);
+    fprintf(mr->out, "%s\n", mr->soa);
+    while ((len = getline(&line, &size, old)) > 0) {
+        if (line[len - 1] == '\n')
+            line[len - 1] = '\0';
+        if (!line_set_has(&mr->deleted, line) && strcmp(line, mr->soa) != 0)
+            fprintf(mr->out, "%s\n", line);
+    }
+    free(line);
+    for (i = 0; i < mr->added.size; i++) {
+        const char *added = mr->added.lines[i];
+        const char *rest;
+        size_t owner;
+
+        if (!added)
+            continue;
+        line_parts(added, &owner, &rest);
+        if (strncmp(rest, "\tIN\tSOA\t", 8) != 0)
+            fprintf(mr->out, "%s\n", added);
+    }
+    return ferror(mr->out) || ferror(old) ? -1 : 0;
+}
+
+int xfr_mirror(const char *path, const struct sockaddr_in *server, const uint8_t *zone,
+               size_t zone_len, uint32_t timeout)
+{
+    struct xfr *x = malloc(sizeof(*x));
+    struct mirror mr = { 0 };
+    char zone_text[HOSTNAME_MAX + 2];
+    char *tmp = malloc(strlen(path) + 5);
+    FILE *old = fopen(path, "r");
+    uint32_t serial = 0;
+    uint64_t started = now_ms();
+    int ret = -1;
+
+    name_to_text(zone, zone_text);
+    if (!x || !tmp)
+        goto out;
+    sprintf(tmp, "%s.new", path);
+
+    /* A file without its SOA first is of no use, the whole zone is asked for then */
+    if (old && !file_serial(old, &serial)) {
+        fclose(old);
+        old = NULL;
+    }
+    if (xfr_start(x, server, zone, zone_len, old ? TYPE_IXFR : TYPE_AXFR, serial, timeout) == -1)
+        goto out;
+
+    mr.x = x;
+    mr.out = fopen(tmp, "w");
+    if (!mr.out) {
+        fprintf(stderr, "Couldn't create %s:\n%d %s\n", tmp, errno, strerror(errno));
+        goto close;
+    }
+    if (old) {
+        mr.line = open_memstream(&mr.line_buf, &mr.line_size);
+        if (!mr.line)
+            goto close;
+    }
+    if (xfr_run(x, mirror_record, &mr) == -1)
+        goto close;
+
+    if (!x->full && !x->current && (!mr.soa || apply_deltas(&mr, old) == -1))
+        goto close;
+    if (fclose(mr.out) != 0) {
+        mr.out = NULL;
+        goto close;
+    }
+    mr.out = NULL;
+    if (x->current) {
+        remove(tmp);
+        fprintf(stderr, "Zone %s is current, serial %u\n", zone_text, serial);
+    }
+    else {
+        if (rename(tmp, path) == -1) {
+            fprintf(stderr, "Couldn't replace %s:\n%d %s\n", path, errno, strerror(errno));
+            goto close;
+        }
+        fprintf(stderr, "Zone %s: serial %u, %s, %llu records deleted, %llu added, %llu messages, %llu bytes, %llu ms\n",
+                zone_text, x->new_serial, x->full ? "whole zone" : "deltas applied",
+                (unsigned long long)mr.deletions, (unsigned long long)mr.additions,
+                (unsigned long long)x->messages, (unsigned long long)x->bytes,
+                (unsigned long long)(now_ms() - started));
+    }
+    ret = 0;
+
+close:
+    xfr_close(x);
+    if (mr.out) {
+        fclose(mr.out);
+        remove(tmp);
+    }
+out:
+    if (mr.line)
+        fclose(mr.line);
+    free(mr.line_buf);
+    free(mr.soa);
+    line_set_free(&mr.deleted);
+    line_set_free(&mr.added);
+    if (old)
+        fclose(old);
+    free(tmp);
+    free(x);
+    return ret;
+}
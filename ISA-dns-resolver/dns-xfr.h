@@ -0,0 +1,77 @@
+#ifndef DNS_XFR_H
+#define DNS_XFR_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+
+#include "dns-message.h"
+
+/* Messages of a TCP stream are up to 64 kB, each with two bytes of length in front.
+ * The buffer holds a whole one and whatever of the next ones came with it, it's the
+ * only memory a transfer takes whatever the size of the zone. */
+#define XFR_MESSAGE_MAX 65535
+#define XFR_BUFFER (4 * (XFR_MESSAGE_MAX + 2))
+
+enum xfr_op {
+    XFR_ADD,                            /* record of the zone, or added by a delta */
+    XFR_DELETE,                         /* record removed by a delta */
+};
+
+/* Record of the transfer with its names written out in full */
+struct xfr_record {
+    const uint8_t *name;
+    size_t name_len;
+    uint16_t type;
+    uint16_t class;
+    uint32_t ttl;
+    const uint8_t *rdata;
+    uint16_t rdlength;
+};
+
+/* Called for every record in the order they come. Returns -1 to stop the transfer. */
+typedef int (*xfr_record_fn)(void *ctx, enum xfr_op op, const struct xfr_record *r);
+
+/* Zone transfer over TCP (AXFR, RFC 5936, or IXFR, RFC 1995), parsed message by message
+ * as it arrives. IXFR deltas come out as deletions and additions, a server which sends
+ * the whole zone instead makes it a full transfer. */
+struct xfr {
+    int32_t fd;
+    uint16_t type;                      /* TYPE_AXFR or TYPE_IXFR */
+    uint16_t id;
+    uint32_t serial;                    /* IXFR, the version the client has */
+    uint8_t zone[NAME_WIRE_MAX];
+    size_t zone_len;
+
+    /* Set once the transfer is done */
+    bool full;                          /* the whole zone came, not deltas */
+    bool current;                       /* IXFR, the client's version is the latest */
+    uint32_t new_serial;
+    uint64_t messages, records, bytes;
+
+    uint8_t buf[XFR_BUFFER];
+    size_t start, end;
+};
+
+/* Connects to the server and asks for the zone, IXFR starting at the serial. timeout is
+ * how long a read may wait. Returns -1 if the server can't be reached. */
+int xfr_start(struct xfr *x, const struct sockaddr_in *server, const uint8_t *zone, size_t zone_len,
+              uint16_t type, uint32_t serial, uint32_t timeout);
+
+/* Reads the transfer to its end, passing each record to fn. Returns -1 if it fails. */
+int xfr_run(struct xfr *x, xfr_record_fn fn, void *ctx);
+void xfr_close(struct xfr *x);
+
+/* Line of a record as it goes to a zone file: owner, TTL, class, type and RDATA */
+void xfr_print_record(FILE *out, const struct xfr_record *r);
+
+/* Keeps a copy of the zone in a zone file. The first transfer is AXFR, later ones ask
+ * for the deltas since the serial of the file and rewrite it with them applied, old
+ * records streamed from the old file, only the deltas held in memory. The new file takes
+ * the place of the old one only once it's complete. */
+int xfr_mirror(const char *path, const struct sockaddr_in *server, const uint8_t *zone,
+               size_t zone_len, uint32_t timeout);
+
+#endif
@@ -0,0 +1,2448 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dns-zone.h"
+#include "dns-message.h"
+
+#define HEADER_SIZE 12
+#define QTYPE_ANY 255
+
+/* Longest entry of a zone file, lines joined by parentheses together */
+#define ZONE_LINE_MAX 65536
+/* Largest block, the records of one type of a name */
+#define BLOCK_MAX 65535
+/* Targets of one block whose addresses go to the additional section */
+#define ADDITIONAL_TARGETS 16
+/* Targets of a name noted for updates of their addresses, NS, MX and SRV together */
+#define ENTRY_TARGETS (3 * ADDITIONAL_TARGETS)
+
+/* Record of the zone file, its RDATA with names uncompressed */
+struct zone_record {
+    uint32_t name;                      /* which of the names */
+    uint16_t type;
+    uint16_t rdlength;
+    uint32_t ttl;
+    uint32_t rdata;                     /* offset in the RDATA arena */
+};
+
+struct zone_name {
+    uint32_t off;                       /* of the wire name in the arena, its key is at the same offset */
+    uint32_t len;
+};
+
+/* Name in canonical order, the same name given twice sorts next to itself */
+struct sorted_name {
+    uint64_t prefix;
+    uint32_t name;
+};
+
+/* Image, or one entry built by an update, as it grows */
+struct zone_buffer {
+    uint8_t *data;
+    size_t size, cap;
+};
+
+/* What the blocks of a name are built with: where the addresses of its targets come
+ * from, the names being compiled or a version of a served zone, and which of the
+ * targets are in the zone */
+struct block_context {
+    uint8_t *msg;                       /* message a block is built in */
+    uint16_t *positions;                /* pointers of the block */
+    const uint8_t *apex;
+    size_t apex_len;
+    void (*addresses)(void *ctx, struct builder *b, const uint8_t *name, size_t len);
+    void *ctx;
+    uint64_t targets[ENTRY_TARGETS];    /* hashes of the keys of the targets of the name */
+    uint32_t targets_count;
+};
+
+struct compile_state {
+    uint8_t *names;                     /* wire names, lowercase */
+    uint8_t *keys;                      /* canonical keys of the names */
+    size_t names_size, names_cap;
+    struct zone_name *ids;
+    uint32_t nnames, ids_cap;
+    struct zone_record *records;
+    size_t nrecords, records_cap;
+    uint8_t *rdata;
+    size_t rdata_size, rdata_cap;
+    bool has_apex;
+    uint32_t apex;                      /* name of the SOA */
+    uint32_t apex_key_len;
+
+    struct sorted_name *sorted;         /* distinct names in canonical order, by rank */
+    uint32_t count;
+    uint32_t *rank_of;                  /* of each name */
+    uint32_t *rec_start;                /* records of each rank, in rec_order */
+    uint32_t *rec_order;
+
+    struct zone_rr *rrs;                /* records of the name being built */
+    size_t rrs_cap;
+    struct zone_referrer *referrers;
+    size_t nreferrers, referrers_cap;
+
+    struct zone_buffer image;
+    struct block_context bc;
+};
+
+static inline uint16_t read_u16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline void write_u16(uint8_t *p, uint16_t value)
+{
+    p[0] = value >> 8;
+    p[1] = value & 0xff;
+}
+
+static inline size_t align4(size_t n)
+{
+    return (n + 3) & ~(size_t)3;
+}
+
+/* Canonical key of a name: labels from the root down, lowercase, each ended by a zero byte.
+ * Keys compare by memcmp in the canonical order of their names, the key of a name is
+ * a prefix of the keys of the names below it. Returns its length, one less than the name's. */
+static size_t name_key(const uint8_t *name, uint8_t *key)
+{
+    uint8_t starts[NAME_WIRE_MAX / 2 + 1];
+    size_t n = 0, pos = 0, k = 0;
+    uint8_t i;
+
+    while (name[pos] != 0) {
+        starts[n++] = pos;
+        pos += name[pos] + 1;
+    }
+    while (n-- > 0) {
+        const uint8_t *label = &name[starts[n]];
+        for (i = 1; i <= label[0]; i++) {
+            uint8_t c = label[i];
+            key[k++] = (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+        }
+        key[k++] = 0;
+    }
+    return k;
+}
+
+/* First eight bytes of the key below the apex, big endian so that numbers sort as the keys do */
+static inline uint64_t key_prefix(const uint8_t *key, size_t key_len, size_t apex_key_len)
+{
+    uint64_t prefix = 0;
+    size_t i;
+
+    for (i = 0; i < 8; i++) {
+        prefix <<= 8;
+        if (apex_key_len + i < key_len)
+            prefix |= key[apex_key_len + i];
+    }
+    return prefix;
+}
+
+static int key_cmp(uint64_t a_prefix, const uint8_t *a, size_t a_len,
+                   uint64_t b_prefix, const uint8_t *b, size_t b_len)
+{
+    int cmp;
+
+    if (a_prefix != b_prefix)
+        return a_prefix < b_prefix ? -1 : 1;
+    cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (cmp)
+        return cmp;
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+/* Whether key b is the key of a name below the name of key a */
+static inline bool key_below(const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len)
+{
+    return b_len > a_len && memcmp(a, b, a_len) == 0;
+}
+
+static int reserve(void **p, size_t *cap, size_t need, size_t item)
+{
+    size_t new_cap = *cap ? *cap : 1 << 12;
+    void *n;
+
+    if (need <= *cap)
+        return 0;
+    while (new_cap < need)
+        new_cap *= 2;
+    if (!(n = realloc(*p, new_cap * item)))
+        return -1;
+    *p = n;
+    *cap = new_cap;
+    return 0;
+}
+
+static int add_name(struct compile_state *st, const uint8_t *wire, size_t len)
+{
+    size_t cap = st->ids_cap;
+
+    /* Records of one name mostly follow each other */
+    if (st->nnames > 0) {
+        const struct zone_name *last = &st->ids[st->nnames - 1];
+        if (last->len == len && memcmp(&st->names[last->off], wire, len) == 0)
+            return st->nnames - 1;
+    }
+    if (st->names_size > UINT32_MAX - NAME_WIRE_MAX || st->nnames == UINT32_MAX) {
+        fprintf(stderr, "Zone is too large\n");
+        return -1;
+    }
+    if (reserve((void **)&st->names, &st->names_cap, st->names_size + len, 1) == -1 ||
+        reserve((void **)&st->ids, &cap, st->nnames + 1, sizeof(struct zone_name)) == -1)
+        return -1;
+    st->ids_cap = cap;
+    memcpy(&st->names[st->names_size], wire, len);
+    st->ids[st->nnames].off = st->names_size;
+    st->ids[st->nnames].len = len;
+    st->names_size += len;
+    return st->nnames++;
+}
+
+static int add_record(struct compile_state *st, uint32_t name, uint16_t type, uint32_t ttl,
+                      const uint8_t *rdata, size_t rdlength)
+{
+    struct zone_record *rec;
+
+    if (st->rdata_size > UINT32_MAX - BLOCK_MAX) {
+        fprintf(stderr, "Zone is too large\n");
+        return -1;
+    }
+    if (reserve((void **)&st->rdata, &st->rdata_cap, st->rdata_size + rdlength, 1) == -1 ||
+        reserve((void **)&st->records, &st->records_cap, st->nrecords + 1, sizeof(struct zone_record)) == -1)
+        return -1;
+    rec = &st->records[st->nrecords++];
+    rec->name = name;
+    rec->type = type;
+    rec->ttl = ttl;
+    rec->rdata = st->rdata_size;
+    rec->rdlength = rdlength;
+    memcpy(&st->rdata[st->rdata_size], rdata, rdlength);
+    st->rdata_size += rdlength;
+    return 0;
+}
+
+/* Reads the next entry of the zone file into buf, lines inside parentheses joined into one,
+ * comments taken off. Returns 1 with an entry, 0 at the end, -1 if it's malformed. */
+static int read_entry(FILE *in, char *buf, size_t size, uint32_t *lineno)
+{
+    char line[ZONE_LINE_MAX];
+    size_t len = 0;
+    int depth = 0;
+
+    while (fgets(line, sizeof(line), in)) {
+        bool quoted = false;
+        char *c;
+
+        (*lineno)++;
+        for (c = line; *c; c++) {
+            if (len + 2 >= size)
+                return -1;
+            if (*c == '\\' && c[1] != '\0') {
+                buf[len++] = *c++;
+            }
+            else if (*c == '"')
+                quoted = !quoted;
+            else if (!quoted && *c == ';')
+                break;
+            else if (!quoted && (*c == '(' || *c == ')')) {
+                depth += *c == '(' ? 1 : -1;
+                *c = ' ';
+            }
+            else if (*c == '\n' || *c == '\r')
+                *c = ' ';
+            buf[len++] = *c;
+        }
+        if (depth < 0)
+            return -1;
+        if (depth == 0) {
+            buf[len] = '\0';
+            return 1;
+        }
+    }
+    if (ferror(in) || depth > 0)
+        return -1;
+    buf[len] = '\0';
+    return len > 0 ? 1 : 0;
+}
+
+static char * next_token(char **p)
+{
+    char *start;
+
+    while (**p == ' ' || **p == '\t')
+        (*p)++;
+    if (**p == '\0')
+        return NULL;
+    start = *p;
+    while (**p != '\0' && **p != ' ' && **p != '\t')
+        (*p)++;
+    if (**p != '\0')
+        *(*p)++ = '\0';
+    return start;
+}
+
+static bool all_digits(const char *s)
+{
+    return *s != '\0' && strspn(s, "0123456789") == strlen(s);
+}
+
+static int parse_zone(FILE *in, struct compile_state *st)
+{
+    char *entry = malloc(ZONE_LINE_MAX);
+    uint8_t *rdata = malloc(BLOCK_MAX);
+    uint8_t origin[NAME_WIRE_MAX], wire[NAME_WIRE_MAX];
+    size_t origin_len = 0;
+    uint32_t lineno = 0, ttl = 0, default_ttl = 0;
+    bool has_ttl = false, has_default_ttl = false;
+    int32_t owner = -1, ret = -1, got;
+
+    if (!entry || !rdata)
+        goto out;
+    while ((got = read_entry(in, entry, ZONE_LINE_MAX, &lineno)) == 1) {
+        char *p = entry, *token;
+        int32_t type = -1, len;
+        bool explicit_ttl = false;
+
+        if (entry[0] == '$') {
+            token = next_token(&p);
+            if (strcasecmp(token, "$ORIGIN") == 0 && (token = next_token(&p)) &&
+                (len = name_encode_origin(token, origin_len ? origin : NULL, origin_len, wire, true)) != -1) {
+                memcpy(origin, wire, len);
+                origin_len = len;
+            }
+            else if (strcasecmp(token, "$TTL") == 0 && (token = next_token(&p)) && all_digits(token)) {
+                default_ttl = strtoul(token, NULL, 10);
+                has_default_ttl = true;
+            }
+            else {
+                fprintf(stderr, "Line %u: unsupported directive %s\n", lineno, entry);
+                goto out;
+            }
+            continue;
+        }
+
+        /* Owner left out is the one of the entry before */
+        if (entry[0] != ' ' && entry[0] != '\t') {
+            token = next_token(&p);
+            if (!token ||
+                (len = name_encode_origin(token, origin_len ? origin : NULL, origin_len, wire, true)) == -1) {
+                fprintf(stderr, "Line %u: invalid name %s\n", lineno, token ? token : "");
+                goto out;
+            }
+            if ((owner = add_name(st, wire, len)) == -1)
+                goto out;
+        }
+        if (!(token = next_token(&p)))
+            continue;
+        if (owner == -1) {
+            fprintf(stderr, "Line %u: no owner name\n", lineno);
+            goto out;
+        }
+
+        /* TTL and class in either order, then the type */
+        for (; token; token = next_token(&p)) {
+            if (all_digits(token)) {
+                ttl = strtoul(token, NULL, 10);
+                explicit_ttl = true;
+            }
+            else if (strcasecmp(token, "IN") == 0)
+                continue;
+            else if ((type = rr_type_parse(token)) == -1) {
+                fprintf(stderr, "Line %u: unknown type or class %s\n", lineno, token);
+                goto out;
+            }
+            else
+                break;
+        }
+        if (type == -1 || type == TYPE_AXFR || type == TYPE_IXFR) {
+            fprintf(stderr, "Line %u: no type\n", lineno);
+            goto out;
+        }
+        if (!explicit_ttl) {
+            if (has_default_ttl)
+                ttl = default_ttl;
+            else if (!has_ttl) {
+                fprintf(stderr, "Line %u: no TTL and no $TTL\n", lineno);
+                goto out;
+            }
+        }
+        has_ttl = true;
+
+        len = rr_rdata_encode(type, p, origin_len ? origin : NULL, origin_len, rdata, BLOCK_MAX);
+        if (len == -1) {
+            fprintf(stderr, "Line %u: invalid data of %s record: %s\n", lineno, token, p);
+            goto out;
+        }
+        if (type == TYPE_SOA) {
+            if (st->has_apex && st->apex != (uint32_t)owner) {
+                fprintf(stderr, "Line %u: second SOA record, a file holds one zone\n", lineno);
+                goto out;
+            }
+            st->has_apex = true;
+            st->apex = owner;
+        }
+        if (add_record(st, owner, type, ttl, rdata, len) == -1)
+            goto out;
+    }
+    if (got == -1) {
+        fprintf(stderr, "Line %u: malformed entry\n", lineno);
+        goto out;
+    }
+    if (!st->has_apex) {
+        fprintf(stderr, "Zone has no SOA record\n");
+        goto out;
+    }
+    ret = 0;
+
+out:
+    free(entry);
+    free(rdata);
+    return ret;
+}
+
+/* qsort has no context argument, the arenas for the comparisons are kept here */
+static const struct compile_state *sort_state;
+
+static int sorted_cmp(const void *a, const void *b)
+{
+    const struct sorted_name *sa = a, *sb = b;
+    const struct zone_name *na = &sort_state->ids[sa->name], *nb = &sort_state->ids[sb->name];
+
+    return key_cmp(sa->prefix, &sort_state->keys[na->off], na->len - 1,
+                   sb->prefix, &sort_state->keys[nb->off], nb->len - 1);
+}
+
+static int record_cmp(const void *a, const void *b)
+{
+    const struct zone_record *ra = &sort_state->records[*(const uint32_t *)a];
+    const struct zone_record *rb = &sort_state->records[*(const uint32_t *)b];
+
+    if (ra->type != rb->type)
+        return ra->type - rb->type;
+    if (ra->rdlength != rb->rdlength)
+        return ra->rdlength - rb->rdlength;
+    return memcmp(&sort_state->rdata[ra->rdata], &sort_state->rdata[rb->rdata], ra->rdlength);
+}
+
+/* Puts the names into canonical order, the same name given apart twice gets one rank, and
+ * groups the records by their names and types */
+static int sort_zone(struct compile_state *st)
+{
+    const struct zone_name *apex = &st->ids[st->apex];
+    uint32_t i, r;
+
+    st->keys = malloc(st->names_size ? st->names_size : 1);
+    st->sorted = malloc((st->nnames ? st->nnames : 1) * sizeof(struct sorted_name));
+    st->rank_of = malloc((st->nnames ? st->nnames : 1) * sizeof(uint32_t));
+    if (!st->keys || !st->sorted || !st->rank_of)
+        return -1;
+
+    st->apex_key_len = apex->len - 1;
+    for (i = 0; i < st->nnames; i++) {
+        const struct zone_name *n = &st->ids[i];
+
+        if (!name_in_zone(&st->names[n->off], n->len, &st->names[apex->off], apex->len)) {
+            char text[HOSTNAME_MAX + 2];
+            name_to_text(&st->names[n->off], text);
+            fprintf(stderr, "%s is not in the zone\n", text);
+            return -1;
+        }
+        name_key(&st->names[n->off], &st->keys[n->off]);
+        st->sorted[i].prefix = key_prefix(&st->keys[n->off], n->len - 1, st->apex_key_len);
+        st->sorted[i].name = i;
+    }
+    sort_state = st;
+    qsort(st->sorted, st->nnames, sizeof(struct sorted_name), sorted_cmp);
+
+    for (i = 0, st->count = 0; i < st->nnames; i++) {
+        if (i == 0 || sorted_cmp(&st->sorted[i], &st->sorted[st->count - 1]) != 0)
+            st->sorted[st->count++] = st->sorted[i];
+        st->rank_of[st->sorted[i].name] = st->count - 1;
+    }
+
+    /* Counting sort of the records by rank, then by type within a name */
+    st->rec_start = calloc(st->count + 1, sizeof(uint32_t));
+    st->rec_order = malloc((st->nrecords ? st->nrecords : 1) * sizeof(uint32_t));
+    if (!st->rec_start || !st->rec_order)
+        return -1;
+    for (i = 0; i < st->nrecords; i++)
+        st->rec_start[st->rank_of[st->records[i].name] + 1]++;
+    for (r = 0; r < st->count; r++)
+        st->rec_start[r + 1] += st->rec_start[r];
+    {
+        uint32_t *fill = malloc((st->count ? st->count : 1) * sizeof(uint32_t));
+        if (!fill)
+            return -1;
+        memcpy(fill, st->rec_start, st->count * sizeof(uint32_t));
+        for (i = 0; i < st->nrecords; i++)
+            st->rec_order[fill[st->rank_of[st->records[i].name]]++] = i;
+        free(fill);
+    }
+    for (r = 0; r < st->count; r++) {
+        if (st->rec_start[r + 1] - st->rec_start[r] > 1)
+            qsort(&st->rec_order[st->rec_start[r]], st->rec_start[r + 1] - st->rec_start[r],
+                  sizeof(uint32_t), record_cmp);
+    }
+    return 0;
+}
+
+/* Rank of a name of the zone, -1 if there's no such name */
+static int64_t find_rank(const struct compile_state *st, const uint8_t *wire, size_t len)
+{
+    uint8_t key[NAME_WIRE_MAX];
+    size_t key_len = name_key(wire, key);
+    uint64_t prefix = key_prefix(key, key_len, st->apex_key_len);
+    uint32_t lo = 0, hi = st->count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const struct zone_name *n = &st->ids[st->sorted[mid].name];
+        int cmp = key_cmp(st->sorted[mid].prefix, &st->keys[n->off], n->len - 1, prefix, key, key_len);
+
+        if (cmp == 0)
+            return mid;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -1;
+}
+
+/* Adds len bytes aligned to 4, or to 8 for the index and the samples */
+static uint8_t * buffer_append(struct zone_buffer *buf, size_t len, size_t align, size_t *off)
+{
+    size_t at = (buf->size + align - 1) & ~(align - 1);
+
+    if (at + len > UINT32_MAX) {
+        fprintf(stderr, "Zone is too large\n");
+        return NULL;
+    }
+    if (reserve((void **)&buf->data, &buf->cap, at + len, 1) == -1)
+        return NULL;
+    memset(&buf->data[buf->size], 0, at + len - buf->size);
+    buf->size = at + len;
+    *off = at;
+    return &buf->data[at];
+}
+
+/* Notes where a name of the message is a pointer. Returns -1 if it runs past end. */
+static int name_pointers(const uint8_t *msg, size_t *pos, size_t end, uint16_t *positions,
+                         uint32_t *count, size_t base)
+{
+    while (*pos < end) {
+        uint8_t c = msg[*pos];
+
+        if ((c & 0xc0) == 0xc0) {
+            positions[(*count)++] = *pos - base;
+            *pos += 2;
+            return *pos <= end ? 0 : -1;
+        }
+        *pos += c + 1;
+        if (c == 0)
+            return 0;
+    }
+    return -1;
+}
+
+/* Finds the compression pointers of the records the builder wrote from base on */
+static uint32_t find_pointers(const uint8_t *msg, size_t base, size_t end, uint16_t *positions)
+{
+    size_t pos = base;
+    uint32_t count = 0;
+
+    while (pos < end) {
+        uint16_t type, rdlength;
+        uint32_t record_count;
+        size_t rdend;
+        const char *f;
+
+        if (name_pointers(msg, &pos, end, positions, &count, base) == -1 || pos + 10 > end)
+            break;
+        type = read_u16(&msg[pos]);
+        rdlength = read_u16(&msg[pos + 8]);
+        pos += 10;
+        rdend = pos + rdlength;
+        record_count = count;
+
+        /* RDATA the builder copied as it was isn't walked as names */
+        if (rr_type_compressible(type)) {
+            for (f = rr_type(type)->layout; *f && pos < rdend; f++) {
+                int size;
+
+                if (*f == 'n' || *f == 'N') {
+                    if (name_pointers(msg, &pos, rdend, positions, &count, base) == -1)
+                        break;
+                    continue;
+                }
+                if ((size = rr_field_size(*f, &msg[pos], rdend - pos)) == -1)
+                    break;
+                pos += size;
+            }
+            if (pos != rdend || *f)
+                count = record_count;
+        }
+        pos = rdend;
+    }
+    return count;
+}
+
+/* Name the record points to, uncompressed in its RDATA */
+static const uint8_t * record_target(const struct zone_rr *rr, size_t *len)
+{
+    const char *f;
+    size_t pos = 0;
+
+    for (f = rr_type(rr->type)->layout; *f; f++) {
+        size_t start = pos;
+        int size;
+
+        if (*f == 'n' || *f == 'N') {
+            while (pos < rr->rdlength && rr->rdata[pos] != 0)
+                pos += rr->rdata[pos] + 1;
+            if (++pos > rr->rdlength)
+                return NULL;
+            if (*f == 'N') {
+                *len = pos - start;
+                return &rr->rdata[start];
+            }
+            continue;
+        }
+        if ((size = rr_field_size(*f, &rr->rdata[pos], rr->rdlength - pos)) == -1)
+            return NULL;
+        pos += size;
+    }
+    return NULL;
+}
+
+static inline uint64_t key_hash(const uint8_t *key, size_t key_len)
+{
+    return name_hash_fast(key, key_len, 0);
+}
+
+/* Adds addresses of the targets of the records within the zone to the additional section,
+ * each target once, and notes the targets */
+static void add_targets(struct block_context *bc, struct builder *b, const struct zone_rr *rrs, uint32_t count)
+{
+    uint64_t seen[ADDITIONAL_TARGETS];
+    uint32_t n = 0, i, j;
+
+    for (i = 0; i < count && n < ADDITIONAL_TARGETS; i++) {
+        uint8_t key[NAME_WIRE_MAX];
+        const uint8_t *target;
+        uint64_t hash;
+        size_t len;
+
+        if (!(target = record_target(&rrs[i], &len)) || !name_in_zone(target, len, bc->apex, bc->apex_len))
+            continue;
+        hash = key_hash(key, name_key(target, key));
+        for (j = 0; j < n && seen[j] != hash; j++)
+            ;
+        if (j < n)
+            continue;
+        seen[n++] = hash;
+        if (bc->targets_count < ENTRY_TARGETS)
+            bc->targets[bc->targets_count++] = hash;
+        bc->addresses(bc->ctx, b, target, len);
+    }
+}
+
+static inline bool same_rr(const struct zone_rr *a, const struct zone_rr *b)
+{
+    return a->type == b->type && a->rdlength == b->rdlength && memcmp(a->rdata, b->rdata, a->rdlength) == 0;
+}
+
+/* Builds the block of records of one type, all in the section, with the addresses of
+ * their targets if the type has targets which get them (RFC 1035, 3.3.9; RFC 2782).
+ * SOA for negative answers has the TTL of negative caching (RFC 2308, 5).
+ * Returns -1 if it couldn't be added to the buffer. */
+static int add_block(struct block_context *bc, struct zone_buffer *buf, const uint8_t *name, size_t name_len,
+                     const struct zone_rr *rrs, uint32_t count, enum section section, size_t *off)
+{
+    uint16_t type = rrs[0].type;
+    struct zone_block *block;
+    struct builder b;
+    size_t base, answer_end;
+    uint32_t i, pointers;
+    uint8_t *p;
+
+    builder_init(&b, bc->msg, BLOCK_MAX, 0);
+    builder_question(&b, name, name_len, type);
+    base = b.len;
+    for (i = 0; i < count; i++) {
+        uint32_t ttl = rrs[i].ttl;
+
+        if (i > 0 && same_rr(&rrs[i], &rrs[i - 1]))
+            continue;
+        if (section == SECTION_AUTHORITY && type == TYPE_SOA && rrs[i].rdlength >= 4) {
+            const uint8_t *minimum = &rrs[i].rdata[rrs[i].rdlength - 4];
+            uint32_t negative = (uint32_t)minimum[0] << 24 | minimum[1] << 16 | minimum[2] << 8 | minimum[3];
+            if (negative < ttl)
+                ttl = negative;
+        }
+        if (builder_add(&b, section, name, name_len, type, ttl, rrs[i].rdata, rrs[i].rdlength) == -1) {
+            char text[HOSTNAME_MAX + 2];
+            name_to_text(name, text);
+            fprintf(stderr, "Records of %s don't fit in a message, some are left out\n", text);
+            break;
+        }
+    }
+    answer_end = b.len;
+    if (type == TYPE_NS || type == TYPE_MX || type == TYPE_SRV)
+        add_targets(bc, &b, rrs, count);
+
+    pointers = find_pointers(bc->msg, base, b.len, bc->positions);
+    if (!(p = buffer_append(buf, sizeof(*block) + align4(pointers * 2) + b.len - base, 4, off)))
+        return -1;
+    block = (struct zone_block *)p;
+    block->type = type;
+    block->len = b.len - base;
+    block->answer_len = answer_end - base;
+    block->base = base;
+    for (i = 0; i < 3; i++)
+        block->counts[i] = read_u16(&bc->msg[6 + 2 * i]);
+    block->pointers = pointers;
+    memcpy(block + 1, bc->positions, pointers * 2);
+    memcpy(p + sizeof(*block) + align4(pointers * 2), &bc->msg[base], b.len - base);
+    return 0;
+}
+
+/* Appends the entry of a name with the blocks of its records, which are sorted by type.
+ * A cut has the referral first. */
+static int add_entry(struct block_context *bc, struct zone_buffer *buf, const uint8_t *name, size_t name_len,
+                     const uint8_t *key, uint8_t flags, const struct zone_rr *rrs, uint32_t count,
+                     size_t *entry_off)
+{
+    struct zone_entry *entry;
+    uint32_t i, last, blocks = 0;
+    size_t off;
+
+    if (!(entry = (struct zone_entry *)buffer_append(buf, sizeof(*entry) + name_len - 1, 4, entry_off)))
+        return -1;
+    entry->name_len = name_len;
+    entry->flags = flags;
+    memcpy(entry + 1, key, name_len - 1);
+
+    bc->targets_count = 0;
+    for (i = 0; i < count && (flags & ZONE_CUT); i = last) {
+        for (last = i; last < count && rrs[last].type == rrs[i].type; last++)
+            ;
+        if (rrs[i].type == TYPE_NS) {
+            if (add_block(bc, buf, name, name_len, &rrs[i], last - i, SECTION_AUTHORITY, &off) == -1)
+                return -1;
+            blocks++;
+        }
+    }
+    for (i = 0; i < count; i = last) {
+        for (last = i; last < count && rrs[last].type == rrs[i].type; last++)
+            ;
+        if ((flags & ZONE_CUT) && rrs[i].type == TYPE_NS)
+            continue;
+        if (add_block(bc, buf, name, name_len, &rrs[i], last - i, SECTION_ANSWER, &off) == -1)
+            return -1;
+        blocks++;
+    }
+    ((struct zone_entry *)&buf->data[*entry_off])->blocks = blocks;
+    return 0;
+}
+
+/* Addresses of a name being compiled */
+static void compiled_addresses(void *ctx, struct builder *b, const uint8_t *name, size_t len)
+{
+    const struct compile_state *st = ctx;
+    int64_t rank = find_rank(st, name, len);
+    uint32_t k;
+
+    if (rank == -1)
+        return;
+    for (k = st->rec_start[rank]; k < st->rec_start[rank + 1]; k++) {
+        const struct zone_record *addr = &st->records[st->rec_order[k]];
+        if (addr->type == TYPE_A || addr->type == TYPE_AAAA)
+            builder_add(b, SECTION_ADDITIONAL, name, len, addr->type, addr->ttl,
+                        &st->rdata[addr->rdata], addr->rdlength);
+    }
+}
+
+static int referrer_cmp(const void *a, const void *b)
+{
+    const struct zone_referrer *ra = a, *rb = b;
+
+    if (ra->target != rb->target)
+        return ra->target < rb->target ? -1 : 1;
+    return ra->entry < rb->entry ? -1 : ra->entry > rb->entry;
+}
+
+static int build_image(struct compile_state *st)
+{
+    const struct zone_name *apex = &st->ids[st->apex];
+    struct zone_header *header;
+    size_t off, cut_off = 0, header_off, index_off, samples_off, referrers_off;
+    const uint8_t *cut_key = NULL;
+    size_t cut_key_len = 0;
+    uint8_t *p;
+    uint32_t r;
+
+    st->bc.apex = &st->names[apex->off];
+    st->bc.apex_len = apex->len;
+    st->bc.addresses = compiled_addresses;
+    st->bc.ctx = st;
+    if (!buffer_append(&st->image, sizeof(struct zone_header), 8, &header_off) ||
+        !buffer_append(&st->image, (size_t)st->count * sizeof(struct zone_key), 8, &index_off) ||
+        !buffer_append(&st->image, (st->count + ZONE_SAMPLE - 1) / ZONE_SAMPLE * sizeof(uint64_t), 8, &samples_off))
+        return -1;
+
+    for (r = 0; r < st->count; r++) {
+        const struct zone_name *n = &st->ids[st->sorted[r].name];
+        const uint8_t *key = &st->keys[n->off];
+        uint32_t i, count = st->rec_start[r + 1] - st->rec_start[r];
+        struct zone_key *index;
+        size_t entry_off;
+        uint8_t flags = 0;
+        bool has_ns = false;
+
+        if (reserve((void **)&st->rrs, &st->rrs_cap, count, sizeof(struct zone_rr)) == -1)
+            return -1;
+        for (i = 0; i < count; i++) {
+            const struct zone_record *rec = &st->records[st->rec_order[st->rec_start[r] + i]];
+            st->rrs[i].type = rec->type;
+            st->rrs[i].rdlength = rec->rdlength;
+            st->rrs[i].ttl = rec->ttl;
+            st->rrs[i].rdata = &st->rdata[rec->rdata];
+            has_ns |= rec->type == TYPE_NS;
+        }
+
+        /* Names of a delegated zone follow its cut in canonical order */
+        if (cut_key && key_below(cut_key, cut_key_len, key, n->len - 1))
+            flags = ZONE_BELOW_CUT;
+        else if (r == 0)
+            flags = ZONE_APEX;
+        else if (has_ns) {
+            flags = ZONE_CUT;
+            cut_key = key;
+            cut_key_len = n->len - 1;
+        }
+
+        if (add_entry(&st->bc, &st->image, &st->names[n->off], n->len, key, flags, st->rrs, count, &entry_off) == -1)
+            return -1;
+        if (flags & ZONE_CUT)
+            cut_off = entry_off;
+        if (flags & ZONE_BELOW_CUT)
+            ((struct zone_entry *)&st->image.data[entry_off])->cut = cut_off;
+
+        index = (struct zone_key *)&st->image.data[index_off] + r;
+        index->prefix = st->sorted[r].prefix;
+        index->entry = entry_off;
+        index->name_len = n->len;
+        if (r % ZONE_SAMPLE == 0)
+            ((uint64_t *)&st->image.data[samples_off])[r / ZONE_SAMPLE] = index->prefix;
+
+        for (i = 0; i < st->bc.targets_count; i++) {
+            struct zone_referrer *ref;
+            if (reserve((void **)&st->referrers, &st->referrers_cap, st->nreferrers + 1,
+                        sizeof(struct zone_referrer)) == -1)
+                return -1;
+            ref = &st->referrers[st->nreferrers++];
+            ref->target = st->bc.targets[i];
+            ref->entry = entry_off;
+            ref->unused = 0;
+        }
+
+        if (flags & ZONE_APEX) {
+            for (i = 0; st->rrs[i].type != TYPE_SOA; i++)
+                ;
+            if (add_block(&st->bc, &st->image, &st->names[n->off], n->len, &st->rrs[i], 1,
+                          SECTION_AUTHORITY, &off) == -1)
+                return -1;
+            ((struct zone_header *)&st->image.data[header_off])->negative_off = off;
+            ((struct zone_header *)&st->image.data[header_off])->apex_off = entry_off;
+        }
+    }
+
+    if (st->nreferrers > 1)
+        qsort(st->referrers, st->nreferrers, sizeof(struct zone_referrer), referrer_cmp);
+    if (!(p = buffer_append(&st->image, st->nreferrers * sizeof(struct zone_referrer), 8, &referrers_off)))
+        return -1;
+    memcpy(p, st->referrers, st->nreferrers * sizeof(struct zone_referrer));
+
+    header = (struct zone_header *)&st->image.data[header_off];
+    memcpy(header->magic, ZONE_MAGIC, sizeof(header->magic));
+    header->count = st->count;
+    header->records = st->nrecords;
+    header->index_off = index_off;
+    header->samples_off = samples_off;
+    header->referrers_off = referrers_off;
+    header->referrers = st->nreferrers;
+    header->size = st->image.size;
+    header->apex_len = apex->len;
+    memcpy(header->apex, &st->names[apex->off], header->apex_len);
+    return 0;
+}
+
+static void compile_state_free(struct compile_state *st)
+{
+    free(st->names);
+    free(st->keys);
+    free(st->ids);
+    free(st->records);
+    free(st->rdata);
+    free(st->sorted);
+    free(st->rank_of);
+    free(st->rec_start);
+    free(st->rec_order);
+    free(st->rrs);
+    free(st->referrers);
+    free(st->bc.msg);
+    free(st->bc.positions);
+}
+
+/* Compiles the zone file into an image, which the caller frees */
+static int zone_build(FILE *in, uint8_t **image, size_t *size)
+{
+    struct compile_state st = { 0 };
+    int ret = -1;
+
+    st.bc.msg = malloc(BLOCK_MAX);
+    st.bc.positions = malloc(BLOCK_MAX);
+    if (!st.bc.msg || !st.bc.positions || parse_zone(in, &st) == -1 || sort_zone(&st) == -1 ||
+        build_image(&st) == -1) {
+        free(st.image.data);
+        goto out;
+    }
+    *image = st.image.data;
+    *size = st.image.size;
+    ret = 0;
+
+out:
+    compile_state_free(&st);
+    return ret;
+}
+
+int zone_compile(FILE *in, const char *out_path)
+{
+    const struct zone_header *header;
+    char tmp_path[4096];
+    uint8_t *image;
+    size_t size;
+    FILE *out;
+    bool ok;
+
+    if (zone_build(in, &image, &size) == -1)
+        return -1;
+
+    /* Written next to the target and renamed, a running server never maps a half written file */
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", out_path) >= (int)sizeof(tmp_path) ||
+        !(out = fopen(tmp_path, "wb"))) {
+        fprintf(stderr, "Couldn't create %s:\n%d %s\n", tmp_path, errno, strerror(errno));
+        free(image);
+        return -1;
+    }
+    ok = fwrite(image, 1, size, out) == size;
+    ok = (fclose(out) == 0) && ok;
+    if (!ok || rename(tmp_path, out_path) == -1) {
+        fprintf(stderr, "Couldn't write %s:\n%d %s\n", out_path, errno, strerror(errno));
+        unlink(tmp_path);
+        free(image);
+        return -1;
+    }
+    header = (const struct zone_header *)image;
+    printf("%u names, %u records, %zu bytes\n", header->count, header->records, size);
+    free(image);
+    return 0;
+}
+
+/* Name changed by updates: its records, and the entry built from them the way the names
+ * of the image are. Versions share it until an update changes the name again. */
+struct zone_data {
+    uint32_t refs;
+    uint32_t stamp;                     /* update which built it */
+    uint8_t key[NAME_WIRE_MAX];
+    uint8_t name[NAME_WIRE_MAX];        /* lowercase */
+    uint8_t name_len;
+    struct zone_entry *entry;           /* NULL if the name has no records left */
+    struct zone_record *records;        /* sorted by type and RDATA, the name of each unused */
+    uint32_t count;
+    uint8_t *rdata;
+};
+
+/* Treap of the changed names, ordered by their keys and heaped by hashes of them. A node
+ * doesn't change once a version holds it: an update copies the path down to each name
+ * it changes and shares the rest of the tree with the version before. */
+struct zone_node {
+    uint32_t refs;
+    uint32_t priority;
+    struct zone_node *left, *right;
+    struct zone_data *data;
+};
+
+/* Names built by updates with a target in their additional sections, the counterpart of
+ * the referrers of the image. Links are only added: a name which lost the target since is
+ * just built once more than it had to be. The index passes from version to version. */
+struct referrer_link {
+    struct referrer_link *next;
+    uint64_t target;                    /* hash of the target's key */
+    uint8_t key_len;
+    uint8_t key[];
+};
+
+struct referrer_index {
+    struct referrer_link **buckets;
+    uint32_t cap;                       /* buckets, a power of two */
+    uint32_t count;
+};
+
+struct zone_version {
+    struct zone_node *root;
+    uint32_t names;                     /* in the tree */
+    uint32_t stamp;                     /* updates applied */
+    uint32_t serial;
+    uint8_t *negative;                  /* block of the SOA for negative answers */
+    struct referrer_index *referrers;
+};
+
+static void data_release(struct zone_data *d)
+{
+    if (--d->refs > 0)
+        return;
+    free(d->entry);
+    free(d->records);
+    free(d->rdata);
+    free(d);
+}
+
+static void node_release(struct zone_node *n)
+{
+    if (!n || --n->refs > 0)
+        return;
+    node_release(n->left);
+    node_release(n->right);
+    data_release(n->data);
+    free(n);
+}
+
+static void referrers_free(struct referrer_index *ix)
+{
+    uint32_t i;
+
+    if (!ix)
+        return;
+    for (i = 0; i < ix->cap; i++) {
+        while (ix->buckets[i]) {
+            struct referrer_link *next = ix->buckets[i]->next;
+            free(ix->buckets[i]);
+            ix->buckets[i] = next;
+        }
+    }
+    free(ix->buckets);
+    free(ix);
+}
+
+/* Notes the name as a referrer of the target, once */
+static int referrers_add(struct referrer_index *ix, uint64_t target, const uint8_t *key, size_t key_len)
+{
+    struct referrer_link *link, **bucket;
+    uint32_t i;
+
+    if (ix->count >= ix->cap) {
+        uint32_t cap = ix->cap ? ix->cap * 2 : 256;
+        struct referrer_link **buckets = calloc(cap, sizeof(*buckets));
+        if (!buckets)
+            return -1;
+        for (i = 0; i < ix->cap; i++) {
+            while ((link = ix->buckets[i])) {
+                ix->buckets[i] = link->next;
+                link->next = buckets[link->target & (cap - 1)];
+                buckets[link->target & (cap - 1)] = link;
+            }
+        }
+        free(ix->buckets);
+        ix->buckets = buckets;
+        ix->cap = cap;
+    }
+    bucket = &ix->buckets[target & (ix->cap - 1)];
+    for (link = *bucket; link; link = link->next) {
+        if (link->target == target && link->key_len == key_len && memcmp(link->key, key, key_len) == 0)
+            return 0;
+    }
+    if (!(link = malloc(sizeof(*link) + key_len)))
+        return -1;
+    link->target = target;
+    link->key_len = key_len;
+    memcpy(link->key, key, key_len);
+    link->next = *bucket;
+    *bucket = link;
+    ix->count++;
+    return 0;
+}
+
+static void version_free(struct zone_version *v)
+{
+    if (!v)
+        return;
+    node_release(v->root);
+    referrers_free(v->referrers);
+    free(v->negative);
+    free(v);
+}
+
+static struct zone_node * node_new(struct zone_data *data, uint32_t priority, struct zone_node *left,
+                                   struct zone_node *right)
+{
+    struct zone_node *n = malloc(sizeof(*n));
+
+    if (!n)
+        return NULL;
+    n->refs = 1;
+    n->priority = priority;
+    n->data = data;
+    n->left = left;
+    n->right = right;
+    data->refs++;
+    if (left)
+        left->refs++;
+    if (right)
+        right->refs++;
+    return n;
+}
+
+static inline int data_cmp(const uint8_t *key, size_t key_len, const struct zone_data *d)
+{
+    return key_cmp(0, key, key_len, 0, d->key, d->name_len - 1);
+}
+
+/* Tree with the data in place of the node of its name, or added, the path to it copied.
+ * Returns the new root, NULL if out of memory. */
+static struct zone_node * node_insert(struct zone_node *n, struct zone_data *data, bool *added)
+{
+    struct zone_node *copy, *child;
+    int cmp;
+
+    if (!n) {
+        *added = true;
+        return node_new(data, (uint32_t)key_hash(data->key, data->name_len - 1), NULL, NULL);
+    }
+    if ((cmp = data_cmp(data->key, data->name_len - 1, n->data)) == 0)
+        return node_new(data, n->priority, n->left, n->right);
+    if (!(child = node_insert(cmp < 0 ? n->left : n->right, data, added)))
+        return NULL;
+    copy = node_new(n->data, n->priority, cmp < 0 ? child : n->left, cmp < 0 ? n->right : child);
+    node_release(child);
+    if (!copy)
+        return NULL;
+
+    /* Both are fresh copies, rotating them changes nothing an older version holds */
+    if (child->priority > copy->priority) {
+        if (cmp < 0) {
+            copy->left = child->right;
+            child->right = copy;
+        }
+        else {
+            copy->right = child->left;
+            child->left = copy;
+        }
+        return child;
+    }
+    return copy;
+}
+
+static const struct zone_data * node_find(const struct zone_node *n, const uint8_t *key, size_t key_len)
+{
+    while (n) {
+        int cmp = data_cmp(key, key_len, n->data);
+        if (cmp == 0)
+            return n->data;
+        n = cmp < 0 ? n->left : n->right;
+    }
+    return NULL;
+}
+
+/* First name after the key */
+static const struct zone_data * node_next(const struct zone_node *n, const uint8_t *key, size_t key_len)
+{
+    const struct zone_data *next = NULL;
+
+    while (n) {
+        if (data_cmp(key, key_len, n->data) < 0) {
+            next = n->data;
+            n = n->left;
+        }
+        else
+            n = n->right;
+    }
+    return next;
+}
+
+static int check_image(struct zone *z, const char *path)
+{
+    const struct zone_header *header = (const struct zone_header *)z->image;
+
+    if (z->size < sizeof(*header) || memcmp(header->magic, ZONE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->size != z->size || header->index_off != ((sizeof(*header) + 7) & ~(size_t)7) ||
+        header->index_off + (uint64_t)header->count * sizeof(struct zone_key) > header->samples_off ||
+        header->samples_off % 8 != 0 ||
+        header->samples_off + (header->count + ZONE_SAMPLE - 1) / ZONE_SAMPLE * sizeof(uint64_t) > z->size ||
+        header->apex_off + sizeof(struct zone_entry) > z->size ||
+        header->referrers_off % 8 != 0 ||
+        header->referrers_off + (uint64_t)header->referrers * sizeof(struct zone_referrer) > z->size ||
+        header->negative_off + sizeof(struct zone_block) > z->size ||
+        header->apex_len == 0 || header->count == 0) {
+        fprintf(stderr, "%s is not a compiled zone\n", path);
+        return -1;
+    }
+    z->header = header;
+    z->index = (const struct zone_key *)(z->image + header->index_off);
+    z->samples = (const uint64_t *)(z->image + header->samples_off);
+    z->samples_count = (header->count + ZONE_SAMPLE - 1) / ZONE_SAMPLE;
+    z->referrers = (const struct zone_referrer *)(z->image + header->referrers_off);
+    return 0;
+}
+
+int zone_load(struct zone *z, const char *path)
+{
+    char magic[8] = { 0 };
+    struct stat st;
+    uint8_t *image;
+    FILE *in;
+    int fd;
+
+    memset(z, 0, sizeof(*z));
+    fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "Couldn't open %s:\n%d %s\n", path, errno, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+
+    /* A compiled zone is mapped, its pages are brought in by the questions */
+    if (read(fd, magic, sizeof(magic)) == sizeof(magic) && memcmp(magic, ZONE_MAGIC, sizeof(magic)) == 0) {
+        z->image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (z->image == MAP_FAILED) {
+            fprintf(stderr, "Couldn't map %s:\n%d %s\n", path, errno, strerror(errno));
+            z->image = NULL;
+            return -1;
+        }
+        z->size = st.st_size;
+        z->mapped = true;
+    }
+    /* The magic ends with the version of the layout, an older image can't be read */
+    else if (memcmp(magic, ZONE_MAGIC, sizeof(magic) - 2) == 0) {
+        fprintf(stderr, "%s is compiled for another version, compile it again\n", path);
+        close(fd);
+        return -1;
+    }
+    else {
+        if (lseek(fd, 0, SEEK_SET) == -1 || !(in = fdopen(fd, "r"))) {
+            fprintf(stderr, "Couldn't read %s:\n%d %s\n", path, errno, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        if (zone_build(in, &image, &z->size) == -1) {
+            fclose(in);
+            return -1;
+        }
+        fclose(in);
+        z->image = image;
+    }
+    if (check_image(z, path) == -1) {
+        zone_unload(z);
+        return -1;
+    }
+    return 0;
+}
+
+void zone_unload(struct zone *z)
+{
+    version_free(z->version);
+    if (z->mapped)
+        munmap((void *)z->image, z->size);
+    else
+        free((void *)z->image);
+    memset(z, 0, sizeof(*z));
+}
+
+static inline const struct zone_entry * entry_at(const struct zone *z, uint32_t off)
+{
+    return (const struct zone_entry *)(z->image + off);
+}
+
+static inline const struct zone_block * first_block(const struct zone_entry *e)
+{
+    return (const struct zone_block *)((const uint8_t *)(e + 1) + align4(e->name_len - 1));
+}
+
+static inline const struct zone_block * next_block(const struct zone_block *b)
+{
+    return (const struct zone_block *)((const uint8_t *)(b + 1) + align4(b->pointers * 2) + align4(b->len));
+}
+
+/* Finds the name of the key, or where it would be in the index. Both searches go by
+ * the prefix alone and without branches, which a random name would mispredict half the
+ * time; keys are compared only among the names of the same prefix, mostly one. */
+static const struct zone_entry * zone_find(const struct zone *z, const uint8_t *key, size_t key_len,
+                                           uint32_t *at)
+{
+    size_t apex_key_len = z->header->apex_len - 1;
+    uint64_t prefix = key_prefix(key, key_len, apex_key_len);
+    const uint64_t *sample = z->samples;
+    const struct zone_key *k;
+    uint32_t n = z->samples_count, below, lo, hi, run;
+
+    /* Samples smaller than the prefix; the first name not smaller comes after the last of them
+     * and no later than the next sample */
+    while (n > 1) {
+        uint32_t half = n / 2;
+        /* Both places the next step may look at are fetched while this one waits */
+        __builtin_prefetch(&sample[half / 2]);
+        __builtin_prefetch(&sample[half + half / 2]);
+        sample = sample[half] < prefix ? sample + half : sample;
+        n -= half;
+    }
+    below = sample - z->samples + (*sample < prefix);
+    lo = below ? (below - 1) * ZONE_SAMPLE + 1 : 0;
+    hi = (uint64_t)below * ZONE_SAMPLE < z->header->count ? below * ZONE_SAMPLE : z->header->count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (z->index[mid].prefix < prefix)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    /* End of the names of the same prefix, by doubling steps and a search between the last
+     * two in case the run is long */
+    hi = lo;
+    if (lo < z->header->count && z->index[lo].prefix == prefix) {
+        for (run = 1; lo + run < z->header->count && z->index[lo + run].prefix == prefix; run *= 2)
+            ;
+        hi = lo + run / 2 + 1;
+        n = lo + run < z->header->count ? lo + run : z->header->count;
+        while (hi < n) {
+            uint32_t mid = hi + (n - hi) / 2;
+            if (z->index[mid].prefix == prefix)
+                hi = mid + 1;
+            else
+                n = mid;
+        }
+    }
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp;
+
+        k = &z->index[mid];
+        cmp = key_cmp(0, (const uint8_t *)(entry_at(z, k->entry) + 1) + apex_key_len,
+                      k->name_len - 1 - apex_key_len, 0, key + apex_key_len, key_len - apex_key_len);
+        if (cmp == 0) {
+            *at = mid;
+            return entry_at(z, k->entry);
+        }
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *at = lo;
+    return NULL;
+}
+
+/* Name of the key in the version of root: changed by an update, or as the image has it.
+ * at is where the names after it start in the index. */
+static const struct zone_entry * view_find(const struct zone *z, const struct zone_node *root,
+                                           const uint8_t *key, size_t key_len, uint32_t *at)
+{
+    const struct zone_entry *e = zone_find(z, key, key_len, at);
+    const struct zone_data *d;
+
+    if (!root)
+        return e;
+    if (e)
+        (*at)++;
+    return (d = node_find(root, key, key_len)) ? d->entry : e;
+}
+
+/* First name below the key, from at in the index on, which has records; if there's one,
+ * the name of the key exists without records of its own (empty non-terminal) */
+static const struct zone_entry * view_below(const struct zone *z, const struct zone_node *root,
+                                            const uint8_t *key, size_t key_len, uint32_t at)
+{
+    const struct zone_entry *e = NULL;
+    const struct zone_data *d = NULL;
+
+    for (; at < z->header->count; at++) {
+        const struct zone_entry *image = entry_at(z, z->index[at].entry);
+        const uint8_t *image_key = (const uint8_t *)(image + 1);
+
+        if (!key_below(key, key_len, image_key, image->name_len - 1))
+            break;
+        /* Names an update took all records of are passed over */
+        if (!root || !(d = node_find(root, image_key, image->name_len - 1))) {
+            e = image;
+            break;
+        }
+        if (d->entry) {
+            e = d->entry;
+            break;
+        }
+    }
+    if (!root)
+        return e;
+    for (d = node_next(root, key, key_len); d && key_below(key, key_len, d->key, d->name_len - 1);
+         d = node_next(root, d->key, d->name_len - 1)) {
+        if (d->entry) {
+            if (!e || key_cmp(0, d->key, d->name_len - 1, 0, (const uint8_t *)(e + 1), e->name_len - 1) < 0)
+                e = d->entry;
+            break;
+        }
+    }
+    return e;
+}
+
+/* Cut the name of the entry is below. Names built by updates don't point to it, the names
+ * above are looked at from the apex down; NULL if there's none. */
+static const struct zone_entry * cut_of(const struct zone *z, const struct zone_node *root,
+                                        const struct zone_entry *e)
+{
+    const uint8_t *key = (const uint8_t *)(e + 1);
+    size_t len = z->header->apex_len - 1;
+    uint32_t at;
+
+    if (!root)
+        return entry_at(z, e->cut);
+    while (len < e->name_len - 1u) {
+        const struct zone_entry *cut;
+
+        do
+            len++;
+        while (key[len - 1] != 0);
+        cut = view_find(z, root, key, len, &at);
+        if (cut && (cut->flags & ZONE_CUT))
+            return cut;
+    }
+    return NULL;
+}
+
+static inline const uint8_t * block_wire(const struct zone_block *b)
+{
+    return (const uint8_t *)(b + 1) + align4(b->pointers * 2);
+}
+
+/* Copies the block to the end of the message, the additional section too if asked for and
+ * it fits. Pointers to the name the block was built for are moved by delta, to the name
+ * of the question itself if it's a wildcard; pointers into the block itself by where it
+ * lands. Returns false if not even the answer fits. */
+static bool copy_block(uint8_t *msg, size_t *at, size_t size, const struct zone_block *b, bool additional,
+                       int32_t delta, bool wildcard, uint16_t *counts)
+{
+    const uint16_t *positions = (const uint16_t *)(b + 1);
+    const uint8_t *wire = block_wire(b);
+    size_t len = additional ? b->len : b->answer_len;
+    uint32_t i;
+
+    if (*at + len > size) {
+        len = b->answer_len;
+        additional = false;
+        if (*at + len > size)
+            return false;
+    }
+    memcpy(&msg[*at], wire, len);
+    if (*at != b->base || delta != 0 || wildcard) {
+        for (i = 0; i < b->pointers && positions[i] < len; i++) {
+            uint8_t *p = &msg[*at + positions[i]];
+            uint16_t target = read_u16(p) & 0x3fff;
+
+            if (target >= b->base)
+                target = target - b->base + *at;
+            else if (!wildcard || target != HEADER_SIZE)
+                target += delta;
+            write_u16(p, 0xc000 | target);
+        }
+    }
+    *at += len;
+    counts[0] += b->counts[0];
+    counts[1] += b->counts[1];
+    if (additional)
+        counts[2] += b->counts[2];
+    return true;
+}
+
+size_t zone_answer(const struct zone *z, uint8_t *msg, size_t qname_len, uint16_t qtype, size_t size)
+{
+    const struct zone_header *header = z->header;
+    const struct zone_node *root = z->version ? z->version->root : NULL;
+    const struct zone_entry *e, *below;
+    const struct zone_block *b, *found = NULL, *cname = NULL;
+    uint8_t key[NAME_WIRE_MAX];
+    size_t key_len = name_key(&msg[HEADER_SIZE], key), ce_len;
+    size_t question_end = HEADER_SIZE + qname_len + 4, at = question_end;
+    uint16_t counts[3] = { 0, 0, 0 }, i;
+    uint8_t rcode = RCODE_NOERROR;
+    bool wildcard = false, fits = true;
+    uint32_t pos;
+
+    /* QR and AA set, opcode and RD kept */
+    msg[2] = 0x80 | 0x04 | (msg[2] & 0x79);
+    msg[3] = 0;
+
+    e = view_find(z, root, key, key_len, &pos);
+    if (!e) {
+        /* Empty non-terminal, or the closest name above it which exists */
+        below = view_below(z, root, key, key_len, pos);
+        if (below && (below->flags & ZONE_BELOW_CUT)) {
+            e = cut_of(z, root, below);
+            goto referral;
+        }
+        if (below)
+            goto negative;
+        for (ce_len = key_len; ; ) {
+            /* Drop the last label of the key */
+            ce_len--;
+            while (ce_len > 0 && key[ce_len - 1] != 0)
+                ce_len--;
+            e = view_find(z, root, key, ce_len, &pos);
+            if (e && (e->flags & ZONE_CUT))
+                goto referral;
+            if (e && (e->flags & ZONE_BELOW_CUT)) {
+                e = cut_of(z, root, e);
+                goto referral;
+            }
+            if (e || ce_len <= header->apex_len - 1u)
+                break;
+            if ((below = view_below(z, root, key, ce_len, pos))) {
+                if (below->flags & ZONE_BELOW_CUT) {
+                    e = cut_of(z, root, below);
+                    goto referral;
+                }
+                break;
+            }
+        }
+
+        /* Wildcard at the closest encloser (RFC 4592) */
+        key[ce_len] = '*';
+        key[ce_len + 1] = 0;
+        e = view_find(z, root, key, ce_len + 2, &pos);
+        if (!e || (e->flags & (ZONE_CUT | ZONE_BELOW_CUT))) {
+            rcode = RCODE_NXDOMAIN;
+            goto negative;
+        }
+        wildcard = true;
+    }
+    else if (e->flags & ZONE_BELOW_CUT) {
+        e = cut_of(z, root, e);
+        goto referral;
+    }
+    else if (e->flags & ZONE_CUT)
+        goto referral;
+
+    for (i = 0, b = first_block(e); i < e->blocks; i++, b = next_block(b)) {
+        if (qtype == QTYPE_ANY) {
+            found = b;
+            if (!(fits = copy_block(msg, &at, size, b, false, qname_len - e->name_len, wildcard, counts)))
+                break;
+        }
+        else if (b->type == qtype)
+            found = b;
+        else if (b->type == TYPE_CNAME)
+            cname = b;
+    }
+    if (qtype != QTYPE_ANY) {
+        found = found ? found : cname;
+        if (found)
+            fits = copy_block(msg, &at, size, found, true, qname_len - e->name_len, wildcard, counts);
+    }
+    if (found)
+        goto done;
+
+negative:
+    b = z->version ? (const struct zone_block *)z->version->negative :
+                     (const struct zone_block *)(z->image + header->negative_off);
+    fits = copy_block(msg, &at, size, b, true, qname_len - header->apex_len, false, counts);
+    goto done;
+
+referral:
+    if (!e)
+        goto negative;
+    msg[2] &= ~0x04;
+    fits = copy_block(msg, &at, size, first_block(e), true, qname_len - e->name_len, false, counts);
+
+done:
+    if (!fits) {
+        msg[2] |= 0x02;
+        at = question_end;
+        counts[0] = counts[1] = counts[2] = 0;
+    }
+    msg[3] = rcode;
+    for (i = 0; i < 3; i++)
+        write_u16(&msg[6 + 2 * i], counts[i]);
+    return at;
+}
+
+/* Room to read a block back in: header, question and the block, then its RDATA unpacked */
+#define SCRATCH_RDATA (HEADER_SIZE + NAME_WIRE_MAX + 4 + BLOCK_MAX)
+#define SCRATCH_SIZE (SCRATCH_RDATA + BLOCK_MAX)
+
+/* Records of a name while an update works on them */
+struct record_list {
+    struct zone_record *records;
+    size_t count, cap;
+    uint8_t *rdata;
+    size_t rdata_size, rdata_cap;
+};
+
+/* Name an update builds, and what its change means for other names */
+struct fresh_name {
+    struct zone_data *data;
+    bool addresses;                     /* its A or AAAA records changed */
+    bool cut;                           /* it got NS records or lost them */
+};
+
+/* One update as it's applied */
+struct update_state {
+    struct zone *z;
+    const struct zone_node *old;        /* root of the version answered from */
+    struct zone_node *root;             /* of the version being built */
+    uint32_t names;
+    uint32_t stamp;
+    struct referrer_index *referrers;   /* of the version answered from, added to in place */
+    struct fresh_name *fresh;
+    size_t fresh_count, fresh_cap;
+    struct zone_rr *rrs;
+    size_t rrs_cap;
+    struct record_list addresses;
+    struct block_context bc;
+    uint8_t *scratch;
+};
+
+static inline uint32_t read_u32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static inline void write_u32(uint8_t *p, uint32_t value)
+{
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+/* Serial of SOA RDATA, the first of the five numbers at its end */
+static inline uint32_t soa_serial(const uint8_t *rdata, uint16_t rdlength)
+{
+    return read_u32(&rdata[rdlength - 20]);
+}
+
+/* Serial arithmetic (RFC 1982) */
+static inline bool serial_newer(uint32_t a, uint32_t b)
+{
+    return a != b && (uint32_t)(a - b) < 0x80000000u;
+}
+
+/* Name of a key, lowercase. Returns its length. */
+static size_t key_name(const uint8_t *key, size_t key_len, uint8_t *name)
+{
+    size_t end = key_len, start, out = 0;
+
+    while (end > 0) {
+        for (start = end - 1; start > 0 && key[start - 1] != 0; start--)
+            ;
+        name[out++] = end - 1 - start;
+        memcpy(&name[out], &key[start], end - 1 - start);
+        out += end - 1 - start;
+        end = start;
+    }
+    name[out++] = 0;
+    return out;
+}
+
+static int list_add(struct record_list *l, uint16_t type, uint32_t ttl, const uint8_t *rdata, uint16_t rdlength)
+{
+    struct zone_record *rec;
+
+    if (reserve((void **)&l->rdata, &l->rdata_cap, l->rdata_size + rdlength + 1, 1) == -1 ||
+        reserve((void **)&l->records, &l->cap, l->count + 1, sizeof(struct zone_record)) == -1)
+        return -1;
+    rec = &l->records[l->count++];
+    rec->name = 0;
+    rec->type = type;
+    rec->ttl = ttl;
+    rec->rdata = l->rdata_size;
+    rec->rdlength = rdlength;
+    memcpy(&l->rdata[l->rdata_size], rdata, rdlength);
+    l->rdata_size += rdlength;
+    return 0;
+}
+
+static void list_remove(struct record_list *l, size_t i)
+{
+    memmove(&l->records[i], &l->records[i + 1], (l->count - i - 1) * sizeof(struct zone_record));
+    l->count--;
+}
+
+static inline void list_clear(struct record_list *l)
+{
+    l->count = 0;
+    l->rdata_size = 0;
+}
+
+static void list_free(struct record_list *l)
+{
+    free(l->records);
+    free(l->rdata);
+}
+
+static bool list_has(const struct record_list *l, uint16_t type)
+{
+    size_t i;
+
+    for (i = 0; i < l->count; i++) {
+        if (l->records[i].type == type)
+            return true;
+    }
+    return false;
+}
+
+/* Sum of the hashes of the addresses, which doesn't depend on their order */
+static uint64_t list_addresses(const struct record_list *l)
+{
+    uint64_t sum = 0;
+    size_t i;
+
+    for (i = 0; i < l->count; i++) {
+        const struct zone_record *rec = &l->records[i];
+        if (rec->type == TYPE_A || rec->type == TYPE_AAAA)
+            sum += name_hash_fast(&l->rdata[rec->rdata], rec->rdlength, rec->type) ^ rec->ttl;
+    }
+    return sum;
+}
+
+/* Whether RDATA are the same, names in them compared regardless of case (RFC 4343) */
+static bool rdata_equal(uint16_t type, const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len)
+{
+    const char *f;
+    size_t pos = 0;
+
+    if (a_len != b_len)
+        return false;
+    for (f = rr_type(type)->layout; *f && pos < a_len; f++) {
+        size_t start = pos;
+        int size;
+
+        if (*f == 'n' || *f == 'N') {
+            while (pos < a_len && a[pos] != 0)
+                pos += a[pos] + 1;
+            if (++pos > a_len || !name_equal(&a[start], pos - start, &b[start], pos - start))
+                return false;
+            continue;
+        }
+        if ((size = rr_field_size(*f, &a[pos], a_len - pos)) == -1)
+            break;
+        if (memcmp(&a[start], &b[start], size) != 0)
+            return false;
+        pos += size;
+    }
+    return memcmp(&a[pos], &b[pos], a_len - pos) == 0;
+}
+
+/* Reads the records of an entry back from its blocks, those of one type or all if type
+ * is 0. Returns -1 if a block doesn't read, which a block the builder wrote always does. */
+static int entry_records(const struct zone_entry *e, uint16_t type, struct record_list *l, uint8_t *scratch)
+{
+    const struct zone_block *b;
+    uint8_t name[NAME_WIRE_MAX];
+    size_t name_len = key_name((const uint8_t *)(e + 1), e->name_len - 1, name);
+    uint16_t i;
+
+    for (i = 0, b = first_block(e); i < e->blocks; i++, b = next_block(b)) {
+        struct message m;
+        struct rr rr;
+        int got, len;
+
+        if (type && b->type != type)
+            continue;
+        if (b->base != HEADER_SIZE + name_len + 4)
+            return -1;
+        memset(scratch, 0, HEADER_SIZE);
+        write_u16(&scratch[4], 1);
+        write_u16(&scratch[6], b->counts[0]);
+        write_u16(&scratch[8], b->counts[1]);
+        memcpy(&scratch[HEADER_SIZE], name, name_len);
+        write_u16(&scratch[HEADER_SIZE + name_len], b->type);
+        write_u16(&scratch[HEADER_SIZE + name_len + 2], CLASS_IN);
+        memcpy(&scratch[b->base], block_wire(b), b->answer_len);
+
+        if (message_parse(&m, scratch, b->base + b->answer_len) == -1)
+            return -1;
+        while ((got = message_next(&m, &rr)) == 1) {
+            if ((len = message_rdata_unpack(&m, &rr, &scratch[SCRATCH_RDATA], BLOCK_MAX)) == -1 ||
+                list_add(l, rr.type, rr.ttl, &scratch[SCRATCH_RDATA], len) == -1)
+                return -1;
+        }
+        if (got == -1)
+            return -1;
+    }
+    return 0;
+}
+
+/* Adds the records of the name in the version of root to the list, those of one type or
+ * all if type is 0 */
+static int view_records(const struct zone *z, const struct zone_node *root, const uint8_t *key,
+                        size_t key_len, uint16_t type, struct record_list *l, uint8_t *scratch)
+{
+    const struct zone_data *d = node_find(root, key, key_len);
+    const struct zone_entry *e;
+    uint32_t i, at;
+
+    if (d) {
+        for (i = 0; i < d->count; i++) {
+            const struct zone_record *rec = &d->records[i];
+            if ((!type || rec->type == type) &&
+                list_add(l, rec->type, rec->ttl, &d->rdata[rec->rdata], rec->rdlength) == -1)
+                return -1;
+        }
+        return 0;
+    }
+    e = zone_find(z, key, key_len, &at);
+    return e ? entry_records(e, type, l, scratch) : 0;
+}
+
+/* Whether the name has NS records in the version of root; a cut of the image has them in
+ * its first block, any other name in one of them */
+static bool view_has_ns(const struct zone *z, const struct zone_node *root, const uint8_t *key, size_t key_len)
+{
+    const struct zone_data *d = node_find(root, key, key_len);
+    const struct zone_entry *e;
+    const struct zone_block *b;
+    uint32_t i, at;
+
+    if (d) {
+        for (i = 0; i < d->count; i++) {
+            if (d->records[i].type == TYPE_NS)
+                return true;
+        }
+        return false;
+    }
+    if (!(e = zone_find(z, key, key_len, &at)))
+        return false;
+    for (i = 0, b = first_block(e); i < e->blocks; i++, b = next_block(b)) {
+        if (b->type == TYPE_NS)
+            return true;
+    }
+    return false;
+}
+
+/* qsort has no context argument */
+static const uint8_t *sort_rdata;
+static const struct zone_change *sort_changes;
+
+static int list_cmp(const void *a, const void *b)
+{
+    const struct zone_record *ra = a, *rb = b;
+
+    if (ra->type != rb->type)
+        return ra->type - rb->type;
+    if (ra->rdlength != rb->rdlength)
+        return ra->rdlength - rb->rdlength;
+    return memcmp(&sort_rdata[ra->rdata], &sort_rdata[rb->rdata], ra->rdlength);
+}
+
+/* Changes grouped by name, case aside, each name's in the order given */
+static int change_cmp(const void *a, const void *b)
+{
+    uint32_t ia = *(const uint32_t *)a, ib = *(const uint32_t *)b;
+    const struct zone_change *ca = &sort_changes[ia], *cb = &sort_changes[ib];
+    size_t i;
+
+    if (ca->name_len != cb->name_len)
+        return ca->name_len < cb->name_len ? -1 : 1;
+    for (i = 0; i < ca->name_len; i++) {
+        uint8_t x = ca->name[i], y = cb->name[i];
+        x = (x >= 'A' && x <= 'Z') ? x | 0x20 : x;
+        y = (y >= 'A' && y <= 'Z') ? y | 0x20 : y;
+        if (x != y)
+            return x < y ? -1 : 1;
+    }
+    return ia < ib ? -1 : ia > ib;
+}
+
+/* Data of a name with the records of the list, sorted, the same record once */
+static struct zone_data * data_new(const uint8_t *key, size_t key_len, struct record_list *l, uint32_t stamp)
+{
+    struct zone_data *d = calloc(1, sizeof(*d));
+    size_t i, size = 0;
+
+    if (!d)
+        return NULL;
+    sort_rdata = l->rdata;
+    if (l->count > 1)
+        qsort(l->records, l->count, sizeof(struct zone_record), list_cmp);
+    for (i = 0; i < l->count; i++)
+        size += l->records[i].rdlength;
+    d->records = malloc((l->count ? l->count : 1) * sizeof(struct zone_record));
+    d->rdata = malloc(size ? size : 1);
+    if (!d->records || !d->rdata) {
+        free(d->records);
+        free(d->rdata);
+        free(d);
+        return NULL;
+    }
+    for (i = 0, size = 0; i < l->count; i++) {
+        const struct zone_record *rec = &l->records[i];
+        if (d->count > 0 && list_cmp(rec, &l->records[i - 1]) == 0)
+            continue;
+        d->records[d->count] = *rec;
+        d->records[d->count].rdata = size;
+        memcpy(&d->rdata[size], &l->rdata[rec->rdata], rec->rdlength);
+        size += rec->rdlength;
+        d->count++;
+    }
+    memcpy(d->key, key, key_len);
+    d->name_len = key_name(key, key_len, d->name);
+    d->stamp = stamp;
+    return d;
+}
+
+/* Puts the data into the version being built */
+static int version_insert(struct update_state *u, struct zone_data *d, bool addresses, bool cut)
+{
+    struct zone_node *root;
+    bool added = false;
+
+    if (reserve((void **)&u->fresh, &u->fresh_cap, u->fresh_count + 1, sizeof(struct fresh_name)) == -1 ||
+        !(root = node_insert(u->root, d, &added))) {
+        if (d->refs == 0) {
+            d->refs = 1;
+            data_release(d);
+        }
+        return -1;
+    }
+    node_release(u->root);
+    u->root = root;
+    u->names += added;
+    u->fresh[u->fresh_count].data = d;
+    u->fresh[u->fresh_count].addresses = addresses;
+    u->fresh[u->fresh_count].cut = cut;
+    u->fresh_count++;
+    return 0;
+}
+
+/* Builds the name anew with the records it has, its blocks depend on a name the update changed */
+static int refresh(struct update_state *u, const uint8_t *key, size_t key_len, struct record_list *l)
+{
+    const struct zone_data *d = node_find(u->root, key, key_len);
+    struct zone_data *fresh;
+
+    if (d && d->stamp == u->stamp)
+        return 0;
+    list_clear(l);
+    if (view_records(u->z, u->root, key, key_len, 0, l, u->scratch) == -1)
+        return -1;
+    if (l->count == 0)
+        return 0;
+    if (!(fresh = data_new(key, key_len, l, u->stamp)))
+        return -1;
+    return version_insert(u, fresh, false, false);
+}
+
+/* Builds anew the names with the name among the targets of their additional sections */
+static int refresh_referrers(struct update_state *u, const uint8_t *key, size_t key_len, struct record_list *l)
+{
+    const struct zone *z = u->z;
+    const struct referrer_link *link;
+    uint64_t target = key_hash(key, key_len);
+    uint32_t lo = 0, hi = z->header->referrers;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (z->referrers[mid].target < target)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (; lo < z->header->referrers && z->referrers[lo].target == target; lo++) {
+        const struct zone_entry *e = entry_at(z, z->referrers[lo].entry);
+        if (refresh(u, (const uint8_t *)(e + 1), e->name_len - 1, l) == -1)
+            return -1;
+    }
+
+    /* The index is added to only once the names are built, not while it's walked here */
+    for (link = u->referrers->cap ? u->referrers->buckets[target & (u->referrers->cap - 1)] : NULL; link;
+         link = link->next) {
+        if (link->target == target && refresh(u, link->key, link->key_len, l) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+/* Builds anew the names below a name which became a cut or stopped being one */
+static int refresh_below(struct update_state *u, const uint8_t *key, size_t key_len, struct record_list *l)
+{
+    const struct zone *z = u->z;
+    const struct zone_data *d;
+    uint8_t next[NAME_WIRE_MAX];
+    uint32_t at;
+
+    if (zone_find(z, key, key_len, &at))
+        at++;
+    for (; at < z->header->count; at++) {
+        const struct zone_entry *e = entry_at(z, z->index[at].entry);
+        if (!key_below(key, key_len, (const uint8_t *)(e + 1), e->name_len - 1))
+            break;
+        if (refresh(u, (const uint8_t *)(e + 1), e->name_len - 1, l) == -1)
+            return -1;
+    }
+    for (d = node_next(u->root, key, key_len); d && key_below(key, key_len, d->key, d->name_len - 1); ) {
+        /* The node of the name may be replaced, the walk goes on from a copy of its key */
+        size_t next_len = d->name_len - 1;
+
+        memcpy(next, d->key, next_len);
+        if (refresh(u, next, next_len, l) == -1)
+            return -1;
+        d = node_next(u->root, next, next_len);
+    }
+    return 0;
+}
+
+/* Addresses of a name in the version being built */
+static void version_addresses(void *ctx, struct builder *b, const uint8_t *name, size_t len)
+{
+    struct update_state *u = ctx;
+    struct record_list *l = &u->addresses;
+    uint8_t key[NAME_WIRE_MAX];
+    size_t key_len = name_key(name, key), i;
+
+    list_clear(l);
+    if (view_records(u->z, u->root, key, key_len, TYPE_A, l, u->scratch) == -1 ||
+        view_records(u->z, u->root, key, key_len, TYPE_AAAA, l, u->scratch) == -1)
+        return;
+    for (i = 0; i < l->count; i++) {
+        const struct zone_record *rec = &l->records[i];
+        builder_add(b, SECTION_ADDITIONAL, name, len, rec->type, rec->ttl, &l->rdata[rec->rdata], rec->rdlength);
+    }
+}
+
+/* Flags of a name in the version being built, from the NS records of the names above it */
+static uint8_t name_flags(struct update_state *u, const struct zone_data *d)
+{
+    size_t key_len = d->name_len - 1, len = u->z->header->apex_len - 1;
+    uint32_t i;
+
+    if (key_len == len)
+        return ZONE_APEX;
+    for (;;) {
+        do
+            len++;
+        while (d->key[len - 1] != 0);
+        if (len >= key_len)
+            break;
+        if (view_has_ns(u->z, u->root, d->key, len))
+            return ZONE_BELOW_CUT;
+    }
+    for (i = 0; i < d->count; i++) {
+        if (d->records[i].type == TYPE_NS)
+            return ZONE_CUT;
+    }
+    return 0;
+}
+
+/* rrs of the data, for the builder of blocks */
+static int data_rrs(struct update_state *u, const struct zone_data *d)
+{
+    uint32_t i;
+
+    if (reserve((void **)&u->rrs, &u->rrs_cap, d->count, sizeof(struct zone_rr)) == -1)
+        return -1;
+    for (i = 0; i < d->count; i++) {
+        u->rrs[i].type = d->records[i].type;
+        u->rrs[i].rdlength = d->records[i].rdlength;
+        u->rrs[i].ttl = d->records[i].ttl;
+        u->rrs[i].rdata = &d->rdata[d->records[i].rdata];
+    }
+    return 0;
+}
+
+/* Builds the entry of the name as the image would have it */
+static int build_entry(struct update_state *u, struct zone_data *d)
+{
+    struct zone_buffer buf = { 0 };
+    uint8_t *shrunk;
+    uint32_t i;
+    size_t off;
+
+    if (d->count == 0)
+        return 0;
+    if (data_rrs(u, d) == -1 ||
+        add_entry(&u->bc, &buf, d->name, d->name_len, d->key, name_flags(u, d), u->rrs, d->count, &off) == -1) {
+        free(buf.data);
+        return -1;
+    }
+    if ((shrunk = realloc(buf.data, buf.size)))
+        buf.data = shrunk;
+    d->entry = (struct zone_entry *)buf.data;
+    for (i = 0; i < u->bc.targets_count; i++) {
+        if (referrers_add(u->referrers, u->bc.targets[i], d->key, d->name_len - 1) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+/* Checks the prerequisites against the version answered from (RFC 2136, 3.2.5) */
+static int check_prerequisites(struct update_state *u, const struct zone_change *changes, uint32_t count,
+                               struct record_list *l)
+{
+    uint32_t i, j, k;
+
+    for (i = 0; i < count; i++) {
+        const struct zone_change *c = &changes[i];
+        uint8_t key[NAME_WIRE_MAX];
+        size_t key_len;
+        bool any = c->op == ZONE_REQUIRE_NAME || c->op == ZONE_REQUIRE_NO_NAME;
+
+        if (c->op >= ZONE_ADD)
+            continue;
+        key_len = name_key(c->name, key);
+        list_clear(l);
+        if (view_records(u->z, u->old, key, key_len, any ? 0 : c->rr.type, l, u->scratch) == -1)
+            return RCODE_SERVFAIL;
+        switch (c->op) {
+        case ZONE_REQUIRE_NAME:
+            if (l->count == 0)
+                return RCODE_NXDOMAIN;
+            break;
+        case ZONE_REQUIRE_NO_NAME:
+            if (l->count > 0)
+                return RCODE_YXDOMAIN;
+            break;
+        case ZONE_REQUIRE_RRSET:
+            if (l->count == 0)
+                return RCODE_NXRRSET;
+            break;
+        case ZONE_REQUIRE_NO_RRSET:
+            if (l->count > 0)
+                return RCODE_YXRRSET;
+            break;
+        default:
+            /* Every record required is there, every record there is required */
+            for (j = 0; j < count; j++) {
+                const struct zone_change *r = &changes[j];
+                if (r->op != ZONE_REQUIRE_RR || r->rr.type != c->rr.type ||
+                    !name_equal(r->name, r->name_len, c->name, c->name_len))
+                    continue;
+                for (k = 0; k < l->count && !rdata_equal(c->rr.type, &l->rdata[l->records[k].rdata],
+                                                         l->records[k].rdlength, r->rr.rdata, r->rr.rdlength); k++)
+                    ;
+                if (k == l->count)
+                    return RCODE_NXRRSET;
+            }
+            for (k = 0; k < l->count; k++) {
+                for (j = 0; j < count; j++) {
+                    const struct zone_change *r = &changes[j];
+                    if (r->op == ZONE_REQUIRE_RR && r->rr.type == c->rr.type &&
+                        name_equal(r->name, r->name_len, c->name, c->name_len) &&
+                        rdata_equal(c->rr.type, &l->rdata[l->records[k].rdata], l->records[k].rdlength,
+                                    r->rr.rdata, r->rr.rdlength))
+                        break;
+                }
+                if (j == count)
+                    return RCODE_NXRRSET;
+            }
+            break;
+        }
+    }
+    return RCODE_NOERROR;
+}
+
+/* Adds a record (RFC 2136, 3.4.2.2). The SOA is replaced only by a newer one, CNAME and
+ * other data don't go together, a record already there takes the TTL; all records of the
+ * type take it (RFC 2181, 5.2). Returns whether the records changed, -1 if out of memory. */
+static int add_rr(struct record_list *l, const struct zone_rr *rr, bool apex)
+{
+    bool changed = false, found = false;
+    size_t i;
+
+    if (rr->type == TYPE_SOA) {
+        if (!apex || rr->rdlength < 22)
+            return 0;
+        for (i = 0; i < l->count && l->records[i].type != TYPE_SOA; i++)
+            ;
+        if (i < l->count) {
+            if (!serial_newer(soa_serial(rr->rdata, rr->rdlength),
+                              soa_serial(&l->rdata[l->records[i].rdata], l->records[i].rdlength)))
+                return 0;
+            list_remove(l, i);
+        }
+        return list_add(l, rr->type, rr->ttl, rr->rdata, rr->rdlength) == -1 ? -1 : 1;
+    }
+    for (i = 0; i < l->count; i++) {
+        uint16_t type = l->records[i].type;
+        if ((rr->type == TYPE_CNAME) != (type == TYPE_CNAME))
+            return 0;
+    }
+    if (rr->type == TYPE_CNAME && l->count > 0) {
+        if (rdata_equal(TYPE_CNAME, &l->rdata[l->records[0].rdata], l->records[0].rdlength, rr->rdata, rr->rdlength) &&
+            l->records[0].ttl == rr->ttl)
+            return 0;
+        list_clear(l);
+        return list_add(l, rr->type, rr->ttl, rr->rdata, rr->rdlength) == -1 ? -1 : 1;
+    }
+
+    for (i = 0; i < l->count; i++) {
+        struct zone_record *rec = &l->records[i];
+        if (rec->type != rr->type)
+            continue;
+        if (rec->ttl != rr->ttl) {
+            rec->ttl = rr->ttl;
+            changed = true;
+        }
+        found |= rdata_equal(rr->type, &l->rdata[rec->rdata], rec->rdlength, rr->rdata, rr->rdlength);
+    }
+    if (!found) {
+        if (list_add(l, rr->type, rr->ttl, rr->rdata, rr->rdlength) == -1)
+            return -1;
+        changed = true;
+    }
+    return changed;
+}
+
+/* Deletes records (RFC 2136, 3.4.2.3 and 3.4.2.4). The SOA and the NS records of the apex
+ * stay, all but the last NS record may be deleted one by one. */
+static bool delete_rrs(struct record_list *l, const struct zone_change *c, bool apex)
+{
+    bool changed = false;
+    size_t i, ns = 0;
+
+    for (i = 0; i < l->count; i++)
+        ns += l->records[i].type == TYPE_NS;
+    for (i = l->count; i-- > 0; ) {
+        const struct zone_record *rec = &l->records[i];
+
+        if (rec->type == TYPE_SOA || (apex && rec->type == TYPE_NS && (c->op != ZONE_DELETE_RR || ns == 1)))
+            continue;
+        if (c->op != ZONE_DELETE_NAME && rec->type != c->rr.type)
+            continue;
+        if (c->op == ZONE_DELETE_RR &&
+            !rdata_equal(rec->type, &l->rdata[rec->rdata], rec->rdlength, c->rr.rdata, c->rr.rdlength))
+            continue;
+        ns -= rec->type == TYPE_NS;
+        list_remove(l, i);
+        changed = true;
+    }
+    return changed;
+}
+
+/* Raises the serial of the SOA of the apex past the one answered with, unless the update
+ * did. The apex is one of the names built then. */
+static int raise_serial(struct update_state *u, struct record_list *l, uint32_t *serial)
+{
+    const struct zone *z = u->z;
+    uint8_t key[NAME_WIRE_MAX];
+    size_t key_len = name_key(z->header->apex, key);
+    const struct zone_data *d = node_find(u->root, key, key_len);
+    struct zone_data *apex;
+    struct zone_record *soa;
+    uint32_t i;
+
+    if (d && d->stamp == u->stamp)
+        apex = (struct zone_data *)d;
+    else {
+        list_clear(l);
+        if (view_records(z, u->root, key, key_len, 0, l, u->scratch) == -1 ||
+            !(apex = data_new(key, key_len, l, u->stamp)) || version_insert(u, apex, false, false) == -1)
+            return -1;
+    }
+    for (i = 0; i < apex->count && apex->records[i].type != TYPE_SOA; i++)
+        ;
+    if (i == apex->count)
+        return -1;
+    soa = &apex->records[i];
+    *serial = soa_serial(&apex->rdata[soa->rdata], soa->rdlength);
+    if (!serial_newer(*serial, zone_serial(z))) {
+        *serial = zone_serial(z) + 1;
+        write_u32(&apex->rdata[soa->rdata + soa->rdlength - 20], *serial);
+    }
+    return 0;
+}
+
+/* Block of the SOA for negative answers of the version being built */
+static uint8_t * negative_block(struct update_state *u)
+{
+    uint8_t key[NAME_WIRE_MAX];
+    size_t key_len = name_key(u->z->header->apex, key), off;
+    const struct zone_data *apex = node_find(u->root, key, key_len);
+    struct zone_buffer buf = { 0 };
+    struct zone_rr soa;
+    uint32_t i;
+
+    for (i = 0; i < apex->count && apex->records[i].type != TYPE_SOA; i++)
+        ;
+    soa.type = TYPE_SOA;
+    soa.rdlength = apex->records[i].rdlength;
+    soa.ttl = apex->records[i].ttl;
+    soa.rdata = &apex->rdata[apex->records[i].rdata];
+    if (add_block(&u->bc, &buf, apex->name, apex->name_len, &soa, 1, SECTION_AUTHORITY, &off) == -1) {
+        free(buf.data);
+        return NULL;
+    }
+    return buf.data;
+}
+
+int zone_update(struct zone *z, const struct zone_change *changes, uint32_t count, uint32_t *rebuilt)
+{
+    struct update_state u = { .z = z };
+    struct record_list l = { 0 };
+    struct zone_version *v = NULL;
+    uint32_t *order = malloc((count ? count : 1) * sizeof(uint32_t));
+    uint32_t i, j, last, n = 0, serial = 0;
+    size_t applied;
+    int rcode = RCODE_SERVFAIL;
+
+    *rebuilt = 0;
+    u.old = z->version ? z->version->root : NULL;
+    u.root = (struct zone_node *)u.old;
+    if (u.root)
+        u.root->refs++;
+    u.names = z->version ? z->version->names : 0;
+    u.stamp = (z->version ? z->version->stamp : 0) + 1;
+    u.referrers = z->version ? z->version->referrers : calloc(1, sizeof(*u.referrers));
+    u.scratch = malloc(SCRATCH_SIZE);
+    u.bc.msg = malloc(BLOCK_MAX);
+    u.bc.positions = malloc(BLOCK_MAX);
+    u.bc.apex = z->header->apex;
+    u.bc.apex_len = z->header->apex_len;
+    u.bc.addresses = version_addresses;
+    u.bc.ctx = &u;
+    if (!order || !u.referrers || !u.scratch || !u.bc.msg || !u.bc.positions)
+        goto out;
+
+    for (i = 0; i < count; i++) {
+        if (!name_in_zone(changes[i].name, changes[i].name_len, z->header->apex, z->header->apex_len)) {
+            rcode = RCODE_NOTZONE;
+            goto out;
+        }
+    }
+    if ((rcode = check_prerequisites(&u, changes, count, &l)) != RCODE_NOERROR)
+        goto out;
+    rcode = RCODE_SERVFAIL;
+
+    /* Each name takes its changes in their order, the names are independent of each other */
+    for (i = 0; i < count; i++) {
+        if (changes[i].op >= ZONE_ADD)
+            order[n++] = i;
+    }
+    sort_changes = changes;
+    qsort(order, n, sizeof(uint32_t), change_cmp);
+    for (i = 0; i < n; i = last) {
+        const struct zone_change *c = &changes[order[i]];
+        uint8_t key[NAME_WIRE_MAX];
+        size_t key_len = name_key(c->name, key);
+        bool apex = key_len == z->header->apex_len - 1u, had_ns, changed = false;
+        struct zone_data *d;
+        uint64_t addresses;
+        int got;
+
+        for (last = i + 1; last < n && name_equal(changes[order[last]].name, changes[order[last]].name_len,
+                                                  c->name, c->name_len); last++)
+            ;
+        list_clear(&l);
+        if (view_records(z, u.old, key, key_len, 0, &l, u.scratch) == -1)
+            goto out;
+        had_ns = list_has(&l, TYPE_NS);
+        addresses = list_addresses(&l);
+        for (j = i; j < last; j++) {
+            c = &changes[order[j]];
+            if (c->op == ZONE_ADD)
+                got = add_rr(&l, &c->rr, apex);
+            else
+                got = delete_rrs(&l, c, apex);
+            if (got == -1)
+                goto out;
+            changed |= got;
+        }
+        if (!changed)
+            continue;
+        if (!(d = data_new(key, key_len, &l, u.stamp)) ||
+            version_insert(&u, d, list_addresses(&l) != addresses, !apex && had_ns != list_has(&l, TYPE_NS)) == -1)
+            goto out;
+    }
+    if (u.fresh_count == 0) {
+        rcode = RCODE_NOERROR;
+        goto out;
+    }
+    if (raise_serial(&u, &l, &serial) == -1)
+        goto out;
+
+    /* Names whose additional sections have the changed addresses, and names under a cut
+     * which came or went; a name is built once however many changes touch it */
+    for (i = 0, applied = u.fresh_count; i < applied; i++) {
+        const struct zone_data *d = u.fresh[i].data;
+        if (u.fresh[i].addresses && refresh_referrers(&u, d->key, d->name_len - 1, &l) == -1)
+            goto out;
+        if (u.fresh[i].cut && refresh_below(&u, d->key, d->name_len - 1, &l) == -1)
+            goto out;
+    }
+    for (i = 0; i < u.fresh_count; i++) {
+        if (build_entry(&u, u.fresh[i].data) == -1)
+            goto out;
+    }
+
+    if (!(v = calloc(1, sizeof(*v))) || !(v->negative = negative_block(&u))) {
+        free(v);
+        goto out;
+    }
+    v->root = u.root;
+    v->names = u.names;
+    v->stamp = u.stamp;
+    v->serial = serial;
+    v->referrers = u.referrers;
+    u.root = NULL;
+    u.referrers = NULL;
+
+    /* Questions are answered from the new version from here on, the old one goes */
+    if (z->version)
+        z->version->referrers = NULL;
+    version_free(z->version);
+    z->version = v;
+    *rebuilt = u.fresh_count;
+    rcode = RCODE_NOERROR;
+
+out:
+    node_release(u.root);
+    if (!z->version)
+        referrers_free(u.referrers);
+    list_free(&l);
+    list_free(&u.addresses);
+    free(u.fresh);
+    free(u.rrs);
+    free(u.scratch);
+    free(u.bc.msg);
+    free(u.bc.positions);
+    free(order);
+    return rcode;
+}
+
+uint32_t zone_serial(const struct zone *z)
+{
+    const struct zone_block *b;
+
+    if (z->version)
+        return z->version->serial;
+    b = (const struct zone_block *)(z->image + z->header->negative_off);
+    return read_u32(block_wire(b) + b->answer_len - 20);
+}
+
+uint32_t zone_changed(const struct zone *z)
+{
+    return z->version ? z->version->names : 0;
+}
@@ -0,0 +1,157 @@
+#ifndef DNS_ZONE_H
+#define DNS_ZONE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "dns-names.h"
+
+#define ZONE_MAGIC "DNSZON2"
+
+/* Every this many names the index has a sample of its prefix, the samples are small enough
+ * to stay in cache and narrow a search down to a few lines of the index */
+#define ZONE_SAMPLE 64
+
+/* Flags of a name */
+#define ZONE_APEX 0x01
+#define ZONE_CUT 0x02                   /* delegated, its only block is the referral */
+#define ZONE_BELOW_CUT 0x04             /* glue or occluded, answered by the referral of its cut */
+
+/* Layout of a compiled zone, the same whether it's mapped from a file of dns-compile or
+ * built in memory from a zone file. Numbers are in host byte order, offsets are from the
+ * start of the image:
+ *   header
+ *   struct zone_key index[count]       names in canonical order (RFC 4034, 6.1)
+ *   uint64_t samples[]                 prefix of every ZONE_SAMPLE-th name of the index
+ *   entries, one per name, 4-byte aligned:
+ *       struct zone_entry, canonical key of the name (name_len - 1 bytes), blocks
+ *   blocks, 4-byte aligned:
+ *       struct zone_block, u16 positions of its compression pointers, wire records
+ *   struct zone_referrer referrers[]   names whose additional section has a name of the zone
+ * A block is a ready answer for one type of the name: its records in wire format as they
+ * follow a question for the name, owner names and names of RDATA compressed against it,
+ * and the addresses of targets within the zone in the additional section. Answering is a
+ * copy of the block, the pointers are moved only when the block goes elsewhere than it was
+ * built for (referrals, wildcards and negative answers). Every name keeps the blocks of all
+ * its records, also glue and the records a cut hides, so that updates can read them back. */
+struct zone_header {
+    char magic[8];
+    uint32_t count;                     /* names */
+    uint32_t records;
+    uint32_t index_off;
+    uint32_t samples_off;
+    uint32_t apex_off;                  /* entry of the apex */
+    uint32_t negative_off;              /* block of the SOA for negative answers */
+    uint32_t referrers_off;
+    uint32_t referrers;
+    uint32_t size;                      /* of the whole image */
+    uint8_t apex_len;
+    uint8_t apex[NAME_WIRE_MAX];
+};
+
+/* Names are searched by the first bytes of their keys below the apex, the rest of the key
+ * is compared only when those are the same */
+struct zone_key {
+    uint64_t prefix;
+    uint32_t entry;
+    uint32_t name_len;
+};
+
+struct zone_entry {
+    uint8_t name_len;
+    uint8_t flags;
+    uint16_t blocks;
+    uint32_t cut;                       /* entry of the cut above, ZONE_BELOW_CUT only */
+};
+
+/* Name with a target in its additional section, which an update of the target's addresses
+ * builds anew; sorted by the hash of the target's key */
+struct zone_referrer {
+    uint64_t target;
+    uint32_t entry;
+    uint32_t unused;
+};
+
+struct zone_block {
+    uint16_t type;                      /* of the records in the answer, NS of a referral */
+    uint16_t len;                       /* of the wire records */
+    uint16_t answer_len;                /* wire records before the additional section */
+    uint16_t base;                      /* offset in the message the block was built for */
+    uint16_t counts[3];                 /* records of the answer, authority and additional section */
+    uint16_t pointers;
+};
+
+/* Names changed by updates since the image was built, see zone_update */
+struct zone_version;
+
+struct zone {
+    const uint8_t *image;
+    size_t size;
+    bool mapped;                        /* from a compiled file, otherwise allocated */
+    const struct zone_header *header;
+    const struct zone_key *index;
+    const uint64_t *samples;
+    uint32_t samples_count;
+    const struct zone_referrer *referrers;
+    struct zone_version *version;       /* NULL until the first update */
+};
+
+/* Record of a name as updates handle it, RDATA with its names uncompressed */
+struct zone_rr {
+    uint16_t type;
+    uint16_t rdlength;
+    uint32_t ttl;
+    const uint8_t *rdata;
+};
+
+/* Prerequisites and changes of a dynamic update (RFC 2136, 2.4 and 2.5) */
+enum zone_op {
+    ZONE_REQUIRE_NAME,                  /* the name has records */
+    ZONE_REQUIRE_NO_NAME,
+    ZONE_REQUIRE_RRSET,                 /* the name has records of the type */
+    ZONE_REQUIRE_NO_RRSET,
+    ZONE_REQUIRE_RR,                    /* the records of the type are exactly those required */
+    ZONE_ADD,
+    ZONE_DELETE_NAME,                   /* all records of the name */
+    ZONE_DELETE_RRSET,                  /* all records of the type */
+    ZONE_DELETE_RR,
+};
+
+struct zone_change {
+    enum zone_op op;
+    const uint8_t *name;
+    size_t name_len;
+    struct zone_rr rr;                  /* the type, the rest for ZONE_REQUIRE_RR, ZONE_ADD and ZONE_DELETE_RR */
+};
+
+/* Compiles a zone file (RFC 1035, 5) into a file which can be mapped */
+int zone_compile(FILE *in, const char *out_path);
+
+/* Maps a compiled zone, or reads a zone file and compiles it in memory */
+int zone_load(struct zone *z, const char *path);
+void zone_unload(struct zone *z);
+
+/* Answers the question of the message: its header (12 bytes) and the question with the name
+ * uncompressed, qname_len long. Records are added after it, the header gets the flags, the
+ * rcode and the counts. The name must be in the zone. Returns the length of the reply, which
+ * is at most size; an answer which doesn't fit is left out and TC set. */
+size_t zone_answer(const struct zone *z, uint8_t *msg, size_t qname_len, uint16_t qtype, size_t size);
+
+/* Checks the prerequisites and applies the changes as one dynamic update (RFC 2136, 3.2
+ * and 3.4), all or none of them, and increments the serial of the SOA unless the update
+ * raised it itself. The names the update touches, and the names whose blocks have their
+ * addresses or lie below a cut it adds or removes, are built into a new version next to
+ * the one being answered from; the image stays as it is. Answering switches to the new
+ * version by one pointer once it's complete, so the work is that of the change, whatever
+ * the size of the zone. Returns the rcode, rebuilt gets the number of names built. */
+int zone_update(struct zone *z, const struct zone_change *changes, uint32_t count, uint32_t *rebuilt);
+
+/* Serial of the SOA being answered */
+uint32_t zone_serial(const struct zone *z);
+
+/* Names changed by updates so far */
+uint32_t zone_changed(const struct zone *z);
+
+#endif